@@ -0,0 +1,1263 @@
+/* Benchmark harness: generates the standard corpora and times parse,
+ * a list walk (by get_tail and by list_foreach), dict_get, equals,
+ * listdata_hash, printing to memory and reading it back (with MB/s of
+ * the JSON text), parsing with packed numbers, parsing into arenas
+ * freed out of order and listdata_gc over each of them, CBOR encoding
+ * and decoding (also with MB/s of the JSON text, to compare with
+ * parse), a query over the NDJSON records, parsed and streamed,
+ * parsing the NDJSON records into a struct by schema, parsing the
+ * gzipped text through json_input, without and with a thread to
+ * decompress (MB/s of the JSON text), and a JSON Patch and a merge
+ * patch from the corpus to a copy with about 100 values changed, and
+ * applying the JSON Patch.
+ *
+ *   bench/bench [-c] [-j] [-s MB] [-n runs] [corpus ...]
+ *
+ *   -c  check: small corpora, verify every result, exit 1 on failure
+ *   -j  one JSON object per line, for tracking across versions
+ *   -s  approximate size of each corpus (default 4 MB)
+ *   -n  runs per measurement, the fastest is reported (default 5)
+ *
+ * bench/bench-flat is the same built with LISTDATA_FLAT.
+ *
+ * Allocations and peak heap are counted when built with -DWRAP_MALLOC
+ * and linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free
+ * (see Makefile), otherwise they are reported as 0.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "json.h"
+#include "print.h"
+#include "query.h"
+#include "cbor.h"
+#include "input.h"
+#include "schema.h"
+#include "patch.h"
+
+#define T listdata_type
+
+#ifndef VERSION
+#define VERSION "unknown"
+#endif
+
+/* Heap accounting */
+
+struct heap {
+	unsigned long allocs, bytes, peak;
+};
+
+static struct heap heap;
+
+#ifdef WRAP_MALLOC
+void *__real_malloc(size_t);
+void *__real_realloc(void *, size_t);
+void __real_free(void *);
+
+#define HDR 16		/* keeps the alignment of malloc */
+
+void *__wrap_malloc(size_t n)
+{
+	char *p = __real_malloc(n + HDR);
+	if (!p)
+		return NULL;
+	*(size_t *) p = n;
+	heap.allocs++;
+	if ((heap.bytes += n) > heap.peak)
+		heap.peak = heap.bytes;
+	return p + HDR;
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	void *p = n && size > (size_t) -1 / n ? NULL : __wrap_malloc(n * size);
+	if (p)
+		memset(p, 0, n * size);
+	return p;
+}
+
+void __wrap_free(void *q)
+{
+	char *p = q;
+	if (p) {
+		p -= HDR;
+		heap.bytes -= *(size_t *) p;
+		__real_free(p);
+	}
+}
+
+void *__wrap_realloc(void *q, size_t n)
+{
+	char *p = q;
+	size_t old;
+	if (!p)
+		return __wrap_malloc(n);
+	p -= HDR;
+	old = *(size_t *) p;
+	if (!(p = __real_realloc(p, n + HDR)))
+		return NULL;
+	*(size_t *) p = n;
+	heap.allocs++;
+	if ((heap.bytes += n - old) > heap.peak)
+		heap.peak = heap.bytes;
+	return p + HDR;
+}
+#endif
+
+/* Corpus generation */
+
+struct buf {
+	char *s;
+	size_t len, max;
+};
+
+static void put(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->s + b->len, b->max - b->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			exit(2);
+		if (b->len + n < b->max)
+			break;
+		b->max = (b->len + n) * 2 + 64;
+		if (!(b->s = realloc(b->s, b->max)))
+			exit(2);
+	}
+	b->len += n;
+}
+
+static unsigned long seed;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (seed >> 33) % n;
+}
+
+static const char *words[] = {
+	"the", "listdata", "parser", "json", "cons", "heap", "string",
+	"release", "mark", "fast", "slow", "benchmark", "\\\"quoted\\\"",
+	"caf\\u00e9", "line\\nbreak", "tab\\there", "\\ud83d\\ude00",
+	"\\u2603", "a/b", "100%"
+};
+
+#define NUM_WORDS (sizeof(words) / sizeof(words[0]))
+
+static void put_text(struct buf *b, int n)
+{
+	int i;
+	put(b, "\"");
+	for (i=0; i<n; i++)
+		put(b, i ? " %s" : "%s", words[rnd(NUM_WORDS)]);
+	put(b, "\"");
+}
+
+static void put_tweet(struct buf *b, unsigned long id)
+{
+	int i, n = rnd(4);
+	put(b, "{\"created_at\":\"Mon Sep %02u 03:35:21 +0000 2012\","
+	       "\"id\":%lu,\"id_str\":\"%lu\",\"text\":",
+	    rnd(30) + 1, id, id);
+	put_text(b, 5 + rnd(20));
+	put(b, ",\"user\":{\"id\":%u,\"name\":\"user %u\","
+	       "\"screen_name\":\"u%u\",\"description\":",
+	    rnd(1 << 30), rnd(10000), rnd(10000));
+	put_text(b, rnd(12));
+	put(b, ",\"followers_count\":%u,\"verified\":%s},"
+	       "\"entities\":{\"hashtags\":[",
+	    rnd(100000), rnd(8) ? "false" : "true");
+	for (i=0; i<n; i++)
+		put(b, "%s{\"text\":\"tag%u\",\"indices\":[%d,%d]}",
+		    i ? "," : "", rnd(500), i * 10, i * 10 + 6);
+	put(b, "],\"urls\":[]},\"retweet_count\":%u,\"favorited\":%s,"
+	       "\"coordinates\":%s,\"lang\":\"%s\"}",
+	    rnd(1000), rnd(2) ? "false" : "true",
+	    rnd(4) ? "null" : "{\"type\":\"Point\",\"coordinates\":[-75.14,40.05]}",
+	    rnd(3) ? "en" : "sv");
+}
+
+static void gen_twitter(struct buf *b, size_t size)
+{
+	unsigned long id = 250075927172759552UL % 2000000000;
+	put(b, "{\"statuses\":[");
+	do {
+		put_tweet(b, id++);
+		put(b, ",\n");
+	} while (b->len < size);
+	put_tweet(b, id);
+	put(b, "],\"search_metadata\":{\"count\":%lu}}\n", id % 1000);
+}
+
+/* chains of alternately nested objects and arrays */
+static void gen_deep(struct buf *b, size_t size)
+{
+	int i, depth = 256;
+	put(b, "[");
+	do {
+		for (i=0; i<depth; i++)
+			put(b, i & 1 ? "[%d," : "{\"k%d\":", i);
+		put(b, "null");
+		for (i=depth; i--; )
+			put(b, i & 1 ? "]" : "}");
+		put(b, ",\n");
+	} while (b->len < size);
+	put(b, "[]]\n");
+}
+
+static void gen_numbers(struct buf *b, size_t size)
+{
+	put(b, "[");
+	do {
+		switch (rnd(5)) {
+		case 0: put(b, "%u,", rnd(100)); break;
+		case 1: put(b, "-%u,", rnd(2000000000)); break;
+		case 2: put(b, "%u.%03u,", rnd(1000), rnd(1000)); break;
+		case 3: put(b, "-%u.%ue-%u,", rnd(10), rnd(100000), rnd(300)); break;
+		case 4: put(b, "%ue%u,", rnd(1000), rnd(20)); break;
+		}
+		if (!rnd(16))
+			put(b, "\n");
+	} while (b->len < size);
+	put(b, "0]\n");
+}
+
+static void gen_strings(struct buf *b, size_t size)
+{
+	size_t end;
+	put(b, "[");
+	do {
+		put(b, "\"");
+		end = b->len + 65536;
+		while (b->len < end)
+			put(b, "%s ", words[rnd(NUM_WORDS)]);
+		put(b, "\",\n");
+	} while (b->len < size);
+	put(b, "\"\"]\n");
+}
+
+static void gen_ndjson(struct buf *b, size_t size)
+{
+	unsigned long id = 1;
+	do {
+		put(b, "{\"id\":%lu,\"ts\":%u,\"level\":\"%s\",\"msg\":",
+		    id++, 1350000000 + rnd(1000000),
+		    rnd(10) ? "info" : "error");
+		put_text(b, 3 + rnd(8));
+		put(b, ",\"ok\":%s,\"ms\":%u.%u}\n",
+		    rnd(10) ? "true" : "false", rnd(500), rnd(10));
+	} while (b->len < size);
+}
+
+struct corpus {
+	const char *name;
+	void (*gen)(struct buf *, size_t);
+	int ndjson;
+	int selected;
+	struct buf text;
+};
+
+static struct corpus corpora[] = {
+	{"twitter", gen_twitter},
+	{"deep", gen_deep},
+	{"numbers", gen_numbers},
+	{"strings", gen_strings},
+	{"ndjson", gen_ndjson, 1}
+};
+
+#define NUM_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+/* Measurement */
+
+static int check, json_out, runs = 5;
+static int failed;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct result {
+	double t;
+	unsigned long ops, allocs, peak;
+	unsigned long base;		/* heap at start of run */
+};
+
+static void start(struct result *r, double *t)
+{
+	heap.allocs = 0;
+	heap.peak = heap.bytes;
+	r->base = heap.bytes;
+	*t = now();
+}
+
+/* keep the fastest run */
+static void stop(struct result *r, double t)
+{
+	t = now() - t;
+	if (!r->t || t < r->t) {
+		r->t = t;
+		r->allocs = heap.allocs;
+		r->peak = heap.peak - r->base;
+	}
+}
+
+static void report(const struct corpus *c, const char *op,
+		   const struct result *r)
+{
+	double mb = c->text.len / 1e6;
+	if (check)
+		return;
+	if (json_out)
+		printf("{\"version\":\"%s\",\"corpus\":\"%s\",\"op\":\"%s\","
+		       "\"bytes\":%lu,\"seconds\":%.9f,\"mb_s\":%.3f,"
+		       "\"ops\":%lu,\"ns_op\":%.3f,\"allocs\":%lu,"
+		       "\"peak_heap\":%lu}\n",
+		       VERSION, c->name, op, (unsigned long) c->text.len,
+		       r->t, mb / r->t, r->ops, r->t / r->ops * 1e9,
+		       r->allocs, r->peak);
+	else
+		printf("%-8s %-8s %9.1f %10lu %10.1f %9lu %11lu\n",
+		       c->name, op, mb / r->t, r->ops, r->t / r->ops * 1e9,
+		       r->allocs, r->peak);
+}
+
+static void fail(const struct corpus *c, const char *what)
+{
+	fprintf(stderr, "%s: %s\n", c->name, what);
+	failed = 1;
+}
+
+/* parse the whole corpus, a list of the values for NDJSON */
+static T parse(struct json_parser *p, const struct corpus *c)
+{
+	const char *s = c->text.s, *e = s + c->text.len;
+	T x = EMPTY_LIST, *tail = &x;
+
+	do {
+		json_parser_reset(p);
+		if (json_parse(p, s, e - s, &s) != JSON_DONE)
+			return 0;
+		while (s < e && *s == '\n')
+			s++;
+		if (p->validate)
+			x = EMPTY_LIST;
+		else if (!c->ndjson)
+			x = p->result;
+		else if ((*tail = cons(p->result, EMPTY_LIST)))
+			tail = load_cons(*tail) + 1;
+		else
+			return 0;
+	} while (c->ndjson && s < e);
+	return s == e ? x : 0;
+}
+
+static void bench_parse(struct corpus *c, int validate)
+{
+	struct json_parser p;
+	struct result r = {0};
+	mpoint mp;
+	double t;
+	int i;
+
+	for (i=0; i<runs; i++) {
+		listdata_mark(mp);
+		start(&r, &t);
+		json_parser_init(&p);
+		p.validate = validate;
+		if (!parse(&p, c))
+			fail(c, "parse failed");
+		json_parser_free(&p);
+		stop(&r, t);
+		listdata_release(mp);
+	}
+	r.ops = 1;
+	report(c, validate ? "validate" : "parse", &r);
+}
+
+/* x as parsed with packed numbers and y without */
+static int same_numbers(T x, T y)
+{
+	int m, e, n, f;
+	if (json_decimal(y, &n, &f))
+		return json_decimal(x, &m, &e) && m == n && e == f;
+	if (!is_cons(y) || (last_tail(y, 0) != EMPTY_LIST &&
+			    last_tail(y, 0) != EMPTY_DICT))
+		return equals(x, y);
+	for (; is_cons(x) && is_cons(y); x = get_tail(x), y = get_tail(y))
+		if (!same_numbers(get_head(x), get_head(y)))
+			return 0;
+	return x == y;
+}
+
+static void bench_packed(struct corpus *c, T x)
+{
+	struct json_parser p;
+	struct result r = {0};
+	mpoint mp;
+	double t;
+	T y;
+	int i;
+
+	for (i=0; i<runs; i++) {
+		listdata_mark(mp);
+		start(&r, &t);
+		json_parser_init(&p);
+		p.packed_numbers = 1;
+		if (!(y = parse(&p, c)))
+			fail(c, "parse failed");
+		json_parser_free(&p);
+		stop(&r, t);
+		if (check && y && !same_numbers(y, x))
+			fail(c, "packed numbers differ");
+		listdata_release(mp);
+	}
+	r.ops = 1;
+	report(c, "packed", &r);
+}
+
+static int is_dict(T x)
+{
+	return is_cons(x) && last_tail(x, 0) == EMPTY_DICT;
+}
+
+struct lookup {
+	T dict, key, val;
+};
+
+struct lookups {
+	struct lookup *a;
+	unsigned long n, max;
+};
+
+/* collect a lookup for every member with a flat or short string
+   name, using a copy of the name so that a flat one is compared by
+   characters (a short one is its own copy) */
+static void collect(struct lookups *l, T x)
+{
+	T y, k;
+	if (!is_dict(x)) {
+		for (; is_cons(x); x = get_tail(x))
+			collect(l, get_head(x));
+		return;
+	}
+	for (y = x; is_cons(y); y = get_tail(get_tail(y))) {
+		if (l->n == l->max) {
+			l->max = l->max ? l->max * 2 : 1024;
+			if (!(l->a = realloc(l->a, l->max * sizeof(*l->a))))
+				exit(2);
+		}
+		k = get_head(y);
+		if (type_of(k) == TYP_STR || type_of(k) == TYP_SHORT) {
+			l->a[l->n].dict = x;
+			l->a[l->n].key = type_of(k) == TYP_STR ?
+					 store_str(load_str(k)) : k;
+			l->a[l->n++].val = *second(y);
+		}
+		collect(l, *second(y));
+	}
+}
+
+static void bench_dict_get(struct corpus *c, T x)
+{
+	struct lookups l = {NULL};
+	struct result r = {0};
+	unsigned long i;
+	double t;
+	T *v;
+	int k;
+
+	collect(&l, x);
+	if (!l.n) {
+		free(l.a);
+		return;
+	}
+	for (k=0; k<runs; k++) {
+		start(&r, &t);
+		for (i=0; i<l.n; i++) {
+			v = dict_get(l.a[i].dict, l.a[i].key);
+			if (check && (!v || !equals(*v, l.a[i].val)))
+				fail(c, "dict_get");
+		}
+		stop(&r, t);
+	}
+	r.ops = l.n;
+	report(c, "dict_get", &r);
+	free(l.a);
+}
+
+static void bench_equals(struct corpus *c, T x, T y)
+{
+	struct result r = {0};
+	double t;
+	int i;
+
+	for (i=0; i<runs; i++) {
+		start(&r, &t);
+		if (!equals(x, y))
+			fail(c, "equals");
+		stop(&r, t);
+	}
+	r.ops = 1;
+	report(c, "equals", &r);
+
+	r.t = 0;
+	for (i=0; i<runs; i++) {
+		start(&r, &t);
+		if (listdata_hash(x) != listdata_hash(y))
+			fail(c, "listdata_hash");
+		stop(&r, t);
+	}
+	report(c, "hash", &r);
+}
+
+/* visit every cons, as a list traversal does */
+static unsigned long walk(T x)
+{
+	unsigned long n = 0;
+	for (; is_cons(x); x = get_tail(x))
+		n += 1 + walk(get_head(x));
+	return n;
+}
+
+/* list_length and list_to_array on every list, against get_tail */
+static void check_lists(struct corpus *c, T x)
+{
+	T buf[64], y;
+	unsigned long n = 0;
+	unsigned i, k;
+
+	if (!is_cons(x))
+		return;
+	for (y = x; is_cons(y); y = get_tail(y)) {
+		n++;
+		check_lists(c, get_head(y));
+	}
+	if (list_length(x) != n)
+		fail(c, "list_length");
+	k = list_to_array(x, buf, 64);
+	if (k != (n < 64 ? n : 64))
+		fail(c, "list_to_array");
+	for (i=0, y=x; i<k; i++, y=get_tail(y))
+		if (buf[i] != get_head(y))
+			fail(c, "list_to_array");
+}
+
+/* the same with list_foreach */
+static int visit(T x, void *n)
+{
+	++*(unsigned long *) n;
+	if (is_cons(x))
+		list_foreach(x, visit, n);
+	return 0;
+}
+
+static void bench_walk(struct corpus *c, T x)
+{
+	struct result r = {0};
+	unsigned long n;
+	double t;
+	int i;
+
+	for (i=0; i<runs; i++) {
+		start(&r, &t);
+		r.ops = walk(x);
+		stop(&r, t);
+	}
+	report(c, "walk", &r);
+
+	memset(&r, 0, sizeof(r));
+	for (i=0; i<runs; i++) {
+		start(&r, &t);
+		n = 0;
+		list_foreach(x, visit, &n);
+		stop(&r, t);
+		if (check && n != walk(x))
+			fail(c, "list_foreach");
+		r.ops = n;
+	}
+	report(c, "foreach", &r);
+	if (check)
+		check_lists(c, x);
+}
+
+/* print the parsed corpus to memory and read it back */
+static void bench_print(struct corpus *c, T x)
+{
+	struct print_buf b;
+	struct sexp_reader rd;
+	struct result r = {0};
+	mpoint mp;
+	double t;
+	int i;
+
+	print_buf_init(&b);
+	for (i=0; i<runs; i++) {
+		b.len = 0;
+		start(&r, &t);
+		if (!bprint(&b, x))
+			fail(c, "print");
+		stop(&r, t);
+	}
+	r.ops = 1;
+	report(c, "print", &r);
+
+	memset(&r, 0, sizeof(r));
+	sexp_reader_init(&rd);
+	for (i=0; i<runs; i++) {
+		listdata_mark(mp);
+		start(&r, &t);
+		if (sexp_read(&rd, b.s, b.len) != JSON_DONE || rd.offset != b.len)
+			fail(c, "sexp_read");
+		stop(&r, t);
+		if (check && !equals(x, rd.result))
+			fail(c, "printed copy differs");
+		listdata_release(mp);
+	}
+	r.ops = 1;
+	report(c, "read", &r);
+
+	if (check) {
+		b.len = 0;
+		b.pretty = 1;
+		listdata_mark(mp);
+		if (!bprint(&b, x) || sexp_read(&rd, b.s, b.len) != JSON_DONE ||
+		    !equals(x, rd.result))
+			fail(c, "pretty printed copy differs");
+		listdata_release(mp);
+	}
+	sexp_reader_free(&rd);
+	print_buf_free(&b);
+}
+
+/* parse copies into three arenas and free the middle one first */
+static void bench_arena(struct corpus *c, struct json_parser *p, T x)
+{
+	static const int order[3] = {1, 0, 2};
+	struct listdata_arena a[3], *old;
+	struct listdata_stats before, after;
+	struct result r = {0};
+	double t;
+	T y[3];
+	int i, k;
+
+	listdata_stats(&before);
+	for (i=0; i<runs; i++) {
+		start(&r, &t);
+		for (k=0; k<3; k++) {
+			listdata_arena_init(&a[k], c->name);
+			old = listdata_arena_use(&a[k]);
+			y[k] = parse(p, c);
+			listdata_arena_use(old);
+		}
+		for (k=0; k<3; k++) {
+			if (check && (!y[order[k]] || !equals(x, y[order[k]])))
+				fail(c, "arena copy differs");
+			listdata_arena_free(&a[order[k]]);
+		}
+		stop(&r, t);
+	}
+	listdata_stats(&after);
+	if (check && after.heap_bytes != before.heap_bytes)
+		fail(c, "arenas not freed");
+	r.ops = 3;
+	report(c, "arena", &r);
+}
+
+/* collect a copy of the corpus between two live ones */
+static void bench_gc(struct corpus *c, struct json_parser *p)
+{
+	struct listdata_stats before, after;
+	struct result r = {0};
+	mpoint mp;
+	double t;
+	T x, y, z;
+	int i;
+
+	listdata_root(&x);
+	listdata_root(&y);
+	for (i=0; i<runs; i++) {
+		listdata_mark(mp);
+		x = parse(p, c);
+		parse(p, c);
+		y = parse(p, c);
+		listdata_stats(&before);
+		start(&r, &t);
+		if (!listdata_gc(mp))
+			fail(c, "listdata_gc");
+		stop(&r, t);
+		listdata_stats(&after);
+		if (check && (!x || !equals(x, y) ||
+			      after.heap_bytes >= before.heap_bytes))
+			fail(c, "listdata_gc");
+		listdata_release(mp);
+	}
+	/* a substring and strings allocated after the one it is cut from */
+	if (check) {
+		listdata_mark(mp);
+		x = store_str("hello world, this is a long string");
+		y = rope_sub(x, 6, 100);
+		store_str("garbage between them");
+		z = store_str("AFTER");
+		if (!listdata_root(&z) || !listdata_gc(mp) ||
+		    !equals_str(y, "world, this is a long string") ||
+		    !equals_str(z, "AFTER"))
+			fail(c, "listdata_gc of a substring");
+		listdata_unroot(&z);
+		listdata_release(mp);
+	}
+	listdata_unroot(&y);
+	listdata_unroot(&x);
+	r.ops = 1;
+	report(c, "gc", &r);
+}
+
+/* encode the parsed corpus and decode it again */
+static void bench_cbor(struct corpus *c, T x)
+{
+	struct cbor_buf b;
+	struct cbor_decoder d;
+	struct result r = {0};
+	mpoint mp;
+	double t;
+	int i;
+
+	cbor_buf_init(&b);
+	for (i=0; i<runs; i++) {
+		b.len = 0;
+		start(&r, &t);
+		if (!cbor_encode(&b, x))
+			fail(c, "cbor_encode");
+		stop(&r, t);
+	}
+	r.ops = 1;
+	report(c, "cbor_enc", &r);
+
+	memset(&r, 0, sizeof(r));
+	cbor_decoder_init(&d);
+	for (i=0; i<runs; i++) {
+		listdata_mark(mp);
+		start(&r, &t);
+		if (cbor_decode(&d, b.s, b.len) != JSON_DONE ||
+		    d.offset != b.len)
+			fail(c, "cbor_decode");
+		stop(&r, t);
+		if (check && !equals(x, d.result))
+			fail(c, "cbor copy differs");
+		listdata_release(mp);
+	}
+	r.ops = 1;
+	report(c, "cbor_dec", &r);
+	cbor_decoder_free(&d);
+	cbor_buf_free(&b);
+}
+
+/* Queries over the NDJSON records: on the parsed list, and on the text
+   fed in chunks, which keeps the heap at one record */
+
+#define QUERY "select(.level == \"error\" and .ms >= 100) | {id, ms}"
+#define CHUNK 65536
+
+static int count_output(T x, void *n)
+{
+	(void) x;
+	++*(unsigned long *) n;
+	return 0;
+}
+
+static double number(T x)
+{
+	double d;
+	return json_number(x, &d) ? d : 0;
+}
+
+/* the same by hand */
+static unsigned long count_errors(T x)
+{
+	T level = store_str("level"), ms = store_str("ms"), *v;
+	unsigned long n = 0;
+	for (; is_cons(x); x = get_tail(x)) {
+		if ((v = dict_get(get_head(x), level)) && equals_str(*v, "error") &&
+		    (v = dict_get(get_head(x), ms)) && number(*v) >= 100)
+			n++;
+	}
+	return n;
+}
+
+/* .[] of strings and numbers the parser stores as lists (a long string,
+   one with characters above U+00FF, a mantissa and exponent) has no
+   output, as in jq */
+static int each_scalar(struct json_parser *p)
+{
+	static const char *const texts[] = {
+		"\"\\u20ac\\u20ac\\u20ac\"", "1.5e300"
+	};
+	char *s = malloc(9003);
+	struct query q;
+	unsigned long n = 0;
+	int i;
+
+	if (!s || !query_compile(&q, ".[]"))
+		return 0;
+	memset(s, 'a', 9002);
+	s[0] = s[9001] = '"';
+	s[9002] = '\0';
+	for (i=0; i<3; i++) {
+		json_parser_reset(p);
+		if (json_parse_str(p, i < 2 ? texts[i] : s, NULL) == JSON_MORE)
+			json_parse_end(p);
+		query_run(&q, p->result, count_output, &n);
+	}
+	query_free(&q);
+	free(s);
+	return n == 0;
+}
+
+static void bench_query(struct corpus *c, T x)
+{
+	struct json_parser p;
+	struct query q;
+	struct result r = {0};
+	unsigned long n, m = list_length(x);
+	size_t i, k;
+	double t;
+	int j, st;
+	T y;
+
+	if (!query_compile(&q, QUERY)) {
+		fail(c, "query_compile");
+		return;
+	}
+	for (j=0; j<runs; j++) {
+		start(&r, &t);
+		n = 0;
+		for (y = x; is_cons(y); y = get_tail(y))
+			if (query_run(&q, get_head(y), count_output, &n))
+				fail(c, "query_run");
+		stop(&r, t);
+	}
+	r.ops = m;
+	report(c, "query", &r);
+	if (check && n != count_errors(x))
+		fail(c, "query");
+
+	memset(&r, 0, sizeof(r));
+	json_parser_init(&p);
+	for (j=0; j<runs; j++) {
+		start(&r, &t);
+		n = 0;
+		st = JSON_MORE;
+		for (i=0; i<c->text.len && st == JSON_MORE; i+=k) {
+			k = c->text.len - i < CHUNK ? c->text.len - i : CHUNK;
+			st = query_feed(&q, &p, c->text.s + i, k, count_output,
+					&n);
+		}
+		if (st == JSON_MORE)
+			st = query_feed_end(&q, &p, count_output, &n);
+		stop(&r, t);
+		if (st != JSON_MORE || (check && n != count_errors(x)))
+			fail(c, "query_feed");
+	}
+	if (check && !each_scalar(&p))
+		fail(c, ".[] of a scalar");
+	json_parser_free(&p);
+	r.ops = m;
+	report(c, "qstream", &r);
+	query_free(&q);
+}
+
+/* The NDJSON records straight into a struct, compared with the parsed
+   records member by member */
+
+struct record {
+	int id, ts;
+	char level[8];
+	char msg[512];
+	int ok;
+	double ms;
+};
+
+static const struct json_field record_fields[] = {
+	JSON_FIELD(struct record, id, JSON_INT),
+	JSON_FIELD(struct record, ts, JSON_INT),
+	JSON_FIELD(struct record, level, JSON_STRING),
+	JSON_FIELD(struct record, msg, JSON_STRING),
+	JSON_FIELD(struct record, ok, JSON_BOOL),
+	JSON_FIELD(struct record, ms, JSON_DOUBLE)
+};
+
+static const struct json_schema record_schema =
+	JSON_SCHEMA(struct record, record_fields);
+
+static int same_record(const struct record *r, T x)
+{
+	T *v;
+	return (v = dict_get(x, store_short("id"))) && load_int(*v) == r->id &&
+	       (v = dict_get(x, store_short("ts"))) && load_int(*v) == r->ts &&
+	       (v = dict_get(x, store_str("level"))) &&
+	       equals_str(*v, r->level) &&
+	       (v = dict_get(x, store_short("ok"))) &&
+	       *v == (r->ok ? JSON_TRUE : JSON_FALSE) &&
+	       (v = dict_get(x, store_short("ms"))) && number(*v) == r->ms;
+}
+
+static void bench_schema(struct corpus *c, T x)
+{
+	struct json_schema_parser sp;
+	struct record rec;
+	struct result r = {0};
+	const char *s, *e = c->text.s + c->text.len;
+	unsigned long n = 0;
+	double t;
+	int i, st;
+	T y;
+
+	json_schema_parser_init(&sp);
+	for (i=0; i<runs; i++) {
+		n = 0;
+		y = x;
+		start(&r, &t);
+		for (s = c->text.s; (st = json_schema_parse(&sp, &record_schema,
+				&rec, s, e - s)) == JSON_DONE; s += sp.offset) {
+			n++;
+			if (check) {
+				if (!is_cons(y) || !same_record(&rec, get_head(y)))
+					fail(c, "schema record differs");
+				y = is_cons(y) ? get_tail(y) : y;
+			}
+		}
+		stop(&r, t);
+		if (st != JSON_MORE || s + sp.offset != e || (check && is_cons(y)))
+			fail(c, "json_schema_parse");
+	}
+	r.ops = n;
+	report(c, "schema", &r);
+	json_schema_parser_free(&sp);
+}
+
+/* Parsing the gzipped text from a file through json_input. Each value
+   is released after it is checked, so the heap is that of the buffers. */
+
+static FILE *gzip_text(const struct buf *b)
+{
+	unsigned char out[CHUNK];
+	FILE *f;
+	z_stream z;
+	int st;
+
+	if (!(f = tmpfile()))
+		return NULL;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, 6, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		fclose(f);
+		return NULL;
+	}
+	z.next_in = (unsigned char *) b->s;
+	z.avail_in = b->len;
+	do {
+		z.next_out = out;
+		z.avail_out = sizeof(out);
+		st = deflate(&z, Z_FINISH);
+		fwrite(out, 1, sizeof(out) - z.avail_out, f);
+	} while (st == Z_OK);
+	deflateEnd(&z);
+	if (st != Z_STREAM_END || fflush(f)) {
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+struct expect {
+	T next;			/* the parsed values, a list for NDJSON */
+	int ndjson;
+	unsigned long n;
+};
+
+static int check_value(T x, void *arg)
+{
+	struct expect *e = arg;
+	T y = e->next;
+	e->n++;
+	if (!check)
+		return 0;
+	if (e->ndjson) {
+		if (!is_cons(y))
+			return 1;
+		e->next = get_tail(y);
+		y = get_head(y);
+	}
+	return !equals(x, y);
+}
+
+static void bench_gzip(struct corpus *c, T x)
+{
+	static const char *ops[] = {"gzip", "gzip_mt"};
+	struct json_parser p;
+	struct json_input in;
+	struct expect e;
+	struct result r;
+	FILE *f;
+	double t;
+	int i, j, st;
+
+	if (!(f = gzip_text(&c->text))) {
+		fail(c, "gzip");
+		return;
+	}
+	json_parser_init(&p);
+	for (j=0; j<2; j++) {
+		memset(&r, 0, sizeof(r));
+		for (i=0; i<runs; i++) {
+			e.next = x;
+			e.ndjson = c->ndjson;
+			e.n = 0;
+			lseek(fileno(f), 0, SEEK_SET);
+			start(&r, &t);
+			if (!json_input_open(&in, fileno(f), CHUNK, j)) {
+				fail(c, in.reason);
+				break;
+			}
+			st = json_input_parse(&in, &p, check_value, &e);
+			json_input_close(&in);
+			stop(&r, t);
+			if (st != JSON_MORE || in.format != JSON_INPUT_GZIP ||
+			    in.out_bytes != c->text.len)
+				fail(c, "json_input_parse");
+			else if (check && (c->ndjson ? is_cons(e.next) : e.n != 1))
+				fail(c, "json_input_parse count");
+		}
+		r.ops = e.n;
+		report(c, ops[j], &r);
+	}
+	json_parser_free(&p);
+	fclose(f);
+}
+
+/* array or object */
+static int is_container(T x)
+{
+	if (is_cons(x))
+		x = last_tail(x, 0);
+	return x == EMPTY_LIST || x == EMPTY_DICT;
+}
+
+/* set every kth value of x other than arrays and objects to 12345,
+   counting them in n */
+static void edit_values(T x, unsigned long k, unsigned long *n)
+{
+	int dict = is_cons(x) && last_tail(x, 0) == EMPTY_DICT, i;
+	for (i=0; is_cons(x); x = get_tail(x), i++) {
+		if (dict && i % 2 == 0)
+			continue;
+		if (is_container(get_head(x)))
+			edit_values(get_head(x), k, n);
+		else if (++*n % k == 0)
+			load_cons(x)[0] = store_int(12345);
+	}
+}
+
+/* the test op of {"a": 1} against mant * 10^exp passes */
+static int test_number(struct json_diff *d, int mant, int exp)
+{
+	T doc = dict_set(EMPTY_DICT, store_short("a"), store_int(1)), op;
+	op = dict_set(EMPTY_DICT, store_short("value"), store_num(mant, exp));
+	op = dict_set(op, store_short("path"), store_short("/a"));
+	op = dict_set(op, store_short("op"), store_short("test"));
+	return json_patch_apply(d, &doc, cons(op, EMPTY_LIST)) == JSON_DONE;
+}
+
+/* diff x with y, its copy with about 100 values changed, and apply the
+   patches */
+static void bench_diff(struct corpus *c, T x, T y)
+{
+	struct json_diff d;
+	struct result r = {0};
+	unsigned long n = 0, k, edits;
+	mpoint mp;
+	double t;
+	T patch, back;
+	int i;
+
+	edit_values(y, (unsigned long) -1, &n);
+	k = n / 100 + 1;
+	edits = n / k;
+	n = 0;
+	edit_values(y, k, &n);
+	json_diff_init(&d);
+
+	for (i=0; i<runs; i++) {
+		listdata_mark(mp);
+		start(&r, &t);
+		if (json_patch_diff(&d, x, y, &patch) != JSON_DONE)
+			fail(c, "json_patch_diff");
+		stop(&r, t);
+		if (check && d.ops != edits)
+			fail(c, "wrong number of patch operations");
+		listdata_release(mp);
+	}
+	r.ops = 1;
+	report(c, "diff", &r);
+
+	memset(&r, 0, sizeof(r));
+	for (i=0; i<runs; i++) {
+		listdata_mark(mp);
+		start(&r, &t);
+		if (json_merge_diff(&d, x, y, &patch) != JSON_DONE)
+			fail(c, "json_merge_diff");
+		stop(&r, t);
+		listdata_release(mp);
+	}
+	r.ops = 1;
+	report(c, "merge", &r);
+
+	/* replace ops only, so x keeps nothing allocated after the mark */
+	memset(&r, 0, sizeof(r));
+	for (i=0; i<runs; i++) {
+		listdata_mark(mp);
+		if (json_patch_diff(&d, x, y, &patch) != JSON_DONE ||
+		    json_patch_diff(&d, y, x, &back) != JSON_DONE)
+			fail(c, "json_patch_diff");
+		start(&r, &t);
+		if (json_patch_apply(&d, &x, patch) != JSON_DONE)
+			fail(c, "json_patch_apply");
+		stop(&r, t);
+		if (check && (json_patch_diff(&d, x, y, &patch) != JSON_DONE ||
+			      patch != EMPTY_LIST))
+			fail(c, "patched copy differs");
+		if (json_patch_apply(&d, &x, back) != JSON_DONE)
+			fail(c, "json_patch_apply");
+		listdata_release(mp);
+	}
+	r.ops = 1;
+	report(c, "apply", &r);
+	if (check && (!test_number(&d, 10, -1) || test_number(&d, 15, -1)))
+		fail(c, "test of a number by value");
+	json_diff_free(&d);
+}
+
+/* a changed digit must make the copies differ */
+static void check_differ(struct corpus *c, struct json_parser *p, T x)
+{
+	char *s = c->text.s + c->text.len;
+	T y;
+	while (s > c->text.s && (*--s < '1' || *s > '8'))
+		;
+	if (s == c->text.s)
+		return;
+	(*s)++;
+	if (!(y = parse(p, c)))
+		fail(c, "parse changed copy");
+	else if (equals(x, y))
+		fail(c, "changed copy equals");
+	(*s)--;
+}
+
+static void run(struct corpus *c)
+{
+	struct json_parser p;
+	struct listdata_stats st;
+	mpoint mp;
+	T x, y;
+
+	bench_parse(c, 0);
+	bench_parse(c, 1);
+
+	listdata_mark(mp);
+	json_parser_init(&p);
+	x = parse(&p, c);
+	p.spine = check;	/* equals also compares the two layouts */
+	y = parse(&p, c);
+	if (!x || !y)
+		fail(c, "parse failed");
+	else {
+		bench_packed(c, x);
+		bench_dict_get(c, x);
+		bench_walk(c, x);
+		bench_equals(c, x, y);
+		bench_print(c, x);
+		bench_arena(c, &p, x);
+		bench_cbor(c, x);
+		if (c->ndjson) {
+			bench_query(c, x);
+			bench_schema(c, x);
+		}
+		bench_gzip(c, x);
+		bench_diff(c, x, y);
+		if (check)
+			check_differ(c, &p, x);
+	}
+	bench_gc(c, &p);
+	json_parser_free(&p);
+	listdata_release(mp);
+	if (check && (listdata_stats(&st), st.heap_bytes))
+		fail(c, "heap not released");
+}
+
+int main(int argc, char **argv)
+{
+	double size = 4;
+	unsigned i;
+	int a, all = 1;
+
+	for (a=1; a<argc && argv[a][0] == '-'; a++) {
+		switch (argv[a][1]) {
+		case 'c':
+			check = 1;
+			break;
+		case 'j':
+			json_out = 1;
+			break;
+		case 's':
+			if (++a < argc)
+				size = atof(argv[a]);
+			break;
+		case 'n':
+			if (++a < argc)
+				runs = atoi(argv[a]);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c] [-j] [-s MB] "
+				"[-n runs] [corpus ...]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (check) {
+		size = 0.25;
+		runs = 1;
+	}
+	if (runs < 1 || size <= 0)
+		return 2;
+	for (; a<argc; a++) {
+		for (i=0; i<NUM_CORPORA; i++) {
+			if (!strcmp(argv[a], corpora[i].name))
+				corpora[i].selected = 1;
+		}
+		all = 0;
+	}
+	if (!check && !json_out)
+		printf("%-8s %-8s %9s %10s %10s %9s %11s\n", "corpus", "op",
+		       "MB/s", "ops", "ns/op", "allocs", "peak heap");
+	for (i=0; i<NUM_CORPORA; i++) {
+		struct corpus *c = &corpora[i];
+		if (!all && !c->selected)
+			continue;
+		seed = i + 1;
+		c->gen(&c->text, size * 1e6);
+		run(c);
+		free(c->text.s);
+	}
+	if (check)
+		printf("%s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
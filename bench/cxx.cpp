@@ -0,0 +1,167 @@
+/* The same walks with the C functions and with listdata.hpp: the sum
+ * of the ints and string bytes of a parsed document, and counting
+ * members with <algorithm>.
+ *
+ *   bench/cxx [-c] [records]
+ *
+ *   -c  check: a small document, exit 1 if the results differ
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include "listdata.hpp"
+extern "C" {
+#include "json.h"
+}
+
+using listdata::value;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, double t, unsigned long ops)
+{
+	std::printf("%-16s %9.1f ns/node\n", name, t / ops * 1e9);
+}
+
+struct sums {
+	unsigned long nodes, ints, bytes;
+	bool operator==(const sums &s) const
+	{
+		return nodes == s.nodes && ints == s.ints && bytes == s.bytes;
+	}
+};
+
+static void walk_c(listdata_type x, sums &s)
+{
+	s.nodes++;
+	switch (type_of(x)) {
+	case TYP_CONS:
+		for (; is_cons(x); x = get_tail(x))
+			walk_c(get_head(x), s);
+		break;
+	case TYP_INT:
+		s.ints += load_int(x);
+		break;
+	case TYP_STR:
+		s.bytes += std::strlen(load_str(x));
+		break;
+	case TYP_SHORT:
+		s.bytes += str_length(x);
+		break;
+	default:
+		break;
+	}
+}
+
+static void walk_cxx(value x, sums &s)
+{
+	listdata::short_buffer buf;
+	s.nodes++;
+	listdata::visit(x, listdata::overloaded{
+		[&](listdata::cons c) {
+			for (value e : c)
+				walk_cxx(e, s);
+		},
+		[&](int i) { s.ints += i; },
+		[&](listdata::string t) { s.bytes += t.view(buf).size(); },
+		[&](listdata::number) {},
+		[&](listdata::atom) {}});
+}
+
+/* records like those of the NDJSON corpus, in an array */
+static std::string document(unsigned n)
+{
+	static const char *words[] = {"alpha", "beta", "gamma", "delta",
+				      "caf\\u00e9", "x"};
+	std::string s = "[";
+	char buf[256];
+	for (unsigned i=0; i<n; i++) {
+		std::snprintf(buf, sizeof(buf),
+			      "%s{\"id\":%u,\"ts\":%u,\"level\":\"%s\","
+			      "\"msg\":\"%s %s\",\"ok\":%s,\"tags\":[%u,%u]}\n",
+			      i ? "," : "", i, 1350000000 + i * 7,
+			      i % 10 ? "info" : "error", words[i % 6],
+			      words[i * 7 % 6], i % 3 ? "true" : "false",
+			      i % 100, i * 13 % 1000);
+		s += buf;
+	}
+	return s + "]";
+}
+
+int main(int argc, char **argv)
+{
+	struct json_parser p;
+	sums a = {}, b = {};
+	unsigned long n = 200000, c1 = 0, c2 = 0;
+	listdata_type level = 0;
+	mpoint mp;
+	double t, best;
+	int check = 0, i, runs;
+
+	for (i=1; i<argc; i++) {
+		if (!std::strcmp(argv[i], "-c"))
+			check = 1;
+		else
+			n = std::strtoul(argv[i], NULL, 10);
+	}
+	if (check)
+		n = 2000;
+	runs = check ? 1 : 5;
+
+	listdata_mark(mp);
+	std::string text = document(n);
+	json_parser_init(&p);
+	if (json_parse(&p, text.data(), text.size(), NULL) != JSON_DONE) {
+		std::fprintf(stderr, "parse failed\n");
+		return 1;
+	}
+	value x = p.result;
+	level = store_short("level");
+
+	for (i=0, best=0; i<runs; i++) {
+		a = sums();
+		t = now();
+		walk_c(x.get(), a);
+		t = now() - t;
+		best = !i || t < best ? t : best;
+	}
+	if (!check)
+		report("c walk", best, a.nodes);
+	for (i=0, best=0; i<runs; i++) {
+		b = sums();
+		t = now();
+		walk_cxx(x, b);
+		t = now() - t;
+		best = !i || t < best ? t : best;
+	}
+	if (!check)
+		report("cxx walk", best, b.nodes);
+
+	/* records with level "error" */
+	for (listdata_type y = x.get(); is_cons(y); y = get_tail(y)) {
+		listdata_type *v = dict_get(get_head(y), level);
+		c1 += v && equals_str(*v, "error");
+	}
+	c2 = std::count_if(x.begin(), x.end(), [](value r) {
+		listdata_type *v = r.find("level");
+		return v && equals_str(*v, "error");
+	});
+
+	json_parser_free(&p);
+	listdata_release(mp);
+	if (!(a == b) || c1 != c2 || c1 != (n + 9) / 10) {
+		std::fprintf(stderr, "results differ\n");
+		return 1;
+	}
+	if (check)
+		std::printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,185 @@
+/* Frozen heap read by several threads: parses a generated corpus,
+ * freezes it and reads it from 1, 2, 4 ... threads at once, each of
+ * them also allocating in its private heap.
+ *
+ *   bench/frozen [-c] [-s MB] [-t threads]
+ *
+ *   -c  check: small corpus, verify the results of every thread,
+ *       exit 1 on failure
+ *   -s  approximate size of the corpus (default 4 MB)
+ *   -t  most threads (default 8)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "json.h"
+
+#define T listdata_type
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* records of users */
+static char *gen(size_t size, size_t *len)
+{
+	size_t max = size + 256, n = 0;
+	char *s = malloc(max);
+	unsigned long i;
+	if (!s)
+		return NULL;
+	n += sprintf(s, "[");
+	for (i=0; n < size; i++)
+		n += sprintf(s + n, "%s{\"id\":%lu,\"name\":\"user %lu\","
+			     "\"tags\":[\"t%lu\",\"t%lu\"],\"score\":%lu}",
+			     i ? ",\n" : "", i, i * 7919 % 100000,
+			     i % 13, i % 7, i * 31 % 1000);
+	n += sprintf(s + n, "]\n");
+	*len = n;
+	return s;
+}
+
+struct reader {
+	pthread_t thread;
+	T data;
+	unsigned long sum;		/* of the record hashes */
+	unsigned long names;		/* characters in the names */
+	int ok;
+};
+
+static T key_name, key_tags;
+
+static int append(T x, void *b)
+{
+	return !list_append(b, x);
+}
+
+/* read every record, and build a scratch copy of its tags with the
+   name in front in the private heap, released after each record */
+static void read_all(struct reader *r)
+{
+	struct listdata_builder b;
+	mpoint mp;
+	T x, rec, *name, *tags, y;
+
+	r->ok = 1;
+	r->sum = r->names = 0;
+	for (x = r->data; is_cons(x); x = get_tail(x)) {
+		rec = get_head(x);
+		r->sum += listdata_hash(rec);
+		name = dict_get(rec, key_name);
+		tags = dict_get(rec, key_tags);
+		/* short names are in the handle, not the heap */
+		if (!name || !tags || (type_of(*name) == TYP_STR &&
+				       !listdata_frozen(*name))) {
+			r->ok = 0;
+			break;
+		}
+		listdata_mark(mp);
+		list_begin(&b);
+		list_append(&b, *name);
+		list_foreach(*tags, append, &b);
+		y = list_finish(&b, EMPTY_LIST);
+		if (!y || listdata_frozen(y) ||
+		    list_length(y) != list_length(*tags) + 1)
+			r->ok = 0;
+		r->names += str_length(*name);
+		listdata_release(mp);
+	}
+}
+
+static void *reader(void *arg)
+{
+	read_all(arg);
+	listdata_thread_exit();
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct json_parser p;
+	struct reader ref, *rs;
+	double size = 4, t;
+	size_t len;
+	int a, i, n, max = 8, check = 0, failed = 0;
+	const char *end;
+	char *text;
+	mpoint mp;
+
+	for (a=1; a<argc && argv[a][0] == '-'; a++) {
+		switch (argv[a][1]) {
+		case 'c':
+			check = 1;
+			break;
+		case 's':
+			if (++a < argc)
+				size = atof(argv[a]);
+			break;
+		case 't':
+			if (++a < argc)
+				max = atoi(argv[a]);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c] [-s MB] [-t threads]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+	if (check) {
+		size = 0.25;
+		max = 4;
+	}
+	if (max < 1 || size <= 0 || !(text = gen(size * 1e6, &len)) ||
+	    !(rs = calloc(max, sizeof(*rs))))
+		return 2;
+
+	listdata_mark(mp);
+	json_parser_init(&p);
+	if (json_parse(&p, text, len, &end) != JSON_DONE) {
+		fprintf(stderr, "parse failed\n");
+		return 1;
+	}
+	ref.data = p.result;
+	json_parser_free(&p);
+	key_name = store_str("name");
+	key_tags = store_str("tags");
+	if (!key_name || !key_tags || !listdata_freeze()) {
+		fprintf(stderr, "freeze failed\n");
+		return 1;
+	}
+	read_all(&ref);
+	if (!ref.ok)
+		failed = 1;
+
+	if (!check)
+		printf("%-8s %9s %12s\n", "threads", "MB/s", "ns/record");
+	for (n=1; n<=max; n*=2) {
+		t = now();
+		for (i=0; i<n; i++) {
+			rs[i].data = ref.data;
+			if (pthread_create(&rs[i].thread, NULL, reader, rs+i))
+				return 2;
+		}
+		for (i=0; i<n; i++) {
+			pthread_join(rs[i].thread, NULL);
+			if (!rs[i].ok || rs[i].sum != ref.sum ||
+			    rs[i].names != ref.names)
+				failed = 1;
+		}
+		t = now() - t;
+		if (!check)
+			printf("%-8d %9.1f %12.1f\n", n, n * len / t / 1e6,
+			       t / n / list_length(ref.data) * 1e9);
+	}
+	if (check)
+		printf("%s\n", failed ? "FAIL" : "ok");
+	listdata_release(mp);
+	free(rs);
+	free(text);
+	return failed;
+}
@@ -0,0 +1,153 @@
+/* Microbenchmarks for listdata_hash and equals:
+ * short keys, long strings and deep trees. Copies of a string with
+ * characters above U+00FF, split at different places, are checked to
+ * be equal and to hash the same first (exit 1 if not).
+ *
+ *   make bench/hash
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "listdata.h"
+
+#define T listdata_type
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static volatile unsigned long sink;
+
+static void report(const char *name, double t, long ops, double bytes)
+{
+	printf("%-24s %9.1f ns/op", name, t / ops * 1e9);
+	if (bytes)
+		printf(" %9.1f MB/s", bytes / t / 1e6);
+	printf("\n");
+}
+
+static void bench_pair(const char *name, T x, T y, long n, double bytes)
+{
+	char buf[64];
+	double t;
+	long i;
+
+	t = now();
+	for (i=0; i<n; i++)
+		sink += equals(x, y);
+	report(strcat(strcpy(buf, name), " equals"), now() - t, n, n * bytes);
+
+	t = now();
+	for (i=0; i<n; i++)
+		sink += listdata_hash(x);
+	report(strcat(strcpy(buf, name), " hash"), now() - t, n, n * bytes);
+
+	if (listdata_hash(x) != listdata_hash(y))
+		printf("%s: hash mismatch\n", name);
+}
+
+#define NKEYS 1024
+
+static void short_keys(long n)
+{
+	static const char *names[] = {"id", "ok", "GET", "name", "unit",
+				      "scale", "timestamp"};
+	T a[NKEYS], b[NKEYS];
+	char buf[32];
+	double t;
+	long i, hits = 0;
+	int k;
+
+	for (k=0; k<NKEYS; k++) {
+		if (k < 7)
+			strcpy(buf, names[k]);
+		else
+			sprintf(buf, "key%d", k);
+		a[k] = store_str(buf);
+		b[k] = store_str(buf);
+	}
+	t = now();
+	for (i=0; i<n; i++) {
+		k = i % NKEYS;
+		hits += equals(a[k], b[(k + (i & 1)) % NKEYS]);
+	}
+	report("short keys equals", now() - t, n, 0);
+	t = now();
+	for (i=0; i<n; i++)
+		sink += listdata_hash(a[i % NKEYS]);
+	report("short keys hash", now() - t, n, 0);
+	sink += hits;
+}
+
+/* flat copy and copy consed from 100-byte pieces */
+static void long_strings(size_t len, long n)
+{
+	char *s = malloc(len + 1);
+	T x, y;
+	size_t i;
+
+	for (i=0; i<len; i++)
+		s[i] = 'a' + i % 26;
+	s[len] = '\0';
+	x = store_str(s);
+	i = (len - 1) / 100 * 100;
+	y = store_str(s + i);
+	while (i) {
+		s[i] = '\0';
+		i -= 100;
+		y = concat(store_str(s + i), y);
+	}
+	bench_pair("long strings", x, y, n, len);
+	free(s);
+}
+
+static T tree(int depth, int width, int seed)
+{
+	T x = EMPTY_LIST;
+	int i;
+	char buf[16];
+	for (i=0; i<width; i++) {
+		if (depth > 1)
+			x = cons(tree(depth - 1, width, seed + i), x);
+		else {
+			sprintf(buf, "v%d", seed + i);
+			x = cons(store_str(buf), cons(store_int(seed * i), x));
+		}
+	}
+	return x;
+}
+
+/* "caf\u20ac\u20acs" as the parser stores it, and split after "ca" */
+static int check_wide(void)
+{
+	T euro = store_int(0x20ac);
+	T x = cons(store_str("caf"), cons(euro, cons(euro, store_str("s"))));
+	T y = cons(store_str("ca"), cons(store_str("f"),
+		   cons(euro, cons(euro, store_str("s")))));
+	T z = cons(store_str("caf"), cons(euro, cons(store_int(0xe9),
+		   store_str("s"))));
+	return equals(x, y) && equals(y, x) && !equals(x, z) &&
+	       listdata_hash(x) == listdata_hash(y);
+}
+
+int main(int argc, char **argv)
+{
+	mpoint mp;
+	long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+	listdata_mark(mp);
+	if (!check_wide()) {
+		fprintf(stderr, "split strings with wide characters differ\n");
+		return 1;
+	}
+	short_keys(n * 10);
+	long_strings(1 << 20, n / 10000 + 1);
+	bench_pair("deep tree", tree(8, 4, 0), tree(8, 4, 0), n / 10000 + 1, 0);
+	bench_pair("deep chain", tree(1000, 1, 0), tree(1000, 1, 0), n / 100 + 1, 0);
+	listdata_release(mp);
+	return 0;
+}
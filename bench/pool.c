@@ -0,0 +1,287 @@
+/* Parallel list algorithms: parses a generated corpus of records,
+ * freezes it and runs list_sort (by a C comparator), list_sort_by,
+ * list_map and list_reduce on it with pools of 1, 2, 4 ... threads,
+ * reporting the speedup over 1 thread.
+ *
+ *   bench/pool [-c] [-s MB] [-t threads]
+ *
+ *   -c  check: small corpus and chunks, compare the results of every
+ *       pool with those computed serially, exit 1 on failure
+ *   -s  approximate size of the corpus (default 8 MB)
+ *   -t  most threads (default 8)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pool.h"
+
+#define T listdata_type
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* records of users, with many equal scores and some without one */
+static char *gen(size_t size, size_t *len)
+{
+	size_t max = size + 256, n = 0;
+	char *s = malloc(max);
+	unsigned long i;
+	if (!s)
+		return NULL;
+	n += sprintf(s, "[");
+	for (i=0; n < size; i++) {
+		n += sprintf(s + n, "%s{\"id\":%lu,\"name\":\"user %lu\","
+			     "\"tags\":[\"t%lu\",\"t%lu\"]", i ? ",\n" : "",
+			     i, i * 7919 % 100000, i % 13, i % 7);
+		if (i % 97)
+			n += sprintf(s + n, ",\"score\":%lu", i * 31 % 1000);
+		n += sprintf(s + n, "}");
+	}
+	n += sprintf(s + n, "]\n");
+	*len = n;
+	return s;
+}
+
+static T key_id, key_score, key_double;
+static const char *const path[] = { "score", NULL };
+
+static long score_of(T rec)
+{
+	T *v = dict_get(rec, key_score);
+	return v ? load_int(*v) : -1;
+}
+
+/* by score, highest first */
+static int by_score(T a, T b, void *arg)
+{
+	long x = score_of(a), y = score_of(b);
+	(void) arg;
+	return (x < y) - (x > y);
+}
+
+/* {"id": id, "double": 2 * score}, null without a score */
+static T doubled(T rec, void *arg)
+{
+	long s = score_of(rec);
+	(void) arg;
+	if (s < 0)
+		return 0;
+	return cons(key_id, cons(*dict_get(rec, key_id),
+		    cons(key_double, cons(store_int(2 * s), EMPTY_DICT))));
+}
+
+struct sum {
+	double score;
+	unsigned long count;
+};
+
+static void add(void *acc, T rec, void *arg)
+{
+	struct sum *s = acc;
+	long x = score_of(rec);
+	(void) arg;
+	if (x >= 0) {
+		s->score += x;
+		s->count++;
+	}
+}
+
+static void combine(void *acc, const void *part, void *arg)
+{
+	struct sum *s = acc;
+	const struct sum *p = part;
+	(void) arg;
+	s->score += p->score;
+	s->count += p->count;
+}
+
+/* serial results */
+
+struct ref {
+	long key;
+	unsigned long i;
+	T x;
+};
+
+static int ref_cmp(const void *a, const void *b)
+{
+	const struct ref *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->i < y->i ? -1 : x->i > y->i;
+}
+
+/* stable sort of data by score, descending if desc */
+static T ref_sort(T data, int desc)
+{
+	unsigned long n = list_length(data), i;
+	struct ref *r = malloc((n + 1) * sizeof(*r));
+	T *v = malloc((n + 1) * sizeof(T)), y;
+	if (!r || !v)
+		exit(2);
+	for (i=0; i<n; i++, data = get_tail(data)) {
+		r[i].x = get_head(data);
+		r[i].key = desc ? -score_of(r[i].x) : score_of(r[i].x);
+		r[i].i = i;
+	}
+	qsort(r, n, sizeof(*r), ref_cmp);
+	for (i=0; i<n; i++)
+		v[i] = r[i].x;
+	y = list_from_array(v, n, EMPTY_LIST);
+	free(r);
+	free(v);
+	return y;
+}
+
+/* x and y have the same elements, by handle */
+static int same(T x, T y)
+{
+	for (; is_cons(x) && is_cons(y); x = get_tail(x), y = get_tail(y))
+		if (get_head(x) != get_head(y))
+			return 0;
+	return x == y;
+}
+
+static const char *const ops[] = { "sort", "sort_by", "map", "reduce" };
+
+/* run op i on data with pool p, check the result against ref */
+static int run(struct list_pool *p, int i, T data, T ref, struct sum *sum)
+{
+	struct sum s;
+	T y = 0;
+
+	switch (i) {
+	case 0:
+		y = list_sort(p, data, by_score, NULL);
+		return y && same(y, ref);
+	case 1:
+		y = list_sort_by(p, data, path);
+		return y && same(y, ref);
+	case 2:
+		y = list_map(p, data, doubled, NULL);
+		return y && equals(y, ref);
+	default:
+		memset(&s, 0, sizeof(s));
+		return list_reduce(p, data, &s, sizeof(s), add, combine, NULL) &&
+		       s.score == sum->score && s.count == sum->count;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct json_parser jp;
+	struct list_pool p;
+	struct listdata_builder b;
+	struct sum sum;
+	T data, x, refs[4];
+	double size = 8, t, base[4];
+	size_t len;
+	int a, i, n, max = 8, check = 0, failed = 0;
+	unsigned long records;
+	const char *end;
+	char *text;
+	mpoint mp;
+
+	for (a=1; a<argc && argv[a][0] == '-'; a++) {
+		switch (argv[a][1]) {
+		case 'c':
+			check = 1;
+			break;
+		case 's':
+			if (++a < argc)
+				size = atof(argv[a]);
+			break;
+		case 't':
+			if (++a < argc)
+				max = atoi(argv[a]);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c] [-s MB] [-t threads]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+	if (check) {
+		size = 0.25;
+		max = 4;
+	}
+	if (max < 1 || size <= 0 || !(text = gen(size * 1e6, &len)))
+		return 2;
+
+	listdata_mark(mp);
+	json_parser_init(&jp);
+	if (json_parse(&jp, text, len, &end) != JSON_DONE) {
+		fprintf(stderr, "parse failed\n");
+		return 1;
+	}
+	data = jp.result;
+	json_parser_free(&jp);
+	key_id = store_short("id");
+	key_score = store_short("score");
+	key_double = store_short("double");
+	if (!listdata_freeze()) {
+		fprintf(stderr, "freeze failed\n");
+		return 1;
+	}
+	records = list_length(data);
+
+	refs[0] = ref_sort(data, 1);
+	refs[1] = ref_sort(data, 0);
+	list_begin(&b);
+	for (x = data; is_cons(x); x = get_tail(x))
+		list_append(&b, doubled(get_head(x), NULL));
+	refs[2] = list_finish(&b, EMPTY_LIST);
+	refs[3] = 0;
+	memset(&sum, 0, sizeof(sum));
+	for (x = data; is_cons(x); x = get_tail(x))
+		add(&sum, get_head(x), NULL);
+
+	if (!check)
+		printf("%-8s %8s %12s %8s %8s\n", "op", "threads", "Mrecords/s",
+		       "speedup", "steals");
+	for (i=0; i<4; i++) {
+		for (n=1; n<=max; n*=2) {
+			if (!list_pool_init(&p, n)) {
+				fprintf(stderr, "list_pool_init: %s\n", p.reason);
+				return 2;
+			}
+			if (check)
+				p.chunk = 64;
+			t = now();
+			if (!run(&p, i, data, refs[i], &sum)) {
+				fprintf(stderr, "%s, %d threads: wrong result%s%s\n",
+					ops[i], n, p.reason ? ": " : "",
+					p.reason ? p.reason : "");
+				failed = 1;
+			}
+			t = now() - t;
+			if (n == 1)
+				base[i] = t;
+			if (!check)
+				printf("%-8s %8u %12.2f %8.2f %8lu\n", ops[i],
+				       p.threads, records / t / 1e6, base[i] / t,
+				       p.steals);
+			list_pool_free(&p);
+		}
+	}
+
+	/* an element of the private heap is refused with threads */
+	if (check && list_pool_init(&p, 2)) {
+		x = cons(cons(key_id, cons(store_int(100000), EMPTY_DICT)), data);
+		if (p.threads > 1 && list_sort_by(&p, x, path)) {
+			fprintf(stderr, "private element not refused\n");
+			failed = 1;
+		}
+		list_pool_free(&p);
+	}
+	if (check)
+		printf("%s\n", failed ? "FAIL" : "ok");
+	listdata_release(mp);
+	free(text);
+	return failed;
+}
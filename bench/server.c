@@ -0,0 +1,257 @@
+/* Many connections at once through json_server: NDJSON records are
+ * written to socketpairs in pieces of random size, round robin, and
+ * the server loop is run between the rounds, so that every connection
+ * has a value in progress most of the time.
+ *
+ *   bench/server [-c] [-s MB] [-n connections] [-w workers]
+ *
+ *   -c  check: small pieces, verify every record and the order of each
+ *       connection, and that a malformed connection and one with a
+ *       value over doc_max are closed; exit 1 on failure
+ *   -s  approximate size of the input (default 32 MB)
+ *   -n  connections (default 1000)
+ *   -w  worker threads (default 2)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "server.h"
+
+#define T listdata_type
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (unsigned) (seed >> 33) % n;
+}
+
+struct conn {
+	int fd;				/* writing end */
+	char *s;
+	size_t len, pos;
+	unsigned long records;		/* written */
+	unsigned long seen;		/* handled, in a worker */
+	int bad;			/* records out of order or wrong */
+	int status;			/* when closed, 1 until then */
+};
+
+static struct conn *conns;
+static T key_conn, key_seq, key_msg;
+
+/* records of connection i, and a top-level number at the end */
+static char *gen(unsigned long i, size_t size, size_t *len,
+		 unsigned long *records)
+{
+	size_t max = size + 256, n = 0;
+	char *s = malloc(max);
+	unsigned long k;
+	if (!s)
+		exit(2);
+	for (k=0; n < size; k++)
+		n += sprintf(s + n, "{\"conn\":%lu, \"seq\":%lu,\"msg\":\"m%lu-%lu\","
+			     "\"tags\":[\"caf\\u00e9\",%u,true,null],"
+			     "\"pos\":{\"x\":%u.%02u,\"y\":-%u}}%s",
+			     i, k, i, k, rnd(1000), rnd(100), rnd(100),
+			     rnd(1000), k % 7 ? "\n" : "\r\n\t ");
+	n += sprintf(s + n, "%lu", k);
+	*len = n;
+	*records = k + 1;
+	return s;
+}
+
+static void handle(object x, unsigned long id, void *arg)
+{
+	struct conn *c = conns + id - 1;
+	char msg[64];
+	T *v;
+	(void) arg;
+	if (type_of(x) == TYP_INT) {	/* the last value */
+		c->bad |= (unsigned long) load_int(x) != c->seen++;
+		return;
+	}
+	sprintf(msg, "m%lu-%lu", id - 1, c->seen);
+	c->bad |= !(v = dict_get(x, key_conn)) ||
+		  (unsigned long) load_int(*v) != id - 1 ||
+		  !(v = dict_get(x, key_seq)) ||
+		  (unsigned long) load_int(*v) != c->seen ||
+		  !(v = dict_get(x, key_msg)) || !equals_str(*v, msg);
+	c->seen++;
+}
+
+static void closed(unsigned long id, int status, void *arg)
+{
+	(void) arg;
+	conns[id - 1].status = status;
+}
+
+/* write the next piece of each connection, close those written out
+   or closed by the server. Return the number still being written. */
+static unsigned long write_round(unsigned long n, unsigned piece)
+{
+	unsigned long i, open = 0;
+	struct conn *c;
+	ssize_t k;
+	size_t m;
+	for (i=0; i<n; i++) {
+		c = conns + i;
+		if (c->fd < 0)
+			continue;
+		m = 1 + rnd(piece);
+		if (m > c->len - c->pos)
+			m = c->len - c->pos;
+		k = write(c->fd, c->s + c->pos, m);
+		if (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EPIPE) {
+			perror("write");
+			exit(2);
+		}
+		if (k > 0)
+			c->pos += k;
+		if (c->pos == c->len || (k < 0 && errno == EPIPE)) {
+			close(c->fd);
+			c->fd = -1;
+		} else {
+			open++;
+		}
+	}
+	return open;
+}
+
+int main(int argc, char **argv)
+{
+	struct json_server s;
+	struct rlimit rl;
+	unsigned long n = 1000, i, records = 0, seen = 0, open;
+	unsigned workers = 2, piece;
+	double size = 32, t;
+	size_t bytes = 0;
+	int check = 0, a, fd[2], failed = 0;
+
+	for (a=1; a<argc; a++) {
+		if (!strcmp(argv[a], "-c"))
+			check = 1;
+		else if (!strcmp(argv[a], "-s") && a + 1 < argc)
+			size = atof(argv[++a]);
+		else if (!strcmp(argv[a], "-n") && a + 1 < argc)
+			n = strtoul(argv[++a], NULL, 10);
+		else if (!strcmp(argv[a], "-w") && a + 1 < argc)
+			workers = atoi(argv[++a]);
+		else {
+			fprintf(stderr, "usage: %s [-c] [-s MB] [-n connections] "
+				"[-w workers]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (check) {
+		size = 1;
+		n = 200;
+	}
+	piece = check ? 64 : 4096;
+	if (!n || size <= 0)
+		return 2;
+	signal(SIGPIPE, SIG_IGN);
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	key_conn = store_short("conn");
+	key_seq = store_short("seq");
+	key_msg = store_short("msg");
+	if (!json_server_init(&s, workers)) {
+		fprintf(stderr, "json_server_init: %s\n", s.reason);
+		return 2;
+	}
+	s.f = handle;
+	s.closed = closed;
+	if (check)
+		s.doc_max = 4096;
+	if (!(conns = calloc(n + 2, sizeof(*conns))))
+		return 2;
+	for (i=0; i<n + 2 * check; i++) {
+		struct conn *c = conns + i;
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd)) {
+			perror("socketpair");
+			return 2;
+		}
+		if (i < n) {
+			c->s = gen(i, size * 1e6 / n, &c->len, &c->records);
+		} else if (i == n) {		/* malformed */
+			c->s = strdup("{\"a\":1}\n{\"b\":[1,2}\n");
+			c->len = strlen(c->s);
+		} else {			/* over doc_max */
+			c->s = calloc(1, 8192);
+			memset(c->s, ' ', 8191);
+			memcpy(c->s, "[1,\"", 4);
+			memcpy(c->s + 8189, "\"]", 2);
+			c->len = 8191;
+		}
+		records += c->records;
+		bytes += c->len;
+		c->fd = fd[0];
+		c->status = 1;
+		fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+		if (json_server_add(&s, fd[1]) != i + 1) {
+			fprintf(stderr, "json_server_add: %s\n", s.reason);
+			return 2;
+		}
+	}
+
+	t = now();
+	for (;;) {
+		open = write_round(n + 2 * check, piece);
+		if (json_server_run(&s, open ? 0 : -1) <= 0)
+			break;
+	}
+	json_server_free(&s);
+	t = now() - t;
+
+	for (i=0; i<n; i++) {
+		seen += conns[i].seen;
+		if (conns[i].bad || conns[i].seen != conns[i].records ||
+		    conns[i].status != JSON_MORE) {
+			fprintf(stderr, "connection %lu: %lu of %lu records%s, "
+				"status %d\n", i, conns[i].seen,
+				conns[i].records, conns[i].bad ? " (bad)" : "",
+				conns[i].status);
+			failed = 1;
+		}
+	}
+	if (check && (conns[n].status != JSON_ERROR || conns[n].seen != 1 ||
+		      conns[n + 1].status != JSON_LIMIT)) {
+		fprintf(stderr, "bad connections: status %d and %d\n",
+			conns[n].status, conns[n + 1].status);
+		failed = 1;
+	}
+	if (s.failed) {
+		fprintf(stderr, "%lu values did not parse: %s\n", s.failed,
+			s.reason);
+		failed = 1;
+	}
+	if (check)
+		printf("%s\n", failed ? "FAIL" : "ok");
+	else
+		printf("%lu connections, %u workers: %lu records, %.1f MB/s, "
+		       "%.0f records/s\n", n, workers, seen, bytes / t / 1e6,
+		       seen / t);
+	for (i=0; i<n + 2 * check; i++)
+		free(conns[i].s);
+	free(conns);
+	return failed;
+}
@@ -0,0 +1,664 @@
+/* CBOR encoder and decoder, see cbor.h.
+ *
+ *  Strings are stored as by the JSON parser: a C string (Latin-1), or
+ *  a consed string with ints for characters above U+00FF (or U+0000).
+ *  Numbers that do not fit are cut to the digits of an int and an
+ *  exponent, as the parser does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "cbor.h"
+
+#define DEPTH_MAX 1024
+
+static void *grow(void *mem, unsigned *max, size_t size)
+{
+	unsigned n = *max ? *max << 1 : 16;
+	void *p = n > *max ? realloc(mem, (size_t) n * size) : NULL;
+	if (p)
+		*max = n;
+	return p;
+}
+
+/* Encoder */
+
+void cbor_buf_init(struct cbor_buf *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+
+void cbor_buf_free(struct cbor_buf *b)
+{
+	free(b->s);
+	free(b->stack);
+	cbor_buf_init(b);
+}
+
+static int reserve(struct cbor_buf *b, size_t n)
+{
+	size_t max = b->max ? b->max : 256;
+	unsigned char *s;
+	if (b->len + n <= b->max)
+		return 1;
+	while (max < b->len + n)
+		max *= 2;
+	if (!(s = realloc(b->s, max)))
+		return 0;
+	b->s = s;
+	b->max = max;
+	return 1;
+}
+
+static int put_byte(struct cbor_buf *b, int c)
+{
+	if (!reserve(b, 1))
+		return 0;
+	b->s[b->len++] = c;
+	return 1;
+}
+
+/* major type and argument */
+static int put_head(struct cbor_buf *b, int major, unsigned long long v)
+{
+	unsigned char *s;
+	int n, i;
+	if (!reserve(b, 9))
+		return 0;
+	s = b->s + b->len;
+	major <<= 5;
+	if (v < 24) {
+		*s = major | v;
+		b->len++;
+		return 1;
+	}
+	n = v < 0x100 ? 1 : v < 0x10000 ? 2 : v <= 0xFFFFFFFFul ? 4 : 8;
+	*s = major | (n == 1 ? 24 : n == 2 ? 25 : n == 4 ? 26 : 27);
+	for (i=n; i>0; i--, v >>= 8)
+		s[i] = v & 0xFF;
+	b->len += n + 1;
+	return 1;
+}
+
+static int put_int(struct cbor_buf *b, int v)
+{
+	if (v >= 0)
+		return put_head(b, 0, v);
+	return put_head(b, 1, -1 - (long long) v);
+}
+
+static int utf8_len(int c)
+{
+	return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+static int put_utf8(unsigned char *s, int c)
+{
+	int n = utf8_len(c), i;
+	if (n == 1) {
+		*s = c;
+		return 1;
+	}
+	for (i=n-1; i>0; i--, c >>= 6)
+		s[i] = 0x80 | (c & 0x3F);
+	*s = (0xF00 >> n) | c;
+	return n;
+}
+
+/* a string as UTF-8 text, return 0 if x is not a string */
+static int put_text(struct cbor_buf *b, object x)
+{
+	struct listdata_chunks c;
+	const char *s;
+	unsigned long n, i, len = 0, bytes = 0;
+	int ch, r;
+
+	chunk_begin(&c, x);
+	while ((r = chunk_next(&c, &s, &n, &ch)) > 0) {
+		if (!s) {
+			if (ch < 0 || ch > 0x10FFFF)
+				return 0;
+			len += utf8_len(ch);
+			continue;
+		}
+		for (i=0; i<n; i++)
+			len += (unsigned char) s[i] < 0x80 ? 1 : 2;
+		bytes += n;
+	}
+	if (r < 0 || !put_head(b, 3, len) || !reserve(b, len))
+		return 0;
+	chunk_begin(&c, x);
+	while (chunk_next(&c, &s, &n, &ch) > 0) {
+		if (!s)
+			b->len += put_utf8(b->s + b->len, ch);
+		else if (bytes == len) {
+			memcpy(b->s + b->len, s, n);	/* all ASCII */
+			b->len += n;
+		} else {
+			for (i=0; i<n; i++)
+				b->len += put_utf8(b->s + b->len,
+						   (unsigned char) s[i]);
+		}
+	}
+	return 1;
+}
+
+/* the members in the order of the JSON text, which is the reverse of
+   the list */
+static int put_map(struct cbor_buf *b, object x)
+{
+	unsigned base = b->n, i;
+	object *stack;
+	for (; is_cons(x); x = get_tail(x)) {
+		if (b->n == b->stack_max) {
+			if (!(stack = grow(b->stack, &b->stack_max,
+					   sizeof(*stack))))
+				return 0;
+			b->stack = stack;
+		}
+		b->stack[b->n++] = get_head(x);
+	}
+	if ((b->n - base) % 2 || !put_head(b, 5, (b->n - base) / 2))
+		return 0;
+	for (i=b->n; i>base; i-=2) {
+		if (!cbor_encode(b, b->stack[i-2]) ||
+		    !cbor_encode(b, b->stack[i-1]))
+			return 0;
+	}
+	b->n = base;
+	return 1;
+}
+
+int cbor_encode(struct cbor_buf *b, object x)
+{
+	object e;
+	int m, n;
+	switch (type_of(x)) {
+	case TYP_INT:
+		return put_int(b, load_int(x));
+	case TYP_NUM:
+		load_num(x, &m, &n);
+		return put_head(b, 6, 4) && put_head(b, 4, 2) &&
+		       put_int(b, n) && put_int(b, m);
+	case TYP_STR:
+	case TYP_SHORT:
+	case TYP_ROPE:
+		return put_text(b, x);
+	case TYP_ATOM:
+		switch (x) {
+		case 0:          return put_byte(b, 0xF6);
+		case JSON_TRUE:  return put_byte(b, 0xF5);
+		case JSON_FALSE: return put_byte(b, 0xF4);
+		case EMPTY_LIST: return put_byte(b, 0x80);
+		case EMPTY_DICT: return put_byte(b, 0xA0);
+		}
+		return 0;
+	case TYP_CONS:
+		break;
+	default:
+		return 0;
+	}
+	e = last_tail(x, 0);
+	if (e == EMPTY_LIST) {
+		if (!put_head(b, 4, list_length(x)))
+			return 0;
+		for (; is_cons(x); x = get_tail(x))
+			if (!cbor_encode(b, get_head(x)))
+				return 0;
+		return 1;
+	}
+	if (e == EMPTY_DICT)
+		return put_map(b, x);
+	if (type_of(e) == TYP_INT && e == get_tail(x))
+		return type_of(get_head(x)) == TYP_INT &&
+		       put_head(b, 6, 4) && put_head(b, 4, 2) &&
+		       put_int(b, load_int(e)) &&
+		       put_int(b, load_int(get_head(x)));
+	return put_text(b, x);
+}
+
+/* Decoder */
+
+struct input {
+	struct cbor_decoder *d;
+	const unsigned char *s, *e;
+};
+
+void cbor_decoder_init(struct cbor_decoder *d)
+{
+	memset(d, 0, sizeof(*d));
+	d->limits.depth = DEPTH_MAX;
+	d->limits.str_len = UINT_MAX;
+	d->limits.elems = UINT_MAX;
+}
+
+void cbor_decoder_free(struct cbor_decoder *d)
+{
+	free(d->buf);
+	free(d->ucs);
+	cbor_decoder_init(d);
+}
+
+static int fail(struct input *in, int st, const char *reason)
+{
+	in->d->reason = reason;
+	return st;
+}
+
+/* major type in *major, additional information in *info and the
+   argument in *v (0 for an indefinite length) */
+static int read_head(struct input *in, int *major, int *info,
+		     unsigned long long *v)
+{
+	int n, c;
+	if (in->s == in->e)
+		return JSON_MORE;
+	c = *in->s++;
+	*major = c >> 5;
+	*info = c & 31;
+	*v = 0;
+	if (*info < 24) {
+		*v = *info;
+		return JSON_DONE;
+	}
+	if (*info == 31)
+		return JSON_DONE;
+	if (*info > 27)
+		return fail(in, JSON_ERROR, "reserved additional information");
+	n = 1 << (*info - 24);
+	if (in->e - in->s < n)
+		return JSON_MORE;
+	while (n--)
+		*v = *v << 8 | *in->s++;
+	return JSON_DONE;
+}
+
+/* as the JSON parser stores a number of up to an int of digits */
+static object make_number(int neg, unsigned long long m, long e)
+{
+	object x, y;
+	while (m > INT_MAX) {
+		m /= 10;
+		e++;
+	}
+	x = store_int(neg ? -(int) m : (int) m);
+	if (e > INT_MAX)
+		e = INT_MAX;
+	else if (e < INT_MIN)
+		e = INT_MIN;
+	if (!e || !x)
+		return x;
+	y = store_int(e);
+	return y ? cons(x, y) : 0;
+}
+
+static object make_float(double d, int single)
+{
+	struct json_parser p;
+	char buf[32];
+	object x = 0;
+	int i;
+	if (d >= INT_MIN && d <= INT_MAX && d == (int) d)
+		return store_int((int) d);
+	for (i=1; i<17; i++) {
+		sprintf(buf, "%.*g", i, d);
+		if (single ? (float) strtod(buf, NULL) == (float) d :
+			     strtod(buf, NULL) == d)
+			break;
+	}
+	sprintf(buf, "%.*g", i, d);
+	json_parser_init(&p);
+	if (json_parse_str(&p, buf, NULL) == JSON_MORE &&
+	    json_parse_end(&p) == JSON_DONE)
+		x = p.result;
+	json_parser_free(&p);
+	return x;
+}
+
+static double half(unsigned h)
+{
+	int e = (h >> 10) & 0x1F;
+	double m = h & 0x3FF;
+	double d = e ? (m + 1024) : m * 2;
+	for (e -= 25; e > 0; e--)
+		d *= 2;
+	for (; e < 0; e++)
+		d /= 2;
+	return h & 0x8000 ? -d : d;
+}
+
+/* n characters from U+0001 to U+00FF */
+static int put_bytes(struct input *in, const unsigned char *s, unsigned n)
+{
+	struct cbor_decoder *d = in->d;
+	char *buf;
+	if (n > d->limits.str_len - d->len - d->nucs)
+		return fail(in, JSON_LIMIT, "string length limit");
+	while (d->len + n >= d->buf_max) {
+		if (!(buf = grow(d->buf, &d->buf_max, 1)))
+			return fail(in, JSON_LIMIT, "out of memory");
+		d->buf = buf;
+	}
+	memcpy(d->buf + d->len, s, n);
+	d->len += n;
+	return JSON_DONE;
+}
+
+/* a character above U+00FF (or U+0000), kept aside as by the parser */
+static int put_uc(struct input *in, int c)
+{
+	struct cbor_decoder *d = in->d;
+	struct json_uc *u;
+	unsigned char b = c;
+	if (c && c < 0x100)
+		return put_bytes(in, &b, 1);
+	if (d->len + d->nucs >= d->limits.str_len)
+		return fail(in, JSON_LIMIT, "string length limit");
+	if (d->nucs == d->ucs_max) {
+		if (!(u = grow(d->ucs, &d->ucs_max, sizeof(*u))))
+			return fail(in, JSON_LIMIT, "out of memory");
+		d->ucs = u;
+	}
+	u = d->ucs + d->nucs++;
+	u->pos = d->len;
+	u->uc = c;
+	return JSON_DONE;
+}
+
+/* n bytes of UTF-8 text, or of Latin-1 for a byte string */
+static int put_chars(struct input *in, int major, const unsigned char *s,
+		     unsigned long long n)
+{
+	const unsigned char *e = s + n, *p;
+	int c, k, j, st;
+	static const int min[4] = {0, 0x80, 0x800, 0x10000};
+	while (s < e) {
+		/* a run of characters stored as they are */
+		for (p = s; p < e && *p && (*p < 0x80 || major == 2); p++)
+			;
+		if (p > s) {
+			if ((st = put_bytes(in, s, p - s)) != JSON_DONE)
+				return st;
+			s = p;
+			continue;
+		}
+		c = *s++;
+		if (c) {
+			k = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+			if (!k || c >= 0xF8 || e - s < k)
+				return fail(in, JSON_ERROR, "invalid UTF-8");
+			c &= 0x3F >> k;
+			for (j=k; j--; ) {
+				if ((*s & 0xC0) != 0x80)
+					return fail(in, JSON_ERROR,
+						    "invalid UTF-8");
+				c = c << 6 | (*s++ & 0x3F);
+			}
+			if (c < min[k] || c > 0x10FFFF)
+				return fail(in, JSON_ERROR, "invalid UTF-8");
+		}
+		if ((st = put_uc(in, c)) != JSON_DONE)
+			return st;
+	}
+	return JSON_DONE;
+}
+
+static object store_part(char *buf, unsigned a, unsigned b)
+{
+	object x;
+	char c = buf[b];
+	buf[b] = '\0';
+	x = store_str(buf + a);
+	buf[b] = c;
+	return x;
+}
+
+/* as the JSON parser makes a string */
+static object make_string(struct cbor_decoder *d)
+{
+	object x, y;
+	unsigned i = d->nucs, n;
+	if (!d->buf) {
+		if (!(d->buf = grow(NULL, &d->buf_max, 1)))
+			return 0;
+	}
+	d->buf[d->len] = '\0';
+	if (!i)
+		return store_short(d->buf);
+	x = store_str(d->buf + d->ucs[i-1].pos);
+	while (x && i--) {
+		y = store_int(d->ucs[i].uc);
+		x = y ? cons(y, x) : 0;
+		n = d->ucs[i].pos;
+		if (i)
+			n -= d->ucs[i-1].pos;
+		if (x && n) {
+			y = store_part(d->buf, d->ucs[i].pos - n, d->ucs[i].pos);
+			x = y ? concat(y, x) : 0;
+		}
+	}
+	return x;
+}
+
+static int text(struct input *in, int major, int info, unsigned long long v,
+		object *x)
+{
+	struct cbor_decoder *d = in->d;
+	int m, st;
+	d->len = d->nucs = 0;
+	if (info != 31) {
+		if (v > (unsigned long long) (in->e - in->s))
+			return JSON_MORE;
+		if ((st = put_chars(in, major, in->s, v)) != JSON_DONE)
+			return st;
+		in->s += v;
+	} else {
+		/* definite chunks of the same type up to a break */
+		for (;;) {
+			if (in->s == in->e)
+				return JSON_MORE;
+			if (*in->s == 0xFF) {
+				in->s++;
+				break;
+			}
+			if ((st = read_head(in, &m, &info, &v)) != JSON_DONE)
+				return st;
+			if (m != major || info == 31)
+				return fail(in, JSON_ERROR, "bad string chunk");
+			if (v > (unsigned long long) (in->e - in->s))
+				return JSON_MORE;
+			if ((st = put_chars(in, major, in->s, v)) != JSON_DONE)
+				return st;
+			in->s += v;
+		}
+	}
+	*x = make_string(d);
+	return *x ? JSON_DONE : fail(in, JSON_LIMIT, "heap limit");
+}
+
+static int value(struct input *in, object *x);
+
+/* 1 if the break that ends an indefinite length is next */
+static int at_break(struct input *in, int info)
+{
+	if (info != 31 || in->s == in->e || *in->s != 0xFF)
+		return 0;
+	in->s++;
+	return 1;
+}
+
+static int array(struct input *in, int info, unsigned long long n,
+		 object *x)
+{
+	struct listdata_builder b;
+	object y;
+	int st;
+	list_begin(&b);
+	for (; info == 31 || n; n--) {
+		if (at_break(in, info))
+			break;
+		if ((st = value(in, &y)) != JSON_DONE)
+			return st;
+		if (!list_append(&b, y))
+			return fail(in, JSON_LIMIT, "heap limit");
+	}
+	*x = list_finish(&b, EMPTY_LIST);
+	return *x ? JSON_DONE : fail(in, JSON_LIMIT, "heap limit");
+}
+
+/* the last member first, as parsed */
+static int map(struct input *in, int info, unsigned long long n, object *x)
+{
+	object k, v;
+	int st;
+	*x = EMPTY_DICT;
+	for (; info == 31 || n; n--) {
+		if (at_break(in, info))
+			break;
+		if ((st = value(in, &k)) != JSON_DONE ||
+		    (st = value(in, &v)) != JSON_DONE)
+			return st;
+		if (!(*x = dict_set(*x, k, v)))
+			return fail(in, JSON_LIMIT, "heap limit");
+	}
+	return JSON_DONE;
+}
+
+/* integer of major type 0 or 1 */
+static int integer(struct input *in, int *neg, unsigned long long *m)
+{
+	int major, info, st;
+	if ((st = read_head(in, &major, &info, m)) != JSON_DONE)
+		return st;
+	if (major > 1 || info == 31)
+		return fail(in, JSON_ERROR, "integer expected");
+	if ((*neg = major))
+		*m = *m == ~0ull ? *m : *m + 1;
+	return JSON_DONE;
+}
+
+/* tag 4 content: [exponent, mantissa] */
+static int decimal(struct input *in, object *x)
+{
+	unsigned long long e, m;
+	int major, info, neg, eneg, st;
+	if ((st = read_head(in, &major, &info, &m)) != JSON_DONE)
+		return st;
+	if (major != 4 || m != 2)
+		return fail(in, JSON_ERROR, "bad decimal fraction");
+	if ((st = integer(in, &eneg, &e)) != JSON_DONE ||
+	    (st = integer(in, &neg, &m)) != JSON_DONE)
+		return st;
+	if (e > LONG_MAX / 2)
+		e = LONG_MAX / 2;
+	*x = make_number(neg, m, eneg ? -(long) e : (long) e);
+	return *x ? JSON_DONE : fail(in, JSON_LIMIT, "heap limit");
+}
+
+static int simple(struct input *in, int info, unsigned long long v,
+		  object *x)
+{
+	union {
+		float f;
+		unsigned u;
+	} f;
+	union {
+		double d;
+		unsigned long long u;
+	} d;
+	switch (info) {
+	case 20:
+		*x = JSON_FALSE;
+		return JSON_DONE;
+	case 21:
+		*x = JSON_TRUE;
+		return JSON_DONE;
+	case 22:
+	case 23:
+		*x = 0;
+		return JSON_DONE;
+	case 25:
+		if ((v & 0x7C00) == 0x7C00)
+			return fail(in, JSON_ERROR, "not a JSON number");
+		d.d = half(v);
+		break;
+	case 26:
+		f.u = v;
+		d.d = f.f;
+		break;
+	case 27:
+		d.u = v;
+		break;
+	case 31:
+		return fail(in, JSON_ERROR, "unexpected break");
+	default:
+		return fail(in, JSON_ERROR, "unsupported simple value");
+	}
+	if (d.d - d.d != 0)
+		return fail(in, JSON_ERROR, "not a JSON number");
+	*x = make_float(d.d, info < 27);
+	return *x ? JSON_DONE : fail(in, JSON_LIMIT, "heap limit");
+}
+
+static int value(struct input *in, object *x)
+{
+	struct cbor_decoder *d = in->d;
+	unsigned long long v;
+	int major, info, st;
+
+	if (++d->count > d->limits.elems)
+		return fail(in, JSON_LIMIT, "element limit");
+	if ((st = read_head(in, &major, &info, &v)) != JSON_DONE)
+		return st;
+	if (info == 31 && (major < 2 || major == 6))
+		return fail(in, JSON_ERROR, "bad indefinite length");
+	switch (major) {
+	case 0:
+	case 1:
+		if (major)
+			v = v == ~0ull ? v : v + 1;
+		*x = make_number(major, v, 0);
+		return *x ? JSON_DONE : fail(in, JSON_LIMIT, "heap limit");
+	case 2:
+	case 3:
+		return text(in, major, info, v, x);
+	case 7:
+		return simple(in, info, v, x);
+	}
+	if (++d->depth > d->limits.depth)
+		return fail(in, JSON_LIMIT, "depth limit");
+	switch (major) {
+	case 4:
+		st = array(in, info, v, x);
+		break;
+	case 5:
+		st = map(in, info, v, x);
+		break;
+	default:
+		if (v == 4)
+			st = decimal(in, x);
+		else
+			st = value(in, x);	/* other tags are ignored */
+	}
+	d->depth--;
+	return st;
+}
+
+int cbor_decode(struct cbor_decoder *d, const void *s, size_t n)
+{
+	struct input in;
+	object x;
+	int st;
+	in.d = d;
+	in.s = s;
+	in.e = in.s + n;
+	d->depth = 0;
+	d->count = 0;
+	d->reason = NULL;
+	st = value(&in, &x);
+	d->offset = in.s - (const unsigned char *) s;
+	if (st == JSON_DONE)
+		d->result = x;
+	return st;
+}
@@ -0,0 +1,58 @@
+#ifndef cbor_h
+#define cbor_h
+
+#include "json.h"
+
+/* CBOR (RFC 8949) encoding of the values made by the JSON parser:
+
+	null true false		simple values 22 21 20
+	int			unsigned or negative integer
+	mantissa and exponent	decimal fraction (tag 4) [exponent, mantissa]
+	string			text string (UTF-8)
+	[] list			array
+	{} members		map, in the order of the JSON text
+
+   so that decoding gives the same values as parsing the JSON text.
+   Decoding also takes byte strings (as Latin-1 text), floats (as
+   the JSON parser would store their shortest form), undefined (as
+   null), indefinite lengths and other tags (which are ignored). */
+
+struct cbor_buf {
+	unsigned char *s;
+	size_t len, max;
+	object *stack;			/* members of the open maps */
+	unsigned n, stack_max;
+};
+
+/* empty buffer, keep the memory for reuse with len = 0 */
+void cbor_buf_init(struct cbor_buf *);
+void cbor_buf_free(struct cbor_buf *);
+
+/* append x, return 0 if out of memory or x is not a JSON value */
+int  cbor_encode(struct cbor_buf *, object x);
+
+/* Decoder context. Containers are decoded by recursion, so depth is
+   limited (by default to 1024). */
+struct cbor_decoder {
+	struct json_limits limits;
+	unsigned depth;
+	unsigned count;			/* values decoded */
+	char *buf;			/* text being decoded */
+	unsigned len, buf_max;
+	struct json_uc *ucs;
+	unsigned nucs, ucs_max;
+	object result;
+	size_t offset;			/* bytes decoded, or of the error */
+	const char *reason;		/* of JSON_ERROR or JSON_LIMIT */
+};
+
+void cbor_decoder_init(struct cbor_decoder *);
+void cbor_decoder_free(struct cbor_decoder *);
+
+/* decode one value from the n bytes at s into result. Return
+   JSON_DONE (offset is the end of the value), JSON_MORE if it is cut
+   short, JSON_ERROR if malformed or JSON_LIMIT if a limit or the heap
+   was exceeded. */
+int  cbor_decode(struct cbor_decoder *, const void *s, size_t n);
+
+#endif
@@ -0,0 +1,362 @@
+/* Compressed input for the resumable parser, see input.h.
+ *
+ *  The input is read into a buffer of compressed bytes and decompressed
+ *  into the slots of the ring. Without a thread there is one slot,
+ *  filled when the caller asks for the next chunk. With one, the thread
+ *  fills the free slots in turn and the caller takes the filled ones:
+ *  a slot is the caller's from json_input_next until the next call.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef LISTDATA_ZSTD
+#include <zstd.h>
+#endif
+#include "input.h"
+
+struct json_input_state {
+	size_t size;
+	char *ring;			/* slots of size bytes */
+	size_t len[JSON_INPUT_SLOTS];
+	unsigned head, tail, count;	/* filled slots */
+	int held;			/* the tail slot is the caller's */
+	int done;			/* no more slots will be filled */
+	const char *error;
+	unsigned long long in_bytes;
+	/* used by the thread that fills */
+	unsigned char *in;		/* compressed bytes */
+	size_t in_pos, in_len;
+	int in_eof;
+	unsigned long long read_bytes;
+	z_stream z;
+	int z_init;
+	int z_end;			/* a gzip member or zstd frame ended */
+#ifdef LISTDATA_ZSTD
+	ZSTD_DStream *zs;
+#endif
+	/* threaded */
+	int started, stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t filled, freed;
+};
+
+/* return 1 if there are compressed bytes, 0 at the end or -1 */
+static int refill(struct json_input *in)
+{
+	struct json_input_state *st = in->st;
+	ssize_t n;
+	if (st->in_pos < st->in_len)
+		return 1;
+	if (st->in_eof)
+		return 0;
+	do {
+		n = read(in->fd, st->in, st->size);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		st->error = "read error";
+		return -1;
+	}
+	st->in_pos = 0;
+	st->in_len = n;
+	st->read_bytes += n;
+	st->in_eof = !n;
+	return n > 0;
+}
+
+static long fill_plain(struct json_input *in, char *buf)
+{
+	struct json_input_state *st = in->st;
+	size_t n = 0, k;
+	int r;
+	while (n < st->size && (r = refill(in)) > 0) {
+		k = st->in_len - st->in_pos;
+		if (k > st->size - n)
+			k = st->size - n;
+		memcpy(buf + n, st->in + st->in_pos, k);
+		st->in_pos += k;
+		n += k;
+	}
+	return n < st->size && r < 0 ? -1 : (long) n;
+}
+
+/* gzip members one after another are decompressed as one */
+static long fill_gzip(struct json_input *in, char *buf)
+{
+	struct json_input_state *st = in->st;
+	z_stream *z = &st->z;
+	int r;
+	z->next_out = (unsigned char *) buf;
+	z->avail_out = st->size;
+	while (z->avail_out) {
+		if ((r = refill(in)) < 0)
+			return -1;
+		if (!r) {
+			if (st->z_end)
+				break;
+			st->error = "truncated gzip stream";
+			return -1;
+		}
+		if (st->z_end) {
+			inflateReset(z);
+			st->z_end = 0;
+		}
+		z->next_in = st->in + st->in_pos;
+		z->avail_in = st->in_len - st->in_pos;
+		r = inflate(z, Z_NO_FLUSH);
+		st->in_pos = st->in_len - z->avail_in;
+		if (r == Z_STREAM_END) {
+			st->z_end = 1;
+		} else if (r != Z_OK) {
+			st->error = z->msg ? z->msg : "gzip error";
+			return -1;
+		}
+	}
+	return st->size - z->avail_out;
+}
+
+#ifdef LISTDATA_ZSTD
+static long fill_zstd(struct json_input *in, char *buf)
+{
+	struct json_input_state *st = in->st;
+	ZSTD_outBuffer out;
+	ZSTD_inBuffer src;
+	size_t r;
+	int k;
+	out.dst = buf;
+	out.size = st->size;
+	out.pos = 0;
+	while (out.pos < out.size) {
+		if ((k = refill(in)) < 0)
+			return -1;
+		if (!k) {
+			if (st->z_end)
+				break;
+			st->error = "truncated zstd stream";
+			return -1;
+		}
+		src.src = st->in + st->in_pos;
+		src.size = st->in_len - st->in_pos;
+		src.pos = 0;
+		r = ZSTD_decompressStream(st->zs, &out, &src);
+		st->in_pos += src.pos;
+		if (ZSTD_isError(r)) {
+			st->error = ZSTD_getErrorName(r);
+			return -1;
+		}
+		st->z_end = !r;
+	}
+	return out.pos;
+}
+#endif
+
+/* fill buf with up to size bytes, return how many (0 at the end) or -1 */
+static long fill(struct json_input *in, char *buf)
+{
+	switch (in->format) {
+	case JSON_INPUT_GZIP:
+		return fill_gzip(in, buf);
+#ifdef LISTDATA_ZSTD
+	case JSON_INPUT_ZSTD:
+		return fill_zstd(in, buf);
+#endif
+	default:
+		return fill_plain(in, buf);
+	}
+}
+
+static void *fill_slots(void *arg)
+{
+	struct json_input *in = arg;
+	struct json_input_state *st = in->st;
+	unsigned slot;
+	int stop;
+	long n;
+
+	for (;;) {
+		pthread_mutex_lock(&st->lock);
+		while (st->count == JSON_INPUT_SLOTS && !st->stop)
+			pthread_cond_wait(&st->freed, &st->lock);
+		slot = st->head;
+		stop = st->stop;
+		pthread_mutex_unlock(&st->lock);
+		if (stop)
+			return NULL;
+		n = fill(in, st->ring + slot * st->size);
+		pthread_mutex_lock(&st->lock);
+		if (n > 0) {
+			st->len[slot] = n;
+			st->head = (slot + 1) % JSON_INPUT_SLOTS;
+			st->count++;
+		} else {
+			st->done = 1;
+		}
+		st->in_bytes = st->read_bytes;
+		pthread_cond_signal(&st->filled);
+		pthread_mutex_unlock(&st->lock);
+		if (n <= 0)
+			return NULL;
+	}
+}
+
+static int open_error(struct json_input *in, const char *reason)
+{
+	json_input_close(in);
+	in->reason = reason;
+	return 0;
+}
+
+int json_input_open(struct json_input *in, int fd, size_t size, int threaded)
+{
+	struct json_input_state *st;
+	ssize_t n;
+
+	memset(in, 0, sizeof(*in));
+	in->fd = fd;
+	in->threaded = threaded;
+	if (!size || !(st = calloc(1, sizeof(*st))))
+		return open_error(in, "out of memory");
+	in->st = st;
+	st->size = size;
+	st->ring = malloc(threaded ? size * JSON_INPUT_SLOTS : size);
+	st->in = calloc(1, size);
+	if (!st->ring || !st->in)
+		return open_error(in, "out of memory");
+
+	/* the format from the first bytes */
+	while (st->in_len < 4 && !st->in_eof) {
+		n = read(fd, st->in + st->in_len, size - st->in_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return open_error(in, "read error");
+		st->in_len += n;
+		st->read_bytes += n;
+		st->in_eof = !n;
+	}
+	if (st->in_len >= 2 && !memcmp(st->in, "\x1F\x8B", 2)) {
+		in->format = JSON_INPUT_GZIP;
+		if (inflateInit2(&st->z, 15 + 16) != Z_OK)
+			return open_error(in, "out of memory");
+		st->z_init = 1;
+	} else if (st->in_len >= 4 && !memcmp(st->in, "\x28\xB5\x2F\xFD", 4)) {
+		in->format = JSON_INPUT_ZSTD;
+#ifdef LISTDATA_ZSTD
+		if (!(st->zs = ZSTD_createDStream()) ||
+		    ZSTD_isError(ZSTD_initDStream(st->zs)))
+			return open_error(in, "out of memory");
+#else
+		return open_error(in, "zstd not supported");
+#endif
+	}
+	in->in_bytes = st->in_bytes = st->read_bytes;
+
+	if (threaded) {
+		pthread_mutex_init(&st->lock, NULL);
+		pthread_cond_init(&st->filled, NULL);
+		pthread_cond_init(&st->freed, NULL);
+		if (pthread_create(&st->thread, NULL, fill_slots, in)) {
+			pthread_mutex_destroy(&st->lock);
+			pthread_cond_destroy(&st->filled);
+			pthread_cond_destroy(&st->freed);
+			return open_error(in, "cannot start thread");
+		}
+		st->started = 1;
+	}
+	return 1;
+}
+
+void json_input_close(struct json_input *in)
+{
+	struct json_input_state *st = in->st;
+	if (!st)
+		return;
+	if (st->started) {
+		pthread_mutex_lock(&st->lock);
+		st->stop = 1;
+		pthread_cond_signal(&st->freed);
+		pthread_mutex_unlock(&st->lock);
+		pthread_join(st->thread, NULL);
+		pthread_mutex_destroy(&st->lock);
+		pthread_cond_destroy(&st->filled);
+		pthread_cond_destroy(&st->freed);
+	}
+	if (st->z_init)
+		inflateEnd(&st->z);
+#ifdef LISTDATA_ZSTD
+	if (st->zs)
+		ZSTD_freeDStream(st->zs);
+#endif
+	free(st->ring);
+	free(st->in);
+	free(st);
+	in->st = NULL;
+}
+
+int json_input_next(struct json_input *in, const char **s, size_t *n)
+{
+	struct json_input_state *st = in->st;
+	long k;
+	int r;
+
+	if (!st->started) {
+		if ((k = fill(in, st->ring)) < 0)
+			in->reason = st->error;
+		in->in_bytes = st->read_bytes;
+		if (k <= 0)
+			return k < 0 ? -1 : 0;
+		*s = st->ring;
+		*n = k;
+		in->out_bytes += k;
+		return 1;
+	}
+	pthread_mutex_lock(&st->lock);
+	if (st->held) {
+		st->tail = (st->tail + 1) % JSON_INPUT_SLOTS;
+		st->count--;
+		st->held = 0;
+		pthread_cond_signal(&st->freed);
+	}
+	while (!st->count && !st->done)
+		pthread_cond_wait(&st->filled, &st->lock);
+	if (st->count) {
+		*s = st->ring + st->tail * st->size;
+		*n = st->len[st->tail];
+		st->held = 1;
+		in->out_bytes += *n;
+		r = 1;
+	} else if (st->error) {
+		in->reason = st->error;
+		r = -1;
+	} else {
+		r = 0;
+	}
+	in->in_bytes = st->in_bytes;
+	pthread_mutex_unlock(&st->lock);
+	return r;
+}
+
+int json_input_parse(struct json_input *in, struct json_parser *p,
+		     int (*f)(object, void *), void *arg)
+{
+	const char *s;
+	size_t n;
+	int r, st = JSON_MORE;
+
+	while ((r = json_input_next(in, &s, &n)) > 0)
+		if ((st = json_feed(p, s, n, f, arg)) != JSON_MORE)
+			return st;
+	if (r < 0) {
+		/* drop the value cut short */
+		if (p->marked) {
+			listdata_release(p->mark);
+			p->marked = 0;
+		}
+		json_parser_reset(p);
+		return JSON_ERROR;
+	}
+	return json_feed_end(p, f, arg);
+}
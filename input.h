@@ -0,0 +1,58 @@
+#ifndef input_h
+#define input_h
+
+#include "json.h"
+
+/* Input adapter: reads a file descriptor, decompressing gzip (and
+   zstd when built with LISTDATA_ZSTD, linked with -lzstd) as detected
+   from the first bytes, into a ring of JSON_INPUT_SLOTS buffers that
+   are handed to the parser in turn. Memory stays the same however
+   long the input is. With threaded set, a second thread reads and
+   decompresses into the free buffers while the caller parses the
+   filled ones (link with -lz -pthread).
+
+	struct json_input in;
+	json_input_open(&in, fd, 65536, 1);
+	st = json_input_parse(&in, &parser, f, arg);
+	json_input_close(&in);
+*/
+
+#define JSON_INPUT_SLOTS 4
+
+enum json_input_format {
+	JSON_INPUT_PLAIN,
+	JSON_INPUT_GZIP,
+	JSON_INPUT_ZSTD
+};
+
+struct json_input_state;
+
+struct json_input {
+	int fd;
+	int format;			/* enum json_input_format */
+	int threaded;
+	unsigned long long in_bytes,	/* read */
+			   out_bytes;	/* handed out */
+	const char *reason;		/* of an error */
+	struct json_input_state *st;
+};
+
+/* buffers of size bytes. Return 0 if out of memory, the thread could
+   not be started or the format is not supported (see reason). */
+int  json_input_open(struct json_input *, int fd, size_t size, int threaded);
+
+/* stop the thread and free the buffers, fd is left open */
+void json_input_close(struct json_input *);
+
+/* next chunk of the decompressed input, valid until the next call.
+   Return 1, 0 at the end or -1 on a read or decompression error (see
+   reason). */
+int  json_input_next(struct json_input *, const char **s, size_t *n);
+
+/* json_feed the whole input to p. Return JSON_MORE when all of it was
+   parsed, the value f returned, JSON_ERROR or JSON_LIMIT (with
+   reason NULL if the parser failed, see json_parse_error). */
+int  json_input_parse(struct json_input *, struct json_parser *p,
+		      int (*f)(object, void *), void *arg);
+
+#endif
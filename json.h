@@ -1,3 +1,7 @@
+#ifndef json_h
+#define json_h
+
+#include <stddef.h>
 #include "listdata.h"
 
 typedef listdata_type object;
@@ -6,6 +10,147 @@ typedef listdata_type object;
 #define JSON_TRUE  3
 #define JSON_FALSE 4
 
-object json_parse_start(const char *);
-object json_parse(const char *, object);
-int json_parse_done(object);
+/* json_parse status */
+enum json_status {
+	JSON_LIMIT = -2,	/* json_limits or heap limit exceeded */
+	JSON_ERROR = -1,
+	JSON_MORE,		/* value not complete, feed more input */
+	JSON_DONE		/* value complete, see result */
+};
+
+/* UINT_MAX for no limit */
+struct json_limits {
+	unsigned depth;		/* nesting of arrays and objects */
+	unsigned str_len;	/* bytes in a string */
+	unsigned elems;		/* values in a document */
+};
+
+/* expected token class */
+enum json_expect {
+	JSON_EXPECT_VALUE,
+	JSON_EXPECT_ELEMENT,		/* value or ']' */
+	JSON_EXPECT_ARRAY_NEXT,		/* ',' or ']' */
+	JSON_EXPECT_NAME,
+	JSON_EXPECT_MEMBER,		/* name or '}' */
+	JSON_EXPECT_COLON,
+	JSON_EXPECT_OBJECT_NEXT,	/* ',' or '}' */
+	JSON_EXPECT_CHAR,		/* in string */
+	JSON_EXPECT_ESCAPE,
+	JSON_EXPECT_HEX,
+	JSON_EXPECT_LITERAL,		/* rest of true false null */
+	JSON_EXPECT_DIGIT,
+	JSON_EXPECT_END,		/* nothing after the value */
+	JSON_EXPECT_MORE,		/* input ended too early */
+	JSON_EXPECT_NONE		/* a limit was exceeded */
+};
+
+struct json_error {
+	unsigned long offset;	/* of the offending byte */
+	unsigned long line, column;	/* from 1 */
+	int expected;		/* enum json_expect */
+	const char *reason;
+};
+
+struct json_frame {
+	int type;		/* '[' or '{' */
+	unsigned base;		/* first element in vals */
+	unsigned n;		/* number of elements */
+};
+
+struct json_uc {
+	unsigned pos;		/* offset in buf */
+	int uc;			/* character above U+00FF (or U+0000) */
+};
+
+/* Resumable parser context. Open containers and their finished
+   elements are kept on contiguous stacks and a partial string is kept
+   in buf, so nothing is allocated on the listdata heap until a value
+   is complete. The stacks survive json_parser_reset for reuse. */
+struct json_parser {
+	int state, sub;
+	struct json_frame *frames;
+	unsigned depth, frames_max;
+	object *vals;
+	unsigned nvals, vals_max;
+	char *buf;
+	unsigned len, buf_max;
+	struct json_uc *ucs;
+	unsigned nucs, ucs_max;
+	int neg, eneg, full;	/* number being parsed */
+	int mant, exp, ex;
+	unsigned count;		/* values parsed */
+	struct json_limits limits;
+	int validate;		/* only check syntax, allocate nothing */
+	int spine;		/* keep each list in one block, see below */
+	int heap_strings;	/* no short strings, see below */
+	int packed_numbers;	/* numbers with a fraction, see below */
+	object result;
+	unsigned long offset,	/* bytes consumed */
+		      line,	/* newlines seen */
+		      line_off,	/* offset of current line */
+		      err_pos;
+	const char *nl;
+	int err_from;
+	const char *reason;
+	mpoint mark;		/* of the value json_feed is in */
+	int marked;
+};
+
+/* initialize without limits. Set validate to check well-formedness
+   only, then result is not the parsed value.
+
+   Arrays and objects are built in order, so their conses are adjacent
+   unless they cross a block. Set spine to start a new block rather
+   than split one (of up to 1024 conses), at the cost of leaving the
+   end of the previous block unused.
+
+   Strings that fit are short strings (see store_short), unless
+   heap_strings is set for code that reads them with load_str.
+
+   A number that is not an int is mant * 10^exp, stored as the cons of
+   the two ints, or with packed_numbers set as a packed number (see
+   store_num) when they fit, which allocates nothing. It is converted
+   only when read with json_number. */
+void json_parser_init(struct json_parser *);
+
+/* start parsing a new document, keep limits and buffers */
+void json_parser_reset(struct json_parser *);
+void json_parser_free(struct json_parser *);
+
+/* parse next chunk of n bytes. *end (if not NULL) is set to the end of
+   the consumed input, which is before the end of the chunk only when a
+   value was completed or an error was found */
+int json_parse(struct json_parser *, const char *, size_t n, const char **end);
+
+/* same for NUL-terminated chunk */
+int json_parse_str(struct json_parser *, const char *, const char **end);
+
+/* end of input: complete a top-level number, or return JSON_MORE if
+   nothing but white space was seen */
+int json_parse_end(struct json_parser *);
+
+/* Parse a stream of values separated by white space (such as NDJSON)
+   fed in chunks, calling f(value, arg) for each one until it returns
+   nonzero. Each value is released once f returns, so the heap does not
+   grow with the stream and f must copy what it keeps (as must the
+   caller of anything it allocates between two chunks of a value).
+   Return JSON_MORE when the chunk is consumed, the value f returned,
+   or JSON_ERROR or JSON_LIMIT (then reset the parser to go on). */
+int json_feed(struct json_parser *, const char *, size_t n,
+	      int (*f)(object, void *), void *arg);
+
+/* end of the stream: complete a last top-level number */
+int json_feed_end(struct json_parser *, int (*f)(object, void *), void *arg);
+
+/* Numbers as the parser makes them: an int, the cons of mant and exp
+   or a packed number. Set *d to the value (the nearest double) or
+   *mant and *exp to its digits and return 1, or return 0 if x is not
+   a number. */
+int json_number(object x, double *d);
+int json_decimal(object x, int *mant, int *exp);
+
+/* after JSON_ERROR or JSON_LIMIT, describe the error (offsets count
+   from json_parser_reset) and return 1, otherwise return 0 */
+int json_parse_error(const struct json_parser *, struct json_error *);
+
+#endif
@@ -6,644 +6,760 @@
  *  Strings are C strings (Latin-1), consed strings or lists terminated
  *  by a string, with ints for characters above U+00FF.
  *
+ *  Objects are lists of names and values terminated by EMPTY_DICT, with
+ *  the last member first (as if built by dict_set).
+ *
  * 2010-07-21
  */
-#include <limits.h>
-#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include "json.h"
 
-#define LIT_NAME_0 8
-#define LIT_NAME_T LIT_NAME_0
-#define LIT_NAME_F (LIT_NAME_0 + 5)
-#define LIT_NAME_N (LIT_NAME_0 + 11)
+/* parser states, named by what they expect */
+enum {
+	S_VALUE = JSON_EXPECT_VALUE,
+	S_FIRST = JSON_EXPECT_ELEMENT,
+	S_ARR_NEXT = JSON_EXPECT_ARRAY_NEXT,
+	S_KEY = JSON_EXPECT_NAME,
+	S_KEY_FIRST = JSON_EXPECT_MEMBER,
+	S_COLON = JSON_EXPECT_COLON,
+	S_OBJ_NEXT = JSON_EXPECT_OBJECT_NEXT,
+	S_STR = JSON_EXPECT_CHAR,
+	S_ESC = JSON_EXPECT_ESCAPE,	/* after '\\' */
+	S_HEX = JSON_EXPECT_HEX,	/* after "\\u", sub digits read */
+	S_LIT = JSON_EXPECT_LITERAL,	/* sub is index in lit_names */
+	S_NUM = JSON_EXPECT_DIGIT,	/* sub is one of N_* */
+	S_DONE = JSON_EXPECT_END,
+	S_ERROR = JSON_EXPECT_NONE + 1,
+	S_LIMIT
+};
+
+/* number states */
+enum {
+	N_SIGN,		/* after '-' */
+	N_ZERO,		/* leading zero */
+	N_INT,
+	N_DOT,
+	N_FRAC,
+	N_E,
+	N_ESIGN,
+	N_EXP
+};
+
+#define LIT_T 0
+#define LIT_F 5
+#define LIT_N 11
 
 static const char lit_names[] = "true\0false\0null";
-static const unsigned char lit_ok[] = {0,0,0,1,0,0,0,0,0,2,0,0,0,0,3};
-static const unsigned char lit_val[] = {0, JSON_TRUE, JSON_FALSE, 0};
 
-static object parse_value(const char *, const char **, object);
+#define EXP_MAX 100000000
 
-static int is_json_atom(object x)
+static void *grow(void *mem, unsigned *max, size_t size)
 {
-	switch (x) {
-	case 0:			/* null  */
-	case EMPTY_LIST:	/* []    */
-	case EMPTY_DICT:	/* {}    */
-	case JSON_TRUE:		/* true  */
-	case JSON_FALSE:	/* false */
-		return 1;
-	default:
-		return 0;
-	}
+	unsigned n = *max ? *max << 1 : 16;
+	void *p = n > *max ? realloc(mem, (size_t) n * size) : NULL;
+	if (p)
+		*max = n;
+	return p;
 }
 
-/* parser state symbol */
-static int is_state_atom(object x)
+void json_parser_init(struct json_parser *p)
 {
-	return x < 0x100 && !is_json_atom(x);
+	memset(p, 0, sizeof(*p));
+	json_parser_reset(p);
+	p->limits.depth = UINT_MAX;
+	p->limits.str_len = UINT_MAX;
+	p->limits.elems = UINT_MAX;
 }
 
-static const char *skip_ws(const char *s)
+void json_parser_reset(struct json_parser *p)
 {
-	switch (*s) {
-	case ' ':
-	case '\t':
-	case '\n':
-	case '\r':
-		return skip_ws(s+1);
-	default:
-		return s;
-	}
+	p->state = S_VALUE;
+	p->depth = 0;
+	p->nvals = 0;
+	p->len = 0;
+	p->nucs = 0;
+	p->count = 0;
+	p->result = 0;
+	p->offset = 0;
+	p->line = 0;
+	p->line_off = 0;
+	p->nl = NULL;
 }
 
-static int match_digits(const char *s)
-{
-	switch (*s) {
-	case '0':
-	case '1':
-	case '2':
-	case '3':
-	case '4':
-	case '5':
-	case '6':
-	case '7':
-	case '8':
-	case '9':
-		return 1 + match_digits(s+1);
-	default:
-		return 0;
-	}
+void json_parser_free(struct json_parser *p)
+{
+	free(p->frames);
+	free(p->vals);
+	free(p->buf);
+	free(p->ucs);
+	p->frames = NULL;
+	p->vals = NULL;
+	p->buf = NULL;
+	p->ucs = NULL;
+	p->frames_max = p->vals_max = p->buf_max = p->ucs_max = 0;
+	json_parser_reset(p);
 }
 
-static int convert_digits(const char *s, int *n, int i)
+static int esc_char(int c)
 {
-	while (*n>0 && i <= INT_MAX/10 && i*10 <= INT_MAX - (*s-'0')) {
-		i = i*10 + (*s-'0');
-		s++;
-		(*n)--;
+	switch (c) {
+	case '"':
+	case '\\':
+	case '/': return c;
+	case 'b': return '\b';
+	case 'f': return '\f';
+	case 'n': return '\n';
+	case 'r': return '\r';
+	case 't': return '\t';
 	}
-	return i;
+	return 0;
 }
 
-static void store_digits(const char *s, int *n, object *p)
+static int limit(struct json_parser *p, const char *reason)
 {
-	*p = store_int(convert_digits(s, n, load_int(*p)));
+	p->reason = reason;
+	return S_LIMIT;
 }
 
-static object push_int(int i, object st)
+static int hex_digit(int c)
 {
-	return cons(store_int(i), st);
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
 }
 
-static object push_zero(object st)
+/* return next state */
+static int put_chars(struct json_parser *p, const char *s, unsigned n)
 {
-	return push_int(0, st);
+	char *buf;
+	if (n > p->limits.str_len - p->len)
+		return limit(p, "string length limit");
+	if (p->validate) {
+		p->len += n;
+		return S_STR;
+	}
+	while (p->len + n >= p->buf_max) {
+		if (!(buf = grow(p->buf, &p->buf_max, 1)))
+			return limit(p, "out of memory");
+		p->buf = buf;
+	}
+	memcpy(p->buf + p->len, s, n);
+	p->len += n;
+	return S_STR;
+}
+
+/* characters above U+00FF are kept aside with their position in buf,
+   a surrogate pair is joined into one character. return next state */
+static int put_uc(struct json_parser *p, int uc)
+{
+	struct json_uc *u;
+	char c = uc;
+	if (uc && uc < 0x100)
+		return put_chars(p, &c, 1);
+	if (p->validate)
+		return put_chars(p, "", 0);
+	if (p->nucs) {
+		u = p->ucs + p->nucs - 1;
+		if (u->pos == p->len && uc >= 0xDC00 && uc < 0xE000 &&
+		    u->uc >= 0xD800 && u->uc < 0xDC00) {
+			u->uc = 0x10000 + ((u->uc - 0xD800) << 10) + (uc - 0xDC00);
+			return S_STR;
+		}
+	}
+	if (p->nucs == p->ucs_max) {
+		if (p->nucs >= p->limits.str_len)
+			return limit(p, "string length limit");
+		if (!(u = grow(p->ucs, &p->ucs_max, sizeof(*u))))
+			return limit(p, "out of memory");
+		p->ucs = u;
+	}
+	u = p->ucs + p->nucs++;
+	u->pos = p->len;
+	u->uc = uc;
+	return S_STR;
 }
 
-static void add(object *p, int n)
+/* The constructors below return 0 when the heap is exhausted,
+   which is never a valid string, number or container.
+   When validating they allocate nothing and return EMPTY_LIST. */
+
+static object store_part(char *buf, unsigned a, unsigned b)
 {
-	*p = store_int(load_int(*p) + n);
+	object x;
+	char c = buf[b];
+	buf[b] = '\0';
+	x = store_str(buf + a);
+	buf[b] = c;
+	return x;
 }
 
-static void frac_part(const char *s, int n, object st)
+static object make_string(struct json_parser *p)
 {
-	object *p = third(st);
-	int m = n;
-	if (p && type_of(*p) == TYP_INT) {
-		store_digits(s, &n, p);
-		if (n) {
-			m -= n;
-			*p = push_zero(*p);
+	object x, y;
+	unsigned i = p->nucs, n;
+	if (p->validate)
+		return EMPTY_LIST;
+	if (!p->buf && put_chars(p, "", 0) != S_STR)
+		return 0;
+	p->buf[p->len] = '\0';
+	if (!i && !p->heap_strings)
+		x = store_short(p->buf);
+	else
+		x = store_str(p->buf + (i ? p->ucs[i-1].pos : 0));
+	while (x && i--) {
+		y = store_int(p->ucs[i].uc);
+		x = y ? cons(y, x) : 0;
+		n = p->ucs[i].pos;
+		if (i)
+			n -= p->ucs[i-1].pos;
+		if (x && n) {
+			y = store_part(p->buf, p->ucs[i].pos - n, p->ucs[i].pos);
+			x = y ? concat(y, x) : 0;
 		}
-		add(second(st), m);
 	}
+	return x;
 }
 
-static object parse_digits(const char *s, int n, object st)
+static object make_number(struct json_parser *p)
 {
-	object *p = first(st);
-	if (p) {
-		switch (*p) {
-		case '+':
-		case '-':
-			return parse_digits(s, n, push_zero(st));
-		case '.':
-			frac_part(s, n, st);
-			break;
-		case 0xE0:
-		case 0xE1:
-		case 0xE2:
-			*p |= 4;
-		case 0xE4:
-		case 0xE5:
-		case 0xE6:
-			if (p = second(st))
-				store_digits(s, &n, p);
-			break;
-		default:
-			if (is_cons(*p))
-				add(first(*p), n);
-			else {
-				store_digits(s, &n, p);
-				if (n)
-					*p = push_int(n, *p);
-			}
-		}
-	}
-	return st;
+	long e = (long) p->exp + (p->eneg ? -p->ex : p->ex);
+	object x, y;
+	if (p->validate)
+		return EMPTY_LIST;
+	if (e > INT_MAX)
+		e = INT_MAX;
+	else if (e < INT_MIN)
+		e = INT_MIN;
+	if (e && p->packed_numbers &&
+	    (x = store_num(p->neg ? -p->mant : p->mant, e)))
+		return x;
+	x = store_int(p->neg ? -p->mant : p->mant);
+	if (!e || !x)
+		return x;
+	y = store_int(e);
+	return y ? cons(x, y) : 0;
 }
 
-static object parse_number1(const char *s, const char **end, object st)
+static void start_number(struct json_parser *p, int c)
 {
-	object *p = first(st), a = 0xE0;
-	int n;
-	if (p && *p == 0xE0) {
-		switch (*s) {
-		case '-': (*p)++;
-		case '+': (*p)++; s++;
-		}
-	}
-	n = match_digits(s);
-	if (n) {
-		st = parse_digits(s, n, st);
-		s += n;
-	}
-	switch (*s) {
-	case '.':
-		a = '.';
-	case 'e':
-	case 'E':
-		return parse_number1(s+1, end, cons(a, push_zero(st)));
-	}
-	*end = s;
-	return st;
+	p->neg = c == '-';
+	p->eneg = 0;
+	p->full = 0;
+	p->mant = p->neg ? 0 : c - '0';
+	p->exp = 0;
+	p->ex = 0;
+	p->sub = p->neg ? N_SIGN : c == '0' ? N_ZERO : N_INT;
 }
 
-static int pop_number(object *st, int *e)
+static int add_digit(struct json_parser *p, int d)
 {
-	object top = pop(st), *p;
-	int i;
-	/* exponent part */
-	switch (top) {
-	case 0xE4:
-	case 0xE5:
-		*e += load_int(pop(st));
-		top = pop(st);
-		break;
-	case 0xE6:
-		*e -= load_int(pop(st));
-		top = pop(st);
-	}
-	/* number of fraction digits */
-	if (top == '.') {
-		*e -= load_int(pop(st));
-		top = pop(st);
-	}
-	/* number of excess int digits */
-	*e += load_int(pop(&top));
-
-	if (type_of(top) == TYP_INT) {
-		i = load_int(top);
-		if (p = first(*st)) {
-			switch (*p) {
-			case '+': return i;
-			case '-': return -i;
-			}
-		}
+	if (!p->full && p->mant <= (INT_MAX - d) / 10) {
+		p->mant = p->mant * 10 + d;
+		return 1;
 	}
-	*st = 0;
+	p->full = 1;
 	return 0;
 }
 
-static object parse_number(const char *s, const char **end, object st)
-{
-	object *p;
-	int i, e = 0;
-	mpoint mp;
-	listdata_mark(mp);
-	st = parse_number1(s, &s, st);
-	if (*s) {
-		i = pop_number(&st, &e);
-		listdata_release(mp);
-		if (st) {
-			*(p = first(st)) = store_int(i);
-			if (e)
-				*p = cons(*p, store_int(e));
+/* return end of number, which is malformed unless number_complete */
+static const char *scan_number(struct json_parser *p, const char *s, const char *e)
+{
+	int c, d;
+	for (; s < e; s++) {
+		c = *s;
+		d = c - '0';
+		if (d >= 0 && d <= 9) {
+			switch (p->sub) {
+			case N_ZERO:
+				return s;
+			case N_SIGN:
+				p->sub = d ? N_INT : N_ZERO;
+			case N_INT:
+				if (!add_digit(p, d))
+					p->exp++;
+				break;
+			case N_DOT:
+				p->sub = N_FRAC;
+			case N_FRAC:
+				if (add_digit(p, d))
+					p->exp--;
+				break;
+			case N_E:
+			case N_ESIGN:
+				p->sub = N_EXP;
+			case N_EXP:
+				if (p->ex < EXP_MAX)
+					p->ex = p->ex * 10 + d;
+			}
+			continue;
+		}
+		switch (p->sub) {
+		case N_ZERO:
+		case N_INT:
+			if (c == '.') {
+				p->sub = N_DOT;
+				continue;
+			}
+		case N_FRAC:
+			if (c == 'e' || c == 'E') {
+				p->sub = N_E;
+				continue;
+			}
+			break;
+		case N_E:
+			if (c == '-' || c == '+') {
+				p->eneg = c == '-';
+				p->sub = N_ESIGN;
+				continue;
+			}
 		}
+		return s;
 	}
-	*end = s;
-	return st;
+	return s;
 }
 
-static int esc_char(int c)
+static int number_complete(struct json_parser *p)
 {
-	switch (c) {
-	case '"':
-	case '\\':
-	case '/': return c;
-	case 'b': return '\b';
-	case 'f': return '\f';
-	case 'n': return '\n';
-	case 'r': return '\r';
-	case 't': return '\t';
+	switch (p->sub) {
+	case N_ZERO:
+	case N_INT:
+	case N_FRAC:
+	case N_EXP:
+		return 1;
+	default:
+		return 0;
 	}
-	return 0;
 }
 
-static int match_hex_quad(const char *s)
+/* return next state */
+static int open_frame(struct json_parser *p, int type)
 {
-	int i;
-	for (i=0; i<4; i++) {
-		if (!isxdigit(*s++))
-			return i;
+	struct json_frame *f;
+	if (p->depth >= p->limits.depth)
+		return limit(p, "depth limit");
+	if (p->depth == p->frames_max) {
+		if (!(f = grow(p->frames, &p->frames_max, sizeof(*f))))
+			return limit(p, "out of memory");
+		p->frames = f;
+	}
+	f = p->frames + p->depth++;
+	f->type = type;
+	f->base = p->nvals;
+	f->n = 0;
+	return type == '[' ? S_FIRST : S_KEY_FIRST;
+}
+
+/* list of the values from base, ending in end. The members of an
+   object are taken from the last, as pairs. */
+static object make_list(struct json_parser *p, unsigned base, int pairs,
+			object end)
+{
+	struct listdata_builder b;
+	unsigned i, j, n = p->nvals - base;
+	list_begin(&b);
+	for (i=0; i<n; i++) {
+		if (p->spine && !b.left && !list_reserve(&b, n - i))
+			return 0;
+		j = pairs ? n - 2 - (i & ~1u) + (i & 1) : i;
+		if (!list_append(&b, p->vals[base + j]))
+			return 0;
 	}
-	return 4;
+	return list_finish(&b, end);
 }
 
-static int convert_hex_quad(const char *s)
+static object close_array(struct json_parser *p)
 {
-	char hexs[6] = "";
-	unsigned u;
-	hexs[0] = s[0];
-	hexs[1] = s[1];
-	hexs[2] = s[2];
-	hexs[3] = s[3];
-	sscanf(hexs, "%x", &u);
-	return u;
+	unsigned base = p->frames[--p->depth].base;
+	object x = make_list(p, base, 0, EMPTY_LIST);
+	p->nvals = base;
+	return x;
 }
 
-static object append(object x, object y)
+static object close_object(struct json_parser *p)
 {
-	return x ? concat(x, y) : y;
+	unsigned base = p->frames[--p->depth].base;
+	object x = make_list(p, base, 1, EMPTY_DICT);
+	p->nvals = base;
+	return x;
 }
 
-static object append_str(object x, const char *s)
+/* store finished value, return next state */
+static int value(struct json_parser *p, object x)
 {
-	return *s ? append(x, store_str(s)) : x;
+	struct json_frame *f;
+	object *v;
+	if (++p->count > p->limits.elems)
+		return limit(p, "element limit");
+	if (!p->depth) {
+		p->result = x;
+		return S_DONE;
+	}
+	f = p->frames + p->depth - 1;
+	f->n++;
+	if (!p->validate) {
+		if (p->nvals == p->vals_max) {
+			if (!(v = grow(p->vals, &p->vals_max, sizeof(*v))))
+				return limit(p, "out of memory");
+			p->vals = v;
+		}
+		p->vals[p->nvals++] = x;
+	}
+	if (f->type == '[')
+		return S_ARR_NEXT;
+	return f->n % 2 ? S_COLON : S_OBJ_NEXT;
 }
 
-static object append_uc(object x, int uc)
+static int new_value(struct json_parser *p, object x)
 {
-	object *p = first(last_tail(x, 1));
-	if (p && type_of(*p) == TYP_STR && type_of(p[1]) == TYP_STR)
-		return cons(x, store_int(uc));
-	else
-		return append(x, store_int(uc));
+	return x ? value(p, x) : limit(p, "heap limit");
 }
 
-static object parse_chars(const char *s, const char **end, object st, object *p, int c)
+static const char *skip_ws(struct json_parser *p, const char *s, const char *e)
 {
-	char buf[1024];
-	int i = 0, n;
-	if (c) {		/* prepend char */
-		buf[0] = c;
-		i = 1;
-	}
-	for (; *s && *s != '"'; s++, i++) {
-		if (i >= sizeof(buf)-1) {
-			buf[sizeof(buf)-1] = '\0';
-			*p = append_str(*p, buf);
-			i = 0;
-		}
-		if ((unsigned char) *s < 32)
-			return 0;
-		if (*s != '\\') {
-			buf[i] = *s;
+	for (; s < e; s++) {
+		switch (*s) {
+		case '\n':
+			p->line++;
+			p->nl = s;
+		case ' ':
+		case '\t':
+		case '\r':
 			continue;
 		}
+		break;
+	}
+	return s;
+}
 
-		/* escape sequence */
-		if (!*++s) {
-			st = cons('\\', st);
-			break;
-		}
-		if (*s == 'u') {
-			n = match_hex_quad(++s);
-			if (n < 4) {
-				st = cons('u', cons(store_str(s), st));
-				s += n;
+int json_parse(struct json_parser *p, const char *s, size_t n, const char **end)
+{
+	const char *start = s, *e = s + n, *t;
+	int state = p->state, from = state, c, d;
+
+	if (state == S_DONE) {
+		s = skip_ws(p, s, e);
+		if (s < e)
+			state = S_ERROR;
+	}
+	while (s < e && state < S_DONE) {
+		/* cases that break consume one byte unless they fail */
+		switch (from = state) {
+		case S_VALUE:
+		case S_FIRST:
+			s = skip_ws(p, s, e);
+			if (s == e)
+				continue;
+			switch (c = *s) {
+			case '"':
+				p->len = 0;
+				p->nucs = 0;
+				state = S_STR;
 				break;
+			case '[':
+			case '{':
+				state = open_frame(p, c);
+				break;
+			case ']':
+				state = state == S_FIRST ?
+					new_value(p, close_array(p)) : S_ERROR;
+				break;
+			case 't':
+				p->sub = LIT_T + 1;
+				state = S_LIT;
+				break;
+			case 'f':
+				p->sub = LIT_F + 1;
+				state = S_LIT;
+				break;
+			case 'n':
+				p->sub = LIT_N + 1;
+				state = S_LIT;
+				break;
+			default:
+				if (c != '-' && (c < '0' || c > '9'))
+					state = S_ERROR;
+				else {
+					start_number(p, c);
+					state = S_NUM;
+				}
+			}
+			break;
+		case S_ARR_NEXT:
+			s = skip_ws(p, s, e);
+			if (s == e)
+				continue;
+			if (*s == ',')
+				state = S_VALUE;
+			else if (*s == ']')
+				state = new_value(p, close_array(p));
+			else
+				state = S_ERROR;
+			break;
+		case S_KEY:
+		case S_KEY_FIRST:
+			s = skip_ws(p, s, e);
+			if (s == e)
+				continue;
+			if (*s == '"') {
+				p->len = 0;
+				p->nucs = 0;
+				state = S_STR;
+			} else if (*s == '}' && state == S_KEY_FIRST)
+				state = new_value(p, close_object(p));
+			else
+				state = S_ERROR;
+			break;
+		case S_COLON:
+			s = skip_ws(p, s, e);
+			if (s == e)
+				continue;
+			state = *s == ':' ? S_VALUE : S_ERROR;
+			break;
+		case S_OBJ_NEXT:
+			s = skip_ws(p, s, e);
+			if (s == e)
+				continue;
+			if (*s == ',')
+				state = S_KEY;
+			else if (*s == '}')
+				state = new_value(p, close_object(p));
+			else
+				state = S_ERROR;
+			break;
+		case S_STR:
+			t = s;
+			while (s < e && (c = (unsigned char) *s) != '"' &&
+			       c != '\\' && c >= 0x20)
+				s++;
+			if (s > t && (state = put_chars(p, t, s - t)) != S_STR)
+				continue;
+			if (s == e)
+				continue;
+			if (*s == '"')
+				state = new_value(p, make_string(p));
+			else if (*s == '\\')
+				state = S_ESC;
+			else
+				state = S_ERROR;
+			break;
+		case S_ESC:
+			if (*s == 'u') {
+				p->sub = 0;
+				p->mant = 0;	/* hex value */
+				state = S_HEX;
+			} else if ((c = esc_char(*s)))
+				state = put_uc(p, c);
+			else
+				state = S_ERROR;
+			break;
+		case S_HEX:
+			for (; s < e && p->sub < 4; s++, p->sub++) {
+				if ((d = hex_digit(*s)) < 0)
+					break;
+				p->mant = p->mant << 4 | d;
 			}
-			c = convert_hex_quad(s);
-			if (c && (unsigned) c < 0x100)
-				buf[i] = c;
-			else {
-				buf[i] = '\0';
-				*p = append_uc(append_str(*p, buf), c);
-				i = -1;
+			if (p->sub == 4)
+				state = put_uc(p, p->mant);
+			else if (s < e)
+				state = S_ERROR;
+			continue;
+		case S_LIT:
+			for (; s < e && lit_names[p->sub]; s++, p->sub++) {
+				if (*s != lit_names[p->sub])
+					break;
 			}
-			s += 3;
-		} else {
-			buf[i] = esc_char(*s);
-			if (!buf[i])
-				return 0;
+			if (!lit_names[p->sub])
+				state = value(p, p->sub == LIT_F - 1 ? JSON_TRUE :
+						 p->sub == LIT_N - 1 ? JSON_FALSE : 0);
+			else if (s < e)
+				state = S_ERROR;
+			continue;
+		case S_NUM:
+			s = scan_number(p, s, e);
+			if (s < e)
+				state = number_complete(p) ?
+					new_value(p, make_number(p)) : S_ERROR;
+			continue;
 		}
+		if (state < S_ERROR)
+			s++;
 	}
-	if (i > 0) {
-		buf[i] = '\0';
-		*p = append_str(*p, buf);
+	if (p->nl) {
+		p->line_off = p->offset + (p->nl + 1 - start);
+		p->nl = NULL;
+	}
+	if (state >= S_ERROR && p->state < S_ERROR) {
+		p->err_pos = p->offset + (s - start);
+		p->err_from = from;
+	}
+	p->offset += s - start;
+	p->state = state;
+	if (end)
+		*end = s;
+	switch (state) {
+	case S_ERROR:
+		return JSON_ERROR;
+	case S_LIMIT:
+		return JSON_LIMIT;
+	case S_DONE:
+		return JSON_DONE;
+	default:
+		return JSON_MORE;
 	}
-	*end = s;
-	return st;
-}
-
-static object parse_string1(const char *s, const char **end, object st, int c)
-{
-	object *p = first(st);
-	if (!p)
-		return 0;
-	st = parse_chars(s, &s, st, p, c);
-	if (*s == '"') {
-		if (type_of(last_tail(*p, 0)) != TYP_STR)
-			*p = append(*p, store_str(""));
-		s++;
-	} else if (*s)
-		return 0;
-	else if (first(st) == p)
-		st = cons('"', st);
-	*end = s;
-	return st;
-}
-
-static object parse_string(const char *s, const char **end, object st)
-{
-	return parse_string1(s, end, cons(0, st), 0);
 }
 
-static object parse_element(const char *s, const char **end, object st)
+int json_parse_str(struct json_parser *p, const char *s, const char **end)
 {
-	st = parse_value(s, &s, cons(',', st));
-	*end = skip_ws(s);
-	return st;
+	return json_parse(p, s, strlen(s), end);
 }
 
-static object reduce_array(object st)
+int json_parse_end(struct json_parser *p)
 {
-	object arr = st, *p = &arr, top;
-	while (is_cons(st)) {
-		if ((top = get_head(st)) == '[') {
-			*p = EMPTY_LIST;
-			*load_cons(st) = reverse_list(arr);
-			return st;
-		}
-		if (is_state_atom(top))
-			return 0;
-		p = load_cons(st) + 1;
-		st = *p;
+	switch (p->state) {
+	case S_NUM:
+		if (p->depth || !number_complete(p))
+			break;
+		p->state = new_value(p, make_number(p));
+		if (p->state == S_DONE)
+			return JSON_DONE;
+		p->err_pos = p->offset;
+		p->err_from = S_NUM;
+		return JSON_LIMIT;
+	case S_DONE:
+		return JSON_DONE;
+	case S_ERROR:
+		return JSON_ERROR;
+	case S_LIMIT:
+		return JSON_LIMIT;
+	case S_VALUE:
+		if (!p->depth)
+			return JSON_MORE;
 	}
-	return st == '[' ? reverse_list(arr) : 0;
+	p->err_pos = p->offset;
+	p->err_from = JSON_EXPECT_MORE;
+	p->state = S_ERROR;
+	return JSON_ERROR;
 }
 
-static object parse_array(const char *s, const char **end, object st)
-{
-	s = skip_ws(s);
-	if (*s == ',') {
-		if (!is_cons(st) || get_head(st) == '[')
-			return 0;
-	} else if (*s && *s != ']')
-		st = parse_element(s, &s, st);
-	while (*s == ',' && st)
-		st = parse_element(s+1, &s, st);
-	if (*s == ']') {
-		st = reduce_array(st);
-		s++;
-	} else if (*s)
-		return 0;
-	*end = s;
-	return st;
-}
+/* Streams: the parts of a value are allocated as they complete, so
+   the mark is kept until the whole value has been handed to f */
 
-static object reduce_object(object st)
+static int feed_value(struct json_parser *p, int st,
+		      int (*f)(object, void *), void *arg)
 {
-	object obj = st, *p, *q = NULL, name;
-	if (st == '{')
-		return EMPTY_DICT;
-	while ((p = first(st)) && !is_state_atom(*p) &&
-	       (q = first(p[1])) && type_of(last_tail(*q, 0)) == TYP_STR) {
-		name = *q;
-		*q = *p;
-		*p = name;
-		st = q[1];
-	}
-	if (st == '{') {
-		q[1] = EMPTY_DICT;
-		return obj;
-	}
-	if (p && *p == '{') {
-		if (!q)
-			*p = EMPTY_DICT;
-		else {
-			*p = obj;
-			q[1] = EMPTY_DICT;
-		}
+	if (st == JSON_MORE)
 		return st;
+	if (st == JSON_DONE) {
+		st = f(p->result, arg);
+		json_parser_reset(p);
 	}
-	return 0;
+	listdata_release(p->mark);
+	p->marked = 0;
+	return st;
 }
 
-static object parse_object(const char *s, const char **end, object st, int n)
+int json_feed(struct json_parser *p, const char *s, size_t n,
+	      int (*f)(object, void *), void *arg)
 {
-	s = skip_ws(s);
-	if (n == 0) {
-		if (*s == '"') {
-			st = parse_string(s+1, &s, st);
-			return parse_object(s, end, st, 1);
+	const char *e = s + n;
+	int st = JSON_MORE;
+	while (s < e && st == JSON_MORE) {
+		if (!p->marked) {
+			listdata_mark(p->mark);
+			p->marked = 1;
 		}
-	} else if (n % 2) {
-		if (*s == ':') {
-			st = parse_value(s+1, &s, cons(':', st));
-			return parse_object(s, end, st, n+1);
-		}
-	} else if (*s == ',') {
-		s = skip_ws(s+1);
-		if (*s == '"')
-			return parse_object(s, end, st, 0);
-		st = cons(',', st);
+		st = feed_value(p, json_parse(p, s, e - s, &s), f, arg);
 	}
-	if (*s == '}') {
-		st = reduce_object(st);
-		s++;
-	} else if (*s)
-		return 0;
-	*end = s;
 	return st;
 }
 
-static object parse_lit_name(const char *s, const char **end, object top)
+int json_feed_end(struct json_parser *p, int (*f)(object, void *), void *arg)
 {
-	int i = top - LIT_NAME_0, j;
-	while (*s && *s == lit_names[i+1]) { i++; s++; }
-	*end = s;
-	if (j = lit_ok[i])
-		return lit_val[j];
-	else
-		return *s ? EMPTY_LIST : LIT_NAME_0 + i;
-}
-
-static object parse_value(const char *s, const char **end, object st)
-{
-	object *p;
-	s = skip_ws(s);
-	if (!*s) {
-		*end = s;
+	int st = json_parse_end(p);
+	if (!p->marked)
 		return st;
-	}
-	if (p = first(st)) {
-		*p = '+';
-		switch (*s) {
-		case '"':
-			*p = 0;
-			return parse_string1(s+1, end, st, 0);
-		case '{':
-			*p = '{';
-			return parse_object(s+1, end, st, 0);
-		case '[':
-			*p = '[';
-			return parse_array(s+1, end, st);
-
-		/* true false null */
-		case 't': *p = LIT_NAME_T; break;
-		case 'f': *p = LIT_NAME_F; break;
-		case 'n': *p = LIT_NAME_N; break;
-
-		/* number */
-		case '-':
-			*p = '-';
-			s++;
-		default:
-			return parse_number(s, end, st);
-		}
-		*p = parse_lit_name(s+1, end, *p);
-		if (*p != EMPTY_LIST)
-			return st;
-	}
-	return 0;
-}
-
-/* continue parsing string */
-static object parse_hex_quad(const char *s, const char **end, object st)
-{
-	object *p;
-	char buf[8] = "\\u";
-	int n = copy_str(pop(&st), buf+2, 4), uc;
-	for (; n<4 && *s; n++)
-		buf[n+2] = *s++;
-	n = match_hex_quad(buf+2);
-	if (n < 4) {
-		if (*s)
-			return 0;
-		*end = s;
-		return parse_string1(buf, &s, st, 0);
-	}
-	uc = convert_hex_quad(buf+2);
-	if (uc && (unsigned) uc < 0x100)
-		return parse_string1(s, end, st, uc);
-	p = first(st);
-	if (!p)
-		return 0;
-	*p = append_uc(*p, uc);
-	return parse_string1(s, end, st, 0);
+	if (st != JSON_MORE)
+		return feed_value(p, st, f, arg);
+	listdata_release(p->mark);	/* nothing but white space */
+	p->marked = 0;
+	return st;
 }
 
-static object parse_esc(const char *s, const char **end, object st)
-{
-	int c;
-	if (*s == 'u')
-		return parse_hex_quad(s+1, end, cons(store_str(""), st));
-	c = esc_char(*s);
-	return c ? parse_string1(s+1, end, st, c) : 0;
-}
+/* Numbers */
 
-static object parse(const char *s, object st)
+int json_decimal(object x, int *mant, int *exp)
 {
-	object t, *p;
-	int n;
-	while (*s) {
-		t = st;
-		n = 0;
-		while (p = first(t)) {
-			if (*p == '{' || *p == '[') {
-				t = *p;
-				break;
-			}
-			if (*p == '+' || *p == '-') {
-				st = parse_number(s, &s, st);
-				return parse(s, st);
-			}
-			t = p[1];
-			n++;
-		}
-		switch (t) {
-		case '{':
-			st = parse_object(s, &s, st, n);
-			break;
-		case '[':
-			st = parse_array(s, &s, st);
-			break;
-		default:
-			return *skip_ws(s) ? 0 : st;
-		}
-		s = skip_ws(s);
+	if (type_of(x) == TYP_INT) {
+		*mant = load_int(x);
+		*exp = 0;
+		return 1;
 	}
-	return st;
+	if (load_num(x, mant, exp))
+		return 1;
+	if (!is_cons(x) || type_of(get_head(x)) != TYP_INT ||
+	    type_of(get_tail(x)) != TYP_INT)
+		return 0;
+	*mant = load_int(get_head(x));
+	*exp = load_int(get_tail(x));
+	return 1;
 }
 
-object json_parse_start(const char *s)
-{
-	return json_parse(s, ' ');
-}
+/* powers of ten that are exact doubles */
+static const double powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-object json_parse(const char *s, object st)
+int json_number(object x, double *d)
 {
-	object *p = first(st);
-	if (st == ' ') {
-		s = skip_ws(s);
-		return *s ? parse(s+1, *s) : st;
-	}
-	if (!*s)
-		return st;
-	if (p) {
-		switch (*p) {
-		case ',':
-		case ':':
-			st = parse_value(s, &s, st);
-			break;
-		case '"':
-			st = parse_string1(s, &s, p[1], 0);
-			break;
-		case '\\':
-			st = parse_esc(s, &s, p[1]);
-			break;
-		case 'u':
-			st = parse_hex_quad(s, &s, p[1]);
-			break;
-		case LIT_NAME_T:	/* tr */
-		case LIT_NAME_T+1:	/* tru */
-		case LIT_NAME_T+2:	/* true */
-		case LIT_NAME_F:	/* fa */
-		case LIT_NAME_F+1:	/* fal */
-		case LIT_NAME_F+2:	/* fals */
-		case LIT_NAME_F+3:	/* false */
-		case LIT_NAME_N:	/* nu */
-		case LIT_NAME_N+1:	/* nul */
-		case LIT_NAME_N+2:	/* null */
-			*p = parse_lit_name(s, &s, *p);
-			if (*p == EMPTY_LIST)
-				return 0;
-			break;
-		}
+	char buf[32];
+	int m, e;
+	if (!json_decimal(x, &m, &e))
+		return 0;
+	/* one rounding of exact operands is the nearest double */
+	if (e >= -22 && e <= 22)
+		*d = e < 0 ? m / powers[-e] : m * powers[e];
+	else {
+		sprintf(buf, "%de%d", m, e);
+		*d = strtod(buf, NULL);
 	}
-	return parse(s, st);
-}
-
-int json_parse_done(object st)
-{
-	switch (last_tail(st, 0)) {
-	case EMPTY_LIST:
-	case EMPTY_DICT:
-		return 1;
-	default:
+	return 1;
+}
+
+static const char *const syntax_errors[] = {
+	"value expected",
+	"value or ']' expected",
+	"',' or ']' expected",
+	"name expected",
+	"name or '}' expected",
+	"':' expected",
+	"',' or '}' expected",
+	"control character in string",
+	"invalid escape",
+	"hex digit expected",
+	"invalid literal",
+	"invalid number",
+	"end of input expected",
+	"unexpected end of input"
+};
+
+int json_parse_error(const struct json_parser *p, struct json_error *err)
+{
+	if (p->state != S_ERROR && p->state != S_LIMIT)
 		return 0;
+	err->offset = p->err_pos;
+	err->line = p->line + 1;
+	err->column = p->err_pos - p->line_off + 1;
+	if (p->state == S_LIMIT) {
+		err->expected = JSON_EXPECT_NONE;
+		err->reason = p->reason;
+	} else {
+		err->expected = p->err_from;
+		err->reason = syntax_errors[p->err_from];
 	}
+	return 1;
 }
@@ -4,6 +4,10 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#ifdef LISTDATA_STATS
+#include <time.h>
+#endif
 #include "listdata.h"
 #include "mstack.h"
 
@@ -11,6 +15,21 @@
 
 typedef T cons_cell[2];
 
+/* With LISTDATA_THREADS each thread has a heap of its own, and the
+   frozen heap is shared by all of them. */
+#ifdef LISTDATA_THREADS
+#ifdef LISTDATA_FLAT
+#error "LISTDATA_THREADS does not work with LISTDATA_FLAT"
+#endif
+#ifdef __GNUC__
+#define LOCAL __thread
+#else
+#define LOCAL _Thread_local
+#endif
+#else
+#define LOCAL
+#endif
+
 #define MAX(a,b) ((a)>(b) ? (a) : (b))
 #define MAX3(a,b,c) MAX(a,MAX(b,c))
 
@@ -37,364 +56,2252 @@ enum ttag {
 	TAG_CONS,
 	TAG_STR,
 	TAG_INT,
-	TAG_INUM	/* immediate integer */
+	TAG_INUM,	/* immediate integer */
+	TAG_ROPE,	/* cons block, see Ropes */
+	TAG_SHORT,	/* immediate string */
+	TAG_NUM		/* immediate mantissa and exponent */
 };
 
-static struct mstack mstack;
+/* The heap and the frozen heap are not static, for the inline handle
+   decoding of listdata.hpp. */
+LOCAL struct mstack listdata_heap;
+#define mstack listdata_heap
+
+static LOCAL T str_top, int_top, cons_top;
+static LOCAL char	*str_p;
+static LOCAL int	*int_p;
+static LOCAL cons_cell	*cons_p;
+
+/* Frozen heap: blocks 1 to frozen_top, with a copy of their table
+   that never changes. Set before other threads start. */
+struct mblock *listdata_frozen_blocks;
+unsigned listdata_frozen_top;
+#define frozen listdata_frozen_blocks
+#define frozen_top listdata_frozen_top
+
+#ifdef LISTDATA_STATS
+static LOCAL struct listdata_stats stats;
+#define STAT(x) (x)
+#else
+#define STAT(x)
+#endif
 
-static T str_top, int_top, cons_top;
-static char	 *str_p;
-static int	 *int_p;
-static cons_cell *cons_p;
+/* arena in use or NULL for the default heap, which heap the blocks of
+   the pools belong to (its id in the block tags above the pool tag)
+   and how many blocks the arenas hold */
+static LOCAL struct listdata_arena *arena;
+static LOCAL unsigned heap_id, arena_ids;
+static LOCAL unsigned long arena_blocks;
+#define HEAP_OF(tag) ((unsigned) (tag) >> TAG_BITS)
+#define POOL_TAG(tag) ((tag) & ((1 << TAG_BITS) - 1))
+
+/* hash-consing table, open addressing */
+static LOCAL int sharing;
+static LOCAL T *share_tab;
+static LOCAL unsigned share_size, share_count;
+
+/* Flat heap: with LISTDATA_FLAT all blocks are at a fixed stride in
+   one reserved address range, so a handle is decoded without loading
+   the block table. */
+#define FLAT_BLOCK (OFFSET_NUM * sizeof(cons_cell))
+/* address space reserved in flat mode, at most 2^19 blocks */
+#define FLAT_BLOCKS (BASE_MAX < 0x80000 ? (unsigned) BASE_MAX + 1 : 0x80000)
 
 static void *getmem(T pointer)
 {
+#ifdef LISTDATA_FLAT
+	return mstack.flat + BASE(pointer) * FLAT_BLOCK;
+#else
+#ifdef LISTDATA_THREADS
+	if (BASE(pointer) <= frozen_top)
+		return frozen[BASE(pointer)].mem;
+#endif
 	return mstack.mblocks[BASE(pointer)].mem;
+#endif
 }
 
-void listdata_mark(T *p)
+static void init(void)
 {
 	if (!mstack.mblocks) {
 		mstack_init(&mstack);
 		if (BASE_MAX < mstack.limit)
-			mstack.limit = BASE_MAX;
+			mstack.limit = (unsigned) BASE_MAX;
+#ifdef LISTDATA_FLAT
+		mstack_reserve(&mstack, FLAT_BLOCKS, FLAT_BLOCK);
+#endif
+		/* a new thread starts above the frozen heap */
+		if (frozen_top && !mstack_skip(&mstack, frozen_top))
+			mstack.limit = 0;
 	}
-	p[0] = str_top;
-	p[1] = int_top;
-	p[2] = cons_top;
 }
 
-void listdata_release(const T *p)
+/* allocation pointers after the tops were moved back */
+static void set_pointers(void)
 {
-	T x = MAX3(p[0], p[1], p[2]),
-	  y = MAX3(str_top, int_top, cons_top);
-	if (!x)
-		mstack_free(&mstack, 0);
-	else if (BASE(x) < BASE(y))
-		mstack_free(&mstack, BASE(y));
+	str_p = str_top ? load_str(str_top) : NULL;
+	int_p = int_top ? (int *) getmem(int_top) + OFFSET(int_top) : NULL;
+	cons_p = cons_top ? (cons_cell *) load_cons(cons_top) : NULL;
+}
 
-	str_top  = p[0];
-	int_top  = p[1];
-	cons_top = p[2];
+void listdata_limit(unsigned long bytes)
+{
+	init();
+	mstack.max_bytes = bytes;
+}
 
-	str_p = load_str(str_top);
-	int_p = (int *) getmem(int_top) + OFFSET(int_top);
-	cons_p = (cons_cell *) load_cons(cons_top);
+/* Statistics */
+
+static T pool_top(int i)
+{
+	return i == LISTDATA_POOL_STR ? str_top :
+	       i == LISTDATA_POOL_INT ? int_top : cons_top;
 }
 
-static T tag_base(enum ttag tag, unsigned b)
+static const unsigned pool_unit[LISTDATA_POOLS] = {
+	1, sizeof(int), sizeof(cons_cell)
+};
+
+static int pool_of(int tag)
 {
-	return (tag | ((T) b << TAG_BITS)) << OFFSET_BITS;
+	switch (POOL_TAG(tag)) {
+	case TAG_STR:
+		return LISTDATA_POOL_STR;
+	case TAG_INT:
+		return LISTDATA_POOL_INT;
+	default:
+		return LISTDATA_POOL_CONS;
+	}
 }
 
-T store_str(const char *s)
+/* bytes below the top of a pool of n blocks */
+static unsigned long pool_used(int i, unsigned long n)
 {
-	unsigned b;
-	T str;
-	if (str_p && OFFSET(str_top)+1 < OFFSET_MAX) {
-		str_top++;
-		str_p++;
-	} else {
-		b = mstack_alloc(&mstack, OFFSET_NUM);
-		if (!b)
-			return 0;
-		str_top = tag_base(TAG_STR, b);
-		str_p = mstack.mblocks[b].mem;
+	T top = pool_top(i);
+	if (!n || !top)
+		return 0;
+	return ((n - 1) * OFFSET_NUM + OFFSET(top) + 1) * pool_unit[i];
+}
+
+#ifdef LISTDATA_STATS
+static void update_max(void)
+{
+	struct listdata_pool_stats *s;
+	unsigned long used;
+	int i;
+	for (i=0; i<LISTDATA_POOLS; i++) {
+		s = &stats.pool[i];
+		used = pool_used(i, s->blocks);
+		if (s->blocks > s->max_blocks)
+			s->max_blocks = s->blocks;
+		if (used > s->max_used)
+			s->max_used = used;
 	}
-	str = str_top;
-	while (OFFSET(str_top) < OFFSET_MAX && (*str_p = *s)) {
-		str_top++;
-		str_p++;
-		s++;
+}
+
+/* blocks from b up are about to be freed */
+static void forget_blocks(unsigned b)
+{
+	struct mblock *m;
+	for (b = b ? b : 1; b <= mstack.top; b++) {
+		m = &mstack.mblocks[b];
+		if (m->freeable && !HEAP_OF(m->tag)) {
+			stats.pool[pool_of(m->tag)].blocks--;
+			stats.blocks_freed++;
+		}
 	}
-	*str_p = '\0';
-	return *s ? cons(str, store_str(s)) : str;
 }
+#endif
 
-static T push_int(int x)
+int listdata_stats(struct listdata_stats *s)
 {
+	struct listdata_pool_stats *ps;
+	struct mblock *m;
 	unsigned b;
-	if (int_p && OFFSET(int_top) < OFFSET_MAX) {
-		int_top++;
-		int_p++;
-	} else {
-		b = mstack_alloc(&mstack, OFFSET_NUM * sizeof(int));
-		if (!b)
-			return 0;
-		int_top = tag_base(TAG_INT, b);
-		int_p = mstack.mblocks[b].mem;
+	int i;
+
+	init();
+#ifdef LISTDATA_STATS
+	update_max();
+	*s = stats;
+#else
+	memset(s, 0, sizeof(*s));
+#endif
+	for (i=0; i<LISTDATA_POOLS; i++)
+		s->pool[i].blocks = s->pool[i].bytes = 0;
+	for (b=1; b<=mstack.top; b++) {
+		m = &mstack.mblocks[b];
+		if (m->freeable) {
+			ps = &s->pool[pool_of(m->tag)];
+			ps->blocks++;
+			ps->bytes += m->size;
+		}
 	}
-	*int_p = x;
-	return int_top;
+	for (i=0; i<LISTDATA_POOLS; i++)
+		s->pool[i].used = pool_used(i, s->pool[i].blocks);
+	s->heap_bytes = mstack.bytes;
+	s->max_heap_bytes = mstack.peak_bytes;
+	s->share_bytes = share_size * sizeof(T);
+	s->block_allocs = mstack.allocs;
+	s->block_failures = mstack.failures;
+	s->table_grows = mstack.grows;
+#ifdef LISTDATA_STATS
+	return 1;
+#else
+	return 0;
+#endif
 }
 
-T store_int(int x)
+void listdata_stats_reset(void)
 {
-	return abs(x) > INUM_MAX ? push_int(x) :
-		TAGGED(TAG_INUM) | (((T) x << TAG_BITS) & BASE_MASK)
-				 | ((T) x & (OFFSET_MAX | MSB));
+#ifdef LISTDATA_STATS
+	struct listdata_pool_stats *s;
+	int i;
+#endif
+	init();
+	mstack.peak_bytes = mstack.bytes;
+	mstack.allocs = mstack.failures = mstack.grows = 0;
+#ifdef LISTDATA_STATS
+	stats.marks = stats.releases = 0;
+	stats.release_ns = stats.blocks_freed = 0;
+	for (i=0; i<LISTDATA_POOLS; i++) {
+		s = &stats.pool[i];
+		s->max_blocks = s->blocks;
+		s->max_used = pool_used(i, s->blocks);
+		s->objects = 0;
+	}
+#endif
 }
 
-static int extract_inum(T x)
+/* Hashing bytes a word at a time, independent of fragmentation */
+
+struct chars_hash {
+	unsigned long h, len;
+	unsigned n;			/* bytes in buf */
+	unsigned char buf[sizeof(unsigned long)];
+};
+
+#define HASH_K 0x9E3779B97F4A7C15UL
+
+static unsigned long mix(unsigned long h, unsigned long x)
 {
-	return (x & MSB) ? extract_inum(x ^ MSB) - (int)(INUM_MAX+1) :
-		((x & BASE_MASK) >> TAG_BITS) | OFFSET(x);
+	h = (h ^ x) * HASH_K;
+	return h ^ (h >> 29);
 }
 
-T cons(T head, T tail)
+static void hash_chars(struct chars_hash *c, const char *s, size_t n)
 {
-	unsigned b;
-	if (cons_p && OFFSET(cons_top) < OFFSET_MAX) {
-		cons_top++;
-		cons_p++;
-	} else {
-		b = mstack_alloc(&mstack, OFFSET_NUM * sizeof(cons_cell));
-		if (!b)
-			return 0;
-		cons_top = tag_base(TAG_CONS, b);
-		cons_p = mstack.mblocks[b].mem;
+	unsigned long w;
+	c->len += n;
+	for (; n && c->n; n--) {
+		c->buf[c->n++] = *s++;
+		if (c->n == sizeof(w)) {
+			memcpy(&w, c->buf, sizeof(w));
+			c->h = mix(c->h, w);
+			c->n = 0;
+		}
 	}
-	(*cons_p)[0] = head;
-	(*cons_p)[1] = tail;
-	return cons_top;
+	for (; n >= sizeof(w); n -= sizeof(w), s += sizeof(w)) {
+		memcpy(&w, s, sizeof(w));
+		c->h = mix(c->h, w);
+	}
+	memcpy(c->buf + c->n, s, n);
+	c->n += n;
 }
 
-T cons_nil(T head)
+static unsigned long hash_end(struct chars_hash *c)
 {
-	return cons(head, EMPTY_LIST);
+	unsigned long w = 0;
+	memcpy(&w, c->buf, c->n);
+	return mix(mix(c->h, w), c->len);
 }
 
-enum typ type_of(T x)
+static unsigned long hash_str(const char *s)
+{
+	struct chars_hash c = {TYP_STR};
+	hash_chars(&c, s, strlen(s));
+	return hash_end(&c);
+}
+
+static unsigned long share_hash(T x)
 {
 	switch (x & TAG_MASK) {
 	case TAGGED(TAG_CONS):
-		return TYP_CONS;
+		return mix(mix(0, get_head(x)), get_tail(x));
 	case TAGGED(TAG_STR):
-		return TYP_STR;
-	case TAGGED(TAG_INT):
-	case TAGGED(TAG_INUM):
-		return TYP_INT;
+		return hash_str(load_str(x));
 	default:
-		return TYP_ATOM;
+		return mix(0, load_int(x));
 	}
 }
 
-static int tagged(T x, enum ttag tag)
+static T *share_probe(unsigned long h, enum ttag tag, T a, T b, const char *s)
 {
-	return (x & TAG_MASK) == TAGGED(tag);
+	unsigned i = h & (share_size - 1);
+	T x, *c;
+	for (;; i = (i+1) & (share_size - 1)) {
+		x = share_tab[i];
+		if (!x)
+			break;
+		if ((x & TAG_MASK) != TAGGED(tag))
+			continue;
+		if (arena_blocks &&
+		    HEAP_OF(mstack.mblocks[BASE(x)].tag) != heap_id)
+			continue;
+		switch (tag) {
+		case TAG_CONS:
+			c = load_cons(x);
+			if (c[0] == a && c[1] == b)
+				return share_tab + i;
+			break;
+		case TAG_STR:
+			if (!strcmp(load_str(x), s))
+				return share_tab + i;
+			break;
+		default:
+			if (load_int(x) == (int) a)
+				return share_tab + i;
+		}
+	}
+	return share_tab + i;
 }
 
-char *load_str(T str)
+static int share_rehash(unsigned size)
 {
-	return (char *) getmem(str) + OFFSET(str);
+	T *old = share_tab, *slot;
+	unsigned i, n = share_size;
+	share_tab = calloc(size, sizeof(T));
+	if (!share_tab) {
+		share_tab = old;
+		return 0;
+	}
+	share_size = size;
+	for (i=0; i<n; i++) {
+		if (old[i]) {
+			slot = share_tab + (share_hash(old[i]) & (size - 1));
+			while (*slot)
+				slot = slot+1 < share_tab+size ? slot+1 : share_tab;
+			*slot = old[i];
+		}
+	}
+	free(old);
+	return 1;
 }
 
-int load_int(T x)
+/* slot holding an object equal to (tag a b s) or the empty slot
+   where it should be added. NULL if out of memory */
+static T *share_find(unsigned long h, enum ttag tag, T a, T b, const char *s)
 {
-	switch (x & TAG_MASK) {
-	case TAGGED(TAG_INT):
-		return ((int *) getmem(x))[OFFSET(x)];
-	case TAGGED(TAG_INUM):
-		return extract_inum(x);
-	default:
-		return 0;
-	}
+	if (2 * (share_count+1) > share_size &&
+	    !share_rehash(share_size ? 2 * share_size : 1024))
+		return NULL;
+	return share_probe(h, tag, a, b, s);
 }
 
-T *load_cons(T cons)
+static void share_add(T *slot, T x)
 {
-	return &((cons_cell *) getmem(cons))[OFFSET(cons)][0];
+	*slot = x;
+	share_count++;
 }
 
-T get_head(T cons) { return load_cons(cons)[0]; }
-T get_tail(T cons) { return load_cons(cons)[1]; }
+/* forget objects allocated after mark p (with the blocks after it
+   already freed) */
+static void share_purge(const T *p)
+{
+	unsigned i;
+	T x, top;
+	for (i=0; i<share_size; i++) {
+		x = share_tab[i];
+		if (!x)
+			continue;
+		switch (x & TAG_MASK) {
+		case TAGGED(TAG_STR):	top = p[0]; break;
+		case TAGGED(TAG_INT):	top = p[1]; break;
+		default:		top = p[2];
+		}
+		if (BASE(x) == BASE(top) ? x > top :
+		    BASE(x) > mstack.top || !mstack.mblocks[BASE(x)].mem) {
+			share_tab[i] = 0;
+			share_count--;
+		}
+	}
+	if (share_count)
+		share_rehash(share_size);
+	else {
+		free(share_tab);
+		share_tab = NULL;
+		share_size = 0;
+	}
+}
 
-int is_cons(T x)
+void listdata_share(int on)
 {
-	return tagged(x, TAG_CONS);
+	init();
+	sharing = on;
 }
 
-T nth_tail(T x, int n)
+void listdata_mark(T *p)
 {
-	for (; n>0 && is_cons(x); n--)
-		x = get_tail(x);
-	return !n ? x : 0;
+	init();
+	STAT(stats.marks++);
+	p[0] = str_top;
+	p[1] = int_top;
+	p[2] = cons_top;
 }
 
-T *nth_elem(T x, int n)
+/* Free the blocks of the default heap from b up. The arenas may hold
+   blocks among them, which stay. */
+static void free_blocks(unsigned b)
 {
-	x = nth_tail(x, n);
-	return is_cons(x) ? load_cons(x) : NULL;
+	if (!arena_blocks) {
+		mstack_free(&mstack, b);
+		return;
+	}
+	for (b = MAX(b, mstack.kept + 1); b <= mstack.top; b++)
+		if (!HEAP_OF(mstack.mblocks[b].tag))
+			mstack_clear(&mstack, b);
+	mstack_trim(&mstack);
 }
 
-T *first (T x) { return nth_elem(x, 0); }
-T *second(T x) { return nth_elem(x, 1); }
-T *third (T x) { return nth_elem(x, 2); }
+/* mark p of the default heap, or q with its tops that are in the
+   frozen heap moved to the end of it */
+static const T *thaw_mark(const T *p, T *q)
+{
+	int i;
+	if (!frozen_top || arena)
+		return p;
+	for (i=0; i<LISTDATA_POOLS; i++)
+		q[i] = BASE(p[i]) <= frozen_top ? 0 : p[i];
+	return q;
+}
 
-T last_tail(T x, int n)
+static void arena_release(const T *p);
+
+void listdata_release(const T *p)
 {
-	return is_cons(nth_tail(x, n)) ? last_tail(get_tail(x), n) : x;
+	T q[LISTDATA_POOLS], x, y;
+#ifdef LISTDATA_STATS
+	struct timespec t0, t1;
+#endif
+	p = thaw_mark(p, q);
+	x = MAX3(p[0], p[1], p[2]);
+	y = MAX3(str_top, int_top, cons_top);
+#ifdef LISTDATA_STATS
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	update_max();
+	if (!arena)
+		forget_blocks(x ? BASE(x) + 1 : 0);
+#endif
+	if (arena)
+		arena_release(p);
+	else if (!x)
+		free_blocks(0);
+	else if (BASE(x) < BASE(y))
+		free_blocks(BASE(x) + 1);
+
+	str_top  = p[0];
+	int_top  = p[1];
+	cons_top = p[2];
+
+	set_pointers();
+
+	if (share_count)
+		share_purge(p);
+#ifdef LISTDATA_STATS
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stats.releases++;
+	stats.release_ns += (t1.tv_sec - t0.tv_sec) * 1000000000L +
+			    (t1.tv_nsec - t0.tv_nsec);
+#endif
 }
 
-T pop(T *p)
+static T tag_base(enum ttag tag, unsigned b)
 {
-	T elem = 0;
-	if (is_cons(*p)) {
-		elem = get_head(*p);
-		*p = get_tail(*p);
-	}
-	return elem;
+	return (tag | ((T) b << TAG_BITS)) << OFFSET_BITS;
 }
 
-T reverse_list(T list)
+static int arena_add(unsigned b);
+
+/* allocate a block of n bytes for the pool of tag */
+static unsigned new_block(enum ttag tag, unsigned n)
 {
-	T tail = EMPTY_LIST,
-	  next, *p;
-	while (is_cons(list)) {
-		p = load_cons(list);
-		next = p[1];
-		p[1] = tail;
-		tail = list;
-		list = next;
+	unsigned b;
+#ifdef LISTDATA_STATS
+	struct listdata_pool_stats *s;
+#endif
+	if (!arena)
+		b = mstack_alloc(&mstack, n);
+	else if ((b = mstack_alloc_any(&mstack, n)) && !arena_add(b)) {
+		mstack_clear(&mstack, b);
+		mstack_trim(&mstack);
+		b = 0;
 	}
-	return tail;
+	if (b) {
+		mstack.mblocks[b].tag = tag | heap_id << TAG_BITS;
+#ifdef LISTDATA_STATS
+		s = &stats.pool[pool_of(tag)];
+		if (++s->blocks > s->max_blocks)
+			s->max_blocks = s->blocks;
+#endif
+	}
+	return b;
 }
 
-static const char *match_prefix(const char *s, T prefix)
+/* Arenas */
+
+void listdata_arena_init(struct listdata_arena *a, const char *name)
 {
-	const char *t;
-	if (!tagged(prefix, TAG_STR))
-		return NULL;
-	t = load_str(prefix);
-	for (; *t; s++, t++) {
-		if (*s != *t)
-			return NULL;
-	}
-	return s;
+	init();
+	if (++arena_ids > INT_MAX >> TAG_BITS)
+		arena_ids = 1;
+	a->name = name;
+	a->id = arena_ids;
+	a->top[0] = a->top[1] = a->top[2] = 0;
+	a->blocks = NULL;
+	a->nblocks = a->max = 0;
 }
 
-int equals_str(T x, const char *s)
+/* record block b as one of the arena in use, return 0 if out of memory */
+static int arena_add(unsigned b)
 {
-	for (; is_cons(x); x = get_tail(x)) {
-		s = match_prefix(s, get_head(x));
-		if (!s)
+	unsigned *v, n;
+	if (arena->nblocks == arena->max) {
+		n = arena->max ? 2 * arena->max : 16;
+		if (!(v = realloc(arena->blocks, n * sizeof(*v))))
 			return 0;
+		arena->blocks = v;
+		arena->max = n;
 	}
-	s = match_prefix(s, x);
-	return s && !*s;
+	arena->blocks[arena->nblocks++] = b;
+	arena_blocks++;
+	return 1;
 }
 
-/* Iterate over consed strings:
-   for (s=str_begin(x, &x, NULL); s; s=str_next(s, &x, NULL)) ... */
-
-static char *str_begin(T x, T *p, T *q)
+/* free the blocks of the arena from the ith on */
+static void arena_cut(struct listdata_arena *a, unsigned i)
 {
-	char *s;
-	*p = x;
-	if (is_cons(x))
-		x = get_head(x);
-	if (q)
-		*q = x;
-	if (tagged(x, TAG_STR)) {
-		if (*(s = load_str(x)))
-			return s;
-		if (is_cons(*p))
-			return str_begin(get_tail(*p), p, q);
+	unsigned b;
+	while (a->nblocks > i) {
+		b = a->blocks[--a->nblocks];
+		STAT(stats.pool[pool_of(mstack.mblocks[b].tag)].blocks--);
+		STAT(stats.blocks_freed++);
+		mstack_clear(&mstack, b);
+		arena_blocks--;
 	}
-	return NULL;
+	mstack_trim(&mstack);
 }
 
-static char *str_next(char *s, T *p, T *q)
+/* The blocks of an arena are recorded in the order of allocation, so
+   the ones after the last block holding a top of mark p are newer. */
+static void arena_release(const T *p)
 {
-	if (s[1]) {
-		if (q)
-			(*q)++;
-		return s+1;
+	unsigned i = arena->nblocks, b;
+	for (; i; i--) {
+		b = arena->blocks[i-1];
+		if (b == BASE(p[0]) || b == BASE(p[1]) || b == BASE(p[2]))
+			break;
 	}
-	if (is_cons(*p))
-		return str_begin(get_tail(*p), p, q);
-	return NULL;
+	arena_cut(arena, i);
 }
 
-int equals(T x, T y)
+struct listdata_arena *listdata_arena_use(struct listdata_arena *a)
 {
-	char *s, *t;
-	if (x == y)
-		return 1;
-	if (tagged(x, TAG_STR))
-		return equals_str(y, load_str(x));
-	if (tagged(y, TAG_STR))
-		return equals_str(x, load_str(y));
-	if (tagged(x, TAG_INT))
-		return load_int(x) == load_int(y);
-	if (is_cons(x) && is_cons(y)) {
-		if (equals(get_head(x), get_head(y)))
-			return equals(get_tail(x), get_tail(y));
-		if (tagged(get_head(x), TAG_STR)) {
-			s = str_begin(x, &x, NULL);
-			t = str_begin(y, &y, NULL);
-			while (s && t) {
-				if (*s != *t)
-					return 0;
-				s = str_next(s, &x, NULL);
-				t = str_next(t, &y, NULL);
-			}
-			return !s && !t && tagged(x, TAG_STR) &&
-					   tagged(y, TAG_STR);
-		}
-	}
-	return 0;
+	static LOCAL T heap_top[LISTDATA_POOLS];	/* of the default heap */
+	struct listdata_arena *old = arena;
+	T *t = old ? old->top : heap_top;
+
+	init();
+	t[0] = str_top;
+	t[1] = int_top;
+	t[2] = cons_top;
+	t = a ? a->top : heap_top;
+	str_top  = t[0];
+	int_top  = t[1];
+	cons_top = t[2];
+	set_pointers();
+	arena = a;
+	heap_id = a ? a->id : 0;
+	return old;
 }
 
-T *dict_get(T x, T key)
+void listdata_arena_free(struct listdata_arena *a)
 {
-	T *p = nth_elem(x, 1);
-	return !p || equals(key, get_head(x)) ? p : dict_get(p[1], key);
+	if (arena == a)
+		listdata_arena_use(NULL);
+	arena_cut(a, 0);
+	free(a->blocks);
+	a->blocks = NULL;
+	a->max = 0;
+	a->top[0] = a->top[1] = a->top[2] = 0;
+	if (share_count)
+		share_purge(a->top);
 }
 
-T dict_set(T x, T key, T val)
+unsigned long listdata_arena_bytes(const struct listdata_arena *a)
 {
-	return cons(key, cons(val, x));
+	unsigned long n = 0;
+	unsigned i;
+	for (i=0; i<a->nblocks; i++)
+		n += mstack.mblocks[a->blocks[i]].size;
+	return n;
 }
 
-int copy_str(T x, char *buf, int n)
+/* Freezing */
+
+int listdata_freeze(void)
 {
-	char *s = str_begin(x, &x, NULL);
-	int i;
-	for (i=0; i+1 < n && s; i++) {
-		buf[i] = *s;
-		s = str_next(s, &x, NULL);
+	unsigned n;
+#ifdef LISTDATA_STATS
+	unsigned b;
+#endif
+	init();
+	if (frozen || arena_blocks)
+		return 0;
+	n = mstack.top + 1;
+	if (!(frozen = malloc(n * sizeof(*frozen))))
+		return 0;
+#ifdef LISTDATA_STATS
+	update_max();
+	for (b=1; b<=mstack.top; b++)
+		if (mstack.mblocks[b].freeable)
+			stats.pool[pool_of(mstack.mblocks[b].tag)].blocks--;
+#endif
+	mstack_keep(&mstack);
+	memcpy(frozen, mstack.mblocks, n * sizeof(*frozen));
+	frozen_top = mstack.top;
+	str_top = int_top = cons_top = 0;
+	set_pointers();
+	return 1;
+}
+
+static int is_frozen(T x)
+{
+	switch (x & TAG_MASK) {
+	case TAGGED(TAG_CONS):
+	case TAGGED(TAG_STR):
+	case TAGGED(TAG_INT):
+	case TAGGED(TAG_ROPE):
+		return BASE(x) <= frozen_top;
+	default:
+		return 0;
 	}
-	buf[i] = '\0';
-	return i;
 }
 
-T split(T x, int sep)
+int listdata_frozen(T x)
 {
-	T y, z, *p;
-	char *s = str_begin(x, &y, &z);
-	for (; s; s = str_next(s, &y, &z)) {
-		if (*s == sep) {
-			*s = '\0';
-			z++;
-			if (is_cons(y)) {
-				z = cons(z, get_tail(y));
-				p = &x;
-				while (*p != y)
-					p = load_cons(*p)+1;
-				*p = get_head(y);
-			}
-			return cons(x, split(z, sep));
-		}
+	return is_frozen(x);
+}
+
+int listdata_private(T x)
+{
+	switch (x & TAG_MASK) {
+	case TAGGED(TAG_CONS):
+	case TAGGED(TAG_STR):
+	case TAGGED(TAG_INT):
+	case TAGGED(TAG_ROPE):
+		return !is_frozen(x);
+	default:
+		return 0;
 	}
-	return cons_nil(x);
 }
 
-T concat(T x, T y)
+/* x is or has a frozen cons or fragment, so it must not be modified */
+static int has_frozen(T x)
 {
-	if (is_cons(x)) {
-		y = concat(get_tail(x), y);
-		x = get_head(x);
+	if (!frozen_top)
+		return 0;
+	for (; is_cons(x); x = get_tail(x)) {
+		if (is_frozen(x) || is_frozen(get_head(x)))
+			return 1;
+	}
+	return is_frozen(x);
+}
+
+static T alloc_cons(T head, T tail)
+{
+	unsigned b;
+	if (cons_p && OFFSET(cons_top) < OFFSET_MAX) {
+		cons_top++;
+		cons_p++;
+	} else {
+		b = new_block(TAG_CONS, OFFSET_NUM * sizeof(cons_cell));
+		if (!b)
+			return 0;
+		cons_top = tag_base(TAG_CONS, b);
+		cons_p = mstack.mblocks[b].mem;
 	}
-	return cons(x, y);
+	(*cons_p)[0] = head;
+	(*cons_p)[1] = tail;
+	STAT(stats.pool[LISTDATA_POOL_CONS].objects++);
+	return cons_top;
+}
+
+/* n (1 to OFFSET_NUM) adjacent uninitialized conses,
+   start a new block unless they fit */
+static T alloc_conses(unsigned n)
+{
+	unsigned b;
+	if (cons_p && OFFSET(cons_top) + n <= OFFSET_MAX) {
+		cons_top += n;
+		cons_p += n;
+	} else {
+		b = new_block(TAG_CONS, OFFSET_NUM * sizeof(cons_cell));
+		if (!b)
+			return 0;
+		cons_top = tag_base(TAG_CONS, b) + n - 1;
+		cons_p = (cons_cell *) mstack.mblocks[b].mem + n - 1;
+	}
+	STAT(stats.pool[LISTDATA_POOL_CONS].objects += n);
+	return cons_top - (n - 1);
+}
+
+/* store as much of *s as fits in the block,
+   start a new block unless n bytes fit */
+static T push_str(const char **s, unsigned n)
+{
+	unsigned b;
+	T str;
+	if (str_p && OFFSET(str_top)+n < OFFSET_MAX) {
+		str_top++;
+		str_p++;
+	} else {
+		b = new_block(TAG_STR, OFFSET_NUM);
+		if (!b)
+			return 0;
+		str_top = tag_base(TAG_STR, b);
+		str_p = mstack.mblocks[b].mem;
+	}
+	str = str_top;
+	while (OFFSET(str_top) < OFFSET_MAX && (*str_p = **s)) {
+		str_top++;
+		str_p++;
+		(*s)++;
+	}
+	*str_p = '\0';
+	STAT(stats.pool[LISTDATA_POOL_STR].objects++);
+	return str;
+}
+
+T store_str(const char *s)
+{
+	T str, x, *p = &x, *slot;
+	size_t n;
+	if (sharing && (n = strlen(s)) < OFFSET_MAX) {
+		slot = share_find(hash_str(s), TAG_STR, 0, 0, s);
+		if (slot && *slot)
+			return *slot;
+		str = push_str(&s, n+1);
+		if (slot && str)
+			share_add(slot, str);
+		return str;
+	}
+	while ((str = push_str(&s, 1)) && *s) {
+		if (!(*p = alloc_cons(str, 0)))
+			return 0;
+		p = load_cons(*p) + 1;
+	}
+	*p = str;
+	return str ? x : 0;
+}
+
+static T push_int(int x)
+{
+	unsigned b;
+	if (int_p && OFFSET(int_top) < OFFSET_MAX) {
+		int_top++;
+		int_p++;
+	} else {
+		b = new_block(TAG_INT, OFFSET_NUM * sizeof(int));
+		if (!b)
+			return 0;
+		int_top = tag_base(TAG_INT, b);
+		int_p = mstack.mblocks[b].mem;
+	}
+	*int_p = x;
+	STAT(stats.pool[LISTDATA_POOL_INT].objects++);
+	return int_top;
+}
+
+static T push_shared_int(int x)
+{
+	T *slot = share_find(mix(0, x), TAG_INT, x, 0, NULL), i;
+	if (slot && *slot)
+		return *slot;
+	i = push_int(x);
+	if (slot && i)
+		share_add(slot, i);
+	return i;
+}
+
+T store_int(int x)
+{
+	if (sharing && abs(x) > INUM_MAX)
+		return push_shared_int(x);
+	return abs(x) > INUM_MAX ? push_int(x) :
+		TAGGED(TAG_INUM) | (((T) x << TAG_BITS) & BASE_MASK)
+				 | ((T) x & (OFFSET_MAX | MSB));
+}
+
+/* the bits of an immediate value */
+static T payload(T x)
+{
+	return ((x & BASE_MASK) >> TAG_BITS) | OFFSET(x);
+}
+
+static int extract_inum(T x)
+{
+	return (x & MSB) ? (int) (payload(x ^ MSB) - (INUM_MAX+1)) :
+		(int) payload(x);
+}
+
+T cons(T head, T tail)
+{
+	T *slot, x;
+	if (!sharing)
+		return alloc_cons(head, tail);
+	slot = share_find(mix(mix(0, head), tail), TAG_CONS, head, tail, NULL);
+	if (slot && *slot)
+		return *slot;
+	x = alloc_cons(head, tail);
+	if (slot && x)
+		share_add(slot, x);
+	return x;
+}
+
+T cons_nil(T head)
+{
+	return cons(head, EMPTY_LIST);
+}
+
+enum typ type_of(T x)
+{
+	switch (x & TAG_MASK) {
+	case TAGGED(TAG_CONS):
+		return TYP_CONS;
+	case TAGGED(TAG_STR):
+		return TYP_STR;
+	case TAGGED(TAG_INT):
+	case TAGGED(TAG_INUM):
+		return TYP_INT;
+	case TAGGED(TAG_ROPE):
+		return TYP_ROPE;
+	case TAGGED(TAG_SHORT):
+		return TYP_SHORT;
+	case TAGGED(TAG_NUM):
+		return TYP_NUM;
+	default:
+		return TYP_ATOM;
+	}
+}
+
+static int tagged(T x, enum ttag tag)
+{
+	return (x & TAG_MASK) == TAGGED(tag);
+}
+
+/* Short strings: characters of 7 bits from the low end of the payload,
+   up to the first 0 */
+
+#define SHORT_BITS 7
+
+T store_short(const char *s)
+{
+	T v = 0;
+	unsigned n;
+	for (n=0; s[n]; n++) {
+		if (n == LISTDATA_SHORT_MAX || s[n] & 0x80)
+			return store_str(s);
+		v |= (T) s[n] << n * SHORT_BITS;
+	}
+	return TAGGED(TAG_SHORT) | ((v << TAG_BITS) & BASE_MASK)
+				 | (v & OFFSET_MAX);
+}
+
+/* Packed numbers: the exponent in the low NUM_EXP_BITS of the payload
+   and the mantissa above it, both two's complement */
+
+#define NUM_EXP_BITS (sizeof(T) == 8 ? 11 : 8)
+#define NUM_MANT_BITS (sizeof(T) * CHAR_BIT - TAG_BITS - NUM_EXP_BITS)
+#define NUM_EXP_MASK (((T) 1 << NUM_EXP_BITS) - 1)
+
+static void unpack_num(T x, int *mant, int *exp)
+{
+	T v = payload(x);
+	T m = v >> NUM_EXP_BITS, e = v & NUM_EXP_MASK;
+	*mant = m >> (NUM_MANT_BITS - 1) ? (int) (m - ((T) 1 << NUM_MANT_BITS))
+					  : (int) m;
+	*exp = e >> (NUM_EXP_BITS - 1) ? (int) e - (1 << NUM_EXP_BITS)
+				       : (int) e;
+}
+
+T store_num(int mant, int exp)
+{
+	T v = ((T) mant << NUM_EXP_BITS) | ((T) exp & NUM_EXP_MASK);
+	T x = TAGGED(TAG_NUM) | ((v << TAG_BITS) & BASE_MASK)
+			      | (v & OFFSET_MAX);
+	int m, e;
+	unpack_num(x, &m, &e);
+	return m == mant && e == exp ? x : 0;
+}
+
+int load_num(T x, int *mant, int *exp)
+{
+	if (!tagged(x, TAG_NUM))
+		return 0;
+	unpack_num(x, mant, exp);
+	return 1;
+}
+
+/* mant * 10^exp rounded toward zero, clamped to int */
+static int truncate_num(T x)
+{
+	int m, e;
+	unpack_num(x, &m, &e);
+	for (; e < 0 && m; e++)
+		m /= 10;
+	for (; e > 0 && m; e--) {
+		if (m > INT_MAX / 10 || m < INT_MIN / 10)
+			return m < 0 ? INT_MIN : INT_MAX;
+		m *= 10;
+	}
+	return m;
+}
+
+/* unpack short string x into buf (of LISTDATA_SHORT_MAX + 1 bytes),
+   return its length */
+static unsigned unpack_short(T x, char *buf)
+{
+	T v = payload(x);
+	unsigned n = 0;
+	for (; v; v >>= SHORT_BITS)
+		buf[n++] = v & 0x7F;
+	buf[n] = '\0';
+	return n;
+}
+
+/* x as a heap string if it is a short one */
+static T unshort(T x)
+{
+	char buf[LISTDATA_SHORT_MAX + 1];
+	if (!tagged(x, TAG_SHORT))
+		return x;
+	unpack_short(x, buf);
+	return store_str(buf);
+}
+
+char *load_str(T str)
+{
+	return (char *) getmem(str) + OFFSET(str);
+}
+
+int load_int(T x)
+{
+	switch (x & TAG_MASK) {
+	case TAGGED(TAG_INT):
+		return ((int *) getmem(x))[OFFSET(x)];
+	case TAGGED(TAG_INUM):
+		return extract_inum(x);
+	case TAGGED(TAG_NUM):
+		return truncate_num(x);
+	default:
+		return 0;
+	}
+}
+
+T *load_cons(T cons)
+{
+	return &((cons_cell *) getmem(cons))[OFFSET(cons)][0];
+}
+
+T get_head(T cons) { return load_cons(cons)[0]; }
+T get_tail(T cons) { return load_cons(cons)[1]; }
+
+int is_cons(T x)
+{
+	return tagged(x, TAG_CONS);
+}
+
+T nth_tail(T x, int n)
+{
+	for (; n>0 && is_cons(x); n--)
+		x = get_tail(x);
+	return !n ? x : 0;
+}
+
+T *nth_elem(T x, int n)
+{
+	x = nth_tail(x, n);
+	return is_cons(x) ? load_cons(x) : NULL;
+}
+
+T *first (T x) { return nth_elem(x, 0); }
+T *second(T x) { return nth_elem(x, 1); }
+T *third (T x) { return nth_elem(x, 2); }
+
+T last_tail(T x, int n)
+{
+	T y = nth_tail(x, n);
+	for (; is_cons(y); y = get_tail(y))
+		x = get_tail(x);
+	return x;
+}
+
+T pop(T *p)
+{
+	T elem = 0;
+	if (is_cons(*p)) {
+		elem = get_head(*p);
+		*p = get_tail(*p);
+	}
+	return elem;
+}
+
+T reverse_list(T list)
+{
+	T tail = EMPTY_LIST,
+	  next, *p;
+	if (sharing || has_frozen(list)) {
+		for (; is_cons(list); list = get_tail(list))
+			tail = cons(get_head(list), tail);
+		return tail;
+	}
+	while (is_cons(list)) {
+		p = load_cons(list);
+		next = p[1];
+		p[1] = tail;
+		tail = list;
+		list = next;
+	}
+	return tail;
+}
+
+int list_mutable(T x)
+{
+	return !sharing && !has_frozen(x);
+}
+
+/* List builder */
+
+void list_begin(struct listdata_builder *b)
+{
+	b->list = 0;
+	b->tail = NULL;
+	b->left = 0;
+	b->shared = sharing;
+}
+
+int list_reserve(struct listdata_builder *b, unsigned n)
+{
+	n = n < OFFSET_NUM ? n : OFFSET_NUM;
+	if (b->shared || !n)
+		return 1;
+	if (!(b->next = alloc_conses(n)))
+		return 0;
+	b->left = n;
+	return 1;
+}
+
+int list_append(struct listdata_builder *b, T x)
+{
+	T c, *p;
+	if (b->shared) {
+		/* reversed, see list_finish */
+		c = alloc_cons(x, b->list);
+		b->list = c ? c : b->list;
+		return c != 0;
+	}
+	if (b->left) {
+		c = b->next++;
+		b->left--;
+	} else if (!(c = alloc_cons(x, 0)))
+		return 0;
+	p = load_cons(c);
+	p[0] = x;
+	if (b->tail)
+		*b->tail = c;
+	else
+		b->list = c;
+	b->tail = p + 1;
+	return 1;
+}
+
+T list_finish(struct listdata_builder *b, T end)
+{
+	unsigned n;
+	T x = b->list;
+	if (b->shared) {
+		for (; x && end; x = get_tail(x))
+			end = cons(get_head(x), end);
+		return end;
+	}
+	/* give back what is still on top, but never a whole block */
+	if (b->left && b->next + b->left - 1 == cons_top) {
+		n = b->left - (OFFSET(b->next) ? 0 : 1);
+		cons_top -= n;
+		cons_p -= n;
+		STAT(stats.pool[LISTDATA_POOL_CONS].objects -= n);
+	}
+	b->left = 0;
+	if (!b->tail)
+		return end;
+	*b->tail = end;
+	return x;
+}
+
+T list_from_array(const T *v, unsigned n, T end)
+{
+	struct listdata_builder b;
+	unsigned i;
+	if (sharing) {
+		while (end && n)
+			end = cons(v[--n], end);
+		return end;
+	}
+	list_begin(&b);
+	for (i=0; i<n; i++) {
+		if (!b.left && !list_reserve(&b, n - i))
+			return 0;
+		list_append(&b, v[i]);
+	}
+	return list_finish(&b, end);
+}
+
+/* Bulk traversal. Conses allocated one after another (as by the list
+   builder) are adjacent in their block, and such a run is walked as an
+   array, prefetching ahead, instead of decoding each tail. */
+
+#define PREFETCH_AHEAD 16	/* conses, two cache lines */
+
+#ifdef __GNUC__
+#define prefetch(p) __builtin_prefetch(p)
+#else
+#define prefetch(p)
+#endif
+
+/* the run of adjacent conses from cons x, set *n to its length and
+   *next to the tail of its last cons */
+static cons_cell *cons_run(T x, unsigned *n, T *next)
+{
+	cons_cell *c = (cons_cell *) load_cons(x);
+	unsigned i, max = OFFSET_NUM - OFFSET(x);
+	for (i=1; i < max && c[i-1][1] == x + i; i++) {
+		if (!(i % PREFETCH_AHEAD))
+			prefetch(c + i + PREFETCH_AHEAD);
+	}
+	*n = i;
+	*next = c[i-1][1];
+	return c;
+}
+
+int list_foreach(T x, int (*f)(T, void *), void *arg)
+{
+	cons_cell *c;
+	unsigned i, n;
+	int r;
+	while (is_cons(x)) {
+		c = cons_run(x, &n, &x);
+		for (i=0; i<n; i++) {
+			if ((r = f(c[i][0], arg)))
+				return r;
+		}
+	}
+	return 0;
+}
+
+unsigned list_to_array(T x, T *buf, unsigned max)
+{
+	cons_cell *c;
+	unsigned i, n, k = 0;
+	while (is_cons(x) && k < max) {
+		c = cons_run(x, &n, &x);
+		if (n > max - k) {
+			n = max - k;
+			x = c[n-1][1];
+		}
+		for (i=0; i<n; i++)
+			buf[k++] = c[i][0];
+	}
+	return k;
+}
+
+unsigned long list_length(T x)
+{
+	unsigned long k = 0;
+	unsigned n;
+	while (is_cons(x)) {
+		cons_run(x, &n, &x);
+		k += n;
+	}
+	return k;
+}
+
+static int is_char(T x)
+{
+	return tagged(x, TAG_INT) || tagged(x, TAG_INUM);
+}
+
+/* string or short string */
+static int is_frag(T x)
+{
+	return tagged(x, TAG_STR) || tagged(x, TAG_SHORT);
+}
+
+/* take the next piece of consed string *p: n characters at *s (in buf
+   for a short string), or one character *c above U+00FF with *s set to
+   NULL. return 1 if more follow, 2 if it is the last, 0 if not a
+   string */
+static int next_frag(T *p, const char **s, size_t *n, int *c, char *buf)
+{
+	T x = *p;
+	int more = is_cons(x);
+	if (more) {
+		*p = get_tail(x);
+		x = get_head(x);
+		if (is_char(x)) {
+			*s = NULL;
+			*n = 1;
+			*c = load_int(x);
+			return 1;
+		}
+	}
+	if (tagged(x, TAG_SHORT)) {
+		*n = unpack_short(x, buf);
+		*s = buf;
+	} else if (tagged(x, TAG_STR)) {
+		*s = load_str(x);
+		*n = strlen(*s);
+	} else
+		return 0;
+	return more ? 1 : 2;
+}
+
+/* A rope is a rope handle to a cons (left . b), b is (right . c) and
+   c is (length . depth), allocated together. */
+
+#define ROPE_BITS TAGGED(TAG_ROPE ^ TAG_CONS)
+
+static int is_rope(T x)
+{
+	return tagged(x, TAG_ROPE);
+}
+
+static T rope_left(T x)  { return get_head(x); }
+static T rope_right(T x) { return get_head(get_tail(x)); }
+
+static unsigned long rope_length(T x)
+{
+	return (unsigned) load_int(get_head(nth_tail(x ^ ROPE_BITS, 2)));
+}
+
+static int rope_depth(T x)
+{
+	return is_rope(x) ? load_int(get_tail(nth_tail(x ^ ROPE_BITS, 2))) : 0;
+}
+
+void chunk_begin(struct listdata_chunks *c, T x)
+{
+	c->p = 0;
+	c->n = 1;
+	c->stack[0] = x;
+}
+
+int chunk_next(struct listdata_chunks *c, const char **s, unsigned long *n,
+	       int *ch)
+{
+	size_t k = 0;
+	T x;
+	int r;
+	while (!c->p) {
+		if (!c->n)
+			return 0;
+		for (x = c->stack[--c->n]; is_rope(x); x = rope_left(x))
+			c->stack[c->n++] = rope_right(x);
+		c->p = x;
+	}
+	r = next_frag(&c->p, s, &k, ch, c->buf);
+	if (r != 1)
+		c->p = 0;
+	*n = k;
+	return r ? 1 : -1;
+}
+
+/* compare strings a fragment at a time */
+static int equals_chars(T x, T y)
+{
+	struct listdata_chunks a, b;
+	const char *s = NULL, *t = NULL;
+	unsigned long m = 0, n = 0, k;
+	int ra = 1, rb = 1, c = 0, d = 0;
+	chunk_begin(&a, x);
+	chunk_begin(&b, y);
+	for (;;) {
+		while (!m && ra > 0) {
+			if ((ra = chunk_next(&a, &s, &m, &c)) < 0)
+				return 0;
+		}
+		while (!n && rb > 0) {
+			if ((rb = chunk_next(&b, &t, &n, &d)) < 0)
+				return 0;
+		}
+		if (!m || !n)
+			return !m && !n;
+		if (!s || !t) {
+			if (s || t || c != d)
+				return 0;
+			m = n = 0;
+			continue;
+		}
+		k = m < n ? m : n;
+		if (memcmp(s, t, k))
+			return 0;
+		s += k;
+		t += k;
+		m -= k;
+		n -= k;
+	}
+}
+
+int equals(T x, T y)
+{
+	char buf[LISTDATA_SHORT_MAX + 1];
+	T z;
+	for (; is_cons(x) && is_cons(y); x = get_tail(x), y = get_tail(y)) {
+		if (x == y)
+			return 1;
+		if (!equals(get_head(x), get_head(y)))
+			return equals_chars(x, y);
+	}
+	if (x == y)
+		return 1;
+	if (tagged(y, TAG_SHORT)) {
+		z = x;
+		x = y;
+		y = z;
+	}
+	if (tagged(x, TAG_SHORT)) {
+		if (tagged(y, TAG_SHORT))
+			return 0;
+		unpack_short(x, buf);
+		return equals_str(y, buf);
+	}
+	if (tagged(x, TAG_STR) && tagged(y, TAG_STR))
+		return !strcmp(load_str(x), load_str(y));
+	if (is_frag(x) || is_frag(y) || is_rope(x) || is_rope(y))
+		return equals_chars(x, y);
+	if (tagged(x, TAG_INT))
+		return load_int(x) == load_int(y);
+	return 0;
+}
+
+int equals_str(T x, const char *s)
+{
+	struct listdata_chunks it;
+	const char *t;
+	unsigned long n;
+	int c, r;
+	if (tagged(x, TAG_STR))
+		return !strcmp(load_str(x), s);
+	if (tagged(x, TAG_SHORT)) {
+		unpack_short(x, it.buf);
+		return !strcmp(it.buf, s);
+	}
+	chunk_begin(&it, x);
+	while ((r = chunk_next(&it, &t, &n, &c)) > 0) {
+		if (!t || strncmp(s, t, n))
+			return 0;
+		s += n;
+	}
+	return !r && !*s;
+}
+
+/* consed string or rope x, which is known to be a string.
+   A character above U+00FF is hashed as a NUL and its code. */
+static unsigned long hash_consed(T x)
+{
+	struct chars_hash h = {TYP_STR};
+	struct listdata_chunks it;
+	const char *s = NULL;
+	unsigned long n = 0;
+	int c = 0;
+	chunk_begin(&it, x);
+	while (chunk_next(&it, &s, &n, &c) > 0) {
+		if (s)
+			hash_chars(&h, s, n);
+		else {
+			hash_chars(&h, "", 1);
+			hash_chars(&h, (const char *) &c, sizeof(c));
+		}
+	}
+	return hash_end(&h);
+}
+
+unsigned long listdata_hash(T x)
+{
+	unsigned long h = TYP_CONS;
+	char buf[LISTDATA_SHORT_MAX + 1];
+	T y, str = x;
+	switch (x & TAG_MASK) {
+	case TAGGED(TAG_STR):
+		return hash_str(load_str(x));
+	case TAGGED(TAG_SHORT):
+		unpack_short(x, buf);
+		return hash_str(buf);
+	case TAGGED(TAG_INT):
+	case TAGGED(TAG_INUM):
+		return mix(TYP_INT, load_int(x));
+	case TAGGED(TAG_CONS):
+		break;
+	case TAGGED(TAG_ROPE):
+		return hash_consed(x);
+	case TAGGED(TAG_NUM):
+		return mix(TYP_NUM, x);
+	default:
+		return mix(TYP_ATOM, x);
+	}
+	/* a tail of only string fragments and characters is hashed as
+	   one string, as equals compares it by characters */
+	for (y = x; is_cons(y); y = get_tail(y)) {
+		if (!is_frag(get_head(y)) && !is_char(get_head(y)))
+			str = get_tail(y);
+	}
+	if (!is_frag(y))
+		str = 0;
+	else if (str == x)
+		return hash_consed(x);
+	for (; is_cons(x) && x != str; x = get_tail(x))
+		h = mix(h, listdata_hash(get_head(x)));
+	return mix(h, x == str ? hash_consed(x) : listdata_hash(x));
+}
+
+T *dict_get(T x, T key)
+{
+	T *p;
+	while ((p = nth_elem(x, 1)) && !equals(key, get_head(x)))
+		x = p[1];
+	return p;
+}
+
+T dict_set(T x, T key, T val)
+{
+	return cons(key, cons(val, x));
+}
+
+int copy_str(T x, char *buf, int n)
+{
+	struct listdata_chunks it;
+	const char *s;
+	unsigned long m;
+	int i = 0, c;
+	chunk_begin(&it, x);
+	while (i+1 < n && chunk_next(&it, &s, &m, &c) > 0 && s) {
+		if (m > (unsigned long) (n-1 - i))
+			m = n-1 - i;
+		memcpy(buf + i, s, m);
+		i += m;
+	}
+	buf[i] = '\0';
+	return i;
+}
+
+static int append_frags(struct listdata_builder *b, T y)
+{
+	for (; is_cons(y); y = get_tail(y)) {
+		if (!list_append(b, get_head(y)))
+			return 0;
+	}
+	return list_append(b, y);
+}
+
+/* store the buffered characters as fragments of a piece */
+static int put_frags(struct listdata_builder *b, char *buf, unsigned *i)
+{
+	T y;
+	buf[*i] = '\0';
+	*i = 0;
+	y = store_str(buf);
+	return y && append_frags(b, y);
+}
+
+/* finish a piece with the buffered characters and add it to out */
+static int end_piece(struct listdata_builder *out,
+		     struct listdata_builder *piece, char *buf, unsigned *i)
+{
+	T y;
+	buf[*i] = '\0';
+	*i = 0;
+	y = store_str(buf);
+	y = y ? list_finish(piece, y) : 0;
+	list_begin(piece);
+	return y && list_append(out, y);
+}
+
+/* split into new strings, searching each fragment with memchr */
+static T split_copy(T x, int sep)
+{
+	struct listdata_chunks it;
+	struct listdata_builder out, piece;
+	char buf[OFFSET_NUM];
+	const char *s, *q;
+	unsigned long n, k, m;
+	unsigned i = 0;
+	int c, r;
+	T y;
+
+	chunk_begin(&it, x);
+	list_begin(&out);
+	list_begin(&piece);
+	while ((r = chunk_next(&it, &s, &n, &c)) > 0) {
+		if (!s) {
+			if (i && !put_frags(&piece, buf, &i))
+				return 0;
+			if (!(y = store_int(c)) || !list_append(&piece, y))
+				return 0;
+			continue;
+		}
+		while (n) {
+			q = memchr(s, sep, n);
+			for (k = q ? q - s : n; k; k -= m) {
+				m = k < OFFSET_MAX - i ? k : OFFSET_MAX - i;
+				memcpy(buf + i, s, m);
+				i += m;
+				s += m;
+				n -= m;
+				if (i == OFFSET_MAX && !put_frags(&piece, buf, &i))
+					return 0;
+			}
+			if (q) {
+				s++;
+				n--;
+				if (!end_piece(&out, &piece, buf, &i))
+					return 0;
+			}
+		}
+	}
+	if (!end_piece(&out, &piece, buf, &i))
+		return 0;
+	return list_finish(&out, EMPTY_LIST);
+}
+
+/* Each separator found ends a piece at its fragment, which is cut in
+   place, and the cons holding the fragment starts the next piece. */
+T split(T x, int sep)
+{
+	struct listdata_builder b;
+	T *p = &x, y, frag;
+	char *s, *q;
+	if (sharing || is_rope(x) || tagged(x, TAG_SHORT) || has_frozen(x))
+		return split_copy(x, sep);
+	list_begin(&b);
+	for (;;) {
+		y = *p;
+		frag = is_cons(y) ? get_head(y) : y;
+		if (tagged(frag, TAG_STR)) {
+			s = load_str(frag);
+			while (sep && (q = strchr(s, sep))) {
+				*q = '\0';
+				*p = frag;
+				if (!list_append(&b, x))
+					return 0;
+				frag += q+1 - s;
+				s = q+1;
+				if (is_cons(y))
+					load_cons(y)[0] = frag;
+				x = is_cons(y) ? y : frag;
+				p = &x;
+			}
+		}
+		if (!is_cons(y))
+			break;
+		p = load_cons(y) + 1;
+	}
+	return list_append(&b, x) ? list_finish(&b, EMPTY_LIST) : 0;
+}
+
+/* build from the end so that the cells can be shared */
+static T concat_shared(T x, T y)
+{
+	T r = 0;
+	for (; is_cons(x); x = get_tail(x)) {
+		if (!(r = alloc_cons(get_head(x), r)))
+			return 0;
+	}
+	for (y = cons(x, y); y && r; r = get_tail(r))
+		y = cons(get_head(r), y);
+	return y;
+}
+
+T concat(T x, T y)
+{
+	T z, *p = &z;
+	if (!(x = unshort(x)) || !(y = unshort(y)))
+		return 0;
+	if (sharing)
+		return concat_shared(x, y);
+	for (; is_cons(x); x = get_tail(x)) {
+		if (!(*p = alloc_cons(get_head(x), 0)))
+			return 0;
+		p = load_cons(*p) + 1;
+	}
+	*p = cons(x, y);
+	return *p ? z : 0;
+}
+
+/* Ropes */
+
+#define ROPE_DEPTH_MAX (LISTDATA_ROPE_DEPTH - 16)	/* then rebalance */
+#define ROPE_LEAF 64		/* shorter strings are joined by copying */
+
+unsigned long str_length(T x)
+{
+	struct listdata_chunks it;
+	const char *s;
+	unsigned long n, len = 0;
+	int c;
+	if (is_rope(x))
+		return rope_length(x);
+	if (tagged(x, TAG_STR))
+		return strlen(load_str(x));
+	chunk_begin(&it, x);
+	while (chunk_next(&it, &s, &n, &c) > 0)
+		len += n;
+	return len;
+}
+
+/* l and r, n characters (an int) in all */
+static T make_rope(T l, T r, unsigned long n)
+{
+	int d = MAX(rope_depth(l), rope_depth(r)) + 1;
+	T x, len = store_int(n), *c;
+	if (!len || !(x = alloc_conses(3)))
+		return 0;
+	c = load_cons(x);
+	c[0] = l;
+	c[1] = x + 1;
+	c[2] = r;
+	c[3] = x + 2;
+	c[4] = len;
+	c[5] = store_int(d);
+	return x ^ ROPE_BITS;
+}
+
+/* n bytes without NUL as a new string */
+static T store_chars(const char *s, unsigned long n)
+{
+	char buf[OFFSET_NUM];
+	T x = 0, y;
+	unsigned long k;
+	for (; n || !x; n -= k, s += k) {
+		k = n < OFFSET_MAX ? n : OFFSET_MAX;
+		memcpy(buf, s, k);
+		buf[k] = '\0';
+		y = store_str(buf);
+		x = x && y ? concat(x, y) : y;
+		if (!x)
+			return 0;
+	}
+	return x;
+}
+
+/* the parts of x in order, for rebalancing */
+static int rope_parts(T x, T **v, unsigned *n, unsigned *max)
+{
+	T *a;
+	for (; is_rope(x); x = rope_right(x)) {
+		if (!rope_parts(rope_left(x), v, n, max))
+			return 0;
+	}
+	if (*n == *max) {
+		*max = *max ? 2 * *max : 64;
+		if (!(a = realloc(*v, *max * sizeof(T))))
+			return 0;
+		*v = a;
+	}
+	(*v)[(*n)++] = x;
+	return 1;
+}
+
+static T rope_build(const T *v, unsigned n)
+{
+	T l, r;
+	if (n == 1)
+		return *v;
+	l = rope_build(v, n/2);
+	r = l ? rope_build(v + n/2, n - n/2) : 0;
+	return r ? make_rope(l, r, str_length(l) + str_length(r)) : 0;
+}
+
+static T rope_balance(T x)
+{
+	T *v = NULL;
+	unsigned n = 0, max = 0;
+	x = rope_parts(x, &v, &n, &max) ? rope_build(v, n) : 0;
+	free(v);
+	return x;
+}
+
+/* short strings x and y of m and n characters copied into one */
+static T join_short(T x, T y, unsigned long m, unsigned long n)
+{
+	char buf[ROPE_LEAF];
+	memcpy(buf, load_str(x), m);
+	memcpy(buf + m, load_str(y), n + 1);
+	return store_str(buf);
+}
+
+/* As in counting in binary, a part at the seam no deeper than the
+   other side is joined with it first: appending (or prepending) one
+   piece at a time makes a balanced rope. Short strings at the seam are
+   copied together instead. */
+T rope_concat(T x, T y)
+{
+	unsigned long m, n, k;
+	T r;
+	if (!(x = unshort(x)) || !(y = unshort(y)))
+		return 0;
+	m = str_length(x);
+	n = str_length(y);
+	if (!n)
+		return x;
+	if (!m)
+		return y;
+	if (m > INT_MAX || n > INT_MAX - m)	/* see make_rope */
+		return 0;
+	if (tagged(x, TAG_STR) && tagged(y, TAG_STR) && m + n < ROPE_LEAF)
+		return join_short(x, y, m, n);
+	if (rope_depth(x) >= rope_depth(y)) {
+		if (is_rope(x) && tagged(r = rope_right(x), TAG_STR) &&
+		    tagged(y, TAG_STR) && (k = strlen(load_str(r))) + n < ROPE_LEAF) {
+			if (!(y = join_short(r, y, k, n)))
+				return 0;
+			x = rope_left(x);
+			m -= k;
+			n += k;
+		}
+		while (is_rope(x) &&
+		       rope_depth(r = rope_right(x)) <= rope_depth(y)) {
+			k = str_length(r);
+			if (!(y = make_rope(r, y, k + n)))
+				return 0;
+			x = rope_left(x);
+			m -= k;
+			n += k;
+		}
+	} else {
+		if (is_rope(y) && tagged(r = rope_left(y), TAG_STR) &&
+		    tagged(x, TAG_STR) && (k = strlen(load_str(r))) + m < ROPE_LEAF) {
+			if (!(x = join_short(x, r, m, k)))
+				return 0;
+			y = rope_right(y);
+			m += k;
+			n -= k;
+		}
+		while (is_rope(y) &&
+		       rope_depth(r = rope_left(y)) <= rope_depth(x)) {
+			k = str_length(r);
+			if (!(x = make_rope(x, r, m + k)))
+				return 0;
+			y = rope_right(y);
+			m += k;
+			n -= k;
+		}
+	}
+	if (!(x = make_rope(x, y, m + n)))
+		return 0;
+	return rope_depth(x) > ROPE_DEPTH_MAX ? rope_balance(x) : x;
+}
+
+/* n characters of string x from start, sharing whole fragments. A
+   cut fragment is copied: a handle into the middle of a string would
+   be taken by listdata_gc for a string of its own. */
+static T str_sub(T x, unsigned long start, unsigned long n)
+{
+	struct listdata_builder b;
+	T p = x, y, last = 0;
+	unsigned long k;
+	char *s = NULL;
+	list_begin(&b);
+	while (n && p) {
+		y = is_cons(p) ? get_head(p) : p;
+		p = is_cons(p) ? get_tail(p) : 0;
+		if (tagged(y, TAG_STR))
+			k = strlen(s = load_str(y));
+		else if (is_char(y))
+			k = 1;
+		else
+			break;
+		if (start >= k) {
+			start -= k;
+			continue;
+		}
+		if (tagged(y, TAG_STR)) {
+			k -= start;
+			if (k > n)
+				k = n;
+			if ((start || s[k]) && !(y = store_chars(s + start, k)))
+				return 0;
+		}
+		start = 0;
+		n -= k;
+		if (last && !append_frags(&b, last))
+			return 0;
+		last = y;
+	}
+	if (last && is_char(last)) {
+		if (!list_append(&b, last))
+			return 0;
+		last = 0;
+	}
+	if (!last && !(last = store_str("")))
+		return 0;
+	return list_finish(&b, last);
+}
+
+static T rope_cut(T x, unsigned long start, unsigned long n)
+{
+	unsigned long m;
+	T l, r;
+	if (!is_rope(x))
+		return str_sub(x, start, n);
+	if (!start && n == rope_length(x))
+		return x;
+	l = rope_left(x);
+	m = str_length(l);
+	if (start + n <= m)
+		return rope_cut(l, start, n);
+	if (start >= m)
+		return rope_cut(rope_right(x), start - m, n);
+	l = rope_cut(l, start, m - start);
+	r = l ? rope_cut(rope_right(x), 0, n - (m - start)) : 0;
+	return r ? make_rope(l, r, n) : 0;
+}
+
+T rope_sub(T x, unsigned long start, unsigned long n)
+{
+	unsigned long len;
+	if (!(x = unshort(x)))
+		return 0;
+	len = str_length(x);
+	if (start > len)
+		start = len;
+	if (n > len - start)
+		n = len - start;
+	return rope_cut(x, start, n);
+}
+
+T rope_flatten(T x)
+{
+	struct listdata_builder b;
+	T stack[LISTDATA_ROPE_DEPTH], last = 0;
+	unsigned n = 1;
+	if (!is_rope(x))
+		return x;
+	list_begin(&b);
+	stack[0] = x;
+	while (n) {
+		for (x = stack[--n]; is_rope(x); x = rope_left(x))
+			stack[n++] = rope_right(x);
+		if (last && !append_frags(&b, last))
+			return 0;
+		last = x;
+	}
+	return list_finish(&b, last);
+}
+
+/* Garbage collection
+ *
+ * Objects allocated after a mark are marked from the roots, each pool
+ * is slid down over its own blocks in allocation order (so handles
+ * still increase with age) and references are rewritten through a
+ * table of new handles, found by the rank of an object among the live
+ * objects of its block.
+ */
+
+#define WORD_BITS (sizeof(unsigned long) * CHAR_BIT)
+#define GC_WORDS  (OFFSET_NUM / WORD_BITS)
+
+struct gc_block {
+	unsigned long live[GC_WORDS];	/* bit per offset */
+	unsigned first;			/* index in fwd */
+	unsigned short rank[GC_WORDS];	/* live before each word */
+};
+
+struct gc {
+	const T *from;			/* the mark */
+	unsigned b0;			/* first block in blocks */
+	struct gc_block *blocks;
+	T *fwd;				/* new handles */
+	T *stack;
+	unsigned n, max;		/* of stack */
+	T top[LISTDATA_POOLS];		/* new pool tops */
+};
+
+static LOCAL T **gc_roots;
+static LOCAL unsigned gc_nroots, gc_roots_max;
+static LOCAL unsigned long gc_threshold, gc_bytes;
+
+static const enum ttag pool_tag[LISTDATA_POOLS] = {
+	TAG_STR, TAG_INT, TAG_CONS
+};
+
+int listdata_root(T *r)
+{
+	T **a;
+	unsigned n;
+	if (gc_nroots == gc_roots_max) {
+		n = gc_roots_max ? 2 * gc_roots_max : 16;
+		if (!(a = realloc(gc_roots, n * sizeof(*a))))
+			return 0;
+		gc_roots = a;
+		gc_roots_max = n;
+	}
+	gc_roots[gc_nroots++] = r;
+	return 1;
+}
+
+void listdata_unroot(T *r)
+{
+	unsigned i = gc_nroots;
+	while (i--) {
+		if (gc_roots[i] == r) {
+			gc_roots[i] = gc_roots[--gc_nroots];
+			break;
+		}
+	}
+	if (!gc_nroots) {
+		free(gc_roots);
+		gc_roots = NULL;
+		gc_roots_max = 0;
+	}
+}
+
+static unsigned popcount(unsigned long w)
+{
+#ifdef __GNUC__
+	return __builtin_popcountl(w);
+#else
+	unsigned n = 0;
+	for (; w; w &= w - 1)
+		n++;
+	return n;
+#endif
+}
+
+/* pool of x if it was allocated after the mark, otherwise -1 */
+static int gc_pool(const struct gc *g, T x)
+{
+	int i;
+	if (is_rope(x))
+		x ^= ROPE_BITS;
+	switch (x & TAG_MASK) {
+	case TAGGED(TAG_STR):	i = LISTDATA_POOL_STR; break;
+	case TAGGED(TAG_INT):	i = LISTDATA_POOL_INT; break;
+	case TAGGED(TAG_CONS):	i = LISTDATA_POOL_CONS; break;
+	default:		return -1;
+	}
+	if (x <= g->from[i] || BASE(x) <= frozen_top ||
+	    (arena_blocks && HEAP_OF(mstack.mblocks[BASE(x)].tag)))
+		return -1;
+	return i;
+}
+
+static struct gc_block *gc_block(const struct gc *g, T x)
+{
+	return &g->blocks[BASE(x) - g->b0];
+}
+
+static int gc_live(const struct gc *g, T x)
+{
+	unsigned o = OFFSET(x);
+	return gc_block(g, x)->live[o / WORD_BITS] >> (o % WORD_BITS) & 1;
+}
+
+/* mark x if it is in the collected region, return 1 if it was not */
+static int gc_mark(struct gc *g, T x)
+{
+	unsigned o = OFFSET(x);
+	unsigned long *w;
+	if (gc_pool(g, x) < 0)
+		return 0;
+	w = &gc_block(g, x)->live[o / WORD_BITS];
+	if (*w >> (o % WORD_BITS) & 1)
+		return 0;
+	*w |= 1UL << (o % WORD_BITS);
+	return 1;
+}
+
+static int gc_push(struct gc *g, T x)
+{
+	T *a;
+	unsigned n;
+	if (g->n == g->max) {
+		n = g->max ? 2 * g->max : 256;
+		if (!(a = realloc(g->stack, n * sizeof(T))))
+			return 0;
+		g->stack = a;
+		g->max = n;
+	}
+	g->stack[g->n++] = x;
+	return 1;
+}
+
+static int gc_trace(struct gc *g)
+{
+	unsigned i;
+	T x, *c;
+	for (i=0; i<gc_nroots; i++) {
+		if (!gc_push(g, *gc_roots[i]))
+			return 0;
+	}
+	while (g->n) {
+		x = g->stack[--g->n];
+		while (gc_mark(g, x) && (is_cons(x) || is_rope(x))) {
+			c = load_cons(x);
+			if (!is_cons(c[0]) && !is_rope(c[0]))
+				gc_mark(g, c[0]);
+			else if (!gc_push(g, c[0]))
+				return 0;
+			x = c[1];
+		}
+	}
+	return 1;
+}
+
+static T gc_forward(const struct gc *g, T x)
+{
+	const struct gc_block *b;
+	unsigned i = OFFSET(x) / WORD_BITS, o = OFFSET(x) % WORD_BITS;
+	if (gc_pool(g, x) < 0)
+		return x;
+	b = gc_block(g, x);
+	return g->fwd[b->first + b->rank[i] +
+		      popcount(b->live[i] & ((1UL << o) - 1))] |
+	       (is_rope(x) ? ROPE_BITS : 0);
+}
+
+/* next live offset from o in block b, or OFFSET_NUM */
+static unsigned gc_next(const struct gc_block *b, unsigned o)
+{
+	unsigned long w;
+	while (o < OFFSET_NUM) {
+		w = b->live[o / WORD_BITS] >> (o % WORD_BITS);
+		if (w) {
+			while (!(w & 1)) {
+				w >>= 1;
+				o++;
+			}
+			return o;
+		}
+		o = (o / WORD_BITS + 1) * WORD_BITS;
+	}
+	return OFFSET_NUM;
+}
+
+/* next block of the pool after b, or 0 */
+static unsigned pool_next(int pool, unsigned b)
+{
+	while (++b <= mstack.top) {
+		if (mstack.mblocks[b].freeable &&
+		    mstack.mblocks[b].tag == pool_tag[pool])
+			return b;
+	}
+	return 0;
+}
+
+static unsigned obj_size(int pool, T x)
+{
+	return pool == LISTDATA_POOL_STR ? strlen(load_str(x)) + 1 : 1;
+}
+
+/* Walk the live objects of a pool in order. With move 0, assign their
+   new handles, otherwise move them there. */
+static void gc_slide(struct gc *g, int pool, int move)
+{
+	T from = g->from[pool], x, y;
+	unsigned sb, db, doff = 0, o, n, i, unit = pool_unit[pool];
+	struct gc_block *b;
+
+	sb = from ? BASE(from) : pool_next(pool, 0);
+	db = sb;
+	if (from)
+		doff = OFFSET(from) + 1;
+	if (!move)
+		g->top[pool] = from;
+	for (; sb; sb = pool_next(pool, sb)) {
+		b = &g->blocks[sb - g->b0];
+		i = b->first;
+		for (o = gc_next(b, 0); o < OFFSET_NUM; o = gc_next(b, o+1)) {
+			x = tag_base(pool_tag[pool], sb) | o;
+			n = obj_size(pool, x);
+			if (move) {
+				y = g->fwd[i++];
+				memmove((char *) getmem(y) + OFFSET(y) * unit,
+					(char *) getmem(x) + o * unit, n * unit);
+				continue;
+			}
+			if (doff + n > OFFSET_NUM) {
+				db = pool_next(pool, db);
+				doff = 0;
+			}
+			g->fwd[i++] = tag_base(pool_tag[pool], db) | doff;
+			g->top[pool] = g->fwd[i-1] + n - 1;
+			doff += n;
+		}
+	}
+}
+
+/* rewrite the live conses, the roots and the sharing table */
+static void gc_update(struct gc *g)
+{
+	struct gc_block *b;
+	unsigned sb, o, i;
+	T *c, x;
+
+	for (sb = pool_next(LISTDATA_POOL_CONS, g->b0 - 1); sb;
+	     sb = pool_next(LISTDATA_POOL_CONS, sb)) {
+		b = &g->blocks[sb - g->b0];
+		for (o = gc_next(b, 0); o < OFFSET_NUM; o = gc_next(b, o+1)) {
+			c = ((cons_cell *) mstack.mblocks[sb].mem)[o];
+			c[0] = gc_forward(g, c[0]);
+			c[1] = gc_forward(g, c[1]);
+		}
+	}
+	for (i=0; i<gc_nroots; i++)
+		*gc_roots[i] = gc_forward(g, *gc_roots[i]);
+	for (i=0; i<share_size; i++) {
+		x = share_tab[i];
+		if (!x || gc_pool(g, x) < 0)
+			continue;
+		if (gc_live(g, x))
+			share_tab[i] = gc_forward(g, x);
+		else {
+			share_tab[i] = 0;
+			share_count--;
+		}
+	}
+}
+
+/* free the blocks above the new pool tops */
+static void gc_free(struct gc *g)
+{
+	unsigned b, top = 0;
+	int i;
+	for (i=0; i<LISTDATA_POOLS; i++)
+		top = MAX(top, BASE(g->top[i]));
+	for (b = g->b0; b <= mstack.top; b++) {
+		if (!mstack.mblocks[b].freeable ||
+		    HEAP_OF(mstack.mblocks[b].tag))
+			continue;
+		i = pool_of(mstack.mblocks[b].tag);
+		if (b <= BASE(g->top[i]))
+			continue;
+		STAT(stats.pool[i].blocks--);
+		STAT(stats.blocks_freed++);
+		if (b < top || arena_blocks)
+			mstack_clear(&mstack, b);
+	}
+	if (arena_blocks)
+		mstack_trim(&mstack);
+	else if (top < mstack.top)
+		mstack_free(&mstack, top + 1);
+}
+
+int listdata_gc(const T *p)
+{
+	struct gc g;
+	T q[LISTDATA_POOLS];
+	unsigned i, n, b;
+	int k;
+#ifdef LISTDATA_STATS
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+#endif
+
+	init();
+	if (arena)
+		return 0;
+	memset(&g, 0, sizeof(g));
+	g.from = p = thaw_mark(p, q);
+	g.b0 = BASE(p[0]);
+	for (k=1; k<LISTDATA_POOLS; k++)
+		g.b0 = BASE(p[k]) < g.b0 ? BASE(p[k]) : g.b0;
+	if (g.b0 <= frozen_top)
+		g.b0 = frozen_top + 1;
+	if (g.b0 > mstack.top)
+		return 1;
+	n = mstack.top - g.b0 + 1;
+	if (!(g.blocks = calloc(n, sizeof(*g.blocks))) || !gc_trace(&g))
+		goto fail;
+
+	for (b=0, i=0; b<n; b++) {
+		g.blocks[b].first = i;
+		for (k=0; k<GC_WORDS; k++) {
+			g.blocks[b].rank[k] = i - g.blocks[b].first;
+			i += popcount(g.blocks[b].live[k]);
+		}
+	}
+	if (!(g.fwd = malloc((i ? i : 1) * sizeof(T))))
+		goto fail;
+
+	STAT(update_max());
+	for (k=0; k<LISTDATA_POOLS; k++)
+		gc_slide(&g, k, 0);
+	gc_update(&g);
+	for (k=0; k<LISTDATA_POOLS; k++)
+		gc_slide(&g, k, 1);
+	gc_free(&g);
+
+	str_top  = g.top[LISTDATA_POOL_STR];
+	int_top  = g.top[LISTDATA_POOL_INT];
+	cons_top = g.top[LISTDATA_POOL_CONS];
+	set_pointers();
+
+	if (share_tab)
+		share_rehash(share_size);
+	gc_bytes = mstack.bytes;
+	free(g.blocks);
+	free(g.fwd);
+	free(g.stack);
+#ifdef LISTDATA_STATS
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stats.collections++;
+	stats.gc_ns += (t1.tv_sec - t0.tv_sec) * 1000000000L +
+		       (t1.tv_nsec - t0.tv_nsec);
+#endif
+	return 1;
+fail:
+	free(g.blocks);
+	free(g.stack);
+	return 0;
+}
+
+void listdata_gc_threshold(unsigned long bytes)
+{
+	init();
+	gc_threshold = bytes;
+	gc_bytes = mstack.bytes;
+}
+
+int listdata_gc_poll(const T *p)
+{
+	init();
+	if (!gc_threshold || mstack.bytes < gc_bytes + gc_threshold)
+		return 1;
+	return listdata_gc(p);
+}
+
+void listdata_thread_exit(void)
+{
+	if (!mstack.mblocks)
+		return;
+	mstack_done(&mstack);
+	free(share_tab);
+	free(gc_roots);
+	share_tab = NULL;
+	gc_roots = NULL;
+	share_size = share_count = 0;
+	gc_nroots = gc_roots_max = 0;
+	str_top = int_top = cons_top = 0;
+	set_pointers();
+	arena = NULL;
+	heap_id = 0;
+	arena_blocks = 0;
 }
@@ -1,8 +1,13 @@
 #ifndef listdata_h
 #define listdata_h
 
-/* tagged pointer or immediate data */
+/* tagged pointer or immediate data, 64 bits with LISTDATA_HANDLE64
+   (more and longer short strings, all ints immediate) */
+#ifdef LISTDATA_HANDLE64
+typedef unsigned long long listdata_type;
+#else
 typedef unsigned listdata_type;
+#endif
 
 #define T listdata_type
 
@@ -14,10 +19,160 @@ void listdata_mark(T *p);
 /* release all memory allocated since the mark */
 void listdata_release(const T *p);
 
+/* Garbage collection. listdata_gc(p) frees the objects allocated
+   since mark p that cannot be reached from the registered roots, and
+   moves the rest down, updating the roots. p stays valid but later
+   marks do not, and no handle into the collected objects may be held
+   elsewhere (as in a json_parser in the middle of a value). Older
+   objects are not traced, so as for listdata_release they must not
+   refer to newer ones. Return 0 if out of memory (nothing is freed). */
+int  listdata_gc(const T *p);
+
+/* register the address of a handle as a root, return 0 if out of
+   memory. Unregister before the handle goes out of scope. */
+int  listdata_root(T *);
+void listdata_unroot(T *);
+
+/* listdata_gc_poll(p) collects if the heap has grown by more than the
+   threshold (0 to never collect) since the last collection. Call it
+   where only rooted handles are live. */
+void listdata_gc_threshold(unsigned long bytes);
+int  listdata_gc_poll(const T *p);
+
+/* Hash-consing: while on, cons, store_str and store_int return an
+   existing equal object when there is one, so equal data built in this
+   mode is stored once and compares equal by handle. Shared data is
+   immutable: reverse_list and split copy instead, and it must not be
+   modified through load_cons, nth_elem or dict_get. */
+void listdata_share(int on);
+
+/* limit the total size of allocated blocks (0 for no limit),
+   allocation fails with 0 when it would be exceeded */
+void listdata_limit(unsigned long bytes);
+
+/* Heap statistics. Block counts and sizes and the block allocation
+   counters are always available. Object counters, high-water marks of
+   the pools and mark/release counts and time are kept only when
+   compiled with LISTDATA_STATS, otherwise they are 0. */
+
+enum listdata_pool {
+	LISTDATA_POOL_STR,
+	LISTDATA_POOL_INT,
+	LISTDATA_POOL_CONS,
+	LISTDATA_POOLS
+};
+
+struct listdata_pool_stats {
+	unsigned long blocks,		/* in use */
+		      bytes,		/* size of the blocks */
+		      used;		/* bytes below the top of the pool */
+	unsigned long max_blocks,	/* high-water marks */
+		      max_used;
+	unsigned long objects;		/* allocated */
+};
+
+struct listdata_stats {
+	struct listdata_pool_stats pool[LISTDATA_POOLS];
+	unsigned long heap_bytes,	/* all blocks */
+		      max_heap_bytes,
+		      share_bytes;	/* hash-consing table */
+	unsigned long block_allocs,
+		      block_failures,	/* allocation failed or over limit */
+		      table_grows;	/* reallocations of the block table */
+	unsigned long marks, releases,
+		      release_ns,	/* time spent in listdata_release */
+		      blocks_freed;
+	unsigned long collections,	/* by listdata_gc */
+		      gc_ns;
+};
+
+/* fill in the statistics, return 1 if compiled with LISTDATA_STATS */
+int listdata_stats(struct listdata_stats *);
+
+/* restart counters and high-water marks from the current state */
+void listdata_stats_reset(void);
+
+/* Arenas: heaps of their own, each freed as a unit and in any order.
+   While an arena is in use everything is allocated in it, and mark and
+   release work within it as in the default heap, which is in use
+   otherwise. listdata_gc only collects the default heap and fails
+   while an arena is in use. Objects may refer to objects of another
+   heap only if that heap is freed later. With hash-consing on, objects
+   are shared only within a heap.
+
+	struct listdata_arena a, *old;
+	listdata_arena_init(&a, "request");
+	old = listdata_arena_use(&a);
+	...
+	listdata_arena_use(old);
+	...
+	listdata_arena_free(&a);
+*/
+struct listdata_arena {
+	const char *name;		/* not used by the library */
+	unsigned id;
+	T top[LISTDATA_POOLS];		/* pool tops while not in use */
+	unsigned *blocks, nblocks, max;	/* in order of allocation */
+};
+
+void listdata_arena_init(struct listdata_arena *, const char *name);
+
+/* allocate in arena a (NULL for the default heap), return the arena
+   that was in use */
+struct listdata_arena *listdata_arena_use(struct listdata_arena *a);
+
+/* free everything allocated in the arena, which stays initialized */
+void listdata_arena_free(struct listdata_arena *);
+
+/* size of the blocks of the arena */
+unsigned long listdata_arena_bytes(const struct listdata_arena *);
+
+/* Freezing: listdata_freeze turns everything allocated so far in the
+   default heap into the frozen heap, which is never released,
+   collected or modified (split and reverse_list copy frozen data).
+   Allocation goes on above it, and releasing a mark from before it
+   releases down to its end. Return 0 if there already is a frozen
+   heap, an arena holds blocks or out of memory.
+
+   Built with LISTDATA_THREADS, each thread has a private heap (with its
+   own arenas, marks, hash-consing table and roots), and the frozen heap
+   can be read from all threads without locking: reading it writes
+   nothing and its block table never moves. Freeze before starting the
+   threads that read it. A thread frees its heap with
+   listdata_thread_exit (after its arenas) before it ends. Objects of a
+   private heap must not be used in another thread. */
+int  listdata_freeze(void);
+
+/* 1 if x is in the frozen heap */
+int  listdata_frozen(T x);
+
+/* 1 if x is in the heap of the calling thread, neither frozen nor
+   held in its handle (a short string, small int, packed number or
+   atom), so that another thread cannot read it */
+int  listdata_private(T x);
+
+/* free the heap of the calling thread, other than the frozen heap */
+void listdata_thread_exit(void);
+
 /* Push data objects */
 
 T store_str(const char *);
 T store_int(int);
+
+/* Short strings: up to LISTDATA_SHORT_MAX characters from U+0001 to
+   U+007F packed into the handle. They take no memory, and two are
+   equal only if their handles are. store_short returns one if s fits,
+   otherwise it is store_str. */
+#define LISTDATA_SHORT_MAX (sizeof(listdata_type) == 8 ? 8 : 4)
+
+T store_short(const char *s);
+
+/* Packed numbers: a decimal mantissa and exponent packed into the
+   handle, with the value mant * 10^exp. store_num returns 0 if they do
+   not fit (mant from -2^20 and exp from -128, or -2^49 and -1024 with
+   64-bit handles). Two are equal only if their handles are. */
+T store_num(int mant, int exp);
+
 T cons(T head, T tail);
 T cons_nil(T head);		/* same as cons(x, EMPTY_LIST) */
 
@@ -31,12 +186,16 @@ enum typ {
 	TYP_CONS,
 	TYP_STR,
 	TYP_INT,
-	TYP_ATOM
+	TYP_ATOM,
+	TYP_ROPE,
+	TYP_SHORT,
+	TYP_NUM
 };
 enum typ type_of(T);
 
-char *load_str(T);
-int   load_int(T);
+char *load_str(T);		/* TYP_STR only, see copy_str */
+int   load_int(T);		/* a packed number rounded toward zero */
+int   load_num(T, int *mant, int *exp);	/* return 0 if not TYP_NUM */
 T    *load_cons(T);
 
 T get_head(T);		/* load_cons(x)[0] */
@@ -58,27 +217,130 @@ T last_tail(T, int n);
 
 T pop(T *);
 
-/* return reversed list (destructive) */
+/* return reversed list (destructive, but shared or frozen data is
+   copied) */
 T reverse_list(T);
 
+/* 1 if the conses of list x may be modified in place: hash-consing is
+   off and none of them (or their heads) is frozen */
+int list_mutable(T);
+
+/* List builder: append in O(1) instead of consing onto the front and
+   reversing. Appended elements are linked in place, so with sharing on
+   they are collected in reverse and consed again by list_finish. The
+   list is incomplete until finished and must not be collected or
+   released meanwhile.
+
+	struct listdata_builder b;
+	list_begin(&b);
+	while (...)
+		if (!list_append(&b, x)) ...
+	x = list_finish(&b, EMPTY_LIST);
+*/
+struct listdata_builder {
+	T list;		/* first cons, 0 if empty */
+	T *tail;	/* of the last cons */
+	T next;		/* first reserved cons */
+	unsigned left;	/* reserved conses left */
+	int shared;
+};
+
+void list_begin(struct listdata_builder *);
+
+/* make the next n (up to 1024) appends take contiguous conses, which
+   are allocated now, return 0 if out of memory */
+int  list_reserve(struct listdata_builder *, unsigned n);
+
+/* return 0 if out of memory */
+int  list_append(struct listdata_builder *, T x);
+
+/* terminate with end (EMPTY_LIST for an array), return the list or 0
+   if out of memory. Unused reserved conses are given back if nothing
+   was allocated after them. */
+T    list_finish(struct listdata_builder *, T end);
+
+/* list of n elements terminated by end, laid out in order */
+T    list_from_array(const T *, unsigned n, T end);
+
+/* Bulk traversal, fastest on lists laid out in order */
+
+/* call f(elem, arg) for each element until it returns nonzero, return
+   that value or 0. f must not modify the list. */
+int  list_foreach(T, int (*f)(T, void *), void *arg);
+
+/* store up to max elements in buf, return the number stored */
+unsigned list_to_array(T, T *buf, unsigned max);
+
+unsigned long list_length(T);
+
 int equals_str(T, const char *);
 int equals(T, T);
 
+/* hash consistent with equals (a consed string hashes as its
+   characters, however it is split) */
+unsigned long listdata_hash(T);
+
 T *dict_get(T dict, T key);
 T  dict_set(T dict, T key, T val);
 
 /* Consed string manipulation */
 
-/* copy string to buf of size n.
-   return length of stored string */
+/* copy string to buf of size n, up to the first character above
+   U+00FF (or U+0000). return length of stored string */
 int copy_str(T, char *buf, int n);
 
-/* split string by delimeter char (destructive) */
+/* split string by delimeter char (destructive, but a rope, shared or
+   frozen data is copied) */
 T split(T, int sep);
 
 /* immutable cons concatenation (of strings) */
 T concat(T, T);
 
+/* Iterate over a string (short or not), consed string or rope a
+   fragment at a time:
+
+	struct listdata_chunks c;
+	chunk_begin(&c, x);
+	while (chunk_next(&c, &s, &n, &ch) > 0)
+		...
+*/
+#define LISTDATA_ROPE_DEPTH 64
+
+struct listdata_chunks {
+	T p;				/* rest of the current string */
+	unsigned n;			/* on the stack */
+	T stack[LISTDATA_ROPE_DEPTH];	/* strings and ropes to follow */
+	char buf[LISTDATA_SHORT_MAX + 1];	/* a short string unpacked */
+};
+
+void chunk_begin(struct listdata_chunks *, T);
+
+/* next fragment: n bytes (no NUL) at *s, or a character *ch above
+   U+00FF (or U+0000) with *s NULL and n 1. return 1, 0 at the end or
+   -1 if not a string */
+int  chunk_next(struct listdata_chunks *, const char **s, unsigned long *n,
+		int *ch);
+
+/* characters in a string, consed string or rope (0 if not a string) */
+unsigned long str_length(T);
+
+/* Ropes: strings joined by a node that refers to both parts, so that
+   concatenation does not copy. The parts are strings, consed strings
+   or ropes and are shared, not modified. The depth is kept
+   logarithmic in the number of parts. Ropes compare and hash as their
+   characters. */
+
+/* return x followed by y, or 0 if out of memory or the length would
+   pass INT_MAX */
+T rope_concat(T x, T y);
+
+/* n characters from start (both clamped to the length), shares all
+   but the cut fragments at the ends */
+T rope_sub(T, unsigned long start, unsigned long n);
+
+/* the characters as a consed string (sharing the fragments) */
+T rope_flatten(T);
+
 #undef T
 
 #endif
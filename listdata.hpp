@@ -0,0 +1,443 @@
+#ifndef listdata_hpp
+#define listdata_hpp
+
+/* C++ (17) view of listdata objects, header only. Handles are decoded
+   inline from the block table of listdata.c (one load of the table and
+   one of the block), so walking data costs what it does inside the
+   library. Allocation and the rest go through the C functions.
+
+	listdata::value x = parse(...);
+	for (listdata::value e : x)			// list elements
+		...
+	for (auto [k, v] : x.members())			// key/value pairs
+		...
+	listdata::visit(x, listdata::overloaded{
+		[](int i) { ... },
+		[](listdata::string s) { ... },
+		[](listdata::cons c) { ... },
+		[](listdata::number n) { ... },
+		[](listdata::atom a) { ... }});
+
+   Like the C functions, head and tail do not check that the value is
+   a cons. Iterators follow tails while they are conses, so a list
+   ends at its terminator (EMPTY_LIST, EMPTY_DICT or anything else).
+   An object built by the JSON parser lists its last member first.
+   The other C headers are included in an extern "C" block. */
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+
+extern "C" {
+#include "listdata.h"
+#include "mstack.h"
+
+#ifdef LISTDATA_THREADS
+extern __thread struct mstack listdata_heap;
+#else
+extern struct mstack listdata_heap;
+#endif
+extern struct mblock *listdata_frozen_blocks;
+extern unsigned listdata_frozen_top;
+}
+
+namespace listdata {
+
+typedef listdata_type handle;
+
+namespace detail {
+
+/* the layout of listdata.c: base, tag and offset from the msb */
+const unsigned offset_bits = 10, tag_bits = 3;
+const unsigned base_bit = offset_bits + tag_bits;
+const handle offset_max = ((handle) 1 << offset_bits) - 1;
+const handle tag_mask = (((handle) 1 << tag_bits) - 1) << offset_bits;
+const handle base_mask = ~(tag_mask | offset_max);
+const handle inum_max = (handle) -1 >> (tag_bits + 1);
+const handle msb = ~((handle) -1 >> 1);
+const unsigned short_bits = 7;
+const unsigned num_exp_bits = sizeof(handle) == 8 ? 11 : 8;
+const unsigned num_mant_bits = sizeof(handle) * 8 - tag_bits - num_exp_bits;
+
+enum tag {
+	tag_atom, tag_cons, tag_str, tag_int, tag_inum, tag_rope, tag_short,
+	tag_num
+};
+
+inline unsigned tag_of(handle x)
+{
+	return (unsigned) ((x & tag_mask) >> offset_bits);
+}
+
+inline void *mem(handle x)
+{
+	handle b = x >> base_bit;
+#ifdef LISTDATA_FLAT
+	return listdata_heap.flat + b * (offset_max + 1) * 2 * sizeof(handle);
+#else
+#ifdef LISTDATA_THREADS
+	if (b <= listdata_frozen_top)
+		return listdata_frozen_blocks[b].mem;
+#endif
+	return listdata_heap.mblocks[b].mem;
+#endif
+}
+
+inline handle *cell(handle x)
+{
+	return static_cast<handle *>(mem(x)) + 2 * (x & offset_max);
+}
+
+/* the bits of an immediate value */
+inline handle payload(handle x)
+{
+	return ((x & base_mask) >> tag_bits) | (x & offset_max);
+}
+
+inline int load_int(handle x)
+{
+	switch (tag_of(x)) {
+	case tag_int:
+		return static_cast<int *>(mem(x))[x & offset_max];
+	case tag_inum:
+		return x & msb ? (int) (payload(x ^ msb) - (inum_max + 1)) :
+				 (int) payload(x);
+	}
+	return 0;
+}
+
+inline enum typ type_of(handle x)
+{
+	switch (tag_of(x)) {
+	case tag_cons: return TYP_CONS;
+	case tag_str: return TYP_STR;
+	case tag_int:
+	case tag_inum: return TYP_INT;
+	case tag_rope: return TYP_ROPE;
+	case tag_short: return TYP_SHORT;
+	case tag_num: return TYP_NUM;
+	}
+	return TYP_ATOM;
+}
+
+/* the fields of a packed number, as unpack_num */
+inline int num_mant(handle x)
+{
+	handle m = payload(x) >> num_exp_bits;
+	return m >> (num_mant_bits - 1) ? (int) (m - ((handle) 1 << num_mant_bits))
+					: (int) m;
+}
+
+inline int num_exp(handle x)
+{
+	int e = (int) (payload(x) & (((handle) 1 << num_exp_bits) - 1));
+	return e >> (num_exp_bits - 1) ? e - (1 << num_exp_bits) : e;
+}
+
+} // namespace detail
+
+/* room for a short string unpacked */
+struct short_buffer {
+	char s[LISTDATA_SHORT_MAX + 1];
+};
+
+class list_range;
+class member_range;
+
+class value {
+public:
+	value(handle x = 0) : x(x) {}
+
+	handle get() const { return x; }
+	enum typ type() const { return detail::type_of(x); }
+
+	bool is_null() const { return !x; }
+	bool is_cons() const { return detail::tag_of(x) == detail::tag_cons; }
+	bool is_int() const { return type() == TYP_INT; }
+	bool is_atom() const { return type() == TYP_ATOM; }
+	/* a string, short string or rope (not a consed string) */
+	bool is_string() const
+	{
+		unsigned t = detail::tag_of(x);
+		return t == detail::tag_str || t == detail::tag_short ||
+		       t == detail::tag_rope;
+	}
+
+	value head() const { return detail::cell(x)[0]; }
+	value tail() const { return detail::cell(x)[1]; }
+	/* the slots of a cons, as load_cons */
+	handle *slots() const { return detail::cell(x); }
+
+	int to_int() const { return detail::load_int(x); }
+
+	/* a string or short string (unpacked into buf), otherwise empty */
+	std::string_view view(short_buffer &buf) const
+	{
+		handle v;
+		std::size_t n = 0;
+		switch (detail::tag_of(x)) {
+		case detail::tag_str:
+			return static_cast<const char *>(detail::mem(x)) +
+			       (x & detail::offset_max);
+		case detail::tag_short:
+			for (v = detail::payload(x); v; v >>= detail::short_bits)
+				buf.s[n++] = v & 0x7F;
+			return std::string_view(buf.s, n);
+		}
+		return std::string_view();
+	}
+
+	/* the bytes of any string, with characters above U+00FF (or
+	   U+0000) in UTF-8 */
+	std::string to_string() const
+	{
+		struct listdata_chunks c;
+		const char *s;
+		unsigned long n;
+		std::string r;
+		int ch;
+		chunk_begin(&c, x);
+		while (chunk_next(&c, &s, &n, &ch) > 0) {
+			if (s) {
+				r.append(s, n);
+			} else if (ch < 0x800) {
+				r += (char) (0xC0 | ch >> 6);
+				r += (char) (0x80 | (ch & 0x3F));
+			} else if (ch < 0x10000) {
+				r += (char) (0xE0 | ch >> 12);
+				r += (char) (0x80 | (ch >> 6 & 0x3F));
+				r += (char) (0x80 | (ch & 0x3F));
+			} else {
+				r += (char) (0xF0 | ch >> 18);
+				r += (char) (0x80 | (ch >> 12 & 0x3F));
+				r += (char) (0x80 | (ch >> 6 & 0x3F));
+				r += (char) (0x80 | (ch & 0x3F));
+			}
+		}
+		return r;
+	}
+
+	/* conses to the end of the list */
+	std::size_t length() const
+	{
+		std::size_t n = 0;
+		for (value p = *this; p.is_cons(); p = p.tail())
+			n++;
+		return n;
+	}
+
+	/* nth element, null past the end */
+	value operator[](std::size_t n) const
+	{
+		value p = *this;
+		for (; n && p.is_cons(); n--)
+			p = p.tail();
+		return p.is_cons() ? p.head() : value();
+	}
+
+	/* the value of a member, NULL if there is none (see dict_get) */
+	handle *find(value key) const { return dict_get(x, key.x); }
+	handle *find(const char *key) const
+	{
+		handle *c;
+		for (value p = *this; p.is_cons(); p = c[1]) {
+			c = detail::cell(detail::cell(p.x)[1]);
+			if (equals_str(p.head().x, key))
+				return c;
+		}
+		return NULL;
+	}
+
+	/* compared as by equals, same for the handles */
+	bool operator==(value y) const { return x == y.x || equals(x, y.x); }
+	bool operator!=(value y) const { return !(*this == y); }
+	bool same(value y) const { return x == y.x; }
+
+	inline list_range elements() const;
+	inline member_range members() const;
+
+	class iterator;
+	inline iterator begin() const;
+	inline iterator end() const;
+
+private:
+	handle x;
+};
+
+/* Typed views for visit */
+
+struct atom : value {
+	explicit atom(value x) : value(x) {}
+	unsigned id() const { return (unsigned) get(); }
+};
+
+struct string : value {
+	explicit string(value x) : value(x) {}
+};
+
+struct cons : value {
+	explicit cons(value x) : value(x) {}
+};
+
+/* a packed number, mant * 10^exp (see store_num) */
+struct number : value {
+	explicit number(value x) : value(x) {}
+	int mant() const { return detail::num_mant(get()); }
+	int exp() const { return detail::num_exp(get()); }
+	/* the nearest double, as json_number */
+	double to_double() const
+	{
+		static const double powers[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+			1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+			1e20, 1e21, 1e22
+		};
+		char buf[32];
+		int m = mant(), e = exp();
+		if (e >= -22 && e <= 22)
+			return e < 0 ? m / powers[-e] : m * powers[e];
+		std::snprintf(buf, sizeof(buf), "%de%d", m, e);
+		return std::strtod(buf, NULL);
+	}
+};
+
+/* Iterators. The elements are read through the conses, so reference
+   is value itself, which makes them forward iterators for C++20 and
+   usable with <algorithm> (as a proxy, like vector<bool>). */
+
+class value::iterator {
+public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef value value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef const value *pointer;
+	typedef value reference;
+
+	iterator(handle p = 0) : p(p) {}
+	value operator*() const { return detail::cell(p)[0]; }
+	iterator &operator++()
+	{
+		handle t = detail::cell(p)[1];
+		p = detail::tag_of(t) == detail::tag_cons ? t : 0;
+		return *this;
+	}
+	iterator operator++(int) { iterator i = *this; ++*this; return i; }
+	bool operator==(const iterator &i) const { return p == i.p; }
+	bool operator!=(const iterator &i) const { return p != i.p; }
+	/* the current cons */
+	value position() const { return p; }
+
+private:
+	handle p;	/* a cons, 0 at the end */
+};
+
+class list_range {
+public:
+	explicit list_range(value x) : x(x) {}
+	value::iterator begin() const
+	{
+		return x.is_cons() ? x.get() : 0;
+	}
+	value::iterator end() const { return value::iterator(); }
+
+private:
+	value x;
+};
+
+typedef std::pair<value, value> member;
+
+class member_iterator {
+public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef member value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef const member *pointer;
+	typedef member reference;
+
+	member_iterator(handle p = 0) : p(p) { check(); }
+	member operator*() const
+	{
+		const handle *c = detail::cell(p);
+		return member(c[0], detail::cell(c[1])[0]);
+	}
+	member_iterator &operator++()
+	{
+		p = detail::cell(detail::cell(p)[1])[1];
+		check();
+		return *this;
+	}
+	member_iterator operator++(int)
+	{
+		member_iterator i = *this;
+		++*this;
+		return i;
+	}
+	bool operator==(const member_iterator &i) const { return p == i.p; }
+	bool operator!=(const member_iterator &i) const { return p != i.p; }
+
+private:
+	/* at a key with a value after it */
+	void check()
+	{
+		if (detail::tag_of(p) != detail::tag_cons ||
+		    detail::tag_of(detail::cell(p)[1]) != detail::tag_cons)
+			p = 0;
+	}
+	handle p;
+};
+
+class member_range {
+public:
+	explicit member_range(value x) : x(x) {}
+	member_iterator begin() const { return x.get(); }
+	member_iterator end() const { return member_iterator(); }
+
+private:
+	value x;
+};
+
+inline list_range value::elements() const { return list_range(*this); }
+inline member_range value::members() const { return member_range(*this); }
+inline value::iterator value::begin() const { return elements().begin(); }
+inline value::iterator value::end() const { return iterator(); }
+
+/* Visiting: f is called with the value as an int, string, cons,
+   number or atom, chosen by its type. All calls must return the same
+   type. */
+
+template <class F>
+decltype(auto) visit(value x, F &&f)
+{
+	switch (detail::tag_of(x.get())) {
+	case detail::tag_cons:
+		return f(cons(x));
+	case detail::tag_str:
+	case detail::tag_short:
+	case detail::tag_rope:
+		return f(string(x));
+	case detail::tag_int:
+	case detail::tag_inum:
+		return f(x.to_int());
+	case detail::tag_num:
+		return f(number(x));
+	default:
+		return f(atom(x));
+	}
+}
+
+/* a function object of the lambdas given, for visit */
+template <class... F>
+struct overloaded : F... {
+	using F::operator()...;
+};
+
+template <class... F>
+overloaded(F...) -> overloaded<F...>;
+
+} // namespace listdata
+
+#endif
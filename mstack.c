@@ -3,15 +3,29 @@
  */
 #include <stdlib.h>
 #include <limits.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define HAVE_MMAN
+#endif
 #include "mstack.h"
 
 #define NUM_OF(a) (sizeof(a) / sizeof(a[0]))
 
+#define FLAT_CHUNK 32		/* blocks committed at a time */
+
 void mstack_init(struct mstack *m)
 {
-	m->top = 0;
+	m->top = m->kept = 0;
 	m->end = NUM_OF(m->mblocks_static);
 	m->limit = UINT_MAX / sizeof(struct mblock);
+	m->bytes = 0;
+	m->max_bytes = 0;
+	m->peak_bytes = 0;
+	m->allocs = m->failures = m->grows = 0;
+	m->holes = NULL;
+	m->nholes = m->holes_max = 0;
+	m->flat = NULL;
+	m->flat_size = m->flat_blocks = m->committed = 0;
 	m->mblocks = m->mblocks_static;
 	m->mblocks[0].mem = NULL;
 }
@@ -24,6 +38,8 @@ unsigned mstack_push(struct mstack *m, void *mem)
 	int i = 0,
 	    n = NUM_OF(m->mblocks_static);
 
+	if (top > m->limit)
+		return 0;
 	if (top >= end) {
 		end <<= 1;
 		if (end <= top || end > m->limit)
@@ -42,39 +58,131 @@ unsigned mstack_push(struct mstack *m, void *mem)
 
 		m->end = end;
 		m->mblocks = bs;
+		m->grows++;
 	}
 	m->top = top;
 
 	bs[top].freeable = 0;
+	bs[top].tag = 0;
+	bs[top].size = 0;
 	bs[top].mem = mem;
 
 	return top;
 }
 
+int mstack_reserve(struct mstack *m, unsigned n, unsigned size)
+{
+	m->flat_size = size;
+#ifdef HAVE_MMAN
+	m->flat = mmap(NULL, (size_t) n * size, PROT_NONE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m->flat == MAP_FAILED)
+		m->flat = NULL;
+	else
+		m->flat_blocks = n;
+#endif
+	return m->flat != NULL;
+}
+
+#ifdef HAVE_MMAN
+/* make blocks up to p accessible */
+static int flat_commit(struct mstack *m, unsigned p)
+{
+	unsigned n = (p / FLAT_CHUNK + 1) * FLAT_CHUNK;
+	if (p < m->committed)
+		return 1;
+	if (n > m->flat_blocks)
+		n = m->flat_blocks;
+	if (mprotect(m->flat + (size_t) m->committed * m->flat_size,
+		     (size_t) (n - m->committed) * m->flat_size,
+		     PROT_READ | PROT_WRITE))
+		return 0;
+	m->committed = n;
+	return 1;
+}
+
+/* return the memory of blocks well above top to the system */
+static void flat_decommit(struct mstack *m)
+{
+	unsigned n = (m->top / FLAT_CHUNK + 2) * FLAT_CHUNK;
+	if (n >= m->committed)
+		return;
+	mmap(m->flat + (size_t) n * m->flat_size,
+	     (size_t) (m->committed - n) * m->flat_size, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	m->committed = n;
+}
+#endif
+
+/* memory for block p */
+static void *next_mem(struct mstack *m, unsigned p, unsigned n)
+{
+	if (!m->flat_size)
+		return malloc(n);
+#ifdef HAVE_MMAN
+	if (m->flat && n <= m->flat_size && p < m->flat_blocks &&
+	    flat_commit(m, p))
+		return m->flat + (size_t) p * m->flat_size;
+#endif
+	return NULL;
+}
+
 unsigned mstack_alloc(struct mstack *m, unsigned n)
 {
-	void    *mem = malloc(n);
+	void    *mem;
 	unsigned top = 0;
+	if (m->max_bytes && m->bytes + n > m->max_bytes) {
+		m->failures++;
+		return 0;
+	}
+	mem = next_mem(m, m->top + 1, n);
 	if (mem) {
 		top = mstack_push(m, mem);
-		if (top)
+		if (top) {
 			m->mblocks[top].freeable = 1;
-		else
+			m->mblocks[top].size = n;
+			m->bytes += n;
+			if (m->bytes > m->peak_bytes)
+				m->peak_bytes = m->bytes;
+			m->allocs++;
+		} else if (!m->flat_size)
 			free(mem);
 	}
+	if (!top)
+		m->failures++;
 	return top;
 }
 
+/* forget the holes that were freed */
+static void drop_holes(struct mstack *m)
+{
+	unsigned i, j;
+	for (i = j = 0; i < m->nholes; i++)
+		if (m->holes[i] <= m->top)
+			m->holes[j++] = m->holes[i];
+	m->nholes = j;
+}
+
 void mstack_free(struct mstack *m, unsigned p)
 {
 	unsigned top = m->top;
 	struct mblock *bs = m->mblocks;
 
+	if (p <= m->kept)
+		p = m->kept + 1;
 	for (; top && top >= p; top--) {
-		if (bs[top].freeable)
-			free(bs[top].mem);
+		if (bs[top].freeable) {
+			if (!m->flat_size)
+				free(bs[top].mem);
+			m->bytes -= bs[top].size;
+		}
 	}
 	m->top = top;
+#ifdef HAVE_MMAN
+	if (m->flat)
+		flat_decommit(m);
+#endif
+	drop_holes(m);
 
 	if (top < NUM_OF(m->mblocks_static) && bs != m->mblocks_static) {
 		for (; top; top--)
@@ -84,3 +192,129 @@ void mstack_free(struct mstack *m, unsigned p)
 		m->mblocks = m->mblocks_static;
 	}
 }
+
+void mstack_clear(struct mstack *m, unsigned p)
+{
+	struct mblock *b = &m->mblocks[p];
+	unsigned *h, n;
+	if (!b->freeable && !b->mem)
+		return;		/* already empty */
+	if (b->freeable) {
+		if (!m->flat_size)
+			free(b->mem);
+		m->bytes -= b->size;
+	}
+	b->freeable = 0;
+	b->tag = 0;
+	b->size = 0;
+	b->mem = NULL;
+	if (m->nholes == m->holes_max) {
+		n = m->holes_max ? 2 * m->holes_max : 64;
+		if (!(h = realloc(m->holes, n * sizeof(*h))))
+			return;		/* not reused then */
+		m->holes = h;
+		m->holes_max = n;
+	}
+	m->holes[m->nholes++] = p;
+}
+
+/* an empty block below the top, or 0. Entries made stale by
+   mstack_free or reuse are dropped. */
+static unsigned take_hole(struct mstack *m)
+{
+	unsigned p;
+	while (m->nholes) {
+		p = m->holes[--m->nholes];
+		if (p <= m->top && p > m->kept && !m->mblocks[p].freeable &&
+		    !m->mblocks[p].mem)
+			return p;
+	}
+	return 0;
+}
+
+unsigned mstack_alloc_any(struct mstack *m, unsigned n)
+{
+	struct mblock *b;
+	unsigned p;
+	void *mem;
+	if (m->max_bytes && m->bytes + n > m->max_bytes) {
+		m->failures++;
+		return 0;
+	}
+	if (!(p = take_hole(m)))
+		return mstack_alloc(m, n);
+	if (!(mem = next_mem(m, p, n))) {
+		m->failures++;
+		return 0;
+	}
+	b = &m->mblocks[p];
+	b->freeable = 1;
+	b->tag = 0;
+	b->size = n;
+	b->mem = mem;
+	m->bytes += n;
+	if (m->bytes > m->peak_bytes)
+		m->peak_bytes = m->bytes;
+	m->allocs++;
+	return p;
+}
+
+void mstack_trim(struct mstack *m)
+{
+	unsigned top = m->top;
+	while (top > m->kept && !m->mblocks[top].freeable &&
+	       !m->mblocks[top].mem)
+		top--;
+	if (top < m->top)
+		mstack_free(m, top + 1);
+}
+
+void mstack_keep(struct mstack *m)
+{
+	unsigned p;
+	for (p = m->kept + 1; p <= m->top; p++) {
+		if (m->mblocks[p].freeable) {
+			m->mblocks[p].freeable = 0;
+			m->bytes -= m->mblocks[p].size;
+		}
+	}
+	m->kept = m->top;
+	m->nholes = 0;
+}
+
+int mstack_skip(struct mstack *m, unsigned n)
+{
+	unsigned end = m->end, p;
+	struct mblock *bs;
+	while (end <= n + 1 && end <= m->limit)
+		end <<= 1;
+	if (end > m->end) {
+		if (end > m->limit || !(bs = calloc(end, sizeof(*bs))))
+			return 0;
+		if (m->mblocks != m->mblocks_static)
+			free(m->mblocks);
+		m->mblocks = bs;
+		m->end = end;
+		m->grows++;
+	} else {
+		for (p = 1; p <= n; p++) {
+			m->mblocks[p].freeable = 0;
+			m->mblocks[p].tag = 0;
+			m->mblocks[p].size = 0;
+			m->mblocks[p].mem = NULL;
+		}
+	}
+	m->top = m->kept = n;
+	return 1;
+}
+
+void mstack_done(struct mstack *m)
+{
+	mstack_free(m, 0);
+	if (m->mblocks != m->mblocks_static)
+		free(m->mblocks);
+	free(m->holes);
+	m->mblocks = NULL;
+	m->holes = NULL;
+	m->top = m->kept = 0;
+}
@@ -5,23 +5,67 @@
 
 struct mblock {
 	int freeable;
+	int tag;			/* set by the user, 0 when pushed */
+	unsigned size;
 	void *mem;
 };
 
 struct mstack {
-	unsigned top, end, limit;
+	unsigned top, end, limit,
+		 kept;			/* blocks never popped */
+	unsigned long bytes,		/* allocated by mstack_alloc */
+		      max_bytes,	/* 0 for no limit */
+		      peak_bytes;	/* high-water mark of bytes */
+	unsigned long allocs,		/* successful mstack_alloc calls */
+		      failures,		/* failed mstack_alloc calls */
+		      grows;		/* reallocations of mblocks */
+	unsigned *holes,		/* cleared blocks below top */
+		 nholes, holes_max;
+	char *flat;			/* reserved range in flat mode */
+	unsigned flat_size,		/* of each block, 0 if not flat */
+		 flat_blocks,		/* reserved */
+		 committed;		/* blocks that may be accessed */
 	struct mblock *mblocks, mblocks_static[8];
 };
 
 void mstack_init(struct mstack *);
 
+/* Flat mode: reserve address space for n blocks of the given size
+   (a multiple of the page size) so that mblocks[p].mem is always
+   flat + p*size. Memory is committed as blocks are allocated. Call
+   before allocating, return 0 if not possible (then allocation fails). */
+int mstack_reserve(struct mstack *, unsigned n, unsigned size);
+
 /* push memory block */
 unsigned mstack_push(struct mstack *, void *mem);
 
-/* allocate and push freeable memory block of n bytes */
+/* allocate and push freeable memory block of n bytes
+   (return 0 if it would exceed max_bytes) */
 unsigned mstack_alloc(struct mstack *, unsigned n);
 
 /* free mblocks[p] and everything on top of it */
 void mstack_free(struct mstack *, unsigned p);
 
+/* free the memory of mblocks[p] only, leaving an empty block */
+void mstack_clear(struct mstack *, unsigned p);
+
+/* same as mstack_alloc, but fill an empty block below the top if
+   there is one (so the new block is not necessarily on top) */
+unsigned mstack_alloc_any(struct mstack *, unsigned n);
+
+/* pop the empty blocks off the top */
+void mstack_trim(struct mstack *);
+
+/* keep the blocks up to the top for good: they are no longer freed or
+   counted in bytes, and the stack is not popped below them */
+void mstack_keep(struct mstack *);
+
+/* start a new stack above n blocks kept elsewhere, which are left
+   empty. Return 0 if out of memory. */
+int mstack_skip(struct mstack *, unsigned n);
+
+/* free all blocks but the kept ones, and the tables. mstack_init
+   must be called before using the stack again. */
+void mstack_done(struct mstack *);
+
 #endif
@@ -0,0 +1,782 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "patch.h"
+
+#define TAB_MIN 16
+
+/* a key of two objects being compared */
+struct json_diff_entry {
+	object key;			/* 0 if the slot is free */
+	unsigned long hash;
+	object a, b;			/* first member with it (the cons of
+					   the key) in each, or 0 */
+};
+
+/* a step of a path: a key, and the array index it stands for (-1 if
+   none, -2 for "-", the end) */
+struct json_diff_seg {
+	object key;
+	int index;
+};
+
+/* the strings of a diff */
+enum { N_OP, N_PATH, N_VALUE, N_ADD, N_REMOVE, N_REPLACE, NUM_NAMES };
+
+static const char *names[NUM_NAMES] = {
+	"op", "path", "value", "add", "remove", "replace"
+};
+
+enum { GET, ADD, REMOVE, REPLACE };
+
+static void *grow(void *mem, unsigned *max, size_t size)
+{
+	unsigned n = *max ? *max << 1 : 16;
+	void *p = n > *max ? realloc(mem, (size_t) n * size) : NULL;
+	if (p)
+		*max = n;
+	return p;
+}
+
+void json_diff_init(struct json_diff *d)
+{
+	memset(d, 0, sizeof(*d));
+}
+
+void json_diff_free(struct json_diff *d)
+{
+	free(d->tab);
+	free(d->segs);
+	json_diff_init(d);
+}
+
+static int fail(struct json_diff *d, int st, const char *reason)
+{
+	d->reason = reason;
+	return st;
+}
+
+/* EMPTY_DICT for an object, EMPTY_LIST for an array, otherwise 0 */
+static object container(object x)
+{
+	if (x == EMPTY_DICT || x == EMPTY_LIST)
+		return x;
+	if (!is_cons(x))
+		return 0;
+	x = last_tail(x, 0);
+	return x == EMPTY_DICT || x == EMPTY_LIST ? x : 0;
+}
+
+/* the member key: val in front of object x, as dict_set, 0 if out of
+   memory */
+static object put(object x, object key, object val)
+{
+	x = x ? cons(val, x) : 0;
+	return x ? cons(key, x) : 0;
+}
+
+static object join(object x, object y)
+{
+	return x && y ? rope_concat(x, y) : 0;
+}
+
+/* Key tables */
+
+static struct json_diff_entry *lookup(struct json_diff *d, unsigned base,
+				      unsigned size, object key)
+{
+	unsigned long h = listdata_hash(key);
+	unsigned i = h & (size - 1);
+	struct json_diff_entry *e;
+	for (;; i = (i + 1) & (size - 1)) {
+		e = d->tab + base + i;
+		if (!e->key) {
+			e->key = key;
+			e->hash = h;
+			return e;
+		}
+		if (e->hash == h && (e->key == key || equals(e->key, key)))
+			return e;
+	}
+}
+
+/* enter the keys of objects a and b in a table above those in use,
+   at *base. Return its size, 0 if out of memory. */
+static unsigned match(struct json_diff *d, object a, object b,
+		      unsigned *base)
+{
+	unsigned long n = (list_length(a) + list_length(b)) / 2;
+	unsigned size = TAB_MIN;
+	struct json_diff_entry *e;
+	object c;
+
+	while (size < 2 * n && size < UINT_MAX / 4)
+		size <<= 1;
+	while (d->tab_max - d->tab_top < size) {
+		if (!(e = grow(d->tab, &d->tab_max, sizeof(*e))))
+			return 0;
+		d->tab = e;
+	}
+	*base = d->tab_top;
+	d->tab_top += size;
+	memset(d->tab + *base, 0, size * sizeof(*e));
+	for (c = a; is_cons(c) && is_cons(get_tail(c)); c = get_tail(get_tail(c))) {
+		if (!(e = lookup(d, *base, size, get_head(c)))->a)
+			e->a = c;
+	}
+	for (c = b; is_cons(c) && is_cons(get_tail(c)); c = get_tail(get_tail(c))) {
+		if (!(e = lookup(d, *base, size, get_head(c)))->b)
+			e->b = c;
+	}
+	return size;
+}
+
+/* Merge patches */
+
+/* append the member key of the merge patch for av turning into bv
+   (with av 0 if there is none) */
+static int merge_member(struct json_diff *d, struct listdata_builder *m,
+			object key, object *av, object bv);
+
+static int merge_diff(struct json_diff *d, object a, object b, object *patch)
+{
+	struct listdata_builder m;
+	struct json_diff_entry *e;
+	unsigned base, size;
+	object c, key;
+	int st;
+
+	if (container(a) != EMPTY_DICT || container(b) != EMPTY_DICT) {
+		*patch = b;
+		d->ops++;
+		return JSON_DONE;
+	}
+	*patch = EMPTY_DICT;
+	list_begin(&m);
+	/* members in the same order need no table */
+	for (; is_cons(a) && is_cons(get_tail(a)) && is_cons(b) &&
+	       is_cons(get_tail(b)); a = get_tail(get_tail(a)), b = get_tail(get_tail(b))) {
+		key = get_head(b);
+		if (get_head(a) != key && !equals(get_head(a), key))
+			break;
+		if ((st = merge_member(d, &m, key, load_cons(get_tail(a)),
+				       get_head(get_tail(b)))) != JSON_DONE)
+			return st;
+	}
+	if (a != b) {
+		if (!(size = match(d, a, b, &base)))
+			return fail(d, JSON_LIMIT, "out of memory");
+		for (c = b; is_cons(c) && is_cons(get_tail(c)); c = get_tail(get_tail(c))) {
+			e = lookup(d, base, size, get_head(c));
+			if (e->b == c && (st = merge_member(d, &m, get_head(c),
+					e->a ? load_cons(get_tail(e->a)) : NULL,
+					get_head(get_tail(c)))) != JSON_DONE)
+				return st;
+		}
+		for (c = a; is_cons(c) && is_cons(get_tail(c)); c = get_tail(get_tail(c))) {
+			e = lookup(d, base, size, get_head(c));
+			if (e->a != c || e->b)
+				continue;
+			if (!list_append(&m, get_head(c)) || !list_append(&m, 0))
+				return fail(d, JSON_LIMIT, "heap limit");
+			d->ops++;
+		}
+		d->tab_top = base;
+	}
+	*patch = list_finish(&m, EMPTY_DICT);
+	return *patch ? JSON_DONE : fail(d, JSON_LIMIT, "heap limit");
+}
+
+static int merge_member(struct json_diff *d, struct listdata_builder *m,
+			object key, object *av, object bv)
+{
+	int st;
+	if (!av) {
+		if (!bv)
+			return JSON_DONE;
+		d->ops++;
+	} else if (*av == bv) {
+		return JSON_DONE;
+	} else if (container(*av) == EMPTY_DICT && container(bv) == EMPTY_DICT) {
+		/* counts its own members */
+		if ((st = merge_diff(d, *av, bv, &bv)) != JSON_DONE)
+			return st;
+		if (bv == EMPTY_DICT)
+			return JSON_DONE;
+	} else if (equals(*av, bv)) {
+		return JSON_DONE;
+	} else {
+		d->ops++;
+	}
+	if (!list_append(m, key) || !list_append(m, bv))
+		return fail(d, JSON_LIMIT, "heap limit");
+	return JSON_DONE;
+}
+
+int json_merge_diff(struct json_diff *d, object a, object b, object *patch)
+{
+	d->tab_top = 0;
+	d->ops = 0;
+	d->reason = NULL;
+	return merge_diff(d, a, b, patch);
+}
+
+/* index of the key of the member of object x with key, -1 if none */
+static int find(object x, object key)
+{
+	int i;
+	for (i=0; is_cons(x) && is_cons(get_tail(x)); x = get_tail(get_tail(x))) {
+		if (get_head(x) == key || equals(get_head(x), key))
+			return i;
+		i += 2;
+	}
+	return -1;
+}
+
+/* x with its elements from the nth on replaced by rest: in place if x
+   may be modified, otherwise by copying the first n conses. Return 0
+   if out of memory. */
+static object set_tail(object x, int n, object rest)
+{
+	struct listdata_builder b;
+	if (!n || !rest)
+		return rest;
+	if (list_mutable(x)) {
+		load_cons(nth_tail(x, n - 1))[1] = rest;
+		return x;
+	}
+	list_begin(&b);
+	for (; n--; x = get_tail(x)) {
+		if (!list_append(&b, get_head(x)))
+			return 0;
+	}
+	return list_finish(&b, rest);
+}
+
+/* x with v for its nth element, which is at p */
+static object set_elem(object x, int n, object *p, object v)
+{
+	if (list_mutable(x)) {
+		*p = v;
+		return x;
+	}
+	return set_tail(x, n, cons(v, p[1]));
+}
+
+static int merge_apply(struct json_diff *d, object *x, object patch)
+{
+	object c, key, v, y, *p;
+	int i, st;
+
+	if (container(patch) != EMPTY_DICT) {
+		*x = patch;
+		return JSON_DONE;
+	}
+	if (container(*x) != EMPTY_DICT)
+		*x = EMPTY_DICT;
+	for (c = patch; is_cons(c) && is_cons(get_tail(c)); c = get_tail(get_tail(c))) {
+		key = get_head(c);
+		v = get_head(get_tail(c));
+		d->ops++;
+		if ((i = find(*x, key)) < 0) {
+			if (!v)
+				continue;
+			y = EMPTY_DICT;
+			if ((st = merge_apply(d, &y, v)) != JSON_DONE)
+				return st;
+			*x = put(*x, key, y);
+		} else if (!v) {
+			*x = set_tail(*x, i, nth_tail(*x, i + 2));
+		} else {
+			y = *(p = nth_elem(*x, i + 1));
+			if ((st = merge_apply(d, &y, v)) != JSON_DONE)
+				return st;
+			if (y != *p)
+				*x = set_elem(*x, i + 1, p, y);
+		}
+		if (!*x)
+			return fail(d, JSON_LIMIT, "heap limit");
+	}
+	return JSON_DONE;
+}
+
+int json_merge_apply(struct json_diff *d, object *x, object patch)
+{
+	d->ops = 0;
+	d->reason = NULL;
+	return merge_apply(d, x, patch);
+}
+
+/* JSON Patch */
+
+static struct json_diff_seg *push(struct json_diff *d)
+{
+	struct json_diff_seg *g;
+	if (d->nsegs == d->segs_max) {
+		if (!(g = grow(d->segs, &d->segs_max, sizeof(*g))))
+			return NULL;
+		d->segs = g;
+	}
+	g = d->segs + d->nsegs++;
+	g->key = 0;
+	g->index = -1;
+	return g;
+}
+
+/* path followed by key, with ~ and / escaped */
+static object key_path(object path, object key)
+{
+	struct listdata_chunks it;
+	const char *s;
+	unsigned long n, i, pos = 0, start = 0;
+	int c;
+
+	path = join(path, store_short("/"));
+	chunk_begin(&it, key);
+	while (path && chunk_next(&it, &s, &n, &c) > 0) {
+		for (i=0; s && i < n; i++) {
+			if (s[i] != '~' && s[i] != '/')
+				continue;
+			path = join(path, rope_sub(key, start, pos + i - start));
+			path = join(path, store_short(s[i] == '~' ? "~0" : "~1"));
+			start = pos + i + 1;
+		}
+		pos += n;
+	}
+	return join(path, start ? rope_sub(key, start, pos - start) : key);
+}
+
+/* the path of the segments of the diff in progress */
+static object diff_path(struct json_diff *d)
+{
+	object path = store_short("");
+	char buf[16];
+	unsigned i;
+	for (i=0; path && i < d->nsegs; i++) {
+		if (d->segs[i].key) {
+			path = key_path(path, d->segs[i].key);
+		} else {
+			sprintf(buf, "/%d", d->segs[i].index);
+			path = join(path, store_short(buf));
+		}
+	}
+	return path;
+}
+
+/* step into key, or index i with key 0 */
+static int step(struct json_diff *d, object key, int i)
+{
+	struct json_diff_seg *g;
+	if (!(g = push(d)))
+		return fail(d, JSON_LIMIT, "out of memory");
+	g->key = key;
+	g->index = i;
+	return JSON_DONE;
+}
+
+/* append {"op": op, "path": path} with "value": v unless op is remove,
+   at the path of the diff in progress. With ops NULL, return JSON_MORE
+   instead (a difference). */
+static int add_op(struct json_diff *d, struct listdata_builder *ops,
+		  object op, object v)
+{
+	object x = EMPTY_DICT, path;
+	if (!ops)
+		return JSON_MORE;
+	path = diff_path(d);
+	if (op != d->names[N_REMOVE])
+		x = put(x, d->names[N_VALUE], v);
+	x = path ? put(x, d->names[N_PATH], path) : 0;
+	x = put(x, d->names[N_OP], op);
+	if (!x || !list_append(ops, x))
+		return fail(d, JSON_LIMIT, "heap limit");
+	d->ops++;
+	return JSON_DONE;
+}
+
+static int patch_diff(struct json_diff *d, object a, object b,
+		      struct listdata_builder *ops);
+
+/* op at key, or index i with key 0 */
+static int op_at(struct json_diff *d, struct listdata_builder *ops,
+		 object key, int i, object op, object v)
+{
+	int st;
+	if ((st = step(d, key, i)) != JSON_DONE)
+		return st;
+	st = add_op(d, ops, op, v);
+	d->nsegs--;
+	return st;
+}
+
+/* mant * 10^exp without trailing zeros in mant */
+static void normalize(int *mant, int *exp)
+{
+	if (!*mant)
+		*exp = 0;
+	for (; *mant && *mant % 10 == 0; *mant /= 10)
+		++*exp;
+}
+
+/* a and b are equal values other than arrays and objects. For the
+   test op (ops NULL) numbers are equal when their values are, as
+   1 and 1.0 (RFC 6902 4.6); a diff keeps them apart. */
+static int same_leaf(object a, object b, struct listdata_builder *ops)
+{
+	int m, e, n, f;
+	if (equals(a, b))
+		return 1;
+	if (ops || !json_decimal(a, &m, &e) || !json_decimal(b, &n, &f))
+		return 0;
+	normalize(&m, &e);
+	normalize(&n, &f);
+	return m == n && e == f;
+}
+
+/* diff of a and b at key, or index i with key 0 */
+static int diff_at(struct json_diff *d, struct listdata_builder *ops,
+		   object key, int i, object a, object b)
+{
+	int st;
+	if (a == b)
+		return JSON_DONE;
+	if (!is_cons(a) && !is_cons(b))
+		return same_leaf(a, b, ops) ? JSON_DONE :
+		       op_at(d, ops, key, i, d->names[N_REPLACE], b);
+	if ((st = step(d, key, i)) != JSON_DONE)
+		return st;
+	st = patch_diff(d, a, b, ops);
+	d->nsegs--;
+	return st;
+}
+
+static int object_diff(struct json_diff *d, object a, object b,
+		       struct listdata_builder *ops)
+{
+	struct json_diff_entry *e;
+	unsigned base, size;
+	object c, key, v;
+	int st = JSON_DONE;
+
+	/* members in the same order need no table */
+	for (; is_cons(a) && is_cons(get_tail(a)) && is_cons(b) &&
+	       is_cons(get_tail(b)); a = get_tail(get_tail(a)), b = get_tail(get_tail(b))) {
+		key = get_head(b);
+		if (get_head(a) != key && !equals(get_head(a), key))
+			break;
+		if ((st = diff_at(d, ops, key, -1, get_head(get_tail(a)),
+				  get_head(get_tail(b)))) != JSON_DONE)
+			return st;
+	}
+	if (a == b)
+		return JSON_DONE;
+	if (!(size = match(d, a, b, &base)))
+		return fail(d, JSON_LIMIT, "out of memory");
+	for (c = b; st == JSON_DONE && is_cons(c) && is_cons(get_tail(c));
+	     c = get_tail(get_tail(c))) {
+		key = get_head(c);
+		v = get_head(get_tail(c));
+		e = lookup(d, base, size, key);
+		if (e->b != c)
+			continue;
+		if (!e->a)
+			st = op_at(d, ops, key, -1, d->names[N_ADD], v);
+		else
+			st = diff_at(d, ops, key, -1, get_head(get_tail(e->a)), v);
+	}
+	for (c = a; st == JSON_DONE && is_cons(c) && is_cons(get_tail(c));
+	     c = get_tail(get_tail(c))) {
+		e = lookup(d, base, size, get_head(c));
+		if (e->a == c && !e->b)
+			st = op_at(d, ops, get_head(c), -1, d->names[N_REMOVE], 0);
+	}
+	d->tab_top = base;
+	return st;
+}
+
+static int array_diff(struct json_diff *d, object a, object b,
+		      struct listdata_builder *ops)
+{
+	int i, n, st = JSON_DONE;
+	for (i=0; is_cons(a) && is_cons(b); a = get_tail(a), b = get_tail(b), i++) {
+		if ((st = diff_at(d, ops, 0, i, get_head(a), get_head(b))) !=
+		    JSON_DONE)
+			return st;
+	}
+	for (; st == JSON_DONE && is_cons(b); b = get_tail(b), i++)
+		st = op_at(d, ops, 0, i, d->names[N_ADD], get_head(b));
+	/* from the end, so that the indexes stay valid */
+	for (n = i + list_length(a); st == JSON_DONE && n-- > i; )
+		st = op_at(d, ops, 0, n, d->names[N_REMOVE], 0);
+	return st;
+}
+
+/* with ops NULL, stop at the first difference with JSON_MORE */
+static int patch_diff(struct json_diff *d, object a, object b,
+		      struct listdata_builder *ops)
+{
+	object k;
+	if (a == b)
+		return JSON_DONE;
+	if ((is_cons(a) || is_cons(b)) && (k = container(a)) && k == container(b))
+		return k == EMPTY_DICT ? object_diff(d, a, b, ops) :
+		       array_diff(d, a, b, ops);
+	if (same_leaf(a, b, ops))
+		return JSON_DONE;
+	return add_op(d, ops, d->names[N_REPLACE], b);
+}
+
+int json_patch_diff(struct json_diff *d, object a, object b, object *patch)
+{
+	struct listdata_builder ops;
+	int i, st;
+
+	d->tab_top = 0;
+	d->nsegs = 0;
+	d->ops = 0;
+	d->reason = NULL;
+	for (i=0; i<NUM_NAMES; i++) {
+		if (!(d->names[i] = store_short(names[i])))
+			return fail(d, JSON_LIMIT, "heap limit");
+	}
+	list_begin(&ops);
+	if ((st = patch_diff(d, a, b, &ops)) != JSON_DONE)
+		return st;
+	*patch = list_finish(&ops, EMPTY_LIST);
+	return *patch ? JSON_DONE : fail(d, JSON_LIMIT, "heap limit");
+}
+
+/* the value of the member of object x named s, NULL if none */
+static object *field(object x, const char *s)
+{
+	for (; is_cons(x) && is_cons(get_tail(x)); x = get_tail(get_tail(x))) {
+		if (equals_str(get_head(x), s))
+			return load_cons(get_tail(x));
+	}
+	return NULL;
+}
+
+/* split the JSON Pointer path into segments after those in d->segs */
+static int parse_path(struct json_diff *d, object path)
+{
+	struct listdata_chunks it;
+	struct json_diff_seg *g = NULL;
+	const char *s;
+	unsigned long n, i, pos = 0, start = 0, len = 0;
+	int c, r, tilde = 0;
+
+	chunk_begin(&it, path);
+	while ((r = chunk_next(&it, &s, &n, &c)) > 0) {
+		for (i=0; i<n; i++, pos++) {
+			if (s)
+				c = (unsigned char) s[i];
+			if (tilde) {
+				if (c != '0' && c != '1')
+					return fail(d, JSON_ERROR, "invalid escape in path");
+				g->key = join(g->key, store_short(c == '0' ? "~" : "/"));
+				start = pos + 1;
+				tilde = 0;
+			} else if (c == '/') {
+				if (g && !(g->key = join(g->key, rope_sub(path, start,
+									  pos - start))))
+					return fail(d, JSON_LIMIT, "heap limit");
+				if (g && !len)
+					g->index = -1;
+				if (!(g = push(d)))
+					return fail(d, JSON_LIMIT, "out of memory");
+				g->key = store_short("");
+				g->index = 0;
+				start = pos + 1;
+				len = 0;
+				continue;
+			} else if (!g) {
+				return fail(d, JSON_ERROR, "path does not start with /");
+			} else if (c == '~') {
+				g->key = join(g->key, rope_sub(path, start, pos - start));
+				g->index = -1;
+				tilde = 1;
+			} else if (c == '-' && !len) {
+				g->index = -2;
+			} else if (c >= '0' && c <= '9' && g->index >= 0 &&
+				   (!len || g->index) && g->index <= (INT_MAX - 9) / 10) {
+				g->index = g->index * 10 + c - '0';
+			} else {
+				g->index = -1;
+			}
+			len++;
+		}
+	}
+	if (r < 0)
+		return fail(d, JSON_ERROR, "path is not a string");
+	if (tilde)
+		return fail(d, JSON_ERROR, "invalid escape in path");
+	if (g && !(g->key = join(g->key, rope_sub(path, start, pos - start))))
+		return fail(d, JSON_LIMIT, "heap limit");
+	if (g && !len)
+		g->index = -1;
+	return JSON_DONE;
+}
+
+/* do op at the path of segments i to end in *x: get or remove the
+   value there into *v, or add or replace it with *v */
+static int edit(struct json_diff *d, object *x, unsigned i, unsigned end,
+		int op, object *v)
+{
+	struct json_diff_seg *g = d->segs + i;
+	object kind, y, *p;
+	int k, n, st;
+
+	if (i == end) {
+		if (op == REMOVE)
+			return fail(d, JSON_ERROR, "cannot remove the whole value");
+		if (op == GET)
+			*v = *x;
+		else
+			*x = *v;
+		return JSON_DONE;
+	}
+	if ((kind = container(*x)) == EMPTY_DICT) {
+		if ((k = find(*x, g->key)) < 0) {
+			if (op != ADD || i + 1 < end)
+				return fail(d, JSON_ERROR, "path not found");
+			*x = put(*x, g->key, *v);
+			return *x ? JSON_DONE : fail(d, JSON_LIMIT, "heap limit");
+		}
+		p = nth_elem(*x, ++k);
+	} else if (kind == EMPTY_LIST) {
+		k = g->index == -2 ? (int) list_length(*x) : g->index;
+		if (op == ADD && i + 1 == end) {
+			if (k < 0 || !(y = nth_tail(*x, k)))
+				return fail(d, JSON_ERROR, "path not found");
+			*x = set_tail(*x, k, cons(*v, y));
+			return *x ? JSON_DONE : fail(d, JSON_LIMIT, "heap limit");
+		}
+		if (k < 0 || !(p = nth_elem(*x, k)))
+			return fail(d, JSON_ERROR, "path not found");
+	} else {
+		return fail(d, JSON_ERROR, "path not found");
+	}
+
+	y = *p;
+	if (i + 1 < end) {
+		if ((st = edit(d, &y, i + 1, end, op, v)) != JSON_DONE || y == *p)
+			return st;
+	} else if (op == GET) {
+		*v = y;
+		return JSON_DONE;
+	} else if (op == REMOVE) {
+		*v = y;
+		n = kind == EMPTY_DICT ? 2 : 1;		/* and the key */
+		k -= n - 1;
+		*x = set_tail(*x, k, nth_tail(*x, k + n));
+		return *x ? JSON_DONE : fail(d, JSON_LIMIT, "heap limit");
+	} else {
+		y = *v;
+	}
+	*x = set_elem(*x, k, p, y);
+	return *x ? JSON_DONE : fail(d, JSON_LIMIT, "heap limit");
+}
+
+/* copy the arrays and objects of x into *y, so that a change to one
+   is not seen in the other. Return 0 if out of memory. */
+static int copy(object x, object *y)
+{
+	struct listdata_builder b;
+	object end = container(x), z;
+	if (!end || !is_cons(x)) {
+		*y = x;
+		return 1;
+	}
+	list_begin(&b);
+	for (; is_cons(x); x = get_tail(x)) {
+		if (!copy(get_head(x), &z) || !list_append(&b, z))
+			return 0;
+	}
+	return (*y = list_finish(&b, end)) != 0;
+}
+
+/* 1 if the path of segments 0 to n is a proper prefix of the path of
+   segments n to d->nsegs */
+static int inside(struct json_diff *d, unsigned n)
+{
+	unsigned i;
+	if (d->nsegs - n <= n)
+		return 0;
+	for (i=0; i<n; i++) {
+		if (!equals(d->segs[i].key, d->segs[n + i].key))
+			return 0;
+	}
+	return 1;
+}
+
+static int apply_op(struct json_diff *d, object *x, object op)
+{
+	object *name, *path, *from, *value, v;
+	unsigned n;
+	int st;
+
+	if (container(op) != EMPTY_DICT || !(name = field(op, "op")) ||
+	    !(path = field(op, "path")))
+		return fail(d, JSON_ERROR, "operation without op or path");
+	value = field(op, "value");
+	from = field(op, "from");
+	d->nsegs = 0;
+	if (equals_str(*name, "move") || equals_str(*name, "copy")) {
+		if (!from)
+			return fail(d, JSON_ERROR, "operation without from");
+		if ((st = parse_path(d, *from)) != JSON_DONE)
+			return st;
+		n = d->nsegs;
+		if ((st = parse_path(d, *path)) != JSON_DONE)
+			return st;
+		if (equals_str(*name, "copy")) {
+			if ((st = edit(d, x, 0, n, GET, &v)) != JSON_DONE)
+				return st;
+			if (!copy(v, &v))
+				return fail(d, JSON_LIMIT, "heap limit");
+		} else {
+			if (inside(d, n))
+				return fail(d, JSON_ERROR, "move into itself");
+			if ((st = edit(d, x, 0, n, REMOVE, &v)) != JSON_DONE)
+				return st;
+		}
+		return edit(d, x, n, d->nsegs, ADD, &v);
+	}
+	if ((st = parse_path(d, *path)) != JSON_DONE)
+		return st;
+	if (equals_str(*name, "remove"))
+		return edit(d, x, 0, d->nsegs, REMOVE, &v);
+	if (!value)
+		return fail(d, JSON_ERROR, "operation without value");
+	v = *value;
+	if (equals_str(*name, "add"))
+		return edit(d, x, 0, d->nsegs, ADD, &v);
+	if (equals_str(*name, "replace"))
+		return edit(d, x, 0, d->nsegs, REPLACE, &v);
+	if (!equals_str(*name, "test"))
+		return fail(d, JSON_ERROR, "unknown op");
+	if ((st = edit(d, x, 0, d->nsegs, GET, &v)) != JSON_DONE)
+		return st;
+	/* members in any order */
+	d->nsegs = 0;
+	if ((st = patch_diff(d, v, *value, NULL)) == JSON_MORE)
+		return fail(d, JSON_ERROR, "test failed");
+	return st;
+}
+
+int json_patch_apply(struct json_diff *d, object *x, object patch)
+{
+	int st;
+	d->tab_top = 0;
+	d->ops = 0;
+	d->reason = NULL;
+	if (container(patch) != EMPTY_LIST)
+		return fail(d, JSON_ERROR, "patch is not an array");
+	for (; is_cons(patch); patch = get_tail(patch)) {
+		if ((st = apply_op(d, x, get_head(patch))) != JSON_DONE)
+			return st;
+		d->ops++;
+	}
+	return JSON_DONE;
+}
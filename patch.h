@@ -0,0 +1,74 @@
+#ifndef patch_h
+#define patch_h
+
+#include "json.h"
+
+/* Differences between two parsed JSON values a and b, as patches that
+   are parsed JSON values too, ready to be encoded and sent:
+
+	json_merge_diff		RFC 7386 merge patch: an object of the
+				members that changed, null for those
+				removed, b itself if either is not an object
+	json_patch_diff		RFC 6902 JSON Patch: an array of operations
+				{"op": "add", "path": "/a/0", "value": 1}
+				with the ops add, remove and replace
+
+   Values with identical handles are not looked into, and the members of
+   two objects are matched in order, then through a hash table of their
+   keys from the first that differ, so a diff of a value with an edited
+   copy of it (sharing what did not change) takes time in the size of
+   the changes and of the objects along their paths. Arrays are compared
+   element by element, so an element inserted or removed in front of
+   others shows as changes to each of them. Patches share the values
+   they carry with b, and paths share the keys, as ropes. The keys of an
+   object are taken to be distinct.
+
+	struct json_diff d;
+	json_diff_init(&d);
+	if (json_patch_diff(&d, old, new, &patch) == JSON_DONE)
+		... send patch ...
+	json_diff_free(&d);
+
+   The apply functions update a value in place: a member or element is
+   replaced or unlinked where it is, and a new member is added with
+   dict_set (in front). An element of an array is found by walking the
+   list to it. Conses that may not be modified (hash-consed or
+   frozen, see list_mutable) are copied in front of the change instead.
+   The values of the patch are linked into the result, so the patch
+   must not be released before it. */
+
+struct json_diff_entry;
+struct json_diff_seg;
+
+struct json_diff {
+	struct json_diff_entry *tab;	/* key tables of the objects being
+					   compared, one above the other */
+	unsigned tab_top, tab_max;
+	struct json_diff_seg *segs;	/* path being applied */
+	unsigned nsegs, segs_max;
+	object names[6];		/* "op" "path" "value" and the ops
+					   of a diff */
+	unsigned long ops;		/* in the last diff, or applied */
+	const char *reason;		/* of JSON_ERROR or JSON_LIMIT */
+};
+
+void json_diff_init(struct json_diff *);
+void json_diff_free(struct json_diff *);
+
+/* patch turning a into b. Return JSON_DONE or JSON_LIMIT if out of
+   memory. A merge patch cannot hold a null value, so a member that
+   becomes null comes out as a removal, and a new one that is null is
+   left out. An empty patch ({} or []) means no change. */
+int  json_merge_diff(struct json_diff *, object a, object b, object *patch);
+int  json_patch_diff(struct json_diff *, object a, object b, object *patch);
+
+/* apply the patch to *x. Return JSON_DONE, JSON_ERROR if the patch is
+   malformed, a path does not lead to a value or a test failed (*x
+   then has the operations before it applied), or JSON_LIMIT if out of
+   memory. json_patch_apply also does the ops move, copy and test,
+   which takes numbers to be equal when their values are (1 and 1.0),
+   where a diff tells them apart. */
+int  json_merge_apply(struct json_diff *, object *x, object patch);
+int  json_patch_apply(struct json_diff *, object *x, object patch);
+
+#endif
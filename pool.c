@@ -0,0 +1,589 @@
+/* Work-stealing pool and parallel list algorithms, see pool.h.
+ *
+ *  A job is a function run for the tasks numbered 0 to ntasks - 1.
+ *  Each part (thread taking part, 0 the caller) has the range lo..hi of
+ *  the tasks it has left, under its lock: the owner takes lo, a thief
+ *  moves hi down. A thread that finds no task left anywhere leaves the
+ *  job, and the caller returns when all of them have left it.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#ifdef LISTDATA_THREADS
+#include <pthread.h>
+#endif
+#include "pool.h"
+#include "query.h"
+#include "cbor.h"
+
+#define CHUNK 4096
+#define RUN 16			/* sorted by insertion before merging */
+#define NONE ULONG_MAX		/* no task */
+
+struct item {
+	object key, x;
+};
+
+struct job {
+	void (*run)(struct job *, unsigned long task);
+	object *v;		/* the elements */
+	unsigned long n, chunk;
+	void *arg;
+	/* sort */
+	struct item *src, *dst;
+	unsigned long width;	/* of the runs being merged */
+	int (*cmp)(object, object, void *);
+	const char *const *path;
+	/* map */
+	object (*f)(object, void *);
+	struct cbor_buf *bufs;	/* results of each task */
+	unsigned char *bad;	/* a result of the task did not encode */
+	/* reduce */
+	void (*step)(void *, object, void *);
+	char *accs;		/* of each task */
+	const void *init;
+	size_t size;
+};
+
+struct part {
+	struct list_pool_state *st;
+	unsigned index;
+	unsigned long lo, hi;	/* tasks left */
+	unsigned long steals;	/* in the job */
+#ifdef LISTDATA_THREADS
+	pthread_t thread;
+	pthread_mutex_t lock;
+#endif
+};
+
+struct list_pool_state {
+	struct part *parts;
+	unsigned n;		/* threads started + 1 */
+	struct job *job;
+	unsigned long gen;	/* jobs started */
+	unsigned busy;		/* threads started still in the job */
+	int stop;
+#ifdef LISTDATA_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+#endif
+};
+
+static int fail(struct list_pool *p, const char *reason)
+{
+	p->reason = reason;
+	return 0;
+}
+
+static void lock(struct part *w)
+{
+#ifdef LISTDATA_THREADS
+	pthread_mutex_lock(&w->lock);
+#else
+	(void) w;
+#endif
+}
+
+static void unlock(struct part *w)
+{
+#ifdef LISTDATA_THREADS
+	pthread_mutex_unlock(&w->lock);
+#else
+	(void) w;
+#endif
+}
+
+/* next task of w, else the first of the back half stolen from the
+   next part that has some left, NONE if there is none */
+static unsigned long take(struct part *w)
+{
+	struct list_pool_state *st = w->st;
+	struct part *v;
+	unsigned long t = NONE, hi = 0;
+	unsigned i;
+
+	lock(w);
+	if (w->lo < w->hi)
+		t = w->lo++;
+	unlock(w);
+	for (i=1; t == NONE && i<st->n; i++) {
+		v = st->parts + (w->index + i) % st->n;
+		lock(v);
+		if (v->lo < v->hi) {
+			hi = v->hi;
+			t = v->hi = v->lo + (hi - v->lo) / 2;
+		}
+		unlock(v);
+	}
+	if (t != NONE && i > 1) {
+		lock(w);
+		w->lo = t + 1;
+		w->hi = hi;
+		unlock(w);
+		w->steals++;
+	}
+	return t;
+}
+
+static void run_tasks(struct part *w)
+{
+	struct job *job = w->st->job;
+	unsigned long t;
+	while ((t = take(w)) != NONE)
+		job->run(job, t);
+}
+
+#ifdef LISTDATA_THREADS
+static void *work(void *arg)
+{
+	struct part *w = arg;
+	struct list_pool_state *st = w->st;
+	unsigned long gen = 0;
+
+	pthread_mutex_lock(&st->lock);
+	for (;;) {
+		while (!st->stop && st->gen == gen)
+			pthread_cond_wait(&st->start, &st->lock);
+		if (st->stop)
+			break;
+		gen = st->gen;
+		pthread_mutex_unlock(&st->lock);
+		run_tasks(w);
+		pthread_mutex_lock(&st->lock);
+		if (!--st->busy)
+			pthread_cond_signal(&st->done);
+	}
+	pthread_mutex_unlock(&st->lock);
+	listdata_thread_exit();
+	return NULL;
+}
+#endif
+
+/* run f for tasks 0 to ntasks - 1 on all the parts */
+static void run_job(struct list_pool *p, struct job *job,
+		    void (*f)(struct job *, unsigned long), unsigned long ntasks)
+{
+	struct list_pool_state *st = p->st;
+	unsigned i;
+
+	job->run = f;
+	st->job = job;
+	for (i=0; i<st->n; i++) {
+		st->parts[i].lo = ntasks / st->n * i + (ntasks % st->n) * i / st->n;
+		st->parts[i].hi = ntasks / st->n * (i + 1) +
+				  (ntasks % st->n) * (i + 1) / st->n;
+		st->parts[i].steals = 0;
+	}
+#ifdef LISTDATA_THREADS
+	pthread_mutex_lock(&st->lock);
+	st->busy = st->n - 1;
+	st->gen++;
+	pthread_cond_broadcast(&st->start);
+	pthread_mutex_unlock(&st->lock);
+#endif
+	run_tasks(st->parts);
+#ifdef LISTDATA_THREADS
+	pthread_mutex_lock(&st->lock);
+	while (st->busy)
+		pthread_cond_wait(&st->done, &st->lock);
+	pthread_mutex_unlock(&st->lock);
+#endif
+	p->tasks += ntasks;
+	for (i=0; i<st->n; i++)
+		p->steals += st->parts[i].steals;
+}
+
+int list_pool_init(struct list_pool *p, unsigned threads)
+{
+	struct list_pool_state *st;
+	unsigned i;
+
+	memset(p, 0, sizeof(*p));
+	p->chunk = CHUNK;
+#ifndef LISTDATA_THREADS
+	threads = 1;
+#endif
+	if (!threads)
+		threads = 1;
+	if (!(st = p->st = calloc(1, sizeof(*st))) ||
+	    !(st->parts = calloc(threads, sizeof(*st->parts)))) {
+		free(st);
+		p->st = NULL;
+		return fail(p, "out of memory");
+	}
+	st->n = 1;
+	st->parts->st = st;
+#ifdef LISTDATA_THREADS
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->start, NULL);
+	pthread_cond_init(&st->done, NULL);
+	pthread_mutex_init(&st->parts->lock, NULL);
+	for (i=1; i<threads; i++) {
+		struct part *w = st->parts + i;
+		w->st = st;
+		w->index = i;
+		pthread_mutex_init(&w->lock, NULL);
+		if (pthread_create(&w->thread, NULL, work, w)) {
+			pthread_mutex_destroy(&w->lock);
+			p->threads = st->n;
+			list_pool_free(p);
+			return fail(p, "cannot start a thread");
+		}
+		st->n++;
+	}
+#else
+	(void) i;
+#endif
+	p->threads = st->n;
+	return 1;
+}
+
+void list_pool_free(struct list_pool *p)
+{
+	struct list_pool_state *st = p->st;
+	unsigned i;
+
+	if (!st)
+		return;
+#ifdef LISTDATA_THREADS
+	pthread_mutex_lock(&st->lock);
+	st->stop = 1;
+	pthread_cond_broadcast(&st->start);
+	pthread_mutex_unlock(&st->lock);
+	for (i=1; i<st->n; i++)
+		pthread_join(st->parts[i].thread, NULL);
+	for (i=0; i<st->n; i++)
+		pthread_mutex_destroy(&st->parts[i].lock);
+	pthread_cond_destroy(&st->done);
+	pthread_cond_destroy(&st->start);
+	pthread_mutex_destroy(&st->lock);
+#else
+	(void) i;
+#endif
+	free(st->parts);
+	free(st);
+	p->st = NULL;
+}
+
+/* the elements of list into job->v, 0 if out of memory or one cannot
+   be read by the other threads */
+static int load(struct list_pool *p, struct job *job, object list)
+{
+	unsigned long i;
+
+	memset(job, 0, sizeof(*job));
+	job->chunk = p->chunk ? p->chunk : CHUNK;
+	job->n = list_length(list);
+	if (job->n > UINT_MAX)
+		return fail(p, "list too long");
+	if (!(job->v = malloc((job->n + 1) * sizeof(object))))
+		return fail(p, "out of memory");
+	for (i=0; is_cons(list); list = get_tail(list))
+		job->v[i++] = get_head(list);
+#ifdef LISTDATA_THREADS
+	for (i=0; p->st->n > 1 && i<job->n; i++) {
+		if (listdata_private(job->v[i])) {
+			free(job->v);
+			return fail(p, "element private to the calling thread");
+		}
+	}
+#endif
+	return 1;
+}
+
+static unsigned long tasks(struct job *job, unsigned long n)
+{
+	return (n + job->chunk - 1) / job->chunk;
+}
+
+/* elements lo..hi of task t */
+static void task_range(struct job *job, unsigned long t, unsigned long *lo,
+		       unsigned long *hi)
+{
+	*lo = t * job->chunk;
+	*hi = job->n - *lo < job->chunk ? job->n : *lo + job->chunk;
+}
+
+/* Sort */
+
+/* the value at path in x, null if it is not there */
+static object member_at(object x, const char *const *path)
+{
+	object y;
+	for (; *path; path++) {
+		if (!is_cons(x) || last_tail(x, 0) != EMPTY_DICT)
+			return 0;
+		for (y = x; is_cons(y); y = get_tail(get_tail(y)))
+			if (equals_str(get_head(y), *path))
+				break;
+		if (!is_cons(y))
+			return 0;
+		x = *second(y);
+	}
+	return x;
+}
+
+/* a goes strictly before b */
+static int before(struct job *job, const struct item *a, const struct item *b)
+{
+	if (job->cmp)
+		return job->cmp(a->x, b->x, job->arg) < 0;
+	return query_order(a->key, b->key) < 0;
+}
+
+/* merge a (na items) and b (nb) into out, a first of equal items */
+static void merge(struct job *job, const struct item *a, unsigned long na,
+		  const struct item *b, unsigned long nb, struct item *out)
+{
+	const struct item *ea = a + na, *eb = b + nb;
+	while (a < ea && b < eb)
+		*out++ = before(job, b, a) ? *b++ : *a++;
+	memcpy(out, a, (ea - a) * sizeof(*a));
+	memcpy(out + (ea - a), b, (eb - b) * sizeof(*b));
+}
+
+/* number of items of a among the first k of the merge of a and b */
+static unsigned long merge_split(struct job *job, const struct item *a,
+				 unsigned long na, const struct item *b,
+				 unsigned long nb, unsigned long k)
+{
+	unsigned long lo = k > nb ? k - nb : 0, hi = k < na ? k : na, i;
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (before(job, b + k - i - 1, a + i))
+			hi = i;
+		else
+			lo = i + 1;
+	}
+	return lo;
+}
+
+/* decorate the elements of task t and sort them in src, in runs of
+   RUN by insertion, then by merging runs through dst */
+static void sort_task(struct job *job, unsigned long t)
+{
+	unsigned long lo, hi, n, i, k, m, w;
+	struct item *s, *d, *tmp, x;
+
+	task_range(job, t, &lo, &hi);
+	n = hi - lo;
+	s = job->src + lo;
+	d = job->dst + lo;
+	for (i=0; i<n; i++) {
+		s[i].x = job->v[lo + i];
+		s[i].key = job->path ? member_at(s[i].x, job->path) : s[i].x;
+	}
+	for (i=0; i<n; i+=RUN) {
+		m = n - i < RUN ? n - i : RUN;
+		for (k=1; k<m; k++) {
+			x = s[i + k];
+			for (w = k; w && before(job, &x, s + i + w - 1); w--)
+				s[i + w] = s[i + w - 1];
+			s[i + w] = x;
+		}
+	}
+	for (w=RUN; w<n; w*=2) {
+		for (i=0; i<n; i+=2*w) {
+			m = n - i < w ? n - i : w;
+			k = n - i - m < w ? n - i - m : w;
+			merge(job, s + i, m, s + i + m, k, d + i);
+		}
+		tmp = s;
+		s = d;
+		d = tmp;
+	}
+	if (s != job->src + lo)
+		memcpy(job->src + lo, s, n * sizeof(*s));
+}
+
+/* chunk items of the merge of two runs of width from src into dst */
+static void merge_task(struct job *job, unsigned long t)
+{
+	unsigned long w = job->width, per = 2 * w / job->chunk;
+	unsigned long base = t / per * 2 * w, k = t % per * job->chunk;
+	unsigned long na, nb, end, i0, i1;
+	struct item *a = job->src + base, *b;
+
+	na = job->n - base < w ? job->n - base : w;
+	nb = job->n - base - na < w ? job->n - base - na : w;
+	if (k >= na + nb)
+		return;
+	b = a + na;
+	end = na + nb - k < job->chunk ? na + nb : k + job->chunk;
+	i0 = merge_split(job, a, na, b, nb, k);
+	i1 = merge_split(job, a, na, b, nb, end);
+	merge(job, a + i0, i1 - i0, b + (k - i0), (end - i1) - (k - i0),
+	      job->dst + base + k);
+}
+
+static object sort(struct list_pool *p, object list,
+		   int (*cmp)(object, object, void *),
+		   const char *const *path, void *arg)
+{
+	struct job job;
+	struct item *items, *tmp;
+	unsigned long w, i;
+	object r = 0;
+
+	if (!load(p, &job, list))
+		return 0;
+	job.cmp = cmp;
+	job.path = path;
+	job.arg = arg;
+	if (!(items = malloc((2 * job.n + 1) * sizeof(*items)))) {
+		free(job.v);
+		fail(p, "out of memory");
+		return 0;
+	}
+	job.src = items;
+	job.dst = items + job.n;
+	run_job(p, &job, sort_task, tasks(&job, job.n));
+	for (w=job.chunk; w<job.n; w*=2) {
+		job.width = w;
+		run_job(p, &job, merge_task,
+			(job.n + 2 * w - 1) / (2 * w) * (2 * w / job.chunk));
+		tmp = job.src;
+		job.src = job.dst;
+		job.dst = tmp;
+	}
+	for (i=0; i<job.n; i++)
+		job.v[i] = job.src[i].x;
+	if (!(r = list_from_array(job.v, job.n, EMPTY_LIST)))
+		fail(p, "out of memory");
+	free(items);
+	free(job.v);
+	return r;
+}
+
+object list_sort(struct list_pool *p, object list,
+		 int (*cmp)(object, object, void *), void *arg)
+{
+	return sort(p, list, cmp, NULL, arg);
+}
+
+object list_sort_by(struct list_pool *p, object list, const char *const *path)
+{
+	return sort(p, list, NULL, path, NULL);
+}
+
+/* Map */
+
+/* f of the elements of task t, encoded, in a heap released after */
+static void map_task(struct job *job, unsigned long t)
+{
+	struct cbor_buf *b = job->bufs + t;
+	unsigned long lo, hi;
+	mpoint mp;
+
+	task_range(job, t, &lo, &hi);
+	listdata_mark(mp);
+	for (; lo < hi; lo++) {
+		if (!cbor_encode(b, job->f(job->v[lo], job->arg))) {
+			job->bad[t] = 1;
+			break;
+		}
+	}
+	listdata_release(mp);
+}
+
+object list_map(struct list_pool *p, object list,
+		object (*f)(object, void *), void *arg)
+{
+	struct listdata_builder lb;
+	struct cbor_decoder d;
+	struct job job;
+	unsigned long n, t, i;
+	size_t off;
+	object r = 0;
+
+	if (!load(p, &job, list))
+		return 0;
+	job.f = f;
+	job.arg = arg;
+	n = tasks(&job, job.n);
+	if (!(job.bufs = malloc((n + 1) * sizeof(*job.bufs))) ||
+	    !(job.bad = calloc(n + 1, 1))) {
+		free(job.bufs);
+		free(job.v);
+		fail(p, "out of memory");
+		return 0;
+	}
+	for (t=0; t<n; t++)
+		cbor_buf_init(job.bufs + t);
+	run_job(p, &job, map_task, n);
+
+	cbor_decoder_init(&d);
+	list_begin(&lb);
+	for (t=0, i=0; t<n; t++) {
+		if (job.bad[t]) {
+			fail(p, "result not a JSON value");
+			break;
+		}
+		for (off = 0; off < job.bufs[t].len; off += d.offset, i++) {
+			if (cbor_decode(&d, job.bufs[t].s + off,
+					job.bufs[t].len - off) != JSON_DONE ||
+			    !list_append(&lb, d.result)) {
+				fail(p, "out of memory");
+				break;
+			}
+		}
+		if (off < job.bufs[t].len)
+			break;
+	}
+	r = list_finish(&lb, EMPTY_LIST);
+	if (t < n)
+		r = 0;
+	else if (!r)
+		fail(p, "out of memory");
+	cbor_decoder_free(&d);
+	for (t=0; t<n; t++)
+		cbor_buf_free(job.bufs + t);
+	free(job.bad);
+	free(job.bufs);
+	free(job.v);
+	return r;
+}
+
+/* Reduce */
+
+static void reduce_task(struct job *job, unsigned long t)
+{
+	char *acc = job->accs + t * job->size;
+	unsigned long lo, hi;
+
+	task_range(job, t, &lo, &hi);
+	memcpy(acc, job->init, job->size);
+	for (; lo < hi; lo++)
+		job->step(acc, job->v[lo], job->arg);
+}
+
+int list_reduce(struct list_pool *p, object list, void *acc, size_t size,
+		void (*step)(void *, object, void *),
+		void (*combine)(void *, const void *, void *), void *arg)
+{
+	struct job job;
+	unsigned long n, t;
+	void *init;
+
+	if (!load(p, &job, list))
+		return 0;
+	job.step = step;
+	job.size = size;
+	job.arg = arg;
+	n = tasks(&job, job.n);
+	if (!(init = malloc(size + 1)) ||
+	    !(job.accs = malloc(n * size + 1))) {
+		free(init);
+		free(job.v);
+		return fail(p, "out of memory");
+	}
+	memcpy(init, acc, size);
+	job.init = init;
+	run_job(p, &job, reduce_task, n);
+	for (t=0; t<n; t++)
+		combine(acc, job.accs + t * size, arg);
+	free(job.accs);
+	free(init);
+	free(job.v);
+	return 1;
+}
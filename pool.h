@@ -0,0 +1,90 @@
+#ifndef pool_h
+#define pool_h
+
+#include "json.h"
+
+/* Parallel sort, map and reduce over the elements of a list, with a
+   work-stealing pool of threads.
+
+   The list is split into tasks of chunk elements. Each thread taking
+   part (the calling one among them) starts with an equal share of the
+   tasks, runs them from the front and, when it has none left, steals
+   the back half of the tasks another one has left, so that a thread
+   slowed by costly elements is helped by the others. Results are put
+   together in the order of the list, so they do not depend on the
+   number of threads:
+
+	list_sort	stable merge sort: the tasks sort runs of chunk
+			elements, then merge pairs of runs, each merge
+			split into tasks of chunk elements at the points
+			found by binary search on both runs
+	list_map	f on each element, in the heap of the thread; the
+			results of a task are encoded to CBOR and its heap
+			released, and the calling thread decodes them into
+			the new list
+	list_reduce	an accumulator for each task, combined in order
+
+   Built with LISTDATA_THREADS (liblistdata-mt.a, link with -pthread),
+   other threads cannot read the private heap of the caller, so the
+   elements must be frozen or held in their handles (see
+   listdata_freeze): freeze the data, then start the pool. Otherwise,
+   or with 1 thread, everything runs in the calling thread.
+
+	struct list_pool p;
+	list_pool_init(&p, 4);
+	sorted = list_sort_by(&p, records, path);
+	list_pool_free(&p);
+*/
+
+struct list_pool_state;
+
+struct list_pool {
+	unsigned threads;		/* taking part, the caller included */
+	unsigned long chunk;		/* elements of a task (default 4096) */
+	unsigned long tasks,		/* run */
+		      steals;		/* of tasks from another thread */
+	const char *reason;		/* of the last failure */
+	struct list_pool_state *st;
+};
+
+/* start threads - 1 threads (none without LISTDATA_THREADS), return 0
+   if out of memory or a thread could not be started (see reason) */
+int  list_pool_init(struct list_pool *, unsigned threads);
+
+/* stop the threads and free everything */
+void list_pool_free(struct list_pool *);
+
+/* new list of the elements of list in the order of cmp (negative, 0
+   or positive as a is before, equal to or after b), elements that
+   compare equal in the order of list. cmp is called from all the
+   threads. Return 0 if out of memory or an element is private to the
+   calling thread (see reason). */
+object list_sort(struct list_pool *, object list,
+		 int (*cmp)(object a, object b, void *arg), void *arg);
+
+/* list_sort by the value at path in each element, a NULL-terminated
+   array of member names, in the order of query_order, which is jq's:
+   objects by their sorted keys, then by their values. A value that is
+   not there (or in an element that is not an object) is null. */
+object list_sort_by(struct list_pool *, object list, const char *const *path);
+
+/* new list of f(x, arg) for each element x of list, in order. f is
+   called from all the threads and its results must be JSON values.
+   Return 0 if out of memory, a result is not a JSON value or an
+   element is private to the calling thread (see reason). */
+object list_map(struct list_pool *, object list,
+		object (*f)(object x, void *arg), void *arg);
+
+/* Fold the elements of list into acc, size bytes of plain memory that
+   hold the identity on entry (0 for a sum): each task starts from a
+   copy of it and calls step(its acc, x, arg) for each of its elements,
+   and the accumulators of the tasks are then passed in order to
+   combine(acc, task acc, arg) in the calling thread. step is called
+   from all the threads. Return 0 if out of memory or an element is
+   private to the calling thread (see reason). */
+int  list_reduce(struct list_pool *, object list, void *acc, size_t size,
+		 void (*step)(void *acc, object x, void *arg),
+		 void (*combine)(void *acc, const void *part, void *arg),
+		 void *arg);
+
+#endif
@@ -1,38 +1,658 @@
 #include <stdio.h>
-#include <ctype.h>
-#include "listdata.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include "print.h"
+
+#define PRINT_BUF_SIZE 8192	/* before a flush to f or fd */
+#define DEPTH_MAX 1024
 
 #define NUM_NAMES 3
 static const char *names[NUM_NAMES] = {"null", "()", "{}"};
 
-void print(Q x)
+static const char digits[] = "0123456789ABCDEF";
+
+/* Printer */
+
+void print_buf_init(struct print_buf *b)
 {
-	switch (type_of(x)) {
-	case TYP_CONS:
-		putchar('(');
-		print(get_head(x));
-		while (is_cons(x = get_tail(x))) {
-			putchar(' ');
-			print(get_head(x));
+	memset(b, 0, sizeof(*b));
+	b->fd = -1;
+	b->depth_max = UINT_MAX;
+}
+
+void print_buf_free(struct print_buf *b)
+{
+	free(b->s);
+	b->s = NULL;
+	b->len = b->max = 0;
+}
+
+int print_flush(struct print_buf *b)
+{
+	size_t n = 0;
+	ssize_t k;
+	if (b->error)
+		return 0;
+	if (b->f) {
+		if (fwrite(b->s, 1, b->len, b->f) < b->len)
+			b->error = 1;
+		n = b->len;
+	} else if (b->fd >= 0) {
+		while (n < b->len) {
+			k = write(b->fd, b->s + n, b->len - n);
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k <= 0) {
+				b->error = 1;
+				break;
+			}
+			n += k;
 		}
-		if (x != EMPTY_LIST) {
-			printf(" . ");
-			print(x);
+	}
+	b->len -= n;
+	return !b->error;
+}
+
+/* room for at least 1 and up to n bytes, NULL after an error */
+static char *reserve(struct print_buf *b, size_t n, size_t *room)
+{
+	size_t m;
+	char *s;
+	if (b->error)
+		return NULL;
+	if (b->len == b->max) {
+		if (b->len && (b->f || b->fd >= 0)) {
+			if (!print_flush(b))
+				return NULL;
+		} else {
+			m = b->max ? b->max * 2 : PRINT_BUF_SIZE;
+			if (!(s = realloc(b->s, m))) {
+				b->error = 1;
+				return NULL;
+			}
+			b->s = s;
+			b->max = m;
+		}
+	}
+	*room = b->max - b->len < n ? b->max - b->len : n;
+	return b->s + b->len;
+}
+
+static void put(struct print_buf *b, const char *s, size_t n)
+{
+	size_t k;
+	char *p;
+	while (n && (p = reserve(b, n, &k))) {
+		memcpy(p, s, k);
+		b->len += k;
+		s += k;
+		n -= k;
+	}
+}
+
+static void put_char(struct print_buf *b, int c)
+{
+	char ch = c;
+	if (b->len < b->max)
+		b->s[b->len++] = ch;
+	else
+		put(b, &ch, 1);
+}
+
+static void put_int(struct print_buf *b, long v)
+{
+	char buf[24], *p = buf + sizeof(buf);
+	unsigned long u = v < 0 ? -(unsigned long) v : (unsigned long) v;
+	do
+		*--p = '0' + u % 10;
+	while (u /= 10);
+	if (v < 0)
+		*--p = '-';
+	put(b, p, buf + sizeof(buf) - p);
+}
+
+/* \uXXXX, or \UXXXXXX above U+FFFF */
+static void put_uc(struct print_buf *b, int c)
+{
+	char buf[8];
+	int i, n = c > 0xFFFF ? 6 : 4;
+	buf[0] = '\\';
+	buf[1] = n == 6 ? 'U' : 'u';
+	for (i=0; i<n; i++)
+		buf[2 + i] = digits[c >> 4 * (n - 1 - i) & 0xF];
+	put(b, buf, 2 + n);
+}
+
+static void put_chars(struct print_buf *b, const char *s, unsigned long n)
+{
+	const char *e = s + n, *p;
+	unsigned char c;
+	while (s < e) {
+		for (p = s; p < e && (c = *p) >= 0x20 && c != '"' && c != '\\'; p++)
+			;
+		put(b, s, p - s);
+		if (p == e)
+			break;
+		switch (c = *p) {
+		case '"':  put(b, "\\\"", 2); break;
+		case '\\': put(b, "\\\\", 2); break;
+		case '\n': put(b, "\\n", 2); break;
+		case '\r': put(b, "\\r", 2); break;
+		case '\t': put(b, "\\t", 2); break;
+		default:   put_uc(b, c);
 		}
-		putchar(')');
+		s = p + 1;
+	}
+}
+
+/* string, consed string or rope */
+static void put_string(struct print_buf *b, listdata_type x)
+{
+	struct listdata_chunks c;
+	const char *s;
+	unsigned long n;
+	int ch;
+	put_char(b, '"');
+	chunk_begin(&c, x);
+	while (chunk_next(&c, &s, &n, &ch) > 0) {
+		if (s)
+			put_chars(b, s, n);
+		else
+			put_uc(b, ch);
+	}
+	put_char(b, '"');
+}
+
+static void put_value(struct print_buf *b, listdata_type x, unsigned depth);
+
+/* a cons printed as a string */
+static int is_string(listdata_type x)
+{
+	switch (type_of(last_tail(x, 0))) {
+	case TYP_STR:
+	case TYP_SHORT:
+	case TYP_ROPE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void newline(struct print_buf *b, unsigned depth)
+{
+	unsigned i;
+	put_char(b, '\n');
+	for (i=0; i<depth; i++)
+		put(b, "  ", 2);
+}
+
+/* list x ending in end */
+static void put_list(struct print_buf *b, listdata_type x, listdata_type end,
+		     unsigned depth)
+{
+	listdata_type y;
+	int lines = 0, i;
+	if (depth >= b->depth_max) {
+		put(b, "...", 3);
+		return;
+	}
+	for (y = x; b->pretty && !lines && is_cons(y); y = get_tail(y))
+		lines = is_cons(get_head(y)) && !is_string(get_head(y));
+	put_char(b, '(');
+	for (i=0; is_cons(x); x = get_tail(x), i++) {
+		if (i && lines && (end != EMPTY_DICT || i % 2 == 0))
+			newline(b, depth + 1);
+		else if (i)
+			put_char(b, ' ');
+		put_value(b, get_head(x), depth + 1);
+	}
+	if (x != EMPTY_LIST) {
+		put(b, " . ", 3);
+		put_value(b, x, depth + 1);
+	}
+	put_char(b, ')');
+}
+
+static void put_value(struct print_buf *b, listdata_type x, unsigned depth)
+{
+	int m, e;
+	switch (type_of(x)) {
+	case TYP_CONS:
+		if (is_string(x))
+			put_string(b, x);
+		else
+			put_list(b, x, last_tail(x, 0), depth);
 		break;
 	case TYP_STR:
-		printf("\"%s\"", load_str(x));
+		put_char(b, '"');
+		put_chars(b, load_str(x), strlen(load_str(x)));
+		put_char(b, '"');
+		break;
+	case TYP_ROPE:
+	case TYP_SHORT:
+		put_string(b, x);
 		break;
 	case TYP_INT:
-		printf("%d", load_int(x));
+		put_int(b, load_int(x));
+		break;
+	case TYP_NUM:
+		load_num(x, &m, &e);
+		put_int(b, m);
+		put_char(b, 'e');
+		put_int(b, e);
 		break;
 	case TYP_ATOM:
-		if (x < NUM_NAMES)
-			printf(names[x]);
-		else if (x >= 0x20 && x < 0x7F)
-			printf("'%c'", x);
-		else
-			printf("0x%X", x);
+		if (x < NUM_NAMES) {
+			put(b, names[x], strlen(names[x]));
+		} else if (x >= 0x20 && x < 0x7F) {
+			put_char(b, '\'');
+			put_char(b, (int) x);
+			put_char(b, '\'');
+		} else {
+			put(b, "0x", 2);
+			for (m = sizeof(x) * 2 - 1; m > 0 && !(x >> 4 * m); m--)
+				;
+			for (; m >= 0; m--)
+				put_char(b, digits[x >> 4 * m & 0xF]);
+		}
+	}
+}
+
+int bprint(struct print_buf *b, listdata_type x)
+{
+	put_value(b, x, 0);
+	return !b->error;
+}
+
+void fprint(FILE *f, listdata_type x)
+{
+	struct print_buf b;
+	print_buf_init(&b);
+	b.f = f;
+	bprint(&b, x);
+	print_flush(&b);
+	print_buf_free(&b);
+}
+
+void print(listdata_type x)
+{
+	fprint(stdout, x);
+}
+
+/* Reader */
+
+struct input {
+	struct sexp_reader *r;
+	const char *s, *e;
+};
+
+static void *grow(void *mem, unsigned *max, size_t size)
+{
+	unsigned n = *max ? *max << 1 : 16;
+	void *p = n > *max ? realloc(mem, (size_t) n * size) : NULL;
+	if (p)
+		*max = n;
+	return p;
+}
+
+void sexp_reader_init(struct sexp_reader *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->limits.depth = DEPTH_MAX;
+	r->limits.str_len = UINT_MAX;
+	r->limits.elems = UINT_MAX;
+}
+
+void sexp_reader_free(struct sexp_reader *r)
+{
+	free(r->buf);
+	free(r->ucs);
+	sexp_reader_init(r);
+}
+
+static int fail(struct input *in, int st, const char *reason)
+{
+	in->r->reason = reason;
+	return st;
+}
+
+static int blank(int c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* after a number or word */
+static int delimiter(struct input *in)
+{
+	return in->s == in->e || blank(*in->s) || *in->s == '(' ||
+	       *in->s == ')' || *in->s == '"';
+}
+
+static int put_bytes(struct input *in, const char *s, unsigned n)
+{
+	struct sexp_reader *r = in->r;
+	char *buf;
+	if (n > r->limits.str_len - r->len - r->nucs)
+		return fail(in, JSON_LIMIT, "string length limit");
+	while (r->len + n >= r->buf_max) {
+		if (!(buf = grow(r->buf, &r->buf_max, 1)))
+			return fail(in, JSON_LIMIT, "out of memory");
+		r->buf = buf;
+	}
+	memcpy(r->buf + r->len, s, n);
+	r->len += n;
+	return JSON_DONE;
+}
+
+/* a character above U+00FF (or U+0000), kept aside as by the parser */
+static int read_uc(struct input *in, int c)
+{
+	struct sexp_reader *r = in->r;
+	struct json_uc *u;
+	char b = c;
+	if (c && c < 0x100)
+		return put_bytes(in, &b, 1);
+	if (r->len + r->nucs >= r->limits.str_len)
+		return fail(in, JSON_LIMIT, "string length limit");
+	if (r->nucs == r->ucs_max) {
+		if (!(u = grow(r->ucs, &r->ucs_max, sizeof(*u))))
+			return fail(in, JSON_LIMIT, "out of memory");
+		r->ucs = u;
+	}
+	u = r->ucs + r->nucs++;
+	u->pos = r->len;
+	u->uc = c;
+	return JSON_DONE;
+}
+
+static object store_part(char *buf, unsigned a, unsigned b)
+{
+	object x;
+	char c = buf[b];
+	buf[b] = '\0';
+	x = store_str(buf + a);
+	buf[b] = c;
+	return x;
+}
+
+/* as the JSON parser makes a string */
+static object make_string(struct sexp_reader *r)
+{
+	object x, y;
+	unsigned i = r->nucs, n;
+	if (!r->buf) {
+		if (!(r->buf = grow(NULL, &r->buf_max, 1)))
+			return 0;
+	}
+	r->buf[r->len] = '\0';
+	if (!i)
+		return store_short(r->buf);
+	x = store_str(r->buf + r->ucs[i-1].pos);
+	while (x && i--) {
+		y = store_int(r->ucs[i].uc);
+		x = y ? cons(y, x) : 0;
+		n = r->ucs[i].pos;
+		if (i)
+			n -= r->ucs[i-1].pos;
+		if (x && n) {
+			y = store_part(r->buf, r->ucs[i].pos - n, r->ucs[i].pos);
+			x = y ? concat(y, x) : 0;
+		}
+	}
+	return x;
+}
+
+static int hex(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* character of n hex digits */
+static int hex_char(struct input *in, int n, int *c)
+{
+	int d;
+	if (in->e - in->s < n)
+		return JSON_MORE;
+	for (*c = 0; n--; in->s++) {
+		if ((d = hex(*in->s)) < 0)
+			return fail(in, JSON_ERROR, "hex digit expected");
+		*c = *c << 4 | d;
+	}
+	return JSON_DONE;
+}
+
+static int read_string(struct input *in, object *x)
+{
+	struct sexp_reader *r = in->r;
+	const char *p;
+	int c, st;
+
+	r->len = r->nucs = 0;
+	for (;;) {
+		for (p = in->s; p < in->e && *p != '"' && *p != '\\' && *p; p++)
+			;
+		if (p > in->s && (st = put_bytes(in, in->s, p - in->s)) != JSON_DONE)
+			return st;
+		in->s = p;
+		if (p == in->e)
+			return JSON_MORE;
+		if (!*p)
+			return fail(in, JSON_ERROR, "invalid character");
+		if (*in->s++ == '"')
+			break;
+		if (in->s == in->e)
+			return JSON_MORE;
+		switch (c = *in->s++) {
+		case '"': case '\\': break;
+		case 'n': c = '\n'; break;
+		case 'r': c = '\r'; break;
+		case 't': c = '\t'; break;
+		case 'u':
+		case 'U':
+			if ((st = hex_char(in, c == 'u' ? 4 : 6, &c)) != JSON_DONE)
+				return st;
+			if (c > 0x10FFFF)
+				return fail(in, JSON_ERROR, "invalid character");
+			break;
+		default:
+			return fail(in, JSON_ERROR, "invalid escape");
+		}
+		if ((st = read_uc(in, c)) != JSON_DONE)
+			return st;
+	}
+	return (*x = make_string(r)) ? JSON_DONE :
+	       fail(in, JSON_LIMIT, "heap limit");
+}
+
+/* int, or mantissa and exponent */
+static int read_number(struct input *in, object *x)
+{
+	unsigned long v[2] = {0, 0};
+	int neg[2] = {0, 0}, i = 0, digits = 0;
+	long m, e;
+	object y;
+
+	for (; in->s < in->e; in->s++) {
+		if (*in->s == '-' && !digits && !neg[i]) {
+			neg[i] = 1;
+		} else if (*in->s >= '0' && *in->s <= '9') {
+			v[i] = v[i] * 10 + (*in->s - '0');
+			if (v[i] > (unsigned long) INT_MAX + 1)
+				return fail(in, JSON_ERROR, "number out of range");
+			digits++;
+		} else if (*in->s == 'e' && !i && digits) {
+			i = 1;
+			digits = 0;
+		} else {
+			break;
+		}
+	}
+	if (!digits && in->s == in->e)
+		return JSON_MORE;
+	if (!digits || !delimiter(in))
+		return fail(in, JSON_ERROR, "invalid number");
+	m = neg[0] ? -(long) v[0] : (long) v[0];
+	e = neg[1] ? -(long) v[1] : (long) v[1];
+	if (m > INT_MAX || e > INT_MAX)
+		return fail(in, JSON_ERROR, "number out of range");
+	if (!i) {
+		*x = store_int(m);
+	} else if (!(*x = store_num(m, e))) {
+		/* as the parser stores it without packed_numbers */
+		y = store_int(e);
+		*x = y ? store_int(m) : 0;
+		*x = *x ? cons(*x, y) : 0;
+	}
+	return *x ? JSON_DONE : fail(in, JSON_LIMIT, "heap limit");
+}
+
+/* 0x followed by hex digits, an atom */
+static int read_atom(struct input *in, object *x)
+{
+	unsigned n = 0;
+	int d;
+	for (*x = 0, in->s += 2; in->s < in->e && (d = hex(*in->s)) >= 0;
+	     in->s++, n++) {
+		if (*x >> (sizeof(*x) * 8 - 4))
+			return fail(in, JSON_ERROR, "invalid atom");
+		*x = *x << 4 | d;
+	}
+	if (!n && in->s == in->e)
+		return JSON_MORE;
+	if (!n || !delimiter(in) || type_of(*x) != TYP_ATOM)
+		return fail(in, JSON_ERROR, "invalid atom");
+	return JSON_DONE;
+}
+
+static int read_value(struct input *in, object *x);
+
+/* after the ( */
+static int read_list(struct input *in, object *x)
+{
+	struct sexp_reader *r = in->r;
+	struct listdata_builder b;
+	object y, end = EMPTY_LIST;
+	int st;
+
+	if (r->depth >= r->limits.depth)
+		return fail(in, JSON_LIMIT, "depth limit");
+	r->depth++;
+	list_begin(&b);
+	for (;;) {
+		while (in->s < in->e && blank(*in->s))
+			in->s++;
+		if (in->s == in->e)
+			return JSON_MORE;
+		if (*in->s == ')') {
+			in->s++;
+			break;
+		}
+		if (*in->s == '.' && b.list && in->e - in->s == 1)
+			return JSON_MORE;
+		if (*in->s == '.' && b.list && blank(in->s[1])) {
+			in->s++;
+			if ((st = read_value(in, &end)) != JSON_DONE)
+				return st;
+			while (in->s < in->e && blank(*in->s))
+				in->s++;
+			if (in->s == in->e)
+				return JSON_MORE;
+			if (*in->s++ != ')')
+				return fail(in, JSON_ERROR, "')' expected");
+			break;
+		}
+		if ((st = read_value(in, &y)) != JSON_DONE)
+			return st;
+		if (!list_append(&b, y))
+			return fail(in, JSON_LIMIT, "heap limit");
 	}
+	r->depth--;
+	return (*x = list_finish(&b, end)) ? JSON_DONE :
+	       fail(in, JSON_LIMIT, "heap limit");
+}
+
+/* a word or a character atom */
+static int read_word(struct input *in, const char *w, object v, object *x)
+{
+	size_t n = strlen(w);
+	if ((size_t) (in->e - in->s) < n)
+		return strncmp(in->s, w, in->e - in->s) ?
+		       fail(in, JSON_ERROR, "invalid value") : JSON_MORE;
+	if (strncmp(in->s, w, n))
+		return fail(in, JSON_ERROR, "invalid value");
+	in->s += n;
+	if (!delimiter(in))
+		return fail(in, JSON_ERROR, "invalid value");
+	*x = v;
+	return JSON_DONE;
+}
+
+static int read_value(struct input *in, object *x)
+{
+	struct sexp_reader *r = in->r;
+	char w[4];
+	while (in->s < in->e && blank(*in->s))
+		in->s++;
+	if (in->s == in->e)
+		return JSON_MORE;
+	if (++r->count > r->limits.elems)
+		return fail(in, JSON_LIMIT, "element limit");
+	switch (*in->s) {
+	case '(':
+		in->s++;
+		return read_list(in, x);
+	case '{':
+		return read_word(in, "{}", EMPTY_DICT, x);
+	case '"':
+		in->s++;
+		return read_string(in, x);
+	case 'n':
+		return read_word(in, "null", 0, x);
+	case '\'':
+		if (in->e - in->s < 3)
+			return JSON_MORE;
+		if (in->s[1] < 0x20 || in->s[1] >= 0x7F)
+			return fail(in, JSON_ERROR, "invalid atom");
+		w[0] = w[2] = '\'';
+		w[1] = in->s[1];
+		w[3] = '\0';
+		return read_word(in, w, in->s[1], x);
+	case '0':
+		if (in->e - in->s > 1 && in->s[1] == 'x')
+			return read_atom(in, x);
+		return read_number(in, x);
+	case '.':
+		return fail(in, JSON_ERROR, "elided list");
+	default:
+		if (*in->s == '-' || (*in->s >= '0' && *in->s <= '9'))
+			return read_number(in, x);
+		return fail(in, JSON_ERROR, "value expected");
+	}
+}
+
+int sexp_read(struct sexp_reader *r, const char *s, size_t n)
+{
+	struct input in;
+	int st;
+	in.r = r;
+	in.s = s;
+	in.e = s + n;
+	r->depth = 0;
+	r->count = 0;
+	r->result = 0;
+	r->reason = NULL;
+	st = read_value(&in, &r->result);
+	r->offset = in.s - s;
+	if (st != JSON_DONE)
+		r->result = 0;
+	return st;
 }
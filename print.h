@@ -0,0 +1,79 @@
+#ifndef print_h
+#define print_h
+
+#include <stdio.h>
+#include "json.h"
+
+/* The s-expression form of listdata objects:
+
+	(a b c)		list, ended by () (an array)
+	(a b . c)	list with another end, as ("k" 1 . {}) for an object
+	"..."		string, consed string or rope, with the escapes
+			\" \\ \n \r \t, \uXXXX for other control characters
+			and those above U+00FF, \UXXXXXX above U+FFFF
+	-12		int
+	15e-1		packed number (see store_num)
+	null () {}	atoms 0, EMPTY_LIST and EMPTY_DICT, 'c' for a
+			printable ASCII one and 0x1F for others
+
+   Other bytes of strings are written as they are (Latin-1), and
+   sexp_read reads the form back. */
+
+/* print to a stream, as by bprint */
+void fprint(FILE *, listdata_type);
+void print(listdata_type);	/* to stdout */
+
+/* Buffered printer. Output goes to the buffer and is written to f if
+   it is set, otherwise to fd if it is not -1, each time the buffer is
+   full and by print_flush. Otherwise it is kept in s (len bytes, not
+   NUL-terminated), which grows as needed. With pretty set, a list
+   with a list among its elements has each element (each member of an
+   object) on a line of its own, indented by 2 for each level. Lists
+   nested deeper than depth_max are printed as ..., which does not
+   read back. */
+struct print_buf {
+	char *s;
+	size_t len, max;
+	FILE *f;
+	int fd;
+	int pretty;
+	unsigned depth_max;		/* UINT_MAX by default */
+	int error;			/* out of memory or a write failed */
+};
+
+void print_buf_init(struct print_buf *);
+void print_buf_free(struct print_buf *);	/* does not flush */
+
+/* append x, return 0 if there was an error */
+int  bprint(struct print_buf *, listdata_type x);
+
+/* write out the buffer to f (with fwrite) or fd, return 0 if there
+   was an error */
+int  print_flush(struct print_buf *);
+
+/* Reader context. Lists are read by recursion, so depth is limited
+   (by default to 1024). Strings are stored as the JSON parser stores
+   them. */
+struct sexp_reader {
+	struct json_limits limits;
+	unsigned depth;
+	unsigned count;			/* values read */
+	char *buf;			/* string being read */
+	unsigned len, buf_max;
+	struct json_uc *ucs;
+	unsigned nucs, ucs_max;
+	object result;
+	size_t offset;			/* bytes read, or of the error */
+	const char *reason;		/* of JSON_ERROR or JSON_LIMIT */
+};
+
+void sexp_reader_init(struct sexp_reader *);
+void sexp_reader_free(struct sexp_reader *);
+
+/* read one value from the n bytes at s into result. Return JSON_DONE
+   (offset is the end of the value, a number or word ends at the end of
+   the input), JSON_MORE if it is cut short, JSON_ERROR if malformed or
+   JSON_LIMIT if a limit or the heap was exceeded. */
+int  sexp_read(struct sexp_reader *, const char *s, size_t n);
+
+#endif
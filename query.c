@@ -0,0 +1,1033 @@
+/* Queries compiled to a flat instruction array, see query.h.
+ *
+ *  The interpreter keeps the current value, a stack of values for the
+ *  operands of comparisons and objects, and a stack of forks: the
+ *  points to go on from when backtracking, each with a copy of the
+ *  value stack. Code only jumps forward, so an instruction has at most
+ *  one live fork and the stacks are sized when compiling.
+ *
+ *  Numbers are ints or conses of mantissa and exponent, as made by the
+ *  JSON parser, and are compared by value.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "query.h"
+
+enum {
+	Q_KEY,		/* member val, null if missing */
+	Q_INDEX,	/* element arg, from the end if negative */
+	Q_EACH,		/* each element or member value */
+	Q_CONST,	/* val */
+	Q_DUP,		/* push the value */
+	Q_SWAP,		/* exchange it with the top of the stack */
+	Q_CMP,		/* compare the popped value with it, sub is CMP_* */
+	Q_AND,
+	Q_OR,
+	Q_NOT,
+	Q_LENGTH,
+	Q_OBJECT,	/* arg values popped, named by the list val */
+	Q_FORK,		/* go on, and from arg when backtracking */
+	Q_JUMP,		/* to arg */
+	Q_BEGIN,	/* subquery ending at arg, sub is B_* */
+	Q_END		/* of the subquery begun at arg */
+};
+
+/* what is done with the outputs of a subquery */
+enum {
+	B_COLLECT,
+	B_SELECT,
+	B_COUNT,
+	B_SUM,
+	B_MIN,
+	B_MAX
+};
+
+enum {
+	CMP_EQ,
+	CMP_NE,
+	CMP_LT,
+	CMP_LE,
+	CMP_GT,
+	CMP_GE
+};
+
+struct query_op {
+	int op, sub;
+	int arg;
+	object val;
+};
+
+struct query_fork {
+	int pc;			/* of the instruction that forked */
+	unsigned sp;
+	object v;		/* value there */
+	object next;		/* Q_EACH: rest of the list, B_MIN/B_MAX: so far */
+	int members;		/* Q_EACH of an object */
+	unsigned long count;
+	long isum;		/* B_SUM while all are ints */
+	double sum;
+	int real;
+	struct listdata_builder b;
+};
+
+/* Values */
+
+enum { K_NULL, K_FALSE, K_TRUE, K_NUMBER, K_STRING, K_ARRAY, K_OBJECT,
+       K_OTHER };
+
+static int kind(object x)
+{
+	switch (type_of(x)) {
+	case TYP_INT:
+	case TYP_NUM:
+		return K_NUMBER;
+	case TYP_STR:
+	case TYP_SHORT:
+	case TYP_ROPE:
+		return K_STRING;
+	case TYP_CONS:
+		switch (x = last_tail(x, 0)) {
+		case EMPTY_LIST:
+			return K_ARRAY;
+		case EMPTY_DICT:
+			return K_OBJECT;
+		}
+		return type_of(x) == TYP_INT ? K_NUMBER : K_STRING;
+	default:
+		switch (x) {
+		case 0: return K_NULL;
+		case JSON_FALSE: return K_FALSE;
+		case JSON_TRUE: return K_TRUE;
+		case EMPTY_LIST: return K_ARRAY;
+		case EMPTY_DICT: return K_OBJECT;
+		}
+		return K_OTHER;
+	}
+}
+
+static int truthy(object x)
+{
+	return x && x != JSON_FALSE;
+}
+
+static double number(object x)
+{
+	double d;
+	return json_number(x, &d) ? d : 0;
+}
+
+/* the finite number d as the JSON parser would store it, 0 if out of
+   memory */
+static object store_number(double d)
+{
+	struct json_parser p;
+	char buf[32];
+	object x = 0;
+	if (d >= INT_MIN && d <= INT_MAX && d == (int) d)
+		return store_int((int) d);
+	sprintf(buf, "%.15g", d);
+	json_parser_init(&p);
+	if (json_parse_str(&p, buf, NULL) == JSON_MORE &&
+	    json_parse_end(&p) == JSON_DONE)
+		x = p.result;
+	json_parser_free(&p);
+	return x;
+}
+
+struct chars {
+	struct listdata_chunks c;
+	const char *s;
+	unsigned long n;
+};
+
+/* next character, -1 at the end */
+static int next_char(struct chars *it)
+{
+	int ch;
+	while (!it->n) {
+		if (chunk_next(&it->c, &it->s, &it->n, &ch) <= 0)
+			return -1;
+		if (!it->s) {
+			it->n = 0;
+			return ch;
+		}
+	}
+	it->n--;
+	return (unsigned char) *it->s++;
+}
+
+static int order(object x, object y);
+
+static int order_strings(object x, object y)
+{
+	struct chars a, b;
+	int c, d;
+	if (type_of(x) == TYP_STR && type_of(y) == TYP_STR)
+		return strcmp(load_str(x), load_str(y));
+	chunk_begin(&a.c, x);
+	chunk_begin(&b.c, y);
+	a.n = b.n = 0;
+	do {
+		c = next_char(&a);
+		d = next_char(&b);
+	} while (c == d && c >= 0);
+	return c - d;
+}
+
+/* the first key of object x after prev (0 for the first), 0 if there
+   is none */
+static object next_key(object x, object prev)
+{
+	object k, next = 0;
+	for (; is_cons(x) && is_cons(get_tail(x)); x = get_tail(get_tail(x))) {
+		k = get_head(x);
+		if ((!prev || order_strings(k, prev) > 0) &&
+		    (!next || order_strings(k, next) < 0))
+			next = k;
+	}
+	return next;
+}
+
+/* as jq: by the sorted arrays of their keys, then by the values in
+   the order of the keys. The keys are found by selection, in quadratic
+   time but allocating nothing. */
+static int order_objects(object x, object y)
+{
+	object a = 0, b = 0;
+	int c;
+	for (;;) {
+		a = next_key(x, a);
+		b = next_key(y, b);
+		if (!a || !b)
+			break;
+		if ((c = order_strings(a, b)))
+			return c;
+	}
+	if (a || b)
+		return a ? 1 : -1;
+	while ((a = next_key(x, a)))
+		if ((c = order(*dict_get(x, a), *dict_get(y, a))))
+			return c;
+	return 0;
+}
+
+/* negative, 0 or positive as x is before, equal to or after y */
+static int order(object x, object y)
+{
+	int k = kind(x), c;
+	double a, b;
+
+	if (x == y)
+		return 0;
+	if ((c = k - kind(y)))
+		return c;
+	switch (k) {
+	case K_NUMBER:
+		if (type_of(x) == TYP_INT && type_of(y) == TYP_INT)
+			return (load_int(x) > load_int(y)) -
+			       (load_int(x) < load_int(y));
+		a = number(x);
+		b = number(y);
+		return (a > b) - (a < b);
+	case K_STRING:
+		return order_strings(x, y);
+	case K_ARRAY:
+		for (; is_cons(x) && is_cons(y); x = get_tail(x), y = get_tail(y))
+			if ((c = order(get_head(x), get_head(y))))
+				return c;
+		return is_cons(x) - is_cons(y);
+	case K_OBJECT:
+		return order_objects(x, y);
+	}
+	return x < y ? -1 : 1;
+}
+
+int query_order(object x, object y)
+{
+	return order(x, y);
+}
+
+static int compare(object x, object y, int how)
+{
+	int c = order(x, y);
+	switch (how) {
+	case CMP_EQ: return !c;
+	case CMP_NE: return c != 0;
+	case CMP_LT: return c < 0;
+	case CMP_LE: return c <= 0;
+	case CMP_GT: return c > 0;
+	default:     return c >= 0;
+	}
+}
+
+/* Set *v to the member named key of x, or null if there is none, and
+   return 1, or return 0 if x is not an object. A short name differs
+   from all other short names, so those are only compared by handle. */
+static int member(object x, object key, object *v)
+{
+	object k, y, *p, *hit = NULL;
+	if (!x || x == EMPTY_DICT) {
+		*v = 0;
+		return 1;
+	}
+	while (is_cons(x)) {
+		if (!is_cons(y = get_tail(x)))
+			return 0;
+		p = load_cons(y);
+		if (!hit) {
+			k = get_head(x);
+			if (k == key || (type_of(k) != TYP_SHORT && equals(k, key)))
+				hit = p;
+		}
+		x = p[1];
+	}
+	if (x != EMPTY_DICT)
+		return 0;
+	*v = hit ? *hit : 0;
+	return 1;
+}
+
+static int element(object x, int n, object *v)
+{
+	object *p;
+	int k = kind(x);
+	if (k == K_NULL) {
+		*v = 0;
+		return 1;
+	}
+	if (k != K_ARRAY)
+		return 0;
+	if (n < 0 && (n += list_length(x)) < 0)
+		n = INT_MAX;
+	*v = (p = nth_elem(x, n)) ? *p : 0;
+	return 1;
+}
+
+static int length(object x, object *v)
+{
+	double d;
+	switch (kind(x)) {
+	case K_NULL:
+		*v = store_int(0);
+		break;
+	case K_NUMBER:
+		d = number(x);
+		*v = store_number(d < 0 ? -d : d);
+		break;
+	case K_STRING:
+		*v = store_number(str_length(x));
+		break;
+	case K_ARRAY:
+		*v = store_number(list_length(x));
+		break;
+	case K_OBJECT:
+		*v = store_number(list_length(x) / 2);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+/* Interpreter */
+
+#define SAVED(q, f) ((q)->stack + ((f) - (q)->forks + 1) * (q)->stack_max)
+
+static void add(struct query_fork *f, object x)
+{
+	if (kind(x) != K_NUMBER)
+		return;
+	if (!f->real && type_of(x) == TYP_INT &&
+	    f->isum <= LONG_MAX / 2 && f->isum >= LONG_MIN / 2) {
+		f->isum += load_int(x);
+		return;
+	}
+	if (!f->real) {
+		f->real = 1;
+		f->sum = f->isum;
+	}
+	f->sum += number(x);
+}
+
+/* result of a subquery, return 0 if out of memory */
+static int finish(struct query_fork *f, int how, object *v)
+{
+	double d;
+	switch (how) {
+	case B_COLLECT:
+		*v = list_finish(&f->b, EMPTY_LIST);
+		return *v != 0;
+	case B_COUNT:
+		*v = store_number(f->count);
+		return *v != 0;
+	case B_SUM:
+		d = f->real ? f->sum : f->isum;
+		if (d - d != 0) {
+			*v = 0;		/* overflow */
+			return 1;
+		}
+		*v = store_number(d);
+		return *v != 0;
+	default:
+		*v = f->count ? f->next : 0;
+		return 1;
+	}
+}
+
+int query_run(struct query *q, object x, int (*f)(object, void *), void *arg)
+{
+	const struct query_op *op;
+	struct query_fork *k;
+	object v = x, y, *st = q->stack;
+	unsigned sp = 0, nf = 0, i;
+	int pc = 0, r, kv;
+
+	for (;;) {
+		if (pc == (int) q->n) {
+			if ((r = f(v, arg)))
+				return r;
+			goto back;
+		}
+		op = q->ops + pc++;
+		switch (op->op) {
+		case Q_KEY:
+			if (!member(v, op->val, &v))
+				goto back;
+			break;
+		case Q_INDEX:
+			if (!element(v, op->arg, &v))
+				goto back;
+			break;
+		case Q_EACH:
+			/* a consed string or number is not a list */
+			if (!is_cons(v) ||
+			    ((kv = kind(v)) != K_ARRAY && kv != K_OBJECT))
+				goto back;
+			k = q->forks + nf++;
+			k->pc = pc - 1;
+			k->sp = sp;
+			memcpy(SAVED(q, k), st, sp * sizeof(*st));
+			if ((k->members = kv == K_OBJECT)) {
+				k->next = get_tail(get_tail(v));
+				v = *second(v);
+			} else {
+				k->next = get_tail(v);
+				v = get_head(v);
+			}
+			break;
+		case Q_CONST:
+			v = op->val;
+			break;
+		case Q_DUP:
+			st[sp++] = v;
+			break;
+		case Q_SWAP:
+			y = st[sp-1];
+			st[sp-1] = v;
+			v = y;
+			break;
+		case Q_CMP:
+			y = st[--sp];
+			v = compare(y, v, op->sub) ? JSON_TRUE : JSON_FALSE;
+			break;
+		case Q_AND:
+			y = st[--sp];
+			v = truthy(y) && truthy(v) ? JSON_TRUE : JSON_FALSE;
+			break;
+		case Q_OR:
+			y = st[--sp];
+			v = truthy(y) || truthy(v) ? JSON_TRUE : JSON_FALSE;
+			break;
+		case Q_NOT:
+			v = truthy(v) ? JSON_FALSE : JSON_TRUE;
+			break;
+		case Q_LENGTH:
+			if (!length(v, &v))
+				goto back;
+			if (!v)
+				return -1;
+			break;
+		case Q_OBJECT:
+			v = EMPTY_DICT;
+			sp -= op->arg;
+			for (y = op->val, i = sp; is_cons(y); y = get_tail(y))
+				if (!(v = dict_set(v, get_head(y), st[i++])))
+					return -1;
+			break;
+		case Q_FORK:
+		case Q_BEGIN:
+			k = q->forks + nf++;
+			k->pc = pc - 1;
+			k->sp = sp;
+			memcpy(SAVED(q, k), st, sp * sizeof(*st));
+			k->v = v;
+			k->count = 0;
+			k->isum = 0;
+			k->real = 0;
+			if (op->op == Q_BEGIN && op->sub == B_COLLECT)
+				list_begin(&k->b);
+			break;
+		case Q_JUMP:
+			pc = op->arg;
+			break;
+		case Q_END:
+			for (k = q->forks + nf; (--k)->pc != op->arg; )
+				;
+			switch (q->ops[op->arg].sub) {
+			case B_COLLECT:
+				if (!list_append(&k->b, v))
+					return -1;
+				break;
+			case B_SELECT:
+				if (!truthy(v))
+					break;
+				/* cut the forks of the condition */
+				nf = k - q->forks;
+				sp = k->sp;
+				memcpy(st, SAVED(q, k), sp * sizeof(*st));
+				v = k->v;
+				continue;
+			case B_COUNT:
+				k->count++;
+				break;
+			case B_SUM:
+				add(k, v);
+				break;
+			case B_MIN:
+			case B_MAX:
+				if (!k->count++ || (order(v, k->next) < 0) ==
+						   (q->ops[op->arg].sub == B_MIN))
+					k->next = v;
+				break;
+			}
+			goto back;
+		}
+		continue;
+back:
+		if (!nf)
+			return 0;
+		k = q->forks + nf - 1;
+		op = q->ops + k->pc;
+		sp = k->sp;
+		memcpy(st, SAVED(q, k), sp * sizeof(*st));
+		switch (op->op) {
+		case Q_EACH:
+			if (!is_cons(k->next)) {
+				nf--;
+				goto back;
+			}
+			if (k->members) {
+				v = *second(k->next);
+				k->next = get_tail(get_tail(k->next));
+			} else {
+				v = get_head(k->next);
+				k->next = get_tail(k->next);
+			}
+			pc = k->pc + 1;
+			break;
+		case Q_FORK:
+			nf--;
+			v = k->v;
+			pc = op->arg;
+			break;
+		case Q_BEGIN:
+			nf--;
+			if (op->sub == B_SELECT)
+				goto back;
+			if (!finish(k, op->sub, &v))
+				return -1;
+			pc = op->arg + 1;
+			break;
+		}
+	}
+}
+
+/* Compiler */
+
+struct compiler {
+	struct query *q;
+	const char *text, *s;
+	struct json_parser p;
+};
+
+static int error(struct compiler *c, const char *reason)
+{
+	if (!c->q->error) {
+		c->q->error = reason;
+		c->q->error_pos = c->s - c->text;
+	}
+	return 0;
+}
+
+static int emit(struct compiler *c, int op, int sub, int arg, object val)
+{
+	struct query *q = c->q;
+	struct query_op *ops;
+	unsigned n = q->max ? q->max * 2 : 32;
+	if (q->n == q->max) {
+		if (!(ops = realloc(q->ops, n * sizeof(*ops))))
+			return error(c, "out of memory");
+		q->ops = ops;
+		q->max = n;
+	}
+	ops = q->ops + q->n++;
+	ops->op = op;
+	ops->sub = sub;
+	ops->arg = arg;
+	ops->val = val;
+	return 1;
+}
+
+static int is_target(int op)
+{
+	return op == Q_FORK || op == Q_JUMP || op == Q_BEGIN || op == Q_END;
+}
+
+/* insert an instruction at, moving the targets after it (and the
+   targets of the moved code at it, such as a Q_END of a Q_BEGIN there) */
+static int insert(struct compiler *c, unsigned at, int op)
+{
+	struct query_op *ops;
+	unsigned i;
+	if (!emit(c, op, 0, 0, 0))
+		return 0;
+	ops = c->q->ops;
+	memmove(ops + at + 1, ops + at, (c->q->n - 1 - at) * sizeof(*ops));
+	ops[at].op = op;
+	ops[at].sub = 0;
+	ops[at].arg = 0;
+	ops[at].val = 0;
+	for (i=0; i<c->q->n; i++) {
+		if (i != at && is_target(ops[i].op) &&
+		    (ops[i].arg > (int) at || (i > at && ops[i].arg == (int) at)))
+			ops[i].arg++;
+	}
+	return 1;
+}
+
+static int peek(struct compiler *c)
+{
+	while (*c->s == ' ' || *c->s == '\t' || *c->s == '\n' || *c->s == '\r')
+		c->s++;
+	return *c->s;
+}
+
+static int is_name(int ch)
+{
+	return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+	       (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+/* punctuation (the longer comparisons are tried first) */
+static int accept(struct compiler *c, const char *tok)
+{
+	size_t n = strlen(tok);
+	peek(c);
+	if (strncmp(c->s, tok, n))
+		return 0;
+	c->s += n;
+	return 1;
+}
+
+static int keyword(struct compiler *c, const char *w)
+{
+	size_t n = strlen(w);
+	peek(c);
+	if (strncmp(c->s, w, n) || is_name(c->s[n]))
+		return 0;
+	c->s += n;
+	return 1;
+}
+
+static int expect(struct compiler *c, const char *tok)
+{
+	return accept(c, tok) || error(c, tok[0] == ')' ? "')' expected" :
+				       tok[0] == ']' ? "']' expected" :
+				       tok[0] == '}' ? "'}' expected" :
+				       "'(' expected");
+}
+
+/* a string or number literal, parsed as JSON */
+static object literal(struct compiler *c)
+{
+	const char *e = c->s;
+	int st;
+	if (*e == '"') {
+		for (e++; *e && *e != '"'; e++)
+			if (*e == '\\' && e[1])
+				e++;
+		if (*e++ != '"')
+			return error(c, "unterminated string");
+	} else {
+		while ((*e >= '0' && *e <= '9') || *e == '-' || *e == '+' ||
+		       *e == '.' || *e == 'e' || *e == 'E')
+			e++;
+	}
+	json_parser_reset(&c->p);
+	st = json_parse(&c->p, c->s, e - c->s, NULL);
+	if (st == JSON_MORE)
+		st = json_parse_end(&c->p);
+	if (st != JSON_DONE)
+		return error(c, st == JSON_LIMIT ? "out of memory" :
+				"bad literal");
+	c->s = e;
+	return c->p.result;
+}
+
+/* name of a member: identifier or string */
+static object name(struct compiler *c)
+{
+	const char *s = c->s;
+	char *buf;
+	object x;
+	if (*s == '"')
+		return literal(c);
+	while (is_name(*s))
+		s++;
+	if (s == c->s || (*c->s >= '0' && *c->s <= '9'))
+		return error(c, "name expected");
+	if (!(buf = malloc(s - c->s + 1)))
+		return error(c, "out of memory");
+	memcpy(buf, c->s, s - c->s);
+	buf[s - c->s] = '\0';
+	x = store_short(buf);
+	free(buf);
+	if (!x)
+		return error(c, "out of memory");
+	c->s = s;
+	return x;
+}
+
+static int pipe_expr(struct compiler *);
+static int or_expr(struct compiler *);
+
+/* after '[': ']' or an index and ']' */
+static int subscript(struct compiler *c)
+{
+	char *e;
+	long n;
+	if (accept(c, "]"))
+		return emit(c, Q_EACH, 0, 0, 0);
+	n = strtol(c->s, &e, 10);
+	if (e == c->s || n < INT_MIN || n > INT_MAX)
+		return error(c, "index expected");
+	c->s = e;
+	return expect(c, "]") && emit(c, Q_INDEX, 0, n, 0);
+}
+
+/* instructions at begin followed by more Q_END */
+static int subquery(struct compiler *c, int how, const char *end)
+{
+	unsigned begin = c->q->n;
+	if (!emit(c, Q_BEGIN, how, 0, 0) || !pipe_expr(c) || !expect(c, end))
+		return 0;
+	c->q->ops[begin].arg = c->q->n;
+	return emit(c, Q_END, 0, begin, 0);
+}
+
+static int object_expr(struct compiler *c)
+{
+	struct listdata_builder b;
+	object x;
+	int n = 0;
+	list_begin(&b);
+	do {
+		peek(c);
+		if (!(x = name(c)) || !list_append(&b, x))
+			return error(c, "out of memory");
+		if (!emit(c, Q_DUP, 0, 0, 0))
+			return 0;
+		if (accept(c, ":")) {
+			if (!or_expr(c))
+				return 0;
+		} else if (!emit(c, Q_KEY, 0, 0, x)) {
+			return 0;
+		}
+		if (!emit(c, Q_SWAP, 0, 0, 0))
+			return 0;
+		n++;
+	} while (accept(c, ","));
+	if (!expect(c, "}") || !(x = list_finish(&b, EMPTY_LIST)))
+		return error(c, "out of memory");
+	return emit(c, Q_OBJECT, 0, n, x);
+}
+
+static const struct {
+	const char *name;
+	int how;
+} aggregates[] = {
+	{"select", B_SELECT},
+	{"count", B_COUNT},
+	{"sum", B_SUM},
+	{"min", B_MIN},
+	{"max", B_MAX}
+};
+
+static int term(struct compiler *c)
+{
+	object x;
+	unsigned i;
+	int ch = peek(c);
+
+	if (ch == '.') {
+		c->s++;
+		ch = *c->s;
+		if (ch == '[') {
+			c->s++;
+			return subscript(c);
+		}
+		if (ch == '"' || (is_name(ch) && !(ch >= '0' && ch <= '9')))
+			return (x = name(c)) && emit(c, Q_KEY, 0, 0, x);
+		return 1;
+	}
+	if (ch == '"' || ch == '-' || (ch >= '0' && ch <= '9'))
+		return (x = literal(c)) && emit(c, Q_CONST, 0, 0, x);
+	if (accept(c, "("))
+		return pipe_expr(c) && expect(c, ")");
+	if (accept(c, "[")) {
+		if (accept(c, "]"))
+			return emit(c, Q_CONST, 0, 0, EMPTY_LIST);
+		return subquery(c, B_COLLECT, "]");
+	}
+	if (accept(c, "{")) {
+		if (accept(c, "}"))
+			return emit(c, Q_CONST, 0, 0, EMPTY_DICT);
+		return object_expr(c);
+	}
+	if (keyword(c, "true"))
+		return emit(c, Q_CONST, 0, 0, JSON_TRUE);
+	if (keyword(c, "false"))
+		return emit(c, Q_CONST, 0, 0, JSON_FALSE);
+	if (keyword(c, "null"))
+		return emit(c, Q_CONST, 0, 0, 0);
+	if (keyword(c, "not"))
+		return emit(c, Q_NOT, 0, 0, 0);
+	if (keyword(c, "length"))
+		return emit(c, Q_LENGTH, 0, 0, 0);
+	for (i=0; i<sizeof(aggregates)/sizeof(*aggregates); i++) {
+		if (keyword(c, aggregates[i].name))
+			return expect(c, "(") &&
+			       subquery(c, aggregates[i].how, ")");
+	}
+	return error(c, "unexpected character");
+}
+
+/* term followed by members and subscripts */
+static int postfix(struct compiler *c)
+{
+	object x;
+	int ch;
+	if (!term(c))
+		return 0;
+	for (;;) {
+		ch = peek(c);
+		if (ch == '[') {
+			c->s++;
+			if (!subscript(c))
+				return 0;
+		} else if (ch == '.' && (c->s[1] == '"' || c->s[1] == '[' ||
+					 (is_name(c->s[1]) &&
+					  !(c->s[1] >= '0' && c->s[1] <= '9')))) {
+			c->s++;
+			if (c->s[0] == '[') {
+				c->s++;
+				if (!subscript(c))
+					return 0;
+			} else if (!(x = name(c)) || !emit(c, Q_KEY, 0, 0, x)) {
+				return 0;
+			}
+		} else {
+			return 1;
+		}
+	}
+}
+
+/* a op b as DUP a SWAP b op */
+static int binary(struct compiler *c, unsigned start, int op, int sub,
+		  int (*right)(struct compiler *))
+{
+	return insert(c, start, Q_DUP) && emit(c, Q_SWAP, 0, 0, 0) &&
+	       right(c) && emit(c, op, sub, 0, 0);
+}
+
+static const struct {
+	const char *tok;
+	int how;
+} comparisons[] = {
+	{"==", CMP_EQ},
+	{"!=", CMP_NE},
+	{"<=", CMP_LE},
+	{">=", CMP_GE},
+	{"<", CMP_LT},
+	{">", CMP_GT}
+};
+
+static int cmp_expr(struct compiler *c)
+{
+	unsigned start = c->q->n, i;
+	if (!postfix(c))
+		return 0;
+	for (i=0; i<sizeof(comparisons)/sizeof(*comparisons); i++) {
+		if (accept(c, comparisons[i].tok))
+			return binary(c, start, Q_CMP, comparisons[i].how,
+				      postfix);
+	}
+	return 1;
+}
+
+static int and_expr(struct compiler *c)
+{
+	unsigned start = c->q->n;
+	if (!cmp_expr(c))
+		return 0;
+	while (keyword(c, "and"))
+		if (!binary(c, start, Q_AND, 0, cmp_expr))
+			return 0;
+	return 1;
+}
+
+static int or_expr(struct compiler *c)
+{
+	unsigned start = c->q->n;
+	if (!and_expr(c))
+		return 0;
+	while (keyword(c, "or"))
+		if (!binary(c, start, Q_OR, 0, and_expr))
+			return 0;
+	return 1;
+}
+
+/* a , b as FORK L a JUMP E L: b E: */
+static int comma_expr(struct compiler *c)
+{
+	unsigned start = c->q->n, jump;
+	if (!or_expr(c))
+		return 0;
+	while (accept(c, ",")) {
+		if (!insert(c, start, Q_FORK))
+			return 0;
+		jump = c->q->n;
+		if (!emit(c, Q_JUMP, 0, 0, 0))
+			return 0;
+		c->q->ops[start].arg = c->q->n;
+		if (!or_expr(c))
+			return 0;
+		c->q->ops[jump].arg = c->q->n;
+	}
+	return 1;
+}
+
+static int pipe_expr(struct compiler *c)
+{
+	if (!comma_expr(c))
+		return 0;
+	while (accept(c, "|"))
+		if (!comma_expr(c))
+			return 0;
+	return 1;
+}
+
+/* most forks and stack depth: each forking instruction has at most one
+   live fork, and every expression leaves the stack as it found it */
+static void size(struct query *q)
+{
+	unsigned i, depth = 0;
+	q->forks_max = q->stack_max = 0;
+	for (i=0; i<q->n; i++) {
+		switch (q->ops[i].op) {
+		case Q_EACH:
+		case Q_FORK:
+		case Q_BEGIN:
+			q->forks_max++;
+			break;
+		case Q_DUP:
+			if (++depth > q->stack_max)
+				q->stack_max = depth;
+			break;
+		case Q_CMP:
+		case Q_AND:
+		case Q_OR:
+			depth--;
+			break;
+		case Q_OBJECT:
+			depth -= q->ops[i].arg;
+			break;
+		}
+	}
+}
+
+int query_compile(struct query *q, const char *text)
+{
+	struct compiler c;
+	memset(q, 0, sizeof(*q));
+	c.q = q;
+	c.text = c.s = text;
+	json_parser_init(&c.p);
+	if (pipe_expr(&c) && peek(&c))
+		error(&c, "unexpected character");
+	json_parser_free(&c.p);
+	if (!q->error) {
+		size(q);
+		q->forks = malloc((q->forks_max + 1) * sizeof(*q->forks));
+		q->stack = malloc((q->forks_max + 1) * q->stack_max *
+				  sizeof(*q->stack) + 1);
+		if (!q->forks || !q->stack)
+			error(&c, "out of memory");
+	}
+	if (q->error) {
+		free(q->ops);
+		free(q->forks);
+		free(q->stack);
+		q->ops = NULL;
+		q->forks = NULL;
+		q->stack = NULL;
+		q->n = q->max = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void query_free(struct query *q)
+{
+	free(q->ops);
+	free(q->forks);
+	free(q->stack);
+	memset(q, 0, sizeof(*q));
+}
+
+/* NDJSON streams */
+
+struct feed {
+	struct query *q;
+	int (*f)(object, void *);
+	void *arg;
+};
+
+static int run_value(object x, void *arg)
+{
+	struct feed *fd = arg;
+	int r = query_run(fd->q, x, fd->f, fd->arg);
+	return r < 0 ? JSON_LIMIT : r ? JSON_DONE : JSON_MORE;
+}
+
+int query_feed(struct query *q, struct json_parser *p, const char *s, size_t n,
+	       int (*f)(object, void *), void *arg)
+{
+	struct feed fd;
+	fd.q = q;
+	fd.f = f;
+	fd.arg = arg;
+	return json_feed(p, s, n, run_value, &fd);
+}
+
+int query_feed_end(struct query *q, struct json_parser *p,
+		   int (*f)(object, void *), void *arg)
+{
+	struct feed fd;
+	fd.q = q;
+	fd.f = f;
+	fd.arg = arg;
+	return json_feed_end(p, run_value, &fd);
+}
@@ -0,0 +1,65 @@
+#ifndef query_h
+#define query_h
+
+#include "json.h"
+
+/* Queries over parsed JSON, in a subset of the jq language:
+
+	.  .name  ."name"  .[n]  .[]	identity, member, element, each
+	f | g  f , g  (f)		pipe, both outputs, grouping
+	"str" 12.5 true false null	literals
+	[f]  {a: f, "b": g, c}		collect, object ({c} is {c: .c})
+	== != < <= > >= and or		comparison (null < false < true <
+					numbers < strings < arrays < objects)
+	select(f) not length		as in jq, select passes its input
+					once if any output of f is true
+	count(f) sum(f) min(f) max(f)	aggregates over the outputs of f
+
+   A query is compiled to a flat array of instructions, with the member
+   names and literals stored once, and run by an interpreter that
+   backtracks for each output. Where jq raises a type error (such as
+   .name of an array) there is no output. */
+
+struct query_op;
+struct query_fork;
+
+struct query {
+	struct query_op *ops;
+	unsigned n, max;
+	unsigned forks_max,		/* live forks while running */
+		 stack_max;		/* depth of the value stack */
+	struct query_fork *forks;	/* scratch space of query_run */
+	object *stack;
+	const char *error;		/* set when compiling fails */
+	unsigned error_pos;		/* offset in the text */
+};
+
+/* compile text, return 0 on error (see error and error_pos). The names
+   and literals are allocated on the heap, so the query must be
+   compiled before any mark it is run under. */
+int  query_compile(struct query *, const char *text);
+void query_free(struct query *);
+
+/* call f(output, arg) for each output of the query on x until it
+   returns nonzero. Return that value, 0 when done or -1 if out of
+   memory. A query is run by one thread at a time. */
+int  query_run(struct query *, object x, int (*f)(object, void *), void *arg);
+
+/* Run a query on each value of an NDJSON stream fed in chunks to
+   parser p, as json_feed does: each value is released after the query
+   has run on it. Return JSON_MORE when the chunk is consumed, JSON_DONE
+   if f returned nonzero, JSON_ERROR or JSON_LIMIT if the value did not
+   parse (see json_parse_error) or the heap ran out. */
+int  query_feed(struct query *, struct json_parser *p, const char *s, size_t n,
+		int (*f)(object, void *), void *arg);
+
+/* end of the stream: complete a last top-level number */
+int  query_feed_end(struct query *, struct json_parser *p,
+		    int (*f)(object, void *), void *arg);
+
+/* negative, 0 or positive as x is before, equal to or after y in the
+   order of the comparisons above (objects as in jq, by their sorted
+   keys, then by their values in the order of the keys) */
+int  query_order(object x, object y);
+
+#endif
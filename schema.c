@@ -0,0 +1,535 @@
+/* Schema-specialized JSON parser, see schema.h.
+ *
+ *  Names without escapes are compared in the input, starting with the
+ *  field after the last one matched, so members in the declared order
+ *  match at the first try. Values of known fields are converted in the
+ *  input too: digits to an int or double (the correctly rounded fast
+ *  case when the digits fit in a double, strtod otherwise), strings
+ *  decoded into the array. Everything else goes to the generic parser.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "schema.h"
+
+#define EXP_MAX 100000000
+
+static void *grow(void *mem, unsigned *max, size_t size)
+{
+	unsigned n = *max ? *max << 1 : 16;
+	void *p = n > *max ? realloc(mem, (size_t) n * size) : NULL;
+	if (p)
+		*max = n;
+	return p;
+}
+
+struct input {
+	struct json_schema_parser *sp;
+	const char *s, *e;
+};
+
+void json_schema_parser_init(struct json_schema_parser *sp)
+{
+	memset(sp, 0, sizeof(*sp));
+	json_parser_init(&sp->p);
+}
+
+void json_schema_parser_free(struct json_schema_parser *sp)
+{
+	json_parser_free(&sp->p);
+	free(sp->buf);
+	sp->buf = NULL;
+	sp->buf_max = 0;
+}
+
+static int fail(struct input *in, int st, const char *reason)
+{
+	in->sp->reason = reason;
+	return st;
+}
+
+static int reserve(struct input *in, size_t n)
+{
+	char *buf;
+	while (n > in->sp->buf_max) {
+		if (!(buf = grow(in->sp->buf, &in->sp->buf_max, 1)))
+			return 0;
+		in->sp->buf = buf;
+	}
+	return 1;
+}
+
+/* return the next byte that is not white space, or -1 at the end */
+static int peek(struct input *in)
+{
+	for (; in->s < in->e; in->s++) {
+		switch (*in->s) {
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\r':
+			continue;
+		}
+		return (unsigned char) *in->s;
+	}
+	return -1;
+}
+
+static int expect(struct input *in, int c, const char *reason)
+{
+	int d = peek(in);
+	if (d < 0)
+		return JSON_MORE;
+	if (d != c)
+		return fail(in, JSON_ERROR, reason);
+	in->s++;
+	return JSON_DONE;
+}
+
+static int literal(struct input *in, const char *name)
+{
+	size_t n = strlen(name), k = in->e - in->s;
+	if (k < n)
+		return memcmp(in->s, name, k) ? fail(in, JSON_ERROR,
+			      "invalid literal") : JSON_MORE;
+	if (memcmp(in->s, name, n))
+		return fail(in, JSON_ERROR, "invalid literal");
+	in->s += n;
+	return JSON_DONE;
+}
+
+/* Strings */
+
+/* find the closing quote of the string starting at in->s (after the
+   opening quote), set *esc if there are escapes */
+static int string_end(struct input *in, const char **end, int *esc)
+{
+	const char *s = in->s;
+	*esc = 0;
+	for (; s < in->e; s++) {
+		if (*s == '"') {
+			*end = s;
+			return JSON_DONE;
+		}
+		if (*s == '\\') {
+			*esc = 1;
+			s++;
+		} else if ((unsigned char) *s < 0x20) {
+			in->s = s;
+			return fail(in, JSON_ERROR, "control character in string");
+		}
+	}
+	return JSON_MORE;
+}
+
+static int hex4(const char *s)
+{
+	int i, c, d, v = 0;
+	for (i=0; i<4; i++) {
+		c = s[i];
+		if (c >= '0' && c <= '9')
+			d = c - '0';
+		else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+			d = (c | 0x20) - 'a' + 10;
+		else
+			return -1;
+		v = v << 4 | d;
+	}
+	return v;
+}
+
+static int put_utf8(char *s, int c)
+{
+	if (c < 0x80) {
+		s[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		s[0] = 0xC0 | c >> 6;
+		s[1] = 0x80 | (c & 0x3F);
+		return 2;
+	}
+	if (c < 0x10000) {
+		s[0] = 0xE0 | c >> 12;
+		s[1] = 0x80 | (c >> 6 & 0x3F);
+		s[2] = 0x80 | (c & 0x3F);
+		return 3;
+	}
+	s[0] = 0xF0 | c >> 18;
+	s[1] = 0x80 | (c >> 12 & 0x3F);
+	s[2] = 0x80 | (c >> 6 & 0x3F);
+	s[3] = 0x80 | (c & 0x3F);
+	return 4;
+}
+
+/* decode the string from in->s to end into out, which holds as many
+   bytes. A lone surrogate is kept in its three-byte form. Return the
+   length or -1. */
+static long decode(struct input *in, const char *end, char *out)
+{
+	const char *s = in->s;
+	char *o = out;
+	int c, d;
+	while (s < end) {
+		if (*s != '\\') {
+			*o++ = *s++;
+			continue;
+		}
+		switch (c = s[1]) {
+		case '"':
+		case '\\':
+		case '/': break;
+		case 'b': c = '\b'; break;
+		case 'f': c = '\f'; break;
+		case 'n': c = '\n'; break;
+		case 'r': c = '\r'; break;
+		case 't': c = '\t'; break;
+		case 'u':
+			if (end - s < 6 || (c = hex4(s + 2)) < 0)
+				goto bad;
+			s += 6;
+			if (c >= 0xD800 && c < 0xDC00 && end - s >= 6 &&
+			    s[0] == '\\' && s[1] == 'u' &&
+			    (d = hex4(s + 2)) >= 0xDC00 && d < 0xE000) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (d - 0xDC00);
+				s += 6;
+			}
+			o += put_utf8(o, c);
+			continue;
+		default:
+			goto bad;
+		}
+		*o++ = c;
+		s += 2;
+	}
+	return o - out;
+bad:
+	in->s = s;
+	fail(in, JSON_ERROR, "invalid escape");
+	return -1;
+}
+
+static int string(struct input *in, char *out, size_t size)
+{
+	const char *end;
+	long n;
+	int st, esc;
+	in->s++;
+	if ((st = string_end(in, &end, &esc)) != JSON_DONE)
+		return st;
+	if (!esc) {
+		n = end - in->s;
+		if ((size_t) n >= size)
+			return fail(in, JSON_LIMIT, "string too long");
+		memcpy(out, in->s, n);
+	} else if ((size_t) (end - in->s) < size) {
+		if ((n = decode(in, end, out)) < 0)
+			return JSON_ERROR;
+	} else {
+		if (!reserve(in, end - in->s))
+			return fail(in, JSON_LIMIT, "out of memory");
+		if ((n = decode(in, end, in->sp->buf)) < 0)
+			return JSON_ERROR;
+		if ((size_t) n >= size)
+			return fail(in, JSON_LIMIT, "string too long");
+		memcpy(out, in->sp->buf, n);
+	}
+	out[n] = '\0';
+	in->s = end + 1;
+	return JSON_DONE;
+}
+
+/* Numbers */
+
+struct number {
+	unsigned long long m;	/* up to 19 significant digits */
+	long e;
+	int neg, digits,
+	    exact,		/* no digit was dropped */
+	    integer;		/* no fraction or exponent */
+	const char *from;
+};
+
+static void add_digit(struct number *x, int d, int frac)
+{
+	if (!x->m && !d) {
+		x->e -= frac;
+	} else if (x->digits < 19) {
+		x->m = x->m * 10 + d;
+		x->digits++;
+		x->e -= frac;
+	} else {
+		x->exact = 0;
+		x->e += !frac;
+	}
+}
+
+static int is_digit(struct input *in)
+{
+	return in->s < in->e && *in->s >= '0' && *in->s <= '9';
+}
+
+static int scan_number(struct input *in, struct number *x)
+{
+	long ex = 0;
+	int eneg;
+
+	memset(x, 0, sizeof(*x));
+	x->exact = x->integer = 1;
+	x->from = in->s;
+	x->neg = *in->s == '-';
+	in->s += x->neg;
+	if (!is_digit(in))
+		goto end;
+	if (*in->s == '0')
+		in->s++;
+	else
+		while (is_digit(in))
+			add_digit(x, *in->s++ - '0', 0);
+	if (in->s < in->e && *in->s == '.') {
+		x->integer = 0;
+		in->s++;
+		if (!is_digit(in))
+			goto end;
+		while (is_digit(in))
+			add_digit(x, *in->s++ - '0', 1);
+	}
+	if (in->s < in->e && (*in->s | 0x20) == 'e') {
+		x->integer = 0;
+		in->s++;
+		eneg = in->s < in->e && *in->s == '-';
+		if (in->s < in->e && (*in->s == '-' || *in->s == '+'))
+			in->s++;
+		if (!is_digit(in))
+			goto end;
+		while (is_digit(in)) {
+			if (ex < EXP_MAX)
+				ex = ex * 10 + *in->s - '0';
+			in->s++;
+		}
+		x->e += eneg ? -ex : ex;
+	}
+	if (in->s < in->e)
+		return JSON_DONE;
+end:
+	return in->s == in->e ? JSON_MORE :
+	       fail(in, JSON_ERROR, "invalid number");
+}
+
+static int integer(struct input *in, int *v)
+{
+	struct number x;
+	int st;
+	if ((st = scan_number(in, &x)) != JSON_DONE)
+		return st;
+	if (!x.integer) {
+		in->s = x.from;
+		return fail(in, JSON_ERROR, "integer expected");
+	}
+	if (!x.exact || x.m > (unsigned long long) INT_MAX + x.neg) {
+		in->s = x.from;
+		return fail(in, JSON_ERROR, "integer out of range");
+	}
+	*v = x.neg ? (int) -(long long) x.m : (int) x.m;
+	return JSON_DONE;
+}
+
+static const double powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int real(struct input *in, double *v)
+{
+	struct number x;
+	size_t n;
+	double d;
+	int st;
+	if ((st = scan_number(in, &x)) != JSON_DONE)
+		return st;
+	/* both exact in a double, so one operation rounds correctly */
+	if (x.exact && x.m < 1ULL << 53 && x.e >= -22 && x.e <= 22) {
+		d = x.m;
+		d = x.e < 0 ? d / powers[-x.e] : d * powers[x.e];
+	} else {
+		n = in->s - x.from;
+		if (!reserve(in, n + 1))
+			return fail(in, JSON_LIMIT, "out of memory");
+		memcpy(in->sp->buf, x.from, n);
+		in->sp->buf[n] = '\0';
+		d = strtod(in->sp->buf, NULL);
+	}
+	*v = x.neg ? -d : d;
+	return JSON_DONE;
+}
+
+/* Values */
+
+/* the value at in->s by the generic parser (only checked if x is NULL) */
+static int generic(struct input *in, object *x)
+{
+	struct json_parser *p = &in->sp->p;
+	struct json_error err;
+	const char *end;
+	int st;
+	json_parser_reset(p);
+	p->validate = !x;
+	st = json_parse(p, in->s, in->e - in->s, &end);
+	if (st == JSON_DONE) {
+		if (x)
+			*x = p->result;
+		in->s = end;
+		return st;
+	}
+	if (st == JSON_MORE) {
+		in->s = in->e;
+		return st;
+	}
+	json_parse_error(p, &err);
+	in->s += err.offset;
+	return fail(in, st, err.reason);
+}
+
+static int object_of(struct input *in, const struct json_schema *sc,
+		     char *out);
+
+static int field(struct input *in, const struct json_field *f, char *out)
+{
+	int st, c = peek(in);
+	if (c < 0)
+		return JSON_MORE;
+	if (c == 'n' && f->type != JSON_VALUE)
+		return literal(in, "null");
+	switch (f->type) {
+	case JSON_INT:
+		if (c != '-' && (c < '0' || c > '9'))
+			return fail(in, JSON_ERROR, "number expected");
+		return integer(in, (int *) out);
+	case JSON_DOUBLE:
+		if (c != '-' && (c < '0' || c > '9'))
+			return fail(in, JSON_ERROR, "number expected");
+		return real(in, (double *) out);
+	case JSON_BOOL:
+		if (c != 't' && c != 'f')
+			return fail(in, JSON_ERROR, "true or false expected");
+		if ((st = literal(in, c == 't' ? "true" : "false")) == JSON_DONE)
+			*(int *) out = c == 't';
+		return st;
+	case JSON_STRING:
+		if (c != '"')
+			return fail(in, JSON_ERROR, "string expected");
+		return string(in, out, f->size);
+	case JSON_OBJECT:
+		if (c != '{')
+			return fail(in, JSON_ERROR, "object expected");
+		return object_of(in, f->schema, out);
+	}
+	return generic(in, (object *) out);
+}
+
+/* the field named by the n bytes at s, trying the one at *next first */
+static const struct json_field *find(const struct json_schema *sc,
+				     unsigned *next, const char *s, size_t n)
+{
+	const struct json_field *f;
+	unsigned i, k = *next;
+	for (i=0; i<sc->n; i++) {
+		f = sc->fields + k;
+		k = k + 1 < sc->n ? k + 1 : 0;
+		if (f->name && f->len == n && !memcmp(f->name, s, n)) {
+			*next = k;
+			return f;
+		}
+	}
+	return NULL;
+}
+
+static int object_of(struct input *in, const struct json_schema *sc,
+		     char *out)
+{
+	const struct json_field *f;
+	const char *name, *end;
+	object *rest = NULL, key, val;
+	unsigned i, next = 0;
+	long n;
+	int st, esc, c;
+
+	for (i=0; i<sc->n; i++)
+		if (!sc->fields[i].name) {
+			rest = (object *) (out + sc->fields[i].offset);
+			*rest = EMPTY_DICT;
+		}
+	in->s++;
+	if ((c = peek(in)) == '}') {
+		in->s++;
+		return JSON_DONE;
+	}
+	for (;;) {
+		if (c < 0)
+			return JSON_MORE;
+		if (c != '"')
+			return fail(in, JSON_ERROR, "name expected");
+		name = in->s++;
+		if ((st = string_end(in, &end, &esc)) != JSON_DONE)
+			return st;
+		if (!esc) {
+			f = find(sc, &next, in->s, end - in->s);
+		} else {
+			if (!reserve(in, end - in->s))
+				return fail(in, JSON_LIMIT, "out of memory");
+			if ((n = decode(in, end, in->sp->buf)) < 0)
+				return JSON_ERROR;
+			f = find(sc, &next, in->sp->buf, n);
+		}
+		if (!f && rest) {
+			in->s = name;
+			if ((st = generic(in, &key)) != JSON_DONE)
+				return st;
+		}
+		in->s = end + 1;
+		if ((st = expect(in, ':', "':' expected")) != JSON_DONE)
+			return st;
+		if (f) {
+			st = field(in, f, out + f->offset);
+		} else if (peek(in) < 0) {
+			return JSON_MORE;
+		} else if (!rest) {
+			st = generic(in, NULL);
+		} else if ((st = generic(in, &val)) == JSON_DONE &&
+			   !(*rest = dict_set(*rest, key, val))) {
+			return fail(in, JSON_LIMIT, "heap limit");
+		}
+		if (st != JSON_DONE)
+			return st;
+		if ((c = peek(in)) == '}') {
+			in->s++;
+			return JSON_DONE;
+		}
+		if (c < 0)
+			return JSON_MORE;
+		if (c != ',')
+			return fail(in, JSON_ERROR, "',' or '}' expected");
+		in->s++;
+		c = peek(in);
+	}
+}
+
+int json_schema_parse(struct json_schema_parser *sp,
+		      const struct json_schema *sc, void *out,
+		      const char *s, size_t n)
+{
+	struct input in;
+	int st, c;
+	in.sp = sp;
+	in.s = s;
+	in.e = s + n;
+	sp->reason = NULL;
+	if ((c = peek(&in)) < 0)
+		st = JSON_MORE;
+	else if (c != '{')
+		st = fail(&in, JSON_ERROR, "object expected");
+	else
+		st = object_of(&in, sc, out);
+	sp->offset = in.s - s;
+	return st;
+}
@@ -0,0 +1,98 @@
+#ifndef schema_h
+#define schema_h
+
+#include "json.h"
+
+/* Parsing JSON objects of a known shape straight into a C struct. The
+   members are declared with their C types:
+
+	struct point {
+		int x, y;
+		char label[16];
+		object rest;
+	};
+
+	static const struct json_field point_fields[] = {
+		JSON_FIELD(struct point, x, JSON_INT),
+		JSON_FIELD(struct point, y, JSON_INT),
+		JSON_FIELD_NAMED("label-text", struct point, label, JSON_STRING),
+		JSON_FIELD_REST(struct point, rest)
+	};
+	static const struct json_schema point_schema =
+		JSON_SCHEMA(struct point, point_fields);
+
+   and names are matched against the input in place, expecting the
+   members in the order declared, so that nothing is allocated for the
+   known members. Other members are parsed by the generic parser into
+   the rest member as an object (in the order the parser would build
+   it), or skipped if there is none. A member that is absent or null is
+   left as it was. */
+
+enum json_field_type {
+	JSON_INT,		/* int */
+	JSON_DOUBLE,		/* double */
+	JSON_BOOL,		/* int, 1 for true */
+	JSON_STRING,		/* char array, NUL-terminated UTF-8 */
+	JSON_VALUE,		/* object, any value as the parser makes it */
+	JSON_OBJECT		/* struct of another schema */
+};
+
+struct json_schema;
+
+struct json_field {
+	const char *name;	/* NULL for the rest */
+	unsigned len;
+	int type;		/* enum json_field_type */
+	size_t offset, size;
+	const struct json_schema *schema;	/* of JSON_OBJECT */
+};
+
+struct json_schema {
+	const struct json_field *fields;
+	unsigned n;
+	size_t size;		/* of the struct */
+};
+
+/* name is a string literal */
+#define JSON_FIELD_NAMED(name, type, member, ftype) \
+	{name, sizeof(name) - 1, ftype, offsetof(type, member), \
+	 sizeof(((type *) 0)->member), NULL}
+
+#define JSON_FIELD(type, member, ftype) \
+	JSON_FIELD_NAMED(#member, type, member, ftype)
+
+/* member is a struct described by schema */
+#define JSON_FIELD_STRUCT(type, member, schema) \
+	{#member, sizeof(#member) - 1, JSON_OBJECT, offsetof(type, member), \
+	 sizeof(((type *) 0)->member), &(schema)}
+
+/* member is an object */
+#define JSON_FIELD_REST(type, member) \
+	{NULL, 0, JSON_VALUE, offsetof(type, member), sizeof(object), NULL}
+
+#define JSON_SCHEMA(type, fields) \
+	{fields, sizeof(fields) / sizeof((fields)[0]), sizeof(type)}
+
+/* Parser context. The generic parser, with its limits and options, is
+   used for the members not in the schema and those of type JSON_VALUE,
+   which are allocated on the listdata heap. */
+struct json_schema_parser {
+	struct json_parser p;
+	char *buf;			/* scratch for names and numbers */
+	unsigned buf_max;
+	size_t offset;			/* bytes parsed, or of the error */
+	const char *reason;		/* of JSON_ERROR or JSON_LIMIT */
+};
+
+void json_schema_parser_init(struct json_schema_parser *);
+void json_schema_parser_free(struct json_schema_parser *);
+
+/* parse the object in the n bytes at s into the struct at out. Return
+   JSON_DONE (offset is the end of the object), JSON_MORE if it is cut
+   short, JSON_ERROR if it is malformed or a member has the wrong type,
+   or JSON_LIMIT if a string does not fit its array or a limit or the
+   heap was exceeded. */
+int  json_schema_parse(struct json_schema_parser *, const struct json_schema *,
+		       void *out, const char *s, size_t n);
+
+#endif
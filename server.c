@@ -0,0 +1,491 @@
+/* Event loop for many connections, see server.h.
+ *
+ *  A connection keeps in buf the bytes from the start of the value in
+ *  progress: len of them, all checked by its validating parser. A
+ *  complete value is copied into a job on the queue of the worker of
+ *  the connection, and what follows it is moved to the front.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#ifdef LISTDATA_THREADS
+#include <pthread.h>
+#endif
+#include "server.h"
+
+#define READ_MIN 4096		/* room for a read */
+#define EVENTS 64		/* per epoll_wait */
+
+struct conn {
+	int fd;
+	int listening;
+	unsigned long id;
+	unsigned index;		/* in conns */
+	struct json_parser p;
+	char *buf;
+	size_t len, max;
+};
+
+struct job {
+	struct job *next;
+	unsigned long conn;
+	size_t n;		/* bytes following */
+};
+
+struct worker {
+	struct json_server *s;
+	struct json_parser p;
+	struct job *head, *tail;
+	unsigned count;
+#ifdef LISTDATA_THREADS
+	pthread_t thread;
+	pthread_cond_t filled, freed;
+#endif
+};
+
+struct json_server_state {
+	int epfd;
+	struct conn **conns;	/* and listening sockets */
+	unsigned n, max;
+	unsigned long next_id;
+	struct worker *workers;	/* one used in the loop thread if none */
+	int stop;
+#ifdef LISTDATA_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+static void *grow(void *mem, unsigned *max, size_t size)
+{
+	unsigned n = *max ? *max << 1 : 16;
+	void *p = n > *max ? realloc(mem, (size_t) n * size) : NULL;
+	if (p)
+		*max = n;
+	return p;
+}
+
+static void lock(struct json_server_state *st)
+{
+#ifdef LISTDATA_THREADS
+	pthread_mutex_lock(&st->lock);
+#else
+	(void) st;
+#endif
+}
+
+static void unlock(struct json_server_state *st)
+{
+#ifdef LISTDATA_THREADS
+	pthread_mutex_unlock(&st->lock);
+#else
+	(void) st;
+#endif
+}
+
+static int fail(struct json_server *s, int status, const char *reason)
+{
+	lock(s->st);
+	s->reason = reason;
+	unlock(s->st);
+	return status;
+}
+
+/* Workers */
+
+struct call {
+	struct json_server *s;
+	unsigned long conn;
+};
+
+static int call(object x, void *arg)
+{
+	struct call *c = arg;
+	c->s->f(x, c->conn, c->s->arg);
+	return 0;
+}
+
+/* parse the n bytes of a value at b and hand it to f */
+static void parse_value(struct worker *w, unsigned long conn,
+			const char *b, size_t n)
+{
+	struct json_server *s = w->s;
+	struct json_error err;
+	struct call c;
+	int r;
+
+	c.s = s;
+	c.conn = conn;
+	w->p.limits = s->limits;
+	r = json_feed(&w->p, b, n, call, &c);
+	if (r == JSON_MORE)
+		r = json_feed_end(&w->p, call, &c);
+	if (r == JSON_MORE)
+		return;
+	lock(s->st);
+	s->failed++;
+	s->reason = json_parse_error(&w->p, &err) ? err.reason : "parse failed";
+	unlock(s->st);
+	json_parser_reset(&w->p);
+}
+
+#ifdef LISTDATA_THREADS
+static void *work(void *arg)
+{
+	struct worker *w = arg;
+	struct json_server_state *st = w->s->st;
+	struct job *j;
+
+	for (;;) {
+		pthread_mutex_lock(&st->lock);
+		while (!w->head && !st->stop)
+			pthread_cond_wait(&w->filled, &st->lock);
+		if ((j = w->head)) {
+			if (!(w->head = j->next))
+				w->tail = NULL;
+			w->count--;
+			pthread_cond_signal(&w->freed);
+		}
+		pthread_mutex_unlock(&st->lock);
+		if (!j)
+			break;
+		parse_value(w, j->conn, (const char *) (j + 1), j->n);
+		free(j);
+	}
+	json_parser_free(&w->p);
+	listdata_thread_exit();
+	return NULL;
+}
+#endif
+
+#ifdef LISTDATA_THREADS
+/* queue a copy for the worker of conn, return 0 if out of memory */
+static int queue(struct json_server *s, unsigned long conn,
+		 const char *b, size_t n)
+{
+	struct json_server_state *st = s->st;
+	struct worker *w = st->workers + conn % s->workers;
+	struct job *j;
+
+	if (!(j = malloc(sizeof(*j) + n)))
+		return 0;
+	j->next = NULL;
+	j->conn = conn;
+	j->n = n;
+	memcpy(j + 1, b, n);
+	pthread_mutex_lock(&st->lock);
+	while (w->count && w->count >= s->queue_max)
+		pthread_cond_wait(&w->freed, &st->lock);
+	if (w->tail)
+		w->tail->next = j;
+	else
+		w->head = j;
+	w->tail = j;
+	w->count++;
+	pthread_cond_signal(&w->filled);
+	pthread_mutex_unlock(&st->lock);
+	return 1;
+}
+#endif
+
+/* hand the n bytes of a value at b to a worker, return 0 if out of
+   memory */
+static int dispatch(struct json_server *s, unsigned long conn,
+		    const char *b, size_t n)
+{
+	s->docs++;
+#ifdef LISTDATA_THREADS
+	if (s->workers)
+		return queue(s, conn, b, n);
+#endif
+	parse_value(s->st->workers, conn, b, n);
+	return 1;
+}
+
+/* Connections */
+
+static struct conn *new_conn(struct json_server *s, int fd, int listening)
+{
+	struct json_server_state *st = s->st;
+	struct epoll_event ev;
+	struct conn *c, **v;
+
+	if (st->n == st->max) {
+		if (!(v = grow(st->conns, &st->max, sizeof(*v))))
+			return NULL;
+		st->conns = v;
+	}
+	if (!(c = calloc(1, sizeof(*c))))
+		return NULL;
+	c->fd = fd;
+	c->listening = listening;
+	json_parser_init(&c->p);
+	c->p.validate = 1;
+	c->p.limits = s->limits;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(st->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		free(c);
+		return NULL;
+	}
+	c->index = st->n;
+	st->conns[st->n++] = c;
+	return c;
+}
+
+static void free_conn(struct json_server *s, struct conn *c)
+{
+	struct json_server_state *st = s->st;
+	epoll_ctl(st->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	st->conns[c->index] = st->conns[--st->n];
+	st->conns[c->index]->index = c->index;
+	if (!c->listening) {
+		close(c->fd);
+		s->conns--;
+	}
+	json_parser_free(&c->p);
+	free(c->buf);
+	free(c);
+}
+
+static int blank(int c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* check the bytes read, dispatch the values completed and keep the
+   rest. Return JSON_MORE or the status to close with. */
+static int scan(struct json_server *s, struct conn *c, size_t from)
+{
+	const char *p = c->buf + from, *e = c->buf + c->len, *start = c->buf;
+	struct json_error err;
+	int r;
+
+	for (;;) {
+		while (p == start && p < e && blank(*p))
+			start = ++p;
+		if (p == e)
+			break;
+		r = json_parse(&c->p, p, e - p, &p);
+		if (r == JSON_MORE)
+			break;
+		if (r != JSON_DONE)
+			return fail(s, r, json_parse_error(&c->p, &err) ?
+					  err.reason : "parse failed");
+		if (!dispatch(s, c->id, start, p - start))
+			return fail(s, JSON_LIMIT, "out of memory");
+		json_parser_reset(&c->p);
+		start = p;
+	}
+	c->len = e - start;
+	memmove(c->buf, start, c->len);
+	if (s->doc_max && c->len > s->doc_max)
+		return fail(s, JSON_LIMIT, "value too long");
+	return JSON_MORE;
+}
+
+/* the end of the input: complete a last top-level number */
+static int finish(struct json_server *s, struct conn *c)
+{
+	struct json_error err;
+	int r = json_parse_end(&c->p);
+	if (r == JSON_DONE && !dispatch(s, c->id, c->buf, c->len))
+		return fail(s, JSON_LIMIT, "out of memory");
+	if (r == JSON_DONE || r == JSON_MORE)
+		return JSON_MORE;
+	return fail(s, r, json_parse_error(&c->p, &err) ?
+			  err.reason : "parse failed");
+}
+
+/* read what has arrived, return 1 if the connection stays open,
+   otherwise 0 with the status to close with in *status */
+static int receive(struct json_server *s, struct conn *c, int *status)
+{
+	size_t m, from = c->len;
+	ssize_t n;
+	char *b;
+
+	if (c->max - c->len < READ_MIN) {
+		m = c->max ? c->max * 2 : READ_MIN;
+		if (s->doc_max && m > s->doc_max + READ_MIN)
+			m = s->doc_max + READ_MIN;
+		if (!(b = realloc(c->buf, m))) {
+			*status = fail(s, JSON_LIMIT, "out of memory");
+			return 0;
+		}
+		c->buf = b;
+		c->max = m;
+	}
+	n = read(c->fd, c->buf + c->len, c->max - c->len);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 1;
+		*status = fail(s, JSON_ERROR, "read error");
+		return 0;
+	}
+	if (!n) {
+		*status = finish(s, c);
+		return 0;
+	}
+	c->len += n;
+	*status = scan(s, c, from);
+	return *status == JSON_MORE;
+}
+
+static void accept_all(struct json_server *s, int fd)
+{
+	int c;
+	while ((c = accept(fd, NULL, NULL)) >= 0) {
+		if (!json_server_add(s, c)) {
+			close(c);
+			fail(s, JSON_LIMIT, "out of memory");
+		}
+	}
+}
+
+/* Server */
+
+#ifdef LISTDATA_THREADS
+static int start_workers(struct json_server *s, unsigned n)
+{
+	struct worker *w;
+	for (; s->workers < n; s->workers++) {
+		w = s->st->workers + s->workers;
+		pthread_cond_init(&w->filled, NULL);
+		pthread_cond_init(&w->freed, NULL);
+		if (pthread_create(&w->thread, NULL, work, w)) {
+			pthread_cond_destroy(&w->filled);
+			pthread_cond_destroy(&w->freed);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* once their queues are empty */
+static void stop_workers(struct json_server *s)
+{
+	struct json_server_state *st = s->st;
+	unsigned i;
+	pthread_mutex_lock(&st->lock);
+	st->stop = 1;
+	for (i=0; i<s->workers; i++)
+		pthread_cond_signal(&st->workers[i].filled);
+	pthread_mutex_unlock(&st->lock);
+	for (i=0; i<s->workers; i++) {
+		pthread_join(st->workers[i].thread, NULL);
+		pthread_cond_destroy(&st->workers[i].filled);
+		pthread_cond_destroy(&st->workers[i].freed);
+	}
+	pthread_mutex_destroy(&st->lock);
+}
+#endif
+
+static int init_error(struct json_server *s, const char *reason)
+{
+	json_server_free(s);
+	s->reason = reason;
+	return 0;
+}
+
+int json_server_init(struct json_server *s, unsigned workers)
+{
+	struct json_server_state *st;
+	unsigned i;
+
+	memset(s, 0, sizeof(*s));
+	s->limits.depth = UINT_MAX;
+	s->limits.str_len = UINT_MAX;
+	s->limits.elems = UINT_MAX;
+	s->doc_max = 1 << 24;
+	s->queue_max = 64;
+#ifndef LISTDATA_THREADS
+	workers = 0;
+#endif
+	if (!(st = calloc(1, sizeof(*st))))
+		return init_error(s, "out of memory");
+	s->st = st;
+#ifdef LISTDATA_THREADS
+	pthread_mutex_init(&st->lock, NULL);
+#endif
+	if ((st->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return init_error(s, "cannot create epoll instance");
+	if (!(st->workers = calloc(workers ? workers : 1, sizeof(*st->workers))))
+		return init_error(s, "out of memory");
+	for (i=0; i<(workers ? workers : 1); i++) {
+		st->workers[i].s = s;
+		json_parser_init(&st->workers[i].p);
+	}
+#ifdef LISTDATA_THREADS
+	if (!start_workers(s, workers))
+		return init_error(s, "cannot start thread");
+#endif
+	return 1;
+}
+
+void json_server_free(struct json_server *s)
+{
+	struct json_server_state *st = s->st;
+	if (!st)
+		return;
+	while (st->n)
+		free_conn(s, st->conns[0]);
+#ifdef LISTDATA_THREADS
+	stop_workers(s);
+#endif
+	if (st->workers && !s->workers)
+		json_parser_free(&st->workers[0].p);
+	if (st->epfd >= 0)
+		close(st->epfd);
+	free(st->workers);
+	free(st->conns);
+	free(st);
+	s->st = NULL;
+	s->workers = 0;
+}
+
+unsigned long json_server_add(struct json_server *s, int fd)
+{
+	struct conn *c;
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+	    !(c = new_conn(s, fd, 0)))
+		return 0;
+	c->id = ++s->st->next_id;
+	s->conns++;
+	return c->id;
+}
+
+int json_server_listen(struct json_server *s, int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0 &&
+	       new_conn(s, fd, 1) != NULL;
+}
+
+int json_server_run(struct json_server *s, int timeout)
+{
+	struct json_server_state *st = s->st;
+	struct epoll_event ev[EVENTS];
+	struct conn *c;
+	int i, n, status;
+
+	if ((n = epoll_wait(st->epfd, ev, EVENTS, timeout)) < 0)
+		return errno == EINTR ? (int) st->n : -1;
+	for (i=0; i<n; i++) {
+		c = ev[i].data.ptr;
+		if (c->listening)
+			accept_all(s, c->fd);
+		else if (!receive(s, c, &status)) {
+			if (s->closed)
+				s->closed(c->id, status, s->arg);
+			free_conn(s, c);
+		}
+	}
+	return st->n;
+}
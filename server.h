@@ -0,0 +1,78 @@
+#ifndef server_h
+#define server_h
+
+#include "json.h"
+
+/* Event loop for JSON arriving on many connections at once (Linux,
+   epoll). Each connection is a stream of values separated by white
+   space, read as it arrives, and each complete value is handed to f.
+
+   The loop thread checks the bytes of each connection with its own
+   validating parser, which allocates nothing on the listdata heap, and
+   keeps only the bytes of the value in progress, so a connection costs
+   its parser stacks and at most doc_max bytes however slowly its data
+   comes. A complete value is queued to a worker that parses it in its
+   own heap and calls f, and it is released when f returns. Values of a
+   connection go to the same worker, in order. Built with
+   LISTDATA_THREADS (liblistdata-mt.a, link with -pthread) there are
+   worker threads; otherwise, or with 0 workers, the values are parsed
+   and handled in the loop thread.
+
+	struct json_server s;
+	json_server_init(&s, 4);
+	s.f = handle;
+	json_server_listen(&s, listen_fd);
+	while (json_server_run(&s, -1) > 0)
+		;
+	json_server_free(&s);
+*/
+
+struct json_server_state;
+
+struct json_server {
+	struct json_limits limits;	/* of each value */
+	size_t doc_max;			/* bytes of a value (default 16 MB),
+					   0 for no limit */
+	unsigned queue_max;		/* values waiting for each worker
+					   (default 64) before the loop waits */
+	/* called in a worker with the value and the id of its connection
+	   (from 1, in the order they were added or accepted) */
+	void (*f)(object, unsigned long conn, void *arg);
+	/* called in the loop thread when a connection is closed, with
+	   JSON_MORE at the end of its input, JSON_ERROR if it was
+	   malformed or could not be read, or JSON_LIMIT if a value
+	   exceeded the limits. Values before it may still be waiting. */
+	void (*closed)(unsigned long conn, int status, void *arg);
+	void *arg;
+	unsigned workers;
+	unsigned long conns,		/* open */
+		      docs,		/* values queued */
+		      failed;		/* values that did not parse in a worker */
+	const char *reason;		/* of the last failure */
+	struct json_server_state *st;
+};
+
+/* start the workers (none without LISTDATA_THREADS), return 0 if out of
+   memory or a thread could not be started (see reason). f must be set
+   before the first connection. */
+int  json_server_init(struct json_server *, unsigned workers);
+
+/* close the connections, let the workers finish the values queued,
+   stop them and free everything. The listening sockets stay open. */
+void json_server_free(struct json_server *);
+
+/* read the connected socket fd (made nonblocking), which is closed
+   with the connection. Return the id of the connection, or 0 (fd is
+   left open). */
+unsigned long json_server_add(struct json_server *, int fd);
+
+/* accept connections on the listening socket fd, return 0 if out of
+   memory */
+int  json_server_listen(struct json_server *, int fd);
+
+/* wait up to timeout milliseconds (-1 for ever) for input and handle
+   it. Return the number of open connections and listening sockets, or
+   -1 if epoll failed. */
+int  json_server_run(struct json_server *, int timeout);
+
+#endif
@@ -0,0 +1,104 @@
+/* Encodings: CBOR both ways, and the s-expression printer and reader.
+ */
+#include "test.h"
+#include "cbor.h"
+#include "print.h"
+
+static const char *sample = "{\"id\": 7, \"name\": \"caf\\u00e9 \\u20ac\", "
+	"\"tags\": [\"a\", 1.5, -2, 1e300, true, false, null, [], {}]}";
+
+/* x encoded and decoded again */
+static object cbor_copy(object x, size_t *len)
+{
+	struct cbor_buf b;
+	struct cbor_decoder d;
+	object y = JSON_FALSE;
+
+	cbor_buf_init(&b);
+	cbor_decoder_init(&d);
+	if (cbor_encode(&b, x) &&
+	    cbor_decode(&d, b.s, b.len) == JSON_DONE && d.offset == b.len)
+		y = d.result;
+	*len = b.len;
+	cbor_decoder_free(&d);
+	cbor_buf_free(&b);
+	return y;
+}
+
+static void cbor(void)
+{
+	static const unsigned char known[] = {
+		0x82, 0x01, 0xa1, 0x61, 0x6b, 0xf6	/* [1, {"k": null}] */
+	};
+	struct cbor_buf b;
+	struct cbor_decoder d;
+	object x = json(sample);
+	size_t len;
+
+	CHECK(equals(cbor_copy(x, &len), x));
+	cbor_buf_init(&b);
+	CHECK(cbor_encode(&b, json("[1, {\"k\": null}]")) &&
+	      b.len == sizeof(known) && !memcmp(b.s, known, b.len));
+	cbor_buf_free(&b);
+
+	cbor_decoder_init(&d);
+	CHECK(cbor_decode(&d, known, sizeof(known)) == JSON_DONE &&
+	      equals(d.result, json("[1, {\"k\": null}]")));
+	CHECK(cbor_decode(&d, known, 3) == JSON_MORE);
+	CHECK(cbor_decode(&d, "\xff", 1) == JSON_ERROR);
+	cbor_decoder_free(&d);
+}
+
+/* x printed as an s-expression, NUL-terminated */
+static char *printed(struct print_buf *b, object x, int pretty)
+{
+	static char s[4096];
+	b->len = 0;
+	b->pretty = pretty;
+	if (!bprint(b, x) || b->len >= sizeof(s)) {
+		failures++;
+		return "";
+	}
+	memcpy(s, b->s, b->len);
+	s[b->len] = '\0';
+	return s;
+}
+
+static object read_back(const char *s)
+{
+	struct sexp_reader r;
+	object x = JSON_FALSE;
+	sexp_reader_init(&r);
+	if (sexp_read(&r, s, strlen(s)) == JSON_DONE)
+		x = r.result;
+	sexp_reader_free(&r);
+	return x;
+}
+
+static void sexp(void)
+{
+	struct print_buf b;
+	object x = json(sample);
+
+	print_buf_init(&b);
+	CHECK(!strcmp(printed(&b, json("[1, \"a\\n\\u20ac\", {\"k\": null}, "
+				       "2.5, []]"), 0),
+		      "(1 \"a\\n\\u20AC\" (\"k\" null . {}) (25 . -1) ())"));
+	CHECK(equals(read_back(printed(&b, x, 0)), x));
+	CHECK(equals(read_back(printed(&b, x, 1)), x));
+	CHECK(strchr(printed(&b, x, 1), '\n'));
+	print_buf_free(&b);
+	CHECK(equals(read_back("(1 \"x\" . {})"), cons(store_int(1),
+		      cons(store_short("x"), EMPTY_DICT))));
+	CHECK(read_back("(1 2") == JSON_FALSE);
+}
+
+int main(void)
+{
+	mpoint mp;
+	listdata_mark(mp);
+	cbor();
+	sexp();
+	listdata_release(mp);
+	return report("codec");
+}
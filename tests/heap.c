@@ -0,0 +1,189 @@
+/* Heap: equality and hashing, hash-consing, list building, strings
+ * and ropes, marks, arenas, the garbage collector and freezing.
+ */
+#include <limits.h>
+#include "test.h"
+
+/* "caf€€s" as the parser stores it */
+static object wide(void)
+{
+	object euro = store_int(0x20ac);
+	return cons(store_str("caf"), cons(euro, cons(euro, store_str("s"))));
+}
+
+static void equality(void)
+{
+	object euro = store_int(0x20ac), x = wide();
+	object y = cons(store_str("ca"), cons(store_str("f"),
+			cons(euro, cons(euro, store_str("s")))));
+
+	CHECK(equals(x, y) && equals(y, x));
+	CHECK(listdata_hash(x) == listdata_hash(y));
+	CHECK(equals(x, json("\"caf\\u20ac\\u20acs\"")));
+	CHECK(!equals(x, json("\"caf\\u20ac\\u00e9s\"")));
+	CHECK(equals(concat(store_str("ab"), store_str("cd")), store_str("abcd")));
+	CHECK(listdata_hash(concat(store_str("ab"), store_str("cd"))) ==
+	      listdata_hash(store_str("abcd")));
+	CHECK(equals(json("{\"a\": [1, \"x\"]}"), json("{\"a\": [1, \"x\"]}")));
+	CHECK(listdata_hash(json("[1, 2]")) != listdata_hash(json("[2, 1]")));
+}
+
+static void sharing(void)
+{
+	object x, y;
+	listdata_share(1);
+	x = json("{\"a\": [1, 2, \"long string\"]}");
+	y = json("{\"a\": [1, 2, \"long string\"]}");
+	CHECK(!list_mutable(x));
+	listdata_share(0);
+	CHECK(x == y);
+	CHECK(list_mutable(json("[1, 2]")));
+}
+
+static void lists(void)
+{
+	struct listdata_builder b;
+	object v[5], x;
+	int i;
+
+	list_begin(&b);
+	CHECK(list_finish(&b, EMPTY_LIST) == EMPTY_LIST);
+	list_begin(&b);
+	for (i=0; i<5; i++)
+		CHECK(list_append(&b, v[i] = store_int(i)));
+	x = list_finish(&b, EMPTY_LIST);
+	CHECK(equals(x, json("[0, 1, 2, 3, 4]")));
+	CHECK(equals(list_from_array(v, 5, EMPTY_LIST), x));
+	CHECK(list_length(x) == 5 && list_to_array(x, v, 3) == 3 &&
+	      load_int(v[2]) == 2);
+	CHECK(load_int(last_tail(x, 1) ? get_head(last_tail(x, 1)) : 0) == 4);
+	CHECK(equals(reverse_list(x), json("[4, 3, 2, 1, 0]")));
+	x = dict_set(EMPTY_DICT, store_short("k"), store_int(1));
+	CHECK(dict_get(x, store_short("k")) && load_int(*dict_get(x, store_short("k"))) == 1);
+	CHECK(!dict_get(x, store_short("j")));
+}
+
+static void strings(void)
+{
+	char buf[32];
+	object x, r;
+	int i;
+
+	x = split(store_str("a,bc,,d"), ',');
+	CHECK(equals(x, json("[\"a\", \"bc\", \"\", \"d\"]")));
+	CHECK(type_of(store_short("abc")) == TYP_SHORT &&
+	      store_short("abc") == store_short("abc"));
+	CHECK(equals_str(store_short("abc"), "abc"));
+
+	r = store_str("");
+	for (i=0; i<100; i++) {
+		sprintf(buf, "%02d", i);
+		r = rope_concat(r, store_str(buf));
+	}
+	CHECK(type_of(r) == TYP_ROPE && str_length(r) == 200);
+	CHECK(equals_str(rope_sub(r, 20, 6), "101112"));
+	CHECK(equals(rope_flatten(r), r));
+	CHECK(listdata_hash(rope_flatten(r)) == listdata_hash(r));
+	CHECK(copy_str(rope_sub(r, 198, 10), buf, sizeof(buf)) == 2 &&
+	      !strcmp(buf, "99"));
+	CHECK(str_length(wide()) == 6 && equals(rope_sub(wide(), 3, 2),
+						 json("\"\\u20ac\\u20ac\"")));
+
+	/* a rope shares its parts, so its length can pass INT_MAX, where
+	   rope_concat fails */
+	r = rope_flatten(r);
+	for (i=0; r && i<23; i++)
+		r = rope_concat(r, r);
+	CHECK(r && str_length(r) == 200UL << 23);
+	CHECK(equals_str(rope_sub(r, (200UL << 23) - 4, 10), "9899"));
+	x = rope_concat(r, rope_sub(r, 0, INT_MAX - (200UL << 23)));
+	CHECK(x && str_length(x) == INT_MAX);
+	CHECK(str_length(rope_sub(x, INT_MAX - 2, 10)) == 2);
+	CHECK(!rope_concat(r, r) && !rope_concat(x, store_str("a")));
+}
+
+static void numbers(void)
+{
+	int mant, exp;
+	object x = store_num(-15, -1);
+	double d;
+
+	CHECK(type_of(x) == TYP_NUM && load_num(x, &mant, &exp) &&
+	      mant == -15 && exp == -1);
+	CHECK(json_number(x, &d) && d == -1.5 && load_int(x) == -1);
+	CHECK(x == store_num(-15, -1));
+}
+
+static void heaps(void)
+{
+	struct listdata_arena a, *old;
+	mpoint mp;
+	object x, y, keep;
+
+	listdata_mark(mp);
+	store_str("released");
+	listdata_release(mp);
+
+	listdata_arena_init(&a, "test");
+	old = listdata_arena_use(&a);
+	x = json("{\"in\": \"the arena\"}");
+	listdata_arena_use(old);
+	CHECK(equals(x, json("{\"in\": \"the arena\"}")));
+	listdata_arena_free(&a);
+
+	listdata_mark(mp);
+	x = json("[\"garbage\", \"garbage\", \"garbage\"]");
+	y = json("{\"kept\": [1, 2, \"three\"]}");
+	keep = store_str("after");
+	CHECK(listdata_root(&y) && listdata_root(&keep));
+	CHECK(listdata_gc(mp));
+	CHECK(equals(y, json("{\"kept\": [1, 2, \"three\"]}")));
+	CHECK(equals_str(keep, "after"));
+	listdata_unroot(&keep);
+	listdata_unroot(&y);
+	listdata_release(mp);
+
+	/* a substring is not a handle into the string it is cut from */
+	listdata_mark(mp);
+	x = store_str("hello world, this is a long string");
+	y = rope_sub(x, 6, 100);
+	store_str("junk");
+	keep = store_str("AFTER");
+	CHECK(listdata_root(&x) && listdata_root(&y) && listdata_root(&keep));
+	CHECK(listdata_gc(mp));
+	CHECK(equals_str(x, "hello world, this is a long string"));
+	CHECK(equals_str(y, "world, this is a long string"));
+	CHECK(equals_str(keep, "AFTER"));
+	listdata_unroot(&keep);
+	listdata_unroot(&y);
+	listdata_unroot(&x);
+	listdata_release(mp);
+}
+
+static void freezing(void)
+{
+	object x = json("[\"frozen string\", [1, 2]]"), y;
+	CHECK(listdata_private(x));
+	CHECK(listdata_freeze());
+	CHECK(listdata_frozen(x) && !listdata_private(x));
+	CHECK(!list_mutable(x));
+	y = reverse_list(x);
+	CHECK(equals(x, json("[\"frozen string\", [1, 2]]")) && y != x);
+	CHECK(!listdata_private(store_short("ab")) &&
+	      listdata_private(cons(x, EMPTY_LIST)));
+}
+
+int main(void)
+{
+	mpoint mp;
+	listdata_mark(mp);
+	equality();
+	sharing();
+	lists();
+	strings();
+	numbers();
+	heaps();
+	freezing();
+	listdata_release(mp);
+	return report("heap");
+}
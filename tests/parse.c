@@ -0,0 +1,157 @@
+/* Parser: values, numbers and strings, chunked input, errors, limits,
+ * validation and NDJSON streams.
+ */
+#include "test.h"
+
+static object member(object x, const char *name)
+{
+	object *v = dict_get(x, store_short(name));
+	return v ? *v : JSON_FALSE;
+}
+
+static int count(object x, void *n)
+{
+	(void) x;
+	++*(int *) n;
+	return 0;
+}
+
+/* status and error offset of s */
+static int error_at(const char *s, unsigned long *offset, int *expected)
+{
+	struct json_parser p;
+	struct json_error e;
+	int st;
+	json_parser_init(&p);
+	st = json_parse_str(&p, s, NULL);
+	if (st == JSON_MORE)
+		st = json_parse_end(&p);
+	*offset = 0;
+	*expected = -1;
+	if (json_parse_error(&p, &e)) {
+		*offset = e.offset;
+		*expected = e.expected;
+	}
+	json_parser_free(&p);
+	return st;
+}
+
+static void values(void)
+{
+	object x = json("{\"a\": [1, 2.5, \"x\", true, false, null], \"b\": {}}");
+	object a = member(x, "a");
+	double d;
+	int mant, exp;
+
+	CHECK(list_length(a) == 6);
+	CHECK(type_of(*first(a)) == TYP_INT && load_int(*first(a)) == 1);
+	CHECK(json_number(*second(a), &d) && d == 2.5);
+	CHECK(json_decimal(*second(a), &mant, &exp) && mant == 25 && exp == -1);
+	CHECK(equals_str(*third(a), "x"));
+	CHECK(*nth_elem(a, 3) == JSON_TRUE && *nth_elem(a, 4) == JSON_FALSE &&
+	      *nth_elem(a, 5) == 0);
+	CHECK(member(x, "b") == EMPTY_DICT);
+	CHECK(json("[]") == EMPTY_LIST);
+	CHECK(json("-12") == store_int(-12) || load_int(json("-12")) == -12);
+	CHECK(json_number(json("1e300"), &d) && d == 1e300);
+	CHECK(!json_number(json("\"1\""), &d));
+	CHECK(equals(json("[1, {\"k\": \"v\"}]"), json(" [1,{\"k\":\"v\"}] ")));
+	CHECK(!equals(json("[1, 2]"), json("[2, 1]")));
+}
+
+static void strings(void)
+{
+	char buf[16];
+	object x = json("\"caf\\u00e9 \\\"q\\\"\\n\"");
+
+	CHECK(copy_str(x, buf, sizeof(buf)) == 9 &&
+	      !strcmp(buf, "caf\xe9 \"q\"\n"));
+	x = json("\"\\u20ac\\ud83d\\ude00!\"");
+	CHECK(str_length(x) == 3);
+	CHECK(equals(x, json("\"\\u20ac\\ud83d\\ude00!\"")));
+	CHECK(!equals(x, json("\"\\u20ac\\ud83d\\ude01!\"")));
+	CHECK(type_of(json("\"ab\"")) == TYP_SHORT);
+	CHECK(equals(json("\"ab\""), store_str("ab")));
+}
+
+static void options(void)
+{
+	struct json_parser p;
+	double d;
+
+	json_parser_init(&p);
+	p.heap_strings = 1;
+	p.packed_numbers = 1;
+	CHECK(json_parse_str(&p, "[\"ab\", 1.5]", NULL) == JSON_DONE);
+	CHECK(type_of(*first(p.result)) == TYP_STR);
+	CHECK(type_of(*second(p.result)) == TYP_NUM);
+	CHECK(json_number(*second(p.result), &d) && d == 1.5);
+
+	json_parser_reset(&p);
+	p.validate = 1;
+	CHECK(json_parse_str(&p, "{\"a\": [1, 2]}", NULL) == JSON_DONE);
+	json_parser_reset(&p);
+	CHECK(json_parse_str(&p, "{\"a\": [1, 2}", NULL) == JSON_ERROR);
+	json_parser_free(&p);
+}
+
+static void chunks(void)
+{
+	struct json_parser p;
+	const char *end;
+	int n = 0;
+
+	json_parser_init(&p);
+	CHECK(json_parse_str(&p, "[1, \"ab", NULL) == JSON_MORE);
+	CHECK(json_parse_str(&p, "c\", 2", NULL) == JSON_MORE);
+	CHECK(json_parse_str(&p, "3] [", &end) == JSON_DONE && *end == ' ');
+	CHECK(equals(p.result, json("[1, \"abc\", 23]")));
+	json_parser_reset(&p);
+	CHECK(json_parse_str(&p, "12", NULL) == JSON_MORE);
+	CHECK(json_parse_end(&p) == JSON_DONE && load_int(p.result) == 12);
+
+	json_parser_reset(&p);
+	CHECK(json_feed(&p, "{\"a\":1}\n[2]\n3", 13, count, &n) == JSON_MORE);
+	CHECK(json_feed_end(&p, count, &n) == JSON_MORE && n == 3);
+	json_parser_free(&p);
+}
+
+static void errors(void)
+{
+	struct json_parser p;
+	unsigned long off;
+	int exp;
+	object x;
+
+	CHECK(error_at("[1,]", &off, &exp) == JSON_ERROR && off == 3);
+	CHECK(error_at("{\"a\" 1}", &off, &exp) == JSON_ERROR && off == 5 &&
+	      exp == JSON_EXPECT_COLON);
+	CHECK(error_at("[1] x", &off, &exp) == JSON_DONE);
+	CHECK(error_at("tru", &off, &exp) != JSON_DONE);
+	CHECK(parse("\"\x01\"", &x) == JSON_ERROR);
+	CHECK(parse("[1 2]", &x) == JSON_ERROR);
+
+	json_parser_init(&p);
+	p.limits.depth = 2;
+	CHECK(json_parse_str(&p, "[[1]]", NULL) == JSON_DONE);
+	json_parser_reset(&p);
+	CHECK(json_parse_str(&p, "[[[1]]]", NULL) == JSON_LIMIT);
+	json_parser_reset(&p);
+	p.limits.depth = 100;
+	p.limits.str_len = 3;
+	CHECK(json_parse_str(&p, "\"abcd\"", NULL) == JSON_LIMIT);
+	json_parser_free(&p);
+}
+
+int main(void)
+{
+	mpoint mp;
+	listdata_mark(mp);
+	values();
+	strings();
+	options();
+	chunks();
+	errors();
+	listdata_release(mp);
+	return report("parse");
+}
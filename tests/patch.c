@@ -0,0 +1,187 @@
+/* Diffs and patches: the examples of RFC 6902 and RFC 7386, and diffs
+ * applied back.
+ */
+#include "test.h"
+#include "patch.h"
+
+/* equal, with the members of objects in any order */
+static int same(object x, object y)
+{
+	object end, *v;
+	if (equals(x, y))
+		return 1;
+	if (!is_cons(x) || !is_cons(y) ||
+	    (end = last_tail(x, 0)) != last_tail(y, 0))
+		return 0;
+	if (end == EMPTY_LIST) {
+		for (; is_cons(x) && is_cons(y); x = get_tail(x), y = get_tail(y))
+			if (!same(get_head(x), get_head(y)))
+				return 0;
+		return !is_cons(x) && !is_cons(y);
+	}
+	if (end != EMPTY_DICT || list_length(x) != list_length(y))
+		return 0;
+	for (; is_cons(x); x = get_tail(get_tail(x)))
+		if (!(v = dict_get(y, get_head(x))) || !same(*second(x), *v))
+			return 0;
+	return 1;
+}
+
+/* doc patched by patch is expected, or the patch fails if expected is
+   NULL */
+static int patched(const char *doc, const char *patch, const char *expected)
+{
+	struct json_diff d;
+	object x = json(doc);
+	int st;
+
+	json_diff_init(&d);
+	st = json_patch_apply(&d, &x, json(patch));
+	json_diff_free(&d);
+	if (!expected)
+		return st == JSON_ERROR;
+	if (st == JSON_DONE && same(x, json(expected)))
+		return 1;
+	fprintf(stderr, "%s on %s: ", patch, doc);
+	return 0;
+}
+
+static int merged(const char *doc, const char *patch, const char *expected)
+{
+	struct json_diff d;
+	object x = json(doc);
+	int st;
+
+	json_diff_init(&d);
+	st = json_merge_apply(&d, &x, json(patch));
+	json_diff_free(&d);
+	return st == JSON_DONE && same(x, json(expected));
+}
+
+static void rfc6902(void)
+{
+	CHECK(patched("{\"foo\": \"bar\"}",
+		      "[{\"op\": \"add\", \"path\": \"/baz\", \"value\": \"qux\"}]",
+		      "{\"baz\": \"qux\", \"foo\": \"bar\"}"));
+	CHECK(patched("{\"foo\": [\"bar\", \"baz\"]}",
+		      "[{\"op\": \"add\", \"path\": \"/foo/1\", \"value\": \"qux\"}]",
+		      "{\"foo\": [\"bar\", \"qux\", \"baz\"]}"));
+	CHECK(patched("{\"baz\": \"qux\", \"foo\": \"bar\"}",
+		      "[{\"op\": \"remove\", \"path\": \"/baz\"}]",
+		      "{\"foo\": \"bar\"}"));
+	CHECK(patched("{\"foo\": [\"bar\", \"qux\", \"baz\"]}",
+		      "[{\"op\": \"remove\", \"path\": \"/foo/1\"}]",
+		      "{\"foo\": [\"bar\", \"baz\"]}"));
+	CHECK(patched("{\"baz\": \"qux\", \"foo\": \"bar\"}",
+		      "[{\"op\": \"replace\", \"path\": \"/baz\", \"value\": \"boo\"}]",
+		      "{\"baz\": \"boo\", \"foo\": \"bar\"}"));
+	CHECK(patched("{\"foo\": {\"bar\": \"baz\", \"waldo\": \"fred\"}, "
+		      "\"qux\": {\"corge\": \"grault\"}}",
+		      "[{\"op\": \"move\", \"from\": \"/foo/waldo\", "
+		      "\"path\": \"/qux/thud\"}]",
+		      "{\"foo\": {\"bar\": \"baz\"}, \"qux\": {\"corge\": \"grault\", "
+		      "\"thud\": \"fred\"}}"));
+	CHECK(patched("{\"foo\": [\"all\", \"grass\", \"cows\", \"eat\"]}",
+		      "[{\"op\": \"move\", \"from\": \"/foo/1\", \"path\": \"/foo/3\"}]",
+		      "{\"foo\": [\"all\", \"cows\", \"eat\", \"grass\"]}"));
+	CHECK(patched("{\"baz\": \"qux\", \"foo\": [\"a\", 2, \"c\"]}",
+		      "[{\"op\": \"test\", \"path\": \"/baz\", \"value\": \"qux\"}, "
+		      "{\"op\": \"test\", \"path\": \"/foo/1\", \"value\": 2}]",
+		      "{\"baz\": \"qux\", \"foo\": [\"a\", 2, \"c\"]}"));
+	CHECK(patched("{\"baz\": \"qux\"}",
+		      "[{\"op\": \"test\", \"path\": \"/baz\", \"value\": \"bar\"}]",
+		      NULL));
+	CHECK(patched("{\"foo\": \"bar\"}",
+		      "[{\"op\": \"add\", \"path\": \"/child\", \"value\": "
+		      "{\"grandchild\": {}}}]",
+		      "{\"foo\": \"bar\", \"child\": {\"grandchild\": {}}}"));
+	CHECK(patched("{\"foo\": \"bar\"}",
+		      "[{\"op\": \"add\", \"path\": \"/baz/bat\", \"value\": \"qux\"}]",
+		      NULL));
+	CHECK(patched("{\"foo\": [\"bar\"]}",
+		      "[{\"op\": \"add\", \"path\": \"/foo/-\", \"value\": [\"abc\"]}]",
+		      "{\"foo\": [\"bar\", [\"abc\"]]}"));
+	CHECK(patched("{\"/\": 9, \"~1\": 10}",
+		      "[{\"op\": \"test\", \"path\": \"/~01\", \"value\": 10}]",
+		      "{\"/\": 9, \"~1\": 10}"));
+	CHECK(patched("{\"a\": 1}",
+		      "[{\"op\": \"copy\", \"from\": \"/a\", \"path\": \"/b\"}]",
+		      "{\"a\": 1, \"b\": 1}"));
+
+	/* numbers are equal by value */
+	CHECK(patched("{\"a\": 1, \"b\": [100, {\"c\": 0.5}]}",
+		      "[{\"op\": \"test\", \"path\": \"/a\", \"value\": 1.0}, "
+		      "{\"op\": \"test\", \"path\": \"/b\", "
+		      "\"value\": [1e2, {\"c\": 5e-1}]}]",
+		      "{\"a\": 1, \"b\": [100, {\"c\": 0.5}]}"));
+	CHECK(patched("{\"a\": 1}",
+		      "[{\"op\": \"test\", \"path\": \"/a\", \"value\": 1.5}]",
+		      NULL));
+	CHECK(patched("{\"a\": 0}",
+		      "[{\"op\": \"test\", \"path\": \"/a\", \"value\": -0.0}]",
+		      "{\"a\": 0}"));
+}
+
+static void rfc7386(void)
+{
+	CHECK(merged("{\"a\": \"b\"}", "{\"a\": \"c\"}", "{\"a\": \"c\"}"));
+	CHECK(merged("{\"a\": \"b\"}", "{\"b\": \"c\"}",
+		     "{\"a\": \"b\", \"b\": \"c\"}"));
+	CHECK(merged("{\"a\": \"b\", \"b\": \"c\"}", "{\"a\": null}",
+		     "{\"b\": \"c\"}"));
+	CHECK(merged("{\"a\": [\"b\"]}", "{\"a\": \"c\"}", "{\"a\": \"c\"}"));
+	CHECK(merged("{\"a\": {\"b\": \"c\"}}",
+		     "{\"a\": {\"b\": \"d\", \"c\": null}}",
+		     "{\"a\": {\"b\": \"d\"}}"));
+	CHECK(merged("[1, 2]", "{\"a\": \"b\", \"c\": null}", "{\"a\": \"b\"}"));
+	CHECK(merged("{\"e\": null}", "{\"a\": 1}", "{\"e\": null, \"a\": 1}"));
+	CHECK(merged("{\"a\": \"foo\"}", "null", "null"));
+}
+
+/* diffs of a and b, applied to a, give b */
+static int round_trip(const char *a, const char *b)
+{
+	struct json_diff d;
+	object x = json(a), y = json(b), patch, m = json(a);
+	int ok;
+
+	json_diff_init(&d);
+	ok = json_patch_diff(&d, x, y, &patch) == JSON_DONE &&
+	     json_patch_apply(&d, &x, patch) == JSON_DONE && same(x, y) &&
+	     json_merge_diff(&d, m, y, &patch) == JSON_DONE &&
+	     json_merge_apply(&d, &m, patch) == JSON_DONE && same(m, y);
+	json_diff_free(&d);
+	return ok;
+}
+
+static void diffs(void)
+{
+	struct json_diff d;
+	object patch;
+
+	CHECK(round_trip("{\"a\": 1, \"b\": [1, 2, 3], \"c\": {\"d\": \"x\"}}",
+			 "{\"a\": 2, \"b\": [1, 3], \"c\": {\"e\": \"x\"}, \"f\": 1}"));
+	CHECK(round_trip("[1, 2]", "[1, 2, {\"a\": []}]"));
+	CHECK(round_trip("{\"~/\": 1}", "{\"~/\": 2}"));
+	json_diff_init(&d);
+	CHECK(json_patch_diff(&d, json("[1]"), json("[1.0]"), &patch) ==
+	      JSON_DONE && d.ops == 1);
+	json_diff_free(&d);
+	json_diff_init(&d);
+	CHECK(json_patch_diff(&d, json("{\"a\": [1]}"), json("{\"a\": [1]}"),
+			      &patch) == JSON_DONE && patch == EMPTY_LIST);
+	CHECK(json_merge_diff(&d, json("{\"a\": 1}"), json("{\"a\": 1}"),
+			      &patch) == JSON_DONE && patch == EMPTY_DICT);
+	json_diff_free(&d);
+}
+
+int main(void)
+{
+	mpoint mp;
+	listdata_mark(mp);
+	rfc6902();
+	rfc7386();
+	diffs();
+	listdata_release(mp);
+	return report("patch");
+}
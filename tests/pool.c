@@ -0,0 +1,146 @@
+/* Parallel sort, map and reduce on a frozen list, with pools of 1 to
+ * 4 threads and small chunks, against results computed serially, and
+ * a sort by an object-valued key.
+ */
+#include "test.h"
+#include "pool.h"
+#include "query.h"
+
+#define N 1000
+
+static const char *const path[] = { "k", NULL };
+static const char *const opath[] = { "o", NULL };
+
+/* by k, highest first, a missing k last */
+static int by_k(object a, object b, void *arg)
+{
+	object *x = dict_get(a, store_short("k")), *y = dict_get(b, store_short("k"));
+	int i = x ? load_int(*x) : -1, j = y ? load_int(*y) : -1;
+	(void) arg;
+	return (i < j) - (i > j);
+}
+
+static object twice(object x, void *arg)
+{
+	object *v = dict_get(x, store_short("k"));
+	(void) arg;
+	return v ? store_int(2 * load_int(*v)) : 0;
+}
+
+static void add(void *acc, object x, void *arg)
+{
+	object *v = dict_get(x, store_short("k"));
+	(void) arg;
+	if (v)
+		*(long *) acc += load_int(*v);
+}
+
+static void combine(void *acc, const void *part, void *arg)
+{
+	(void) arg;
+	*(long *) acc += *(const long *) part;
+}
+
+/* elements i of x, by index, are in sorted order: k ascending (or
+   descending) with equal keys in the order of their index */
+static int sorted(object x, int desc)
+{
+	object *k, prev = 0;
+	int a, b, n = 0;
+	for (; is_cons(x); x = get_tail(x), n++) {
+		if (prev) {
+			k = dict_get(prev, store_short("k"));
+			a = k ? load_int(*k) : -1;
+			k = dict_get(get_head(x), store_short("k"));
+			b = k ? load_int(*k) : -1;
+			if (desc ? a < b : a > b)
+				return 0;
+			if (a == b && load_int(*dict_get(prev, store_short("i"))) >
+				      load_int(*dict_get(get_head(x), store_short("i"))))
+				return 0;
+		}
+		prev = get_head(x);
+	}
+	return n == N;
+}
+
+static object field(object x, const char *name)
+{
+	object *v = dict_get(x, store_short(name));
+	return v ? *v : 0;
+}
+
+/* x is sorted by the object o: with the key "a" before "b", then by
+   value, and equal objects in the order of i */
+static int sorted_by_o(object x)
+{
+	object prev = 0, o = 0;
+	int c, n = 0;
+	for (; is_cons(x); x = get_tail(x), n++) {
+		o = field(get_head(x), "o");
+		if (!prev && !dict_get(o, store_short("a")))
+			return 0;
+		if (prev) {
+			c = query_order(field(prev, "o"), o);
+			if (c > 0 || (!c && load_int(field(prev, "i")) >
+					    load_int(field(get_head(x), "i"))))
+				return 0;
+		}
+		prev = get_head(x);
+	}
+	return n == N && dict_get(o, store_short("b"));
+}
+
+int main(void)
+{
+	struct listdata_builder b;
+	struct list_pool p;
+	object data, objs, x, y;
+	char s[64];
+	long sum = 0, acc;
+	unsigned threads;
+	mpoint mp;
+	int i;
+
+	listdata_mark(mp);
+	list_begin(&b);
+	for (i=0; i<N; i++) {
+		if (i % 17)
+			sprintf(s, "{\"i\": %d, \"k\": %d}", i, i * 31 % 50);
+		else
+			sprintf(s, "{\"i\": %d}", i);
+		list_append(&b, json(s));
+		sum += i % 17 ? i * 31 % 50 : 0;
+	}
+	data = list_finish(&b, EMPTY_LIST);
+	list_begin(&b);
+	for (i=0; i<N; i++) {
+		sprintf(s, "{\"i\": %d, \"o\": {\"%c\": %d}}", i,
+			i % 3 ? 'a' : 'b', i * 7 % 10);
+		list_append(&b, json(s));
+	}
+	objs = list_finish(&b, EMPTY_LIST);
+	CHECK(listdata_freeze());
+
+	for (threads=1; threads<=4; threads++) {
+		CHECK(list_pool_init(&p, threads));
+		p.chunk = 16;
+		CHECK(sorted(list_sort(&p, data, by_k, NULL), 1));
+		CHECK(sorted(list_sort_by(&p, data, path), 0));
+		CHECK(sorted_by_o(list_sort_by(&p, objs, opath)));
+		x = list_map(&p, data, twice, NULL);
+		CHECK(x && list_length(x) == N);
+		for (y = data; x && is_cons(y); y = get_tail(y), x = get_tail(x))
+			CHECK(equals(get_head(x), twice(get_head(y), NULL)));
+		acc = 0;
+		CHECK(list_reduce(&p, data, &acc, sizeof(acc), add, combine,
+				  NULL) && acc == sum);
+		CHECK(list_sort_by(&p, EMPTY_LIST, path) == EMPTY_LIST);
+		if (p.threads > 1)
+			CHECK(!list_map(&p, cons(cons(store_int(1), EMPTY_LIST),
+						 data), twice, NULL) && p.reason);
+		list_pool_free(&p);
+	}
+	listdata_release(mp);
+	return report("pool");
+}
@@ -0,0 +1,158 @@
+/* Queries: the outputs of each form on small inputs, compile errors
+ * and NDJSON streams.
+ */
+#include "test.h"
+#include "query.h"
+
+static int collect(object x, void *b)
+{
+	return !list_append(b, x);
+}
+
+/* the outputs of text on the JSON input, as an array */
+static object outputs(const char *text, const char *input)
+{
+	struct listdata_builder b;
+	struct query q;
+	object x = json(input);
+
+	if (!query_compile(&q, text)) {
+		fprintf(stderr, "%s: %s\n", text, q.error);
+		failures++;
+		return JSON_FALSE;
+	}
+	list_begin(&b);
+	if (query_run(&q, x, collect, &b))
+		failures++;
+	query_free(&q);
+	return list_finish(&b, EMPTY_LIST);
+}
+
+/* the outputs of text on input are expected */
+static int gives(const char *text, const char *input, const char *expected)
+{
+	object x = outputs(text, input);
+	if (equals(x, json(expected)))
+		return 1;
+	fprintf(stderr, "%s on %s: ", text, input);
+	return 0;
+}
+
+static void forms(void)
+{
+	const char *rec = "{\"a\": 1, \"b\": [1, \"x\", null], \"c\": {\"d\": 2.5}}";
+
+	CHECK(gives(".", "[1]", "[[1]]"));
+	CHECK(gives(".a", rec, "[1]"));
+	CHECK(gives(".c.d", rec, "[2.5]"));
+	CHECK(gives(".\"a\"", rec, "[1]"));
+	CHECK(gives(".b[1]", rec, "[\"x\"]"));
+	CHECK(gives(".b[]", rec, "[1, \"x\", null]"));
+	CHECK(gives(".c[]", rec, "[2.5]"));
+	CHECK(gives(".missing", rec, "[null]"));
+	CHECK(gives(".a.b", rec, "[]"));
+	CHECK(gives(".a, .c.d", rec, "[1, 2.5]"));
+	CHECK(gives(".b | length", rec, "[3]"));
+	CHECK(gives("[.b[] | select(. != null)]", rec, "[[1, \"x\"]]"));
+	CHECK(gives("{a, e: .c.d}", rec, "[{\"a\": 1, \"e\": 2.5}]"));
+	CHECK(gives("count(.b[])", rec, "[3]"));
+	CHECK(gives("sum(.[])", "[1, 2, 3.5]", "[6.5]"));
+	CHECK(gives("min(.[]), max(.[])", "[3, 1, 2]", "[1, 3]"));
+	CHECK(gives(".[] | . < 2", "[1, 2]", "[true, false]"));
+	CHECK(gives("null < false, 1 < \"a\", \"a\" < [], [] < {}", "null",
+		    "[true, true, true, true]"));
+	CHECK(gives("1 == 1.0, [1] == [1], {\"a\": 1} == {\"a\": 1}", "null",
+		    "[true, true, true]"));
+	CHECK(gives(".a == 1 and .b[0] == 1 or false", rec, "[true]"));
+	CHECK(gives(".a | not", rec, "[false]"));
+}
+
+/* .[] of strings and numbers stored as lists has no output */
+static void scalars(void)
+{
+	char *s = malloc(9003);
+
+	CHECK(gives(".[]", "\"\\u20ac\\u20ac\\u20ac\"", "[]"));
+	CHECK(gives(".[]", "1.5e300", "[]"));
+	CHECK(gives(".[]", "\"x\"", "[]"));
+	CHECK(gives("[.[]]", "{\"a\": \"\\u20ac\"}", "[[\"\\u20ac\"]]"));
+	if (s) {
+		memset(s, 'a', 9002);
+		s[0] = s[9001] = '"';
+		s[9002] = '\0';
+		CHECK(gives(".[]", s, "[]"));
+		CHECK(gives("length", s, "[9000]"));
+		free(s);
+	}
+}
+
+/* objects in the order of jq: keys first, then values */
+static void objects(void)
+{
+	object a = json("{\"a\": 1}"), b = json("{\"b\": 1}");
+
+	CHECK(query_order(a, b) < 0 && query_order(b, a) > 0);
+	CHECK(query_order(json("{\"a\": 2}"), a) > 0 &&
+	      query_order(a, json("{\"a\": 2}")) < 0);
+	CHECK(query_order(json("{\"a\": 1, \"c\": 0}"), b) < 0);
+	CHECK(query_order(a, json("{\"b\": 0, \"a\": 1}")) < 0);
+	CHECK(query_order(json("{\"a\": 1, \"b\": [2]}"),
+			  json("{\"b\": [2], \"a\": 1}")) == 0);
+	CHECK(gives(".[0] < .[1], .[0] > .[1]", "[{\"a\": 1}, {\"b\": 1}]",
+		    "[true, false]"));
+	CHECK(gives(".[0] < .[1], .[0] > .[1]", "[{\"b\": 1}, {\"a\": 1}]",
+		    "[false, true]"));
+	CHECK(gives(".[0] <= .[1], .[0] >= .[1], .[0] == .[1]",
+		    "[{\"b\": [1], \"a\": 1}, {\"a\": 1, \"b\": [1]}]",
+		    "[true, true, true]"));
+	CHECK(gives("min(.[]), max(.[])",
+		    "[{\"b\": 1}, {\"a\": 2}, {\"a\": 1}]",
+		    "[{\"a\": 1}, {\"b\": 1}]"));
+}
+
+static void errors(void)
+{
+	struct query q;
+	CHECK(!query_compile(&q, ".a |") && q.error);
+	CHECK(!query_compile(&q, "[.a") && q.error);
+	CHECK(!query_compile(&q, "nosuch(.)") && q.error);
+}
+
+static int count(object x, void *n)
+{
+	(void) x;
+	++*(int *) n;
+	return 0;
+}
+
+static void streams(void)
+{
+	struct json_parser p;
+	struct query q;
+	const char *s = "{\"ok\": true}\n{\"ok\": false}\n{\"ok\": true}\n";
+	int n = 0;
+
+	CHECK(query_compile(&q, "select(.ok)"));
+	json_parser_init(&p);
+	CHECK(query_feed(&q, &p, s, strlen(s), count, &n) == JSON_MORE);
+	CHECK(query_feed_end(&q, &p, count, &n) == JSON_MORE && n == 2);
+	json_parser_free(&p);
+	query_free(&q);
+
+	CHECK(query_order(json("1"), json("1.0")) == 0);
+	CHECK(query_order(json("\"a\""), json("\"b\"")) < 0);
+	CHECK(query_order(json("[1, 2]"), json("[1]")) > 0);
+}
+
+int main(void)
+{
+	mpoint mp;
+	listdata_mark(mp);
+	forms();
+	scalars();
+	objects();
+	errors();
+	streams();
+	listdata_release(mp);
+	return report("query");
+}
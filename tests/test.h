@@ -0,0 +1,48 @@
+/* Support for the unit tests: CHECK reports a failed condition with
+ * its line and goes on, and each test program ends with
+ * return report("name"), which exits 1 if a check failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json.h"
+
+static int failures;
+
+#define CHECK(c) do { \
+	if (!(c)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c); \
+		failures++; \
+	} \
+} while (0)
+
+static int report(const char *name)
+{
+	printf("%-8s %s\n", name, failures ? "FAIL" : "ok");
+	return failures != 0;
+}
+
+/* parse the JSON text s into *x, return the status */
+static int parse(const char *s, object *x)
+{
+	struct json_parser p;
+	int st;
+	json_parser_init(&p);
+	st = json_parse_str(&p, s, NULL);
+	if (st == JSON_MORE)
+		st = json_parse_end(&p);
+	*x = st == JSON_DONE ? p.result : 0;
+	json_parser_free(&p);
+	return st;
+}
+
+/* the value of s, which must parse */
+static object json(const char *s)
+{
+	object x;
+	if (parse(s, &x) != JSON_DONE) {
+		fprintf(stderr, "does not parse: %s\n", s);
+		failures++;
+	}
+	return x;
+}